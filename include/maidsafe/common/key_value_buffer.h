@@ -17,17 +17,26 @@ License.
 #define MAIDSAFE_COMMON_KEY_VALUE_BUFFER_H_
 
 #include <atomic>
+#include <chrono>
 #include <condition_variable>
 #include <cstdint>
+#include <deque>
+#include <exception>
 #include <functional>
 #include <future>
-#include <map>
+#include <list>
+#include <memory>
 #include <mutex>
+#include <string>
+#include <unordered_map>
+#include <unordered_set>
 #include <utility>
-#include <deque>
+#include <vector>
 
+#include "boost/asio/io_service.hpp"
 #include "boost/filesystem/path.hpp"
 
+#include "maidsafe/common/slab_allocator.h"
 #include "maidsafe/common/tagged_value.h"
 #include "maidsafe/common/types.h"
 
@@ -36,22 +45,206 @@ namespace maidsafe {
 
 namespace test { class KeyValueBufferTest; }
 
+class Active;
+
+namespace detail {
+class CountingBloomFilter;
+class DiskBackend;
+class EvictionQueue;
+class FrequencySketch;
+class KeyOrder;
+class PendingTouches;
+class ReadIndex;
+class TimingWheel;
+}  // namespace detail
+
 class KeyValueBuffer {
  public:
+  // An immutable value which the caller and the memory buffer can share rather than copy.
+  typedef std::shared_ptr<const NonEmptyString> SharedValue;
+  // Called by a background thread, never while either buffer is locked.  If the popped value is
+  // still held in the memory buffer, the functor is passed that copy rather than one read back from
+  // disk.
   typedef std::function<void(const Identity&, const NonEmptyString&)> PopFunctor;
+  typedef std::function<void(std::exception_ptr)> StoreHandler;
+  typedef std::function<void(std::exception_ptr, const NonEmptyString&)> GetHandler;
+  // Called with true when the bytes waiting in queued asynchronous stores rise above the high-water
+  // mark, and with false once they have fallen back to half of it.  Calls are made one at a time,
+  // alternate between true and false, and may skip a rise and fall which came too quickly to
+  // report.  The functor mustn't call StoreAsync or GetAsync.
+  typedef std::function<void(bool)> BackpressureFunctor;
+  // How values are laid out in the disk buffer.  kFilePerKey writes each value to its own file.
+  // kSegmentFile appends values to large segment files and reclaims the space of removed values
+  // with a background compaction, which avoids most filesystem metadata operations.  Removed values
+  // aren't counted against max_disk_usage, so until they're compacted the segment files may use up
+  // to about twice it.
+  enum class DiskLayout { kFilePerKey, kSegmentFile };
+  // How a buffer chooses which of its values to evict when it needs space.  Only values already
+  // copied to disk are evicted from memory, and those popped from disk are also dropped from
+  // memory.  kInsertionOrder evicts the oldest value.  kLru evicts the least recently stored or
+  // read value, and kLfu the least often read.  kArc is the Adaptive Replacement Cache, which
+  // balances recency against frequency.  kGdsf (Greedy-Dual-Size-Frequency) favours keeping small,
+  // often read values.
+  enum class EvictionPolicy { kInsertionOrder, kLru, kLfu, kArc, kGdsf };
+  struct Options {
+    Options()
+        : disk_layout(DiskLayout::kFilePerKey),
+          promote_disk_hits(false),
+          async_high_water_mark(0),
+          backpressure_functor(),
+          spill_writer_count(1),
+          spill_batch_size(16),
+          recover_disk_buffer(false),
+          disk_compression_level(0),
+          memory_eviction_policy(EvictionPolicy::kInsertionOrder),
+          disk_eviction_policy(EvictionPolicy::kInsertionOrder),
+          pop_queue_size(0),
+          key_filter_capacity(0),
+          direct_disk_io(false),
+          default_time_to_live(0),
+          account_memory_overhead(false),
+          memory_admission_max_size(0),
+          admission_sketch_capacity(0),
+          memory_admission_min_frequency(2),
+          deduplicate_disk_values(false) {}
+    DiskLayout disk_layout;
+    // If true, values found by Get in the disk buffer are copied back into the memory buffer by a
+    // background thread, provided they fit within the max memory usage.  Get never waits for this.
+    bool promote_disk_hits;
+    // backpressure_functor is only called if it is valid and async_high_water_mark is non-zero.
+    uint64_t async_high_water_mark;
+    BackpressureFunctor backpressure_functor;
+    // The number of background threads copying values from memory to disk, and the most values
+    // each takes from the memory buffer at a time.  Values still leave memory, and are popped from
+    // disk, in the order they were stored.  Both must be non-zero.
+    uint32_t spill_writer_count, spill_batch_size;
+    // If true, the values left in disk_buffer by a previous KeyValueBuffer which also had this set
+    // are served again, and are popped in their original order.  They're found from a manifest
+    // saved on destruction, so values held only in memory at that point, or those left by a
+    // process which didn't exit cleanly, aren't recovered.  If the recovered values exceed
+    // max_disk_usage, the oldest are popped (or just removed if pop_functor isn't valid).  Ignored
+    // by the constructor which doesn't take disk_buffer.
+    bool recover_disk_buffer;
+    // If non-zero, values are gzip-compressed at this level (at most crypto::kMaxCompressionLevel)
+    // as they're written to the disk buffer, and it's their compressed size which counts against
+    // max_disk_usage.  Values which don't get smaller are written uncompressed.  A disk buffer
+    // written with compression is only recovered by a KeyValueBuffer which also uses it.
+    uint16_t disk_compression_level;
+    // Values are only guaranteed to be popped in the order they were stored if the disk buffer
+    // uses kInsertionOrder.  With any other disk policy, every Get also records a use in the disk
+    // buffer, since a value popped from disk is dropped from memory too.
+    EvictionPolicy memory_eviction_policy, disk_eviction_policy;
+    // Values popped from the disk buffer are read back without the disk buffer locked, and passed
+    // to pop_functor in batches by a background thread, in the order they were popped.  Once this
+    // many (or one, if zero) are waiting to be passed, the disk buffer pops no more until the
+    // functor catches up.  Values still queued on destruction are passed before the destructor
+    // returns.
+    uint32_t pop_queue_size;
+    // If non-zero, a counting Bloom filter sized for this many keys is kept over the keys held, so
+    // that most lookups of absent keys are answered without taking either buffer's lock.  Holding
+    // more keys than this only makes the filter less effective.
+    uint64_t key_filter_capacity;
+    // If true, the disk buffer is written and read with O_DIRECT, bypassing the page cache, so
+    // values spilled from memory aren't also cached by the OS.  Falls back to buffered I/O where
+    // that isn't supported.  Only available with DiskLayout::kFilePerKey.
+    bool direct_disk_io;
+    // If non-zero, values stored without a time to live of their own expire this long after being
+    // stored.  Expired values are removed from both buffers by a background thread, without being
+    // passed to pop_functor, and until then may still be returned by Get.  A value which expires
+    // before being copied to disk is never copied.  Values recovered from a previous disk buffer
+    // never expire.
+    std::chrono::milliseconds default_time_to_live;
+    // If true, each value held in the memory buffer counts against max_memory_usage with an
+    // estimate of its whole footprint: the heap block holding its bytes, the buffer's bookkeeping
+    // for it and its key.  Otherwise only its bytes count, which for small values can be a fraction
+    // of the memory they take.
+    bool account_memory_overhead;
+    // If non-zero, values larger than this many bytes are written straight to the disk buffer by
+    // Store rather than being held in memory first, so that a burst of large values doesn't evict
+    // the small ones held there.  Such values aren't promoted by promote_disk_hits either.
+    uint64_t memory_admission_max_size;
+    // If non-zero, a TinyLFU-style frequency sketch sized for this many keys estimates how often
+    // each key has recently been stored or read.  A value stored while the memory buffer has no
+    // room for it without evicting is then only admitted to memory if its key has been used at
+    // least memory_admission_min_frequency times, counting this store; otherwise it's written
+    // straight to the disk buffer, so that keys used just once don't displace those used often.
+    uint64_t admission_sketch_capacity;
+    uint32_t memory_admission_min_frequency;
+    // If true, the disk buffer holds each distinct value only once, named by the SHA-512 hash of
+    // the bytes written, however many keys it's stored under.  A value whose bytes are already held
+    // for another key isn't written again and takes no more of max_disk_usage; its bytes are
+    // removed once no key holds them.  A disk buffer written with deduplication is only recovered
+    // by a KeyValueBuffer which also uses it.
+    bool deduplicate_disk_values;
+  };
+  // A read-only view of a value's bytes, which stays valid for as long as the view is held, even if
+  // the value is deleted from the buffer.
+  class ValueView {
+   public:
+    ValueView() : data_(), size_(0) {}
+    ValueView(std::shared_ptr<const char> data, size_t size)
+        : data_(std::move(data)), size_(size) {}
+    const char* data() const { return data_.get(); }
+    size_t size() const { return size_; }
+
+   private:
+    std::shared_ptr<const char> data_;
+    size_t size_;
+  };
+  // The progress of a scan begun by BeginScan.  A copy resumes the scan from the same point.
+  class ScanCursor {
+   public:
+    ScanCursor() : snapshot_(0), prefix_(), last_(), done_(true) {}
+    // True once Scan has returned every key of the scan.
+    bool done() const { return done_; }
+
+   private:
+    friend class KeyValueBuffer;
+    uint64_t snapshot_;
+    std::string prefix_;
+    Identity last_;  // Uninitialised until the first batch has been found.
+    bool done_;
+  };
+  struct Stats {
+    Stats()
+        : memory_hits(0), disk_hits(0), misses(0), promotions(0), bytes_spilled(0),
+          values_spilled(0), spills_skipped(0), expirations(0), admissions_bypassed(0),
+          admissions_refused(0), values_deduplicated(0), bytes_deduplicated(0) {}
+    uint64_t memory_hits, disk_hits, misses, promotions;
+    // The bytes and values written to the disk buffer, with the bytes as counted against
+    // max_disk_usage.  Values deleted or replaced while being written are included.
+    uint64_t bytes_spilled, values_spilled;
+    // Values which were deleted, replaced or expired before being written to the disk buffer, so
+    // weren't written at all.  Together with values_spilled, this shows how many disk writes
+    // repeated stores of the same keys have been spared.
+    uint64_t spills_skipped;
+    // Values removed because their time to live had passed.
+    uint64_t expirations;
+    // Values which Store wrote straight to the disk buffer rather than holding in memory: those
+    // larger than Options::memory_admission_max_size, and those refused by the frequency sketch.
+    uint64_t admissions_bypassed, admissions_refused;
+    // Values which Options::deduplicate_disk_values spared writing to the disk buffer, since their
+    // bytes were already held there for another key, and the bytes of those.  The disk buffer's
+    // dedup ratio is (bytes_spilled + bytes_deduplicated) / bytes_spilled.
+    uint64_t values_deduplicated, bytes_deduplicated;
+  };
   // Throws if max_memory_usage >= max_disk_usage.  Throws if a writable folder can't be created in
-  // temp_directory_path().  Starts a background worker thread which copies values from memory to
+  // temp_directory_path().  Starts background worker threads which copy values from memory to
   // disk.  If pop_functor is valid, the disk cache will pop excess items when it is full,
   // otherwise Store will block until there is space made via Delete calls.
-  KeyValueBuffer(MemoryUsage max_memory_usage, DiskUsage max_disk_usage, PopFunctor pop_functor);
+  KeyValueBuffer(MemoryUsage max_memory_usage,
+                 DiskUsage max_disk_usage,
+                 PopFunctor pop_functor,
+                 const Options& options = Options());
   // Throws if max_memory_usage >= max_disk_usage.  Throws if a writable folder can't be created in
-  // "disk_buffer".  Starts a background worker thread which copies values from memory to disk.  If
+  // "disk_buffer".  Starts background worker threads which copy values from memory to disk.  If
   // pop_functor is valid, the disk cache will pop excess items when it is full, otherwise Store
   // will block until there is space made via Delete calls.
   KeyValueBuffer(MemoryUsage max_memory_usage,
                  DiskUsage max_disk_usage,
                  PopFunctor pop_functor,
-                 const boost::filesystem::path& disk_buffer);
+                 const boost::filesystem::path& disk_buffer,
+                 const Options& options = Options());
   ~KeyValueBuffer();
   // Throws if the background worker has thrown (e.g. the disk has become inaccessible).  Throws if
   // the size of value is greater than the current specified maximum disk usage, or if the value
@@ -59,17 +252,92 @@ class KeyValueBuffer {
   // store to memory, blocks until there is enough space to store to disk.  Space will be made
   // available via external calls to Delete, and also automatically if pop_functor_ is not NULL.
   void Store(const Identity& key, const NonEmptyString& value);
+  // As above, but the memory buffer holds on to 'value' rather than copying it.  Throws if value is
+  // null.
+  void Store(const Identity& key, SharedValue value);
+  // As above, but the value expires 'time_to_live' after being stored, as described for
+  // Options::default_time_to_live, rather than after the default.  A zero time_to_live means the
+  // value never expires.
+  void Store(const Identity& key,
+             const NonEmptyString& value,
+             std::chrono::milliseconds time_to_live);
+  void Store(const Identity& key, SharedValue value, std::chrono::milliseconds time_to_live);
   // Throws if the background worker has thrown (e.g. the disk has become inaccessible).  Throws if
   // the value can't be read from disk.  If the value isn't in memory and has started to be stored
-  // to disk, blocks while waiting for the storing to complete.
+  // to disk, blocks while waiting for the storing to complete.  A value held in the memory buffer
+  // is found without taking any lock, so is never held up by concurrent Store, Delete or spilling.
   NonEmptyString Get(const Identity& key);
+  // As above, but a value held in the memory buffer is returned without being copied.
+  SharedValue GetShared(const Identity& key);
+  // As above, but a value read from the disk buffer is mapped into memory where the platform allows
+  // rather than copied, unless it's compressed or is to be promoted.
+  ValueView GetView(const Identity& key);
+  // As for GetView, but views just the 'length' bytes of the value starting at 'offset', or as
+  // many of them as there are.  Throws if offset is beyond the end of the value.  Only the viewed
+  // bytes are read from the disk buffer, unless the value is compressed, and a value read this way
+  // isn't promoted to memory.
+  ValueView GetRange(const Identity& key, uint64_t offset, size_t length);
+  // As for Get, but returns false rather than throwing if the key isn't held.
+  bool TryGet(const Identity& key, NonEmptyString& value);
+  // Returns whether the key is held, without reading its value or counting towards stats().  A
+  // value still being copied to disk counts as held.
+  bool Contains(const Identity& key);
   // Throws if the background worker has thrown (e.g. the disk has become inaccessible).  Throws if
   // the value was written to disk and can't be removed.
   void Delete(const Identity& key);
+  // As for Store, but each buffer's lock is taken once for the whole batch rather than once per
+  // value.  If a key appears more than once, the last value is kept.
+  void StoreBatch(const std::vector<std::pair<Identity, NonEmptyString>>& key_values);
+  // As for Get, but returns the values in the order of 'keys', with an uninitialised value for each
+  // key which isn't held, rather than throwing.  The disk values are all read under one lock.
+  std::vector<NonEmptyString> GetBatch(const std::vector<Identity>& keys);
+  // As for Delete, but keys which aren't held are ignored rather than causing a throw.
+  void DeleteBatch(const std::vector<Identity>& keys);
+  // Begins a scan of the keys held in either buffer which start with 'prefix', or of every key if
+  // it's empty.  Throws if prefix is longer than a key.
+  ScanCursor BeginScan(const std::string& prefix = std::string());
+  // Returns up to 'batch_size' more keys of the scan, in ascending order, and advances 'cursor'
+  // past them.  Returns no keys once cursor.done().  The scan sees the buffer as it was when begun:
+  // each key held then is returned exactly once, unless it's deleted, replaced or expires before
+  // the scan reaches it, and keys stored since aren't returned.  Each buffer's lock is taken in
+  // turn for just long enough to find one batch, so Store and Get are held up for no longer than
+  // that.  Throws if batch_size is 0.
+  std::vector<Identity> Scan(ScanCursor& cursor, size_t batch_size);
+  // These never block on a full buffer or on the disk.  If the operation can be completed in memory
+  // straight away it is, otherwise it is queued to a background thread which performs queued
+  // operations in the order they were made.  While any operation is queued, later ones are
+  // queued behind it.  Errors are reported through the future or handler rather than thrown.
+  std::future<void> StoreAsync(const Identity& key, const NonEmptyString& value);
+  std::future<NonEmptyString> GetAsync(const Identity& key);
+  // As above, but 'handler' is posted to 'io_service' on completion.
+  void StoreAsync(const Identity& key,
+                  const NonEmptyString& value,
+                  boost::asio::io_service& io_service,
+                  StoreHandler handler);
+  void GetAsync(const Identity& key, boost::asio::io_service& io_service, GetHandler handler);
   // Throws if max_memory_usage > max_disk_usage_.
   void SetMaxMemoryUsage(MemoryUsage max_memory_usage);
   // Throws if max_memory_usage_ > max_disk_usage.
   void SetMaxDiskUsage(DiskUsage max_disk_usage);
+  MemoryUsage max_memory_usage();
+  DiskUsage max_disk_usage();
+  // Returns the number of bytes of values currently held in the memory buffer, including their
+  // overhead if Options::account_memory_overhead is set.
+  MemoryUsage CurrentMemoryUsage();
+  // Returns the number of bytes of values currently held in the disk buffer.
+  DiskUsage CurrentDiskUsage();
+  // Returns the disk space needed to hold every value accepted so far: the current disk usage plus
+  // the bytes of values yet to be written to disk, whether held in memory or waiting for disk
+  // space.  A value being written may briefly be counted twice.
+  DiskUsage RequiredDiskUsage();
+  // Returns a size no smaller than that of the largest value accepted but yet to be written to
+  // disk, or 0 if there is none.  Setting the max disk usage below this makes the buffer fail when
+  // it comes to write that value.
+  uint64_t LargestUnwrittenValue();
+  // Returns counts of Get calls served from memory and from disk, of those which found nothing,
+  // of disk hits which have been copied back into memory, of the writes made to and spared from
+  // disk, of expired values, and of values kept out of memory by admission control.
+  Stats stats() const;
 
   friend class test::KeyValueBufferTest;
 
@@ -87,58 +355,299 @@ class KeyValueBuffer {
     std::condition_variable cond_var;
   };
 
+  typedef std::chrono::steady_clock Clock;
+
   enum class StoringState { kNotStarted, kStarted, kCancelled, kCompleted };
 
+  struct IdentityHash {
+    size_t operator()(const Identity& key) const { return std::hash<std::string>()(key.string()); }
+  };
+
   struct MemoryElement {
-    MemoryElement(const Identity& key_in, const NonEmptyString& value_in)
-        : key(key_in), value(value_in), also_on_disk(StoringState::kNotStarted) {}
+    MemoryElement(const Identity& key_in, SharedValue value_in, uint64_t sequence_in)
+        : key(key_in), value(std::move(value_in)), also_on_disk(StoringState::kNotStarted),
+          sequence(sequence_in), expiry(Clock::time_point::max()) {}
     Identity key;
-    NonEmptyString value;
+    SharedValue value;
     StoringState also_on_disk;
+    uint64_t sequence;  // Order in which the value was stored, shared with its DiskElement.
+    Clock::time_point expiry;  // Clock::time_point::max() if the value never expires.
+  };
+  typedef std::list<MemoryElement, detail::SlabStdAllocator<MemoryElement>> MemoryList;
+
+  // The total size of a changing set of values, and a size no smaller than the largest of them:
+  // the largest added since the set was last empty.
+  struct UnwrittenBytes {
+    UnwrittenBytes() : total(0), count(0), largest(0) {}
+    void Add(uint64_t size) {
+      total += size;
+      ++count;
+      if (size > largest)
+        largest = size;
+    }
+    void Remove(uint64_t size) {
+      total -= size;
+      if (--count == 0)
+        largest = 0;
+    }
+    uint64_t total, count, largest;
+  };
+
+  // Each element lives in exactly one of the lists, chosen by its also_on_disk state, and is moved
+  // between them by splicing so that iterators held in 'lookup' remain valid.  Within each list,
+  // elements are held in sequence order.  The nodes of the lists and of 'lookup' are allocated from
+  // 'slabs', so are reused rather than returned to the heap as values come and go.  'unwritten'
+  // counts the values in 'not_on_disk' and 'storing_to_disk', each as the most it can take on disk.
+  struct MemoryIndex {
+    typedef std::pair<const Identity, MemoryList::iterator> LookupEntry;
+    typedef std::unordered_map<Identity, MemoryList::iterator, IdentityHash,
+                               std::equal_to<Identity>, detail::SlabStdAllocator<LookupEntry>>
+        Lookup;
+    MemoryIndex()
+        : slabs(new detail::SlabAllocator),
+          not_on_disk(MemoryList::allocator_type(slabs.get())),
+          storing_to_disk(MemoryList::allocator_type(slabs.get())),
+          on_disk(MemoryList::allocator_type(slabs.get())),
+          lookup(0, IdentityHash(), std::equal_to<Identity>(),
+                 Lookup::allocator_type(slabs.get())),
+          unwritten() {}
+    std::unique_ptr<detail::SlabAllocator> slabs;
+    MemoryList not_on_disk, storing_to_disk, on_disk;
+    Lookup lookup;
+    UnwrittenBytes unwritten;
   };
-  typedef std::deque<MemoryElement> MemoryIndex;
 
   struct DiskElement {
-    explicit DiskElement(const Identity& key_in) : key(key_in), state(StoringState::kStarted) {}
+    DiskElement(const Identity& key_in,
+                const Identity& content_in,
+                uint64_t sequence_in,
+                uint64_t size_in)
+        : key(key_in), content(content_in), state(StoringState::kStarted), sequence(sequence_in),
+          size(size_in), shares_content(false) {}
     Identity key;
+    // With deduplication, the name the backend holds the value under; otherwise uninitialised, and
+    // the value is held under 'key'.
+    Identity content;
     StoringState state;
+    uint64_t sequence, size;
+    // True if the element's content was already held for another key when its space was reserved,
+    // so it isn't written itself.
+    bool shares_content;
+  };
+  typedef std::list<DiskElement> DiskList;
+
+  // The number of elements with reserved space which hold a deduplicated content, and whether it
+  // has been written yet.  Its size counts against the disk usage once, however many hold it.
+  struct Content {
+    explicit Content(uint64_t size_in) : references(1), size(size_in), written(false) {}
+    uint32_t references;
+    uint64_t size;
+    bool written;
   };
-  typedef std::deque<DiskElement> DiskIndex;
 
-  void Init();
-  bool StoreInMemory(const Identity& key, const NonEmptyString& value);
+  // 'storing' holds elements waiting for disk space.  Once its space is reserved, an element is
+  // moved to 'on_disk', which is in sequence order and holds the kStarted elements being written as
+  // well as the kCompleted ones; only a kCompleted element is popped, so values leave the disk in
+  // the order they were stored.  Cancelled elements are removed from 'lookup' immediately, but stay
+  // in their list until the thread storing them notices the cancellation.  'writing' holds the keys
+  // being written by the backend outside the disk lock; a key is never written by two threads at
+  // once.  With deduplication, 'contents' holds each content held by an element in 'on_disk', and
+  // a content is likewise never written by two threads at once.  'unwritten' counts the elements in
+  // 'storing'.  'popping' is true while a popped element's value is read back outside the disk
+  // lock; only one is read back at a time, so values are popped in order and no more than needed.
+  struct DiskIndex {
+    DiskIndex()
+        : storing(), on_disk(), lookup(), writing(), contents(), unwritten(), popping(false) {}
+    DiskList storing, on_disk;
+    std::unordered_map<Identity, DiskList::iterator, IdentityHash> lookup;
+    std::unordered_set<Identity, IdentityHash> writing;
+    std::unordered_map<Identity, Content, IdentityHash> contents;
+    UnwrittenBytes unwritten;
+    bool popping;
+  };
+
+  // A value read from disk, to be copied into memory if the disk element it was read from, as
+  // identified by its sequence, is still the key's value.
+  struct Promotion {
+    Promotion() : key(), value(), sequence(0) {}
+    Promotion(const Identity& key_in, SharedValue value_in, uint64_t sequence_in)
+        : key(key_in), value(std::move(value_in)), sequence(sequence_in) {}
+    Identity key;
+    SharedValue value;
+    uint64_t sequence;
+  };
+
+  enum class Reservation { kReserved, kAbandoned, kWouldBlock };
+
+  void Init(const Options& options);
+  void LoadDiskIndex(const std::vector<std::pair<Identity, uint64_t>>& manifest,
+                     const std::vector<std::pair<Identity, uint64_t>>& contents);
+  void SaveDiskIndex();
+  bool StoreInMemory(const Identity& key, const SharedValue& value, Clock::time_point expiry);
+  bool TryStoreInMemory(const Identity& key, const SharedValue& value);
+  bool ExceedsAdmissionSize(const SharedValue& value) const;
+  bool RefuseAdmission(const Identity& key,
+                       const SharedValue& value,
+                       const uint64_t& required_space);
+  void RecordUse(const Identity& key);
+  void AddToMemory(const Identity& key, const SharedValue& value, Clock::time_point expiry);
+  uint64_t MemoryFootprint(const SharedValue& value) const;
+  uint64_t MaxDiskSize(const SharedValue& value) const;
+  bool MakeSpaceInMemory(const uint64_t& required_space);
   void WaitForSpaceInMemory(const uint64_t& required_space,
                             std::unique_lock<std::mutex>& memory_store_lock);
-  void StoreOnDisk(const Identity& key, const NonEmptyString& value);
-  void WaitForSpaceOnDisk(const Identity& key,
-                          const uint64_t& required_space,
-                          std::unique_lock<std::mutex>& disk_store_lock,
-                          bool& cancelled);
-  void DeleteFromMemory(const Identity& key, StoringState& also_on_disk);
-  void DeleteFromDisk(const Identity& key);
-  void RemoveFile(const Identity& key, NonEmptyString* value);
+  bool StoreOnDisk(const Identity& key,
+                   const SharedValue& value,
+                   uint64_t sequence,
+                   Clock::time_point expiry);
+  uint32_t DiskFormat() const;
+  SharedValue EncodeForDisk(const SharedValue& value) const;
+  NonEmptyString DecodeFromDisk(NonEmptyString stored) const;
+  Identity ContentName(const SharedValue& stored) const;
+  static const Identity& DiskName(const DiskElement& element);
+  void CheckFitsOnDisk(const Identity& key, const uint64_t& required_space);
+  bool AwaitingSpill(const Identity& key, uint64_t sequence);
+  DiskList::iterator RegisterOnDisk(const Identity& key,
+                                    const Identity& content,
+                                    uint64_t sequence,
+                                    uint64_t size);
+  Reservation ReserveSpaceOnDisk(DiskList::iterator storing_itr,
+                                 const uint64_t& required_space,
+                                 std::unique_lock<std::mutex>& disk_store_lock,
+                                 bool holding_reservations);
+  void UnregisterFromDisk(DiskList::iterator storing_itr);
+  void PopFromDisk(DiskList::iterator victim, std::unique_lock<std::mutex>& disk_store_lock);
+  void WriteToBackend(const DiskElement& element, const SharedValue& stored);
+  bool FinishWritingToDisk(DiskList::iterator itr);
+  void AbandonWritingToDisk(DiskList::iterator itr);
+  bool CancelledBeforeWriting(DiskList::iterator itr);
+  void SkipWritingToDisk(DiskList::iterator itr);
+  void ReleaseDiskSpace(const DiskElement& element);
+  MemoryList::iterator MemoryEvictionCandidate();
+  DiskList::iterator DiskEvictionCandidate();
+  void RecordMemoryUse(const Identity& key);
+  void RecordDiskUse(const Identity& key);
+  size_t RemoveKeys(const std::vector<Identity>& keys);
+  void WaitWhileStoring(const Identity& key, std::unique_lock<std::mutex>& disk_store_lock);
+  bool GetFromMemory(const Identity& key, SharedValue& value);
+  // Waits for the value if it's being written to disk.  Returns false if it isn't there.
+  bool GetFromDisk(const Identity& key, SharedValue& value);
+  // Calls 'read' with the name the backend holds key's value under and the size written, without
+  // the disk lock held, and sets 'sequence' to that of the element read.  Waits for the value if
+  // it's being written to disk.  Returns false, counting a miss, if it isn't there.
+  bool ReadFromDisk(const Identity& key,
+                    const std::function<void(const Identity&, uint64_t)>& read,
+                    uint64_t& sequence);
+  void DoStoreAsync(const Identity& key, const SharedValue& value, StoreHandler on_completion);
+  void DoGetAsync(const Identity& key, GetHandler on_completion);
+  bool AsyncOperationsPending();
+  void QueueAsync(uint64_t value_size, std::function<void()> operation);
+  void FinishAsync(uint64_t value_size);
+  void ReportBackpressure();
+  void EraseFromMemory(MemoryList::iterator itr);
+  void CancelOrRemoveFromDisk(DiskList::iterator itr);
+  void RemoveFromBackend(const DiskElement& element, NonEmptyString* value);
   void CopyQueueToDisk();
+  void SpillBatch(const std::vector<MemoryElement>& batch, uint64_t batch_number);
+  void MarkSpilled(const MemoryElement& element);
+  bool PopQueueFull();
+  void WaitForSpaceInPopQueue();
+  void QueuePop(const Identity& key, const SharedValue& value);
+  void DeliverPops();
+  void QueuePromotion(const Identity& key, const SharedValue& value, uint64_t sequence);
+  void PromoteDiskHits();
+  void Promote(const Promotion& hit);
+  SharedValue EraseMemoryCopy(const Identity& key);
+  Clock::time_point ExpiryFor(std::chrono::milliseconds time_to_live) const;
+  void ScheduleExpiry(const Identity& key, uint64_t sequence, Clock::time_point expiry);
+  void ExpireValues();
+  void Expire(const std::vector<std::pair<Identity, uint64_t>>& expired);
   void CheckWorkerIsStillRunning();
   void StopRunning();
-  boost::filesystem::path GetFilename(const Identity& key) const;
   template<typename T>
   bool HasSpace(const T& store, const uint64_t& required_space);
-  template<typename T>
-  typename T::index_type::iterator Find(T& store, const Identity& key);
-  MemoryIndex::iterator FindOldestInMemoryOnly();
-  MemoryIndex::iterator FindMemoryRemovalCandidate(const uint64_t& required_space,
-                                                   std::unique_lock<std::mutex>& memory_store_lock);
-  DiskIndex::iterator FindStartedToStoreOnDisk(const Identity& key);
-  DiskIndex::iterator FindOldestOnDisk();
-  DiskIndex::iterator FindAndThrowIfCancelled(const Identity& key);
+  MemoryList& MemoryListFor(StoringState also_on_disk);
+  MemoryList::iterator FindMemoryRemovalCandidate(const uint64_t& required_space,
+                                                  std::unique_lock<std::mutex>& memory_store_lock);
+  DiskList::iterator FindAndThrowIfCancelled(const Identity& key);
+  bool DefinitelyAbsent(const Identity& key);
+  void ThrowIfDefinitelyAbsent(const Identity& key);
+  void AddToKeyFilter(const Identity& key);
+  void RemoveFromKeyFilter(const Identity& key);
 
   Storage<MemoryUsage, MemoryIndex> memory_store_;
   Storage<DiskUsage, DiskIndex> disk_store_;
   const PopFunctor kPopFunctor_;
   const boost::filesystem::path kDiskBuffer_;
-  const bool kShouldRemoveRoot_;
+  const bool kShouldRemoveRoot_, kRecoverDiskBuffer_;
+  const DiskLayout kDiskLayout_;
+  const uint16_t kDiskCompressionLevel_;
+  const bool kDeduplicateDiskValues_;
+  const bool kAccountMemoryOverhead_;
+  const uint64_t kMemoryAdmissionMaxSize_;
+  const uint32_t kMemoryAdmissionMinFrequency_;
+  // Null if disabled.  Records every Store and Get of a key, without taking any lock.
+  std::unique_ptr<detail::FrequencySketch> admission_sketch_;
+  std::unique_ptr<detail::DiskBackend> disk_backend_;
+  // Null for EvictionPolicy::kInsertionOrder.  Each is guarded by its buffer's mutex, and holds the
+  // values which may be evicted: those in memory_store_.index.on_disk, and the kCompleted ones in
+  // disk_store_.index.on_disk.
+  std::unique_ptr<detail::EvictionQueue> memory_eviction_, disk_eviction_;
+  // Null for EvictionPolicy::kInsertionOrder.  Reads which don't take the relevant buffer's lock
+  // are recorded here, and passed to its eviction queue before it next chooses a value to evict.
+  std::unique_ptr<detail::PendingTouches> pending_memory_touches_, pending_disk_touches_;
+  // Mirrors memory_store_.index.lookup, mapping each key to its value.  Updated with the memory
+  // lock held, but read without any lock, so that Get never waits for writers to find a value in
+  // memory.
+  std::unique_ptr<detail::ReadIndex> memory_read_index_;
+  // Mirror the two lookup tables in key order, each guarded by the relevant buffer's lock, so that
+  // a scan can carry on from the last key it returned however the buffers have changed since.
+  std::unique_ptr<detail::KeyOrder> memory_key_order_, disk_key_order_;
+  // Null if disabled.  Holds one entry for each key in either buffer's lookup table, so a key held
+  // in both has two.  Updated with the relevant buffer's lock held, but read without any lock.
+  std::unique_ptr<detail::CountingBloomFilter> key_filter_;
   std::atomic<bool> running_;
-  std::future<void> worker_;
+  const uint32_t kSpillBatchSize_;
+  // Batches reserve disk space in the order they were taken from memory.  The former is guarded by
+  // the memory mutex, the latter by the disk mutex.
+  uint64_t spill_batches_taken_, spill_batches_reserved_;
+  std::atomic<uint64_t> next_sequence_;
+  std::vector<std::future<void>> workers_;
+  std::mutex worker_error_mutex_;
+  std::exception_ptr worker_error_;
+  const bool kPromoteDiskHits_;
+  std::deque<Promotion> promotion_queue_;
+  std::mutex promotion_mutex_;
+  std::condition_variable promotion_cond_var_;
+  std::future<void> promoter_;
+  // Popped values waiting for pop_functor, and the number of those plus any being passed to it.
+  const uint32_t kPopQueueSize_;
+  std::deque<std::pair<Identity, SharedValue>> pop_queue_;
+  size_t undelivered_pops_;
+  std::mutex pop_mutex_;
+  std::condition_variable pop_cond_var_;
+  std::future<void> pop_deliverer_;
+  // The wheel holds the key and sequence of each value with a time to live, and the expirer is
+  // started with it when the first such value is stored.  Entries for values which have since been
+  // deleted or replaced are left to expire, and are ignored when they do.
+  const std::chrono::milliseconds kDefaultTimeToLive_;
+  std::unique_ptr<detail::TimingWheel> expiry_wheel_;
+  std::mutex expiry_mutex_;
+  std::condition_variable expiry_cond_var_;
+  std::future<void> expirer_;
+  std::atomic<uint64_t> memory_hits_, disk_hits_, misses_, promotions_, bytes_spilled_,
+                        values_spilled_, spills_skipped_, expirations_, admissions_bypassed_,
+                        admissions_refused_, values_deduplicated_, bytes_deduplicated_;
+  const uint64_t kAsyncHighWaterMark_;
+  const BackpressureFunctor kBackpressureFunctor_;
+  std::mutex async_mutex_;
+  uint64_t pending_async_operations_, pending_async_bytes_;
+  bool above_high_water_;
+  // Held while kBackpressureFunctor_ is called.  backpressure_reported_ is the last state passed to
+  // it.
+  std::mutex backpressure_mutex_;
+  bool backpressure_reported_;
+  std::unique_ptr<Active> async_active_;
 };
 
 }  // namespace maidsafe
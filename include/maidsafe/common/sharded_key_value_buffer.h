@@ -0,0 +1,152 @@
+/* Copyright 2012 MaidSafe.net limited
+
+This MaidSafe Software is licensed under the MaidSafe.net Commercial License, version 1.0 or later,
+and The General Public License (GPL), version 3. By contributing code to this project You agree to
+the terms laid out in the MaidSafe Contributor Agreement, version 1.0, found in the root directory
+of this project at LICENSE, COPYING and CONTRIBUTOR respectively and also available at:
+
+http://www.novinet.com/license
+
+Unless required by applicable law or agreed to in writing, software distributed under the License is
+distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or
+implied. See the License for the specific language governing permissions and limitations under the
+License.
+*/
+
+#ifndef MAIDSAFE_COMMON_SHARDED_KEY_VALUE_BUFFER_H_
+#define MAIDSAFE_COMMON_SHARDED_KEY_VALUE_BUFFER_H_
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "boost/filesystem/path.hpp"
+
+#include "maidsafe/common/key_value_buffer.h"
+#include "maidsafe/common/types.h"
+
+
+namespace maidsafe {
+
+// Partitions keys by Identity prefix across a number of independent KeyValueBuffers, each with its
+// own locks and background worker, so that concurrent callers working on different keys don't
+// contend.  The overall memory and disk limits are divided between the shards, and are
+// periodically redistributed towards the shards which are using most of their share.
+class ShardedKeyValueBuffer {
+ public:
+  typedef KeyValueBuffer::PopFunctor PopFunctor;
+  typedef KeyValueBuffer::SharedValue SharedValue;
+  typedef KeyValueBuffer::ValueView ValueView;
+  // The progress of a scan begun by BeginScan, made up of a scan of each shard.
+  class ScanCursor {
+   public:
+    ScanCursor() : shard_(0), shard_cursors_() {}
+    bool done() const { return shard_ == shard_cursors_.size(); }
+
+   private:
+    friend class ShardedKeyValueBuffer;
+    size_t shard_;
+    std::vector<KeyValueBuffer::ScanCursor> shard_cursors_;
+  };
+  // Throws if shard_count is 0, or for any of the reasons the KeyValueBuffer constructor throws.
+  // Each shard gets its own folder in temp_directory_path(), and a key filter (if enabled) sized
+  // for an even share of options.key_filter_capacity.  With options.deduplicate_disk_values, values
+  // are only deduplicated against others held by the same shard.  pop_functor is shared by the
+  // shards and called by one at a time, but values popped by different shards come in no
+  // particular order relative to each other.
+  ShardedKeyValueBuffer(MemoryUsage max_memory_usage,
+                        DiskUsage max_disk_usage,
+                        PopFunctor pop_functor,
+                        uint32_t shard_count,
+                        const KeyValueBuffer::Options& options = KeyValueBuffer::Options());
+  // As above, but shard i uses the folder "disk_buffer/i".
+  ShardedKeyValueBuffer(MemoryUsage max_memory_usage,
+                        DiskUsage max_disk_usage,
+                        PopFunctor pop_functor,
+                        const boost::filesystem::path& disk_buffer,
+                        uint32_t shard_count,
+                        const KeyValueBuffer::Options& options = KeyValueBuffer::Options());
+  ~ShardedKeyValueBuffer();
+  // These behave as the KeyValueBuffer equivalents, except that the size limits applied are those
+  // of the shard which owns the key rather than the overall limits.  Store first tries to
+  // rebalance if the owning shard's disk limit is too small for the value.
+  void Store(const Identity& key, const NonEmptyString& value);
+  void Store(const Identity& key, SharedValue value);
+  void Store(const Identity& key,
+             const NonEmptyString& value,
+             std::chrono::milliseconds time_to_live);
+  void Store(const Identity& key, SharedValue value, std::chrono::milliseconds time_to_live);
+  NonEmptyString Get(const Identity& key);
+  SharedValue GetShared(const Identity& key);
+  ValueView GetView(const Identity& key);
+  ValueView GetRange(const Identity& key, uint64_t offset, size_t length);
+  bool TryGet(const Identity& key, NonEmptyString& value);
+  bool Contains(const Identity& key);
+  void Delete(const Identity& key);
+  // The batch is split by shard, and each shard's part is passed to its KeyValueBuffer batch
+  // function.
+  void StoreBatch(const std::vector<std::pair<Identity, NonEmptyString>>& key_values);
+  std::vector<NonEmptyString> GetBatch(const std::vector<Identity>& keys);
+  void DeleteBatch(const std::vector<Identity>& keys);
+  // These behave as the KeyValueBuffer equivalents.  Every shard's scan is begun at once, and the
+  // shards are then scanned in turn, so keys are only in ascending order within each shard.
+  ScanCursor BeginScan(const std::string& prefix = std::string());
+  std::vector<Identity> Scan(ScanCursor& cursor, size_t batch_size);
+  // Throws if max_memory_usage > max_disk_usage_.
+  void SetMaxMemoryUsage(MemoryUsage max_memory_usage);
+  // Throws if max_memory_usage_ > max_disk_usage.
+  void SetMaxDiskUsage(DiskUsage max_disk_usage);
+  // Redistributes the overall limits between the shards.  Each shard keeps what it currently
+  // needs, counting values it has accepted but yet to write to disk, and any remaining allowance is
+  // split evenly.  No shard's disk limit drops below the largest value it has yet to write.  This is
+  // also done periodically by a background thread, whenever the shards' usage has changed.
+  void Rebalance();
+  uint32_t shard_count() const { return static_cast<uint32_t>(shards_.size()); }
+  // Returns the sum of the shards' stats.
+  KeyValueBuffer::Stats stats() const;
+  KeyValueBuffer& shard(const Identity& key);
+
+ private:
+  ShardedKeyValueBuffer(const ShardedKeyValueBuffer&);
+  ShardedKeyValueBuffer& operator=(const ShardedKeyValueBuffer&);
+
+  void Init(MemoryUsage max_memory_usage, DiskUsage max_disk_usage, uint32_t shard_count);
+  size_t ShardIndex(const Identity& key) const;
+  // Returns the shard at 'shard_index', having rebalanced if its disk limit is less than
+  // 'max_disk_size'.
+  KeyValueBuffer& OwnerWithRoomFor(size_t shard_index, uint64_t max_disk_size);
+  // Returns the indices into 'keys' grouped by owning shard.
+  std::vector<std::vector<size_t>> GroupByShard(const std::vector<Identity>& keys) const;
+  // If 'only_if_changed' is true, does nothing unless the shards' usage has changed since the last
+  // rebalance.
+  void Rebalance(bool only_if_changed);
+  void ApplyLimits(const std::vector<uint64_t>& memory_limits,
+                   const std::vector<uint64_t>& disk_limits);
+  void RunRebalancer();
+
+  static const std::chrono::milliseconds kRebalanceInterval;
+
+  std::vector<std::unique_ptr<KeyValueBuffer>> shards_;
+  MemoryUsage max_memory_usage_;
+  DiskUsage max_disk_usage_;
+  std::vector<uint64_t> memory_limits_, disk_limits_;
+  // The bytes of values being stored to each shard, counted at the most they can take on disk.
+  std::vector<std::atomic<uint64_t>> storing_bytes_;
+  // The usage from which the current limits were worked out.  Guarded by mutex_.
+  std::vector<uint64_t> last_memory_usage_, last_disk_usage_, last_disk_floors_;
+  std::mutex mutex_;
+  std::condition_variable cond_var_;
+  bool running_;
+  std::future<void> rebalancer_;
+};
+
+}  // namespace maidsafe
+
+#endif  // MAIDSAFE_COMMON_SHARDED_KEY_VALUE_BUFFER_H_
@@ -0,0 +1,124 @@
+/* Copyright 2012 MaidSafe.net limited
+
+This MaidSafe Software is licensed under the MaidSafe.net Commercial License, version 1.0 or later,
+and The General Public License (GPL), version 3. By contributing code to this project You agree to
+the terms laid out in the MaidSafe Contributor Agreement, version 1.0, found in the root directory
+of this project at LICENSE, COPYING and CONTRIBUTOR respectively and also available at:
+
+http://www.novinet.com/license
+
+Unless required by applicable law or agreed to in writing, software distributed under the License is
+distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or
+implied. See the License for the specific language governing permissions and limitations under the
+License.
+*/
+
+
+#ifndef MAIDSAFE_COMMON_SLAB_ALLOCATOR_H_
+#define MAIDSAFE_COMMON_SLAB_ALLOCATOR_H_
+
+#include <cstddef>
+#include <cstdint>
+#include <limits>
+#include <memory>
+#include <new>
+#include <utility>
+#include <vector>
+
+
+namespace maidsafe {
+
+namespace detail {
+
+// Hands out blocks in size classes which are multiples of kAlignment, carved from slabs of
+// kSlabSize bytes.  A freed block goes on its class's free list to be handed out again rather than
+// being returned to the heap, so repeatedly allocating and freeing blocks of similar sizes doesn't
+// touch the heap once enough slabs are held.  Requests larger than kMaxSlabbedSize go straight to
+// the heap.  Slabs are only released on destruction, which must follow the freeing of every block.
+// Not thread-safe.
+class SlabAllocator {
+ public:
+  static const size_t kAlignment = 16;
+  static const size_t kMaxSlabbedSize = 512;
+  static const size_t kSlabSize = 64 * 1024;
+
+  SlabAllocator();
+  void* Allocate(size_t size);
+  // 'size' must be that passed to Allocate for 'block'.
+  void Deallocate(void* block, size_t size);
+  // The bytes held in slabs, plus those of larger blocks currently allocated.
+  uint64_t reserved_bytes() const { return reserved_bytes_; }
+  // The bytes of the block handed out for a request of 'size' bytes.
+  static size_t BlockSize(size_t size);
+
+ private:
+  SlabAllocator(const SlabAllocator&);
+  SlabAllocator& operator=(const SlabAllocator&);
+
+  struct FreeBlock {
+    FreeBlock* next;
+  };
+
+  std::vector<FreeBlock*> free_lists_;
+  std::vector<std::unique_ptr<char[]>> slabs_;
+  char* slab_position_;
+  char* slab_end_;
+  uint64_t reserved_bytes_;
+};
+
+// Adapts a SlabAllocator for use by standard containers.  Copies share the SlabAllocator, which
+// must outlive them.
+template<typename T>
+class SlabStdAllocator {
+ public:
+  typedef T value_type;
+  typedef T* pointer;
+  typedef const T* const_pointer;
+  typedef T& reference;
+  typedef const T& const_reference;
+  typedef size_t size_type;
+  typedef ptrdiff_t difference_type;
+  template<typename U>
+  struct rebind {
+    typedef SlabStdAllocator<U> other;
+  };
+
+  explicit SlabStdAllocator(SlabAllocator* slabs) : slabs_(slabs) {}
+  template<typename U>
+  SlabStdAllocator(const SlabStdAllocator<U>& other) : slabs_(other.slabs()) {}  // NOLINT
+
+  T* allocate(size_t count, const void* /*hint*/ = nullptr) {
+    if (count > max_size())
+      throw std::bad_alloc();
+    return static_cast<T*>(slabs_->Allocate(count * sizeof(T)));
+  }
+  void deallocate(T* block, size_t count) { slabs_->Deallocate(block, count * sizeof(T)); }
+  template<typename U, typename... Args>
+  void construct(U* place, Args&&... args) {
+    ::new(static_cast<void*>(place)) U(std::forward<Args>(args)...);
+  }
+  template<typename U>
+  void destroy(U* place) { place->~U(); }
+  size_t max_size() const { return std::numeric_limits<size_t>::max() / sizeof(T); }
+  SlabAllocator* slabs() const { return slabs_; }
+
+ private:
+  SlabAllocator* slabs_;
+};
+
+template<typename T, typename U>
+bool operator==(const SlabStdAllocator<T>& lhs, const SlabStdAllocator<U>& rhs) {
+  return lhs.slabs() == rhs.slabs();
+}
+
+template<typename T, typename U>
+bool operator!=(const SlabStdAllocator<T>& lhs, const SlabStdAllocator<U>& rhs) {
+  return !(lhs == rhs);
+}
+
+}  // namespace detail
+
+}  // namespace maidsafe
+
+
+#endif  // MAIDSAFE_COMMON_SLAB_ALLOCATOR_H_
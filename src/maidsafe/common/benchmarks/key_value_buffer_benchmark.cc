@@ -0,0 +1,961 @@
+/* Copyright 2012 MaidSafe.net limited
+
+This MaidSafe Software is licensed under the MaidSafe.net Commercial License, version 1.0 or later,
+and The General Public License (GPL), version 3. By contributing code to this project You agree to
+the terms laid out in the MaidSafe Contributor Agreement, version 1.0, found in the root directory
+of this project at LICENSE, COPYING and CONTRIBUTOR respectively and also available at:
+
+http://www.novinet.com/license
+
+Unless required by applicable law or agreed to in writing, software distributed under the License is
+distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or
+implied. See the License for the specific language governing permissions and limitations under the
+License.
+*/
+
+// Measures KeyValueBuffer and ShardedKeyValueBuffer throughput and latency.  Each comma-separated
+// option is swept, and every combination of the swept values is run in turn.  For each run, the
+// buffer is first filled with every key, then writers Store and readers TryGet keys chosen with a
+// Zipfian skew for the given duration.  With --reader-scaling, the reader count is swept up to 32
+// with every key held in memory, to show how Get throughput scales with readers.  With
+// --eviction-entries, the sweep is replaced by a measurement of the cost of evicting a value from a
+// file_per_key disk buffer already holding many values.  With --admission-mix, it's replaced by a
+// comparison of the memory hit rate of Gets of small values amid stores of large ones, under each
+// kind of memory admission control.  With --dedup-mix, it's replaced by a comparison of the disk
+// writes and space taken by values of which some repeat, with and without disk deduplication.  Run
+// with --help for the options.
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <fstream>
+#include <functional>
+#include <iomanip>
+#include <iostream>
+#include <memory>
+#include <random>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "boost/filesystem/operations.hpp"
+#include "boost/program_options/options_description.hpp"
+#include "boost/program_options/parsers.hpp"
+#include "boost/program_options/variables_map.hpp"
+
+#include "maidsafe/common/disk_backend.h"
+#include "maidsafe/common/key_value_buffer.h"
+#include "maidsafe/common/log.h"
+#include "maidsafe/common/sharded_key_value_buffer.h"
+#include "maidsafe/common/utils.h"
+
+
+namespace fs = boost::filesystem;
+namespace po = boost::program_options;
+
+namespace maidsafe {
+
+namespace benchmark {
+
+namespace {
+
+typedef std::chrono::steady_clock Clock;
+
+struct Config {
+  uint64_t value_size;
+  double memory_ratio, zipf_skew;
+  uint32_t readers, writers, spill_writers, shards;
+  bool pop, direct_io;
+  KeyValueBuffer::DiskLayout layout;
+  KeyValueBuffer::EvictionPolicy eviction;
+};
+
+struct Latencies {
+  Latencies() : ops(0), p50_us(0), p99_us(0) {}
+  uint64_t ops;
+  double p50_us, p99_us;
+};
+
+struct Result {
+  Config config;
+  double seconds;
+  Latencies stores, gets;
+  uint64_t get_misses, pops, bytes_spilled, values_spilled, spills_skipped;
+};
+
+struct AdmissionResult {
+  std::string name;
+  double seconds;
+  uint64_t gets, memory_hits, disk_hits, admissions_bypassed, admissions_refused;
+};
+
+struct RangeResult {
+  std::string name;
+  double seconds;
+  uint64_t bytes;  // Returned by all the reads together.
+};
+
+struct DedupResult {
+  std::string name;
+  double seconds;
+  uint64_t disk_usage;
+  KeyValueBuffer::Stats stats;
+};
+
+struct EvictionResult {
+  uint64_t entries;
+  double fill_seconds;
+  Latencies removes, puts;
+};
+
+const char* const kLayoutNames[] = { "file_per_key", "segment_file" };
+const char* const kEvictionNames[] = { "insertion", "lru", "lfu", "arc", "gdsf" };
+
+template<typename Enum, size_t N>
+Enum ParseName(const std::string& name, const char* const (&names)[N]) {
+  for (size_t i(0); i != N; ++i) {
+    if (name == names[i])
+      return static_cast<Enum>(i);
+  }
+  throw std::invalid_argument("Unknown value \"" + name + "\"");
+}
+
+bool ParseSwitch(const std::string& item) {
+  if (item != "on" && item != "off")
+    throw std::invalid_argument("Expected \"on\" or \"off\" rather than \"" + item + "\"");
+  return item == "on";
+}
+
+template<typename T>
+std::vector<T> ParseList(const std::string& list, std::function<T(const std::string&)> parse) {
+  std::vector<T> values;
+  std::istringstream stream(list);
+  std::string item;
+  while (std::getline(stream, item, ','))
+    values.push_back(parse(item));
+  if (values.empty())
+    throw std::invalid_argument("Empty list");
+  return values;
+}
+
+// Returns every combination of each config in 'configs' with each of 'values'.
+template<typename T>
+std::vector<Config> Sweep(const std::vector<Config>& configs,
+                          const std::vector<T>& values,
+                          std::function<void(Config&, const T&)> set) {
+  std::vector<Config> swept;
+  for (auto& config : configs) {
+    for (const auto& value : values) {
+      swept.push_back(config);
+      set(swept.back(), value);
+    }
+  }
+  return swept;
+}
+
+// Chooses an index in [0, count) with probability proportional to 1 / (index + 1)^skew, so a skew
+// of 0 is uniform.
+class ZipfGenerator {
+ public:
+  ZipfGenerator(size_t count, double skew) : cumulative_(count) {
+    double total(0.0);
+    for (size_t i(0); i != count; ++i) {
+      total += 1.0 / std::pow(static_cast<double>(i + 1), skew);
+      cumulative_[i] = total;
+    }
+    for (auto& weight : cumulative_)
+      weight /= total;
+  }
+
+  size_t operator()(std::mt19937_64& engine) const {
+    double chosen(std::uniform_real_distribution<double>(0.0, 1.0)(engine));
+    auto itr(std::lower_bound(cumulative_.begin(), cumulative_.end(), chosen));
+    return std::min(static_cast<size_t>(itr - cumulative_.begin()), cumulative_.size() - 1);
+  }
+
+ private:
+  std::vector<double> cumulative_;
+};
+
+Latencies Summarise(std::vector<uint64_t>& nanoseconds) {
+  Latencies latencies;
+  latencies.ops = nanoseconds.size();
+  if (nanoseconds.empty())
+    return latencies;
+  auto percentile([&nanoseconds](double fraction)->double {
+    auto nth(nanoseconds.begin() +
+             static_cast<ptrdiff_t>(fraction * static_cast<double>(nanoseconds.size() - 1)));
+    std::nth_element(nanoseconds.begin(), nth, nanoseconds.end());
+    return static_cast<double>(*nth) / 1000.0;
+  });
+  latencies.p50_us = percentile(0.5);
+  latencies.p99_us = percentile(0.99);
+  return latencies;
+}
+
+uint64_t ElapsedNanoseconds(Clock::time_point start) {
+  return static_cast<uint64_t>(
+      std::chrono::duration_cast<std::chrono::nanoseconds>(Clock::now() - start).count());
+}
+
+template<typename Buffer>
+Result Measure(Buffer& buffer,
+               const Config& config,
+               const std::vector<Identity>& keys,
+               const std::vector<KeyValueBuffer::SharedValue>& values,
+               const std::atomic<uint64_t>& pops,
+               std::chrono::milliseconds duration) {
+  for (size_t i(0); i != keys.size(); ++i)
+    buffer.Store(keys[i], values[i % values.size()]);
+  const KeyValueBuffer::Stats kStatsBefore(buffer.stats());
+  const uint64_t kPopsBefore(pops);
+
+  const ZipfGenerator kChooser(keys.size(), config.zipf_skew);
+  std::atomic<bool> stop(false);
+  std::atomic<uint64_t> get_misses(0);
+  std::vector<std::vector<uint64_t>> store_times(config.writers), get_times(config.readers);
+  std::vector<std::thread> threads;
+  for (uint32_t i(0); i != config.writers; ++i) {
+    threads.emplace_back([&, i] {
+      std::mt19937_64 engine(i);
+      while (!stop) {
+        size_t index(kChooser(engine));
+        Clock::time_point start(Clock::now());
+        buffer.Store(keys[index], values[index % values.size()]);
+        store_times[i].push_back(ElapsedNanoseconds(start));
+      }
+    });
+  }
+  for (uint32_t i(0); i != config.readers; ++i) {
+    threads.emplace_back([&, i] {
+      std::mt19937_64 engine(config.writers + i);
+      NonEmptyString value;
+      while (!stop) {
+        size_t index(kChooser(engine));
+        Clock::time_point start(Clock::now());
+        bool found(buffer.TryGet(keys[index], value));
+        get_times[i].push_back(ElapsedNanoseconds(start));
+        if (!found)
+          ++get_misses;
+      }
+    });
+  }
+  Clock::time_point start(Clock::now());
+  std::this_thread::sleep_for(duration);
+  stop = true;
+  for (auto& thread : threads)
+    thread.join();
+
+  Result result;
+  result.config = config;
+  result.seconds = static_cast<double>(ElapsedNanoseconds(start)) / 1e9;
+  std::vector<uint64_t> all_times;
+  for (auto& times : store_times)
+    all_times.insert(all_times.end(), times.begin(), times.end());
+  result.stores = Summarise(all_times);
+  all_times.clear();
+  for (auto& times : get_times)
+    all_times.insert(all_times.end(), times.begin(), times.end());
+  result.gets = Summarise(all_times);
+  result.get_misses = get_misses;
+  result.pops = pops - kPopsBefore;
+  const KeyValueBuffer::Stats kStatsAfter(buffer.stats());
+  result.bytes_spilled = kStatsAfter.bytes_spilled - kStatsBefore.bytes_spilled;
+  result.values_spilled = kStatsAfter.values_spilled - kStatsBefore.values_spilled;
+  result.spills_skipped = kStatsAfter.spills_skipped - kStatsBefore.spills_skipped;
+  return result;
+}
+
+Result Run(const Config& config, size_t key_count, std::chrono::milliseconds duration) {
+  std::vector<Identity> keys;
+  while (keys.size() != key_count)
+    keys.push_back(Identity(RandomString(64)));
+  std::vector<KeyValueBuffer::SharedValue> values;
+  for (int i(0); i != 16; ++i) {
+    values.push_back(std::make_shared<const NonEmptyString>(
+        RandomString(static_cast<size_t>(config.value_size))));
+  }
+
+  // With popping, the disk buffer holds half of the keys; without, all of them, with room to spare
+  // for values being replaced.
+  const uint64_t kWorkingSet(key_count * config.value_size);
+  const DiskUsage kMaxDiskUsage(config.pop ? kWorkingSet / 2 : kWorkingSet * 2);
+  const MemoryUsage kMaxMemoryUsage(
+      static_cast<uint64_t>(config.memory_ratio * static_cast<double>(kMaxDiskUsage.data)));
+  std::atomic<uint64_t> pops(0);
+  KeyValueBuffer::PopFunctor pop_functor;
+  if (config.pop)
+    pop_functor = [&pops](const Identity&, const NonEmptyString&) { ++pops; };  // NOLINT
+
+  KeyValueBuffer::Options options;
+  options.disk_layout = config.layout;
+  options.memory_eviction_policy = config.eviction;
+  options.disk_eviction_policy = config.eviction;
+  options.spill_writer_count = config.spill_writers;
+  options.direct_disk_io = config.direct_io;
+  if (config.shards == 0) {
+    KeyValueBuffer buffer(kMaxMemoryUsage, kMaxDiskUsage, pop_functor, options);
+    return Measure(buffer, config, keys, values, pops, duration);
+  }
+  ShardedKeyValueBuffer buffer(kMaxMemoryUsage, kMaxDiskUsage, pop_functor, config.shards,
+                               options);
+  return Measure(buffer, config, keys, values, pops, duration);
+}
+
+double OpsPerSecond(const Latencies& latencies, double seconds) {
+  return static_cast<double>(latencies.ops) / seconds;
+}
+
+void PrintHeader() {
+  std::cout << std::left << std::setw(9) << "value" << std::setw(7) << "memory"
+            << std::setw(5) << "rd" << std::setw(5) << "wr" << std::setw(6) << "zipf"
+            << std::setw(5) << "pop" << std::setw(7) << "direct" << std::setw(14) << "layout"
+            << std::setw(10) << "eviction"
+            << std::setw(4) << "sw" << std::setw(7) << "shards" << std::right
+            << std::setw(11) << "store/s" << std::setw(9) << "p50us" << std::setw(9) << "p99us"
+            << std::setw(11) << "get/s" << std::setw(9) << "p50us" << std::setw(9) << "p99us"
+            << std::setw(8) << "miss%" << std::setw(11) << "MBspilled" << std::setw(8) << "skip%"
+            << std::setw(9) << "pops" << '\n';
+}
+
+void PrintRow(const Result& result) {
+  const Config& config(result.config);
+  double miss_percent(result.gets.ops == 0 ? 0.0 :
+      100.0 * static_cast<double>(result.get_misses) / static_cast<double>(result.gets.ops));
+  // The share of values due to be spilled which were replaced or deleted before being written.
+  const uint64_t kSpillsDue(result.values_spilled + result.spills_skipped);
+  double skip_percent(kSpillsDue == 0 ? 0.0 :
+      100.0 * static_cast<double>(result.spills_skipped) / static_cast<double>(kSpillsDue));
+  std::cout << std::left << std::setw(9) << config.value_size << std::setw(7)
+            << config.memory_ratio << std::setw(5) << config.readers << std::setw(5)
+            << config.writers << std::setw(6) << config.zipf_skew << std::setw(5)
+            << (config.pop ? "on" : "off") << std::setw(7) << (config.direct_io ? "on" : "off")
+            << std::setw(14) << kLayoutNames[static_cast<int>(config.layout)]
+            << std::setw(10) << kEvictionNames[static_cast<int>(config.eviction)]
+            << std::setw(4) << config.spill_writers << std::setw(7) << config.shards
+            << std::right << std::fixed << std::setprecision(0)
+            << std::setw(11) << OpsPerSecond(result.stores, result.seconds)
+            << std::setprecision(1) << std::setw(9) << result.stores.p50_us
+            << std::setw(9) << result.stores.p99_us << std::setprecision(0)
+            << std::setw(11) << OpsPerSecond(result.gets, result.seconds)
+            << std::setprecision(1) << std::setw(9) << result.gets.p50_us
+            << std::setw(9) << result.gets.p99_us << std::setw(8) << miss_percent
+            << std::setw(11) << static_cast<double>(result.bytes_spilled) / (1024.0 * 1024.0)
+            << std::setw(8) << skip_percent << std::setw(9) << result.pops << '\n';
+  std::cout.unsetf(std::ios::fixed);
+  std::cout << std::setprecision(6) << std::flush;
+}
+
+void WriteJsonLatencies(std::ostream& json, const char* name, const Latencies& latencies,
+                        double seconds) {
+  json << "\"" << name << "\": {\"ops\": " << latencies.ops
+       << ", \"ops_per_second\": " << OpsPerSecond(latencies, seconds)
+       << ", \"p50_us\": " << latencies.p50_us << ", \"p99_us\": " << latencies.p99_us << "}";
+}
+
+void WriteJson(std::ostream& json, const std::vector<Result>& results) {
+  json << "{\n  \"benchmark\": \"key_value_buffer\",\n  \"results\": [";
+  for (size_t i(0); i != results.size(); ++i) {
+    const Result& result(results[i]);
+    const Config& config(result.config);
+    json << (i == 0 ? "\n" : ",\n") << "    {\"value_size\": " << config.value_size
+         << ", \"memory_ratio\": " << config.memory_ratio << ", \"readers\": " << config.readers
+         << ", \"writers\": " << config.writers << ", \"zipf_skew\": " << config.zipf_skew
+         << ", \"pop\": " << (config.pop ? "true" : "false")
+         << ", \"direct_io\": " << (config.direct_io ? "true" : "false")
+         << ", \"layout\": \"" << kLayoutNames[static_cast<int>(config.layout)]
+         << "\", \"eviction\": \"" << kEvictionNames[static_cast<int>(config.eviction)]
+         << "\", \"spill_writers\": " << config.spill_writers
+         << ", \"shards\": " << config.shards << ", \"seconds\": " << result.seconds << ", ";
+    WriteJsonLatencies(json, "store", result.stores, result.seconds);
+    json << ", ";
+    WriteJsonLatencies(json, "get", result.gets, result.seconds);
+    json << ", \"get_misses\": " << result.get_misses << ", \"bytes_spilled\": "
+         << result.bytes_spilled << ", \"values_spilled\": " << result.values_spilled
+         << ", \"spills_skipped\": " << result.spills_skipped << ", \"pops\": " << result.pops
+         << "}";
+  }
+  json << "\n  ]\n}\n";
+}
+
+// Prints each run's get rate relative to the one-reader run which is otherwise the same.
+void PrintReaderScaling(const std::vector<Result>& results) {
+  auto same_but_readers([](const Config& lhs, const Config& rhs) {
+    return lhs.value_size == rhs.value_size && lhs.memory_ratio == rhs.memory_ratio &&
+           lhs.writers == rhs.writers && lhs.zipf_skew == rhs.zipf_skew && lhs.pop == rhs.pop &&
+           lhs.direct_io == rhs.direct_io && lhs.layout == rhs.layout &&
+           lhs.eviction == rhs.eviction && lhs.spill_writers == rhs.spill_writers &&
+           lhs.shards == rhs.shards;
+  });
+  std::cout << "\nReader scaling\n" << std::left << std::setw(9) << "value" << std::setw(5) << "wr"
+            << std::setw(6) << "zipf" << std::setw(10) << "eviction" << std::setw(7) << "shards"
+            << std::right << std::setw(5) << "rd" << std::setw(11) << "get/s"
+            << std::setw(9) << "scale" << '\n';
+  for (auto& result : results) {
+    const Config& config(result.config);
+    double baseline(0.0);
+    for (auto& other : results) {
+      if (other.config.readers == 1 && same_but_readers(other.config, config))
+        baseline = OpsPerSecond(other.gets, other.seconds);
+    }
+    const double kGetsPerSecond(OpsPerSecond(result.gets, result.seconds));
+    std::cout << std::left << std::setw(9) << config.value_size << std::setw(5) << config.writers
+              << std::setw(6) << config.zipf_skew
+              << std::setw(10) << kEvictionNames[static_cast<int>(config.eviction)]
+              << std::setw(7) << config.shards << std::right << std::setw(5) << config.readers
+              << std::fixed << std::setprecision(0) << std::setw(11) << kGetsPerSecond
+              << std::setprecision(2) << std::setw(9)
+              << (baseline == 0.0 ? 0.0 : kGetsPerSecond / baseline) << '\n';
+    std::cout.unsetf(std::ios::fixed);
+  }
+  std::cout << std::setprecision(6) << std::flush;
+}
+
+std::vector<Config> ParseConfigs(const po::variables_map& variables) {
+  std::function<uint64_t(const std::string&)> to_uint64(
+      [](const std::string& item) { return std::stoull(item); });  // NOLINT
+  std::function<uint32_t(const std::string&)> to_uint32(
+      [](const std::string& item) { return static_cast<uint32_t>(std::stoul(item)); });  // NOLINT
+  std::function<double(const std::string&)> to_double(
+      [](const std::string& item) { return std::stod(item); });  // NOLINT
+  const bool kReaderScaling(variables["reader-scaling"].as<bool>());
+  auto option([&variables, kReaderScaling](const char* name)->std::string {
+    if (kReaderScaling && std::string(name) == "readers")
+      return "1,2,4,8,16,32";
+    if (kReaderScaling && std::string(name) == "memory-ratios")
+      return "1";
+    return variables[name].as<std::string>();
+  });
+
+  std::function<bool(const std::string&)> to_switch(ParseSwitch);
+  Config initial = { 0, 0.0, 0.0, 0, 0, 0, 0, false, false,
+                     KeyValueBuffer::DiskLayout::kFilePerKey,
+                     KeyValueBuffer::EvictionPolicy::kInsertionOrder };
+  std::vector<Config> configs(1, initial);
+  configs = Sweep<uint64_t>(configs, ParseList(option("value-sizes"), to_uint64),
+                            [](Config& config, const uint64_t& value) {
+                              config.value_size = value;
+                            });
+  configs = Sweep<double>(configs, ParseList(option("memory-ratios"), to_double),
+                          [](Config& config, const double& value) {
+                            if (value < 0.0 || value > 1.0)
+                              throw std::invalid_argument("Memory ratio must be in [0, 1]");
+                            config.memory_ratio = value;
+                          });
+  configs = Sweep<uint32_t>(configs, ParseList(option("readers"), to_uint32),
+                            [](Config& config, const uint32_t& value) { config.readers = value; });
+  configs = Sweep<uint32_t>(configs, ParseList(option("writers"), to_uint32),
+                            [](Config& config, const uint32_t& value) { config.writers = value; });
+  configs = Sweep<double>(configs, ParseList(option("zipf"), to_double),
+                          [](Config& config, const double& value) { config.zipf_skew = value; });
+  configs = Sweep<bool>(configs, ParseList(option("pop"), to_switch),
+                        [](Config& config, const bool& value) { config.pop = value; });
+  configs = Sweep<bool>(configs, ParseList(option("direct-io"), to_switch),
+                        [](Config& config, const bool& value) { config.direct_io = value; });
+  configs = Sweep<KeyValueBuffer::DiskLayout>(
+      configs, ParseList<KeyValueBuffer::DiskLayout>(option("layouts"),
+          [](const std::string& item) {
+            return ParseName<KeyValueBuffer::DiskLayout>(item, kLayoutNames);
+          }),
+      [](Config& config, const KeyValueBuffer::DiskLayout& value) { config.layout = value; });
+  configs = Sweep<KeyValueBuffer::EvictionPolicy>(
+      configs, ParseList<KeyValueBuffer::EvictionPolicy>(option("evictions"),
+          [](const std::string& item) {
+            return ParseName<KeyValueBuffer::EvictionPolicy>(item, kEvictionNames);
+          }),
+      [](Config& config, const KeyValueBuffer::EvictionPolicy& value) {
+        config.eviction = value;
+      });
+  configs = Sweep<uint32_t>(configs, ParseList(option("spill-writers"), to_uint32),
+                            [](Config& config, const uint32_t& value) {
+                              config.spill_writers = value;
+                            });
+  configs = Sweep<uint32_t>(configs, ParseList(option("shards"), to_uint32),
+                            [](Config& config, const uint32_t& value) { config.shards = value; });
+  return configs;
+}
+
+// Derives the key for 'index' with the SplitMix64 generator, so that millions of keys needn't be
+// held at once.
+Identity EvictionKey(uint64_t index) {
+  std::string key;
+  uint64_t state(index * 8);
+  while (key.size() != 64) {
+    uint64_t value(state += 0x9e3779b97f4a7c15ULL);
+    value = (value ^ (value >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    value = (value ^ (value >> 27)) * 0x94d049bb133111ebULL;
+    value ^= value >> 31;
+    key.append(reinterpret_cast<const char*>(&value), sizeof(value));
+  }
+  return Identity(key);
+}
+
+// Fills a file_per_key backend with 'entries' values, then times evicting the oldest values and
+// writing the values which replace them, as the disk buffer does when full.
+EvictionResult RunEvictionCost(uint64_t entries, uint64_t value_size, const fs::path& root) {
+  const fs::path kDirectory(root / ("kvb_eviction_" + std::to_string(entries)));
+  fs::remove_all(kDirectory);
+  fs::create_directories(kDirectory);
+  const NonEmptyString kValue(RandomString(static_cast<size_t>(value_size)));
+  EvictionResult result;
+  result.entries = entries;
+  {
+    detail::FilePerKeyDiskBackend backend(kDirectory);
+    Clock::time_point start(Clock::now());
+    for (uint64_t i(0); i != entries; ++i)
+      backend.Put(EvictionKey(i), kValue);
+    result.fill_seconds = static_cast<double>(ElapsedNanoseconds(start)) / 1e9;
+
+    const uint64_t kSamples(std::min<uint64_t>(entries, 10000));
+    std::vector<uint64_t> remove_times, put_times;
+    for (uint64_t i(0); i != kSamples; ++i) {
+      Identity victim(EvictionKey(i)), replacement(EvictionKey(entries + i));
+      start = Clock::now();
+      backend.Remove(victim, nullptr);
+      remove_times.push_back(ElapsedNanoseconds(start));
+      start = Clock::now();
+      backend.Put(replacement, kValue);
+      put_times.push_back(ElapsedNanoseconds(start));
+    }
+    result.removes = Summarise(remove_times);
+    result.puts = Summarise(put_times);
+  }
+  fs::remove_all(kDirectory);
+  return result;
+}
+
+void PrintEvictionResult(const EvictionResult& result) {
+  std::cout << std::right << std::setw(10) << result.entries << std::fixed << std::setprecision(0)
+            << std::setw(11) << static_cast<double>(result.entries) / result.fill_seconds
+            << std::setprecision(1) << std::setw(12) << result.removes.p50_us
+            << std::setw(12) << result.removes.p99_us << std::setw(9) << result.puts.p50_us
+            << std::setw(9) << result.puts.p99_us << '\n';
+  std::cout.unsetf(std::ios::fixed);
+  std::cout << std::setprecision(6) << std::flush;
+}
+
+void WriteEvictionJson(std::ostream& json, const std::vector<EvictionResult>& results) {
+  json << "{\n  \"benchmark\": \"key_value_buffer_eviction\",\n  \"results\": [";
+  for (size_t i(0); i != results.size(); ++i) {
+    json << (i == 0 ? "\n" : ",\n") << "    {\"entries\": " << results[i].entries
+         << ", \"fill_seconds\": " << results[i].fill_seconds << ", ";
+    json << "\"remove_p50_us\": " << results[i].removes.p50_us << ", \"remove_p99_us\": "
+         << results[i].removes.p99_us << ", \"put_p50_us\": " << results[i].puts.p50_us
+         << ", \"put_p99_us\": " << results[i].puts.p99_us << "}";
+  }
+  json << "\n  ]\n}\n";
+}
+
+// Runs the eviction cost measurement for each count in the comma-separated 'entries'.
+int MainEvictionCost(const po::variables_map& variables) {
+  std::vector<uint64_t> entries;
+  try {
+    entries = ParseList<uint64_t>(variables["eviction-entries"].as<std::string>(),
+                                  [](const std::string& item) { return std::stoull(item); });
+  }
+  catch(const std::exception& e) {
+    std::cout << "Invalid --eviction-entries: " << e.what() << '\n';
+    return 1;
+  }
+  const fs::path kRoot(variables.count("eviction-root") ?
+                       fs::path(variables["eviction-root"].as<std::string>()) :
+                       fs::temp_directory_path());
+  const uint64_t kValueSize(variables["eviction-value-size"].as<uint64_t>());
+  std::cout << std::right << std::setw(10) << "entries" << std::setw(11) << "fill/s"
+            << std::setw(12) << "remove p50" << std::setw(12) << "remove p99"
+            << std::setw(9) << "put p50" << std::setw(9) << "put p99" << "  (us)\n";
+  std::vector<EvictionResult> results;
+  for (auto count : entries) {
+    try {
+      results.push_back(RunEvictionCost(count, kValueSize, kRoot));
+      PrintEvictionResult(results.back());
+    }
+    catch(const std::exception& e) {
+      std::cout << "Run failed: " << e.what() << '\n';
+      return 1;
+    }
+  }
+  if (variables.count("json")) {
+    std::ofstream json(variables["json"].as<std::string>());
+    WriteEvictionJson(json, results);
+    if (!json) {
+      std::cout << "Failed to write " << variables["json"].as<std::string>() << '\n';
+      return 1;
+    }
+  }
+  return 0;
+}
+
+// Fills the memory buffer with small values, then Gets them with a Zipfian skew while one op in ten
+// Stores a large value under a new key, as a burst of large chunks read just once would.
+AdmissionResult RunAdmissionMix(const std::string& name,
+                                const KeyValueBuffer::Options& options,
+                                uint64_t op_count) {
+  const size_t kSmallCount(2000), kSmallSize(1024), kLargeSize(16 * 1024);
+  std::vector<Identity> keys;
+  while (keys.size() != kSmallCount)
+    keys.push_back(Identity(RandomString(64)));
+  const KeyValueBuffer::SharedValue kSmallValue(
+      std::make_shared<const NonEmptyString>(RandomString(kSmallSize)));
+  const KeyValueBuffer::SharedValue kLargeValue(
+      std::make_shared<const NonEmptyString>(RandomString(kLargeSize)));
+  // The disk buffer has room for every value, so a small value is only ever dropped from memory.
+  KeyValueBuffer buffer(MemoryUsage(kSmallCount * kSmallSize),
+                        DiskUsage(2 * (kSmallCount * kSmallSize + op_count / 10 * kLargeSize)),
+                        KeyValueBuffer::PopFunctor(), options);
+  for (auto& key : keys)
+    buffer.Store(key, kSmallValue);
+  const KeyValueBuffer::Stats kStatsBefore(buffer.stats());
+
+  const ZipfGenerator kChooser(kSmallCount, 0.99);
+  std::mt19937_64 engine(0);
+  NonEmptyString value;
+  Clock::time_point start(Clock::now());
+  for (uint64_t i(0); i != op_count; ++i) {
+    if (i % 10 == 9)
+      buffer.Store(Identity(RandomString(64)), kLargeValue);
+    else
+      buffer.TryGet(keys[kChooser(engine)], value);
+  }
+  AdmissionResult result;
+  result.name = name;
+  result.seconds = static_cast<double>(ElapsedNanoseconds(start)) / 1e9;
+  result.gets = op_count - op_count / 10;
+  const KeyValueBuffer::Stats kStatsAfter(buffer.stats());
+  result.memory_hits = kStatsAfter.memory_hits - kStatsBefore.memory_hits;
+  result.disk_hits = kStatsAfter.disk_hits - kStatsBefore.disk_hits;
+  result.admissions_bypassed = kStatsAfter.admissions_bypassed - kStatsBefore.admissions_bypassed;
+  result.admissions_refused = kStatsAfter.admissions_refused - kStatsBefore.admissions_refused;
+  return result;
+}
+
+int MainAdmissionMix(const po::variables_map& variables) {
+  const uint64_t kOpCount(variables["admission-ops"].as<uint64_t>());
+  KeyValueBuffer::Options none, size, sketch;
+  size.memory_admission_max_size = 4096;
+  sketch.admission_sketch_capacity = 10000;
+  KeyValueBuffer::Options both(sketch);
+  both.memory_admission_max_size = size.memory_admission_max_size;
+  std::vector<AdmissionResult> results;
+  std::cout << std::left << std::setw(10) << "admission" << std::right << std::setw(9)
+            << "mem hit%" << std::setw(10) << "disk hit%" << std::setw(10) << "bypassed"
+            << std::setw(9) << "refused" << std::setw(9) << "ops/s" << '\n';
+  try {
+    results.push_back(RunAdmissionMix("none", none, kOpCount));
+    results.push_back(RunAdmissionMix("size", size, kOpCount));
+    results.push_back(RunAdmissionMix("sketch", sketch, kOpCount));
+    results.push_back(RunAdmissionMix("both", both, kOpCount));
+  }
+  catch(const std::exception& e) {
+    std::cout << "Run failed: " << e.what() << '\n';
+    return 1;
+  }
+  for (auto& result : results) {
+    const double kGets(static_cast<double>(std::max<uint64_t>(result.gets, 1)));
+    std::cout << std::left << std::setw(10) << result.name << std::right << std::fixed
+              << std::setprecision(1) << std::setw(9)
+              << 100.0 * static_cast<double>(result.memory_hits) / kGets << std::setw(10)
+              << 100.0 * static_cast<double>(result.disk_hits) / kGets << std::setw(10)
+              << result.admissions_bypassed << std::setw(9) << result.admissions_refused
+              << std::setprecision(0) << std::setw(9)
+              << static_cast<double>(kOpCount) / result.seconds << '\n';
+    std::cout.unsetf(std::ios::fixed);
+  }
+  std::cout << std::setprecision(6) << std::flush;
+  return 0;
+}
+
+// Four writers each Store 'op_count' / 4 values under new keys through a memory buffer with room
+// for a few of them, so that all are spilled.  Each value repeats one of 16 fixed values with
+// probability 'repeat_fraction', and is otherwise unique.
+DedupResult RunDedupMix(const std::string& name,
+                        const KeyValueBuffer::Options& options,
+                        uint64_t value_size,
+                        double repeat_fraction,
+                        uint64_t op_count) {
+  const size_t kWriterCount(4), kRepeatedCount(16);
+  std::vector<KeyValueBuffer::SharedValue> repeated;
+  while (repeated.size() != kRepeatedCount) {
+    repeated.push_back(std::make_shared<const NonEmptyString>(
+        RandomString(static_cast<size_t>(value_size))));
+  }
+  KeyValueBuffer buffer(MemoryUsage(8 * value_size), DiskUsage(2 * (op_count + 1) * value_size),
+                        KeyValueBuffer::PopFunctor(), options);
+  std::vector<std::thread> writers;
+  Clock::time_point start(Clock::now());
+  for (size_t i(0); i != kWriterCount; ++i) {
+    writers.emplace_back([&, i] {
+        std::mt19937_64 engine(i);
+        std::bernoulli_distribution repeats(repeat_fraction);
+        for (uint64_t j(0); j != op_count / kWriterCount; ++j) {
+          if (repeats(engine)) {
+            buffer.Store(Identity(RandomString(64)), repeated[engine() % kRepeatedCount]);
+          } else {
+            buffer.Store(Identity(RandomString(64)),
+                         NonEmptyString(RandomString(static_cast<size_t>(value_size))));
+          }
+        }
+    });
+  }
+  for (auto& writer : writers)
+    writer.join();
+  // Wait for the spill writers to catch up, so that every value is counted.
+  const uint64_t kStored(op_count / kWriterCount * kWriterCount);
+  DedupResult result;
+  for (;;) {
+    result.stats = buffer.stats();
+    if (result.stats.values_spilled + result.stats.values_deduplicated >= kStored)
+      break;
+    std::this_thread::sleep_for(std::chrono::milliseconds(1));
+  }
+  result.name = name;
+  result.seconds = static_cast<double>(ElapsedNanoseconds(start)) / 1e9;
+  result.disk_usage = buffer.CurrentDiskUsage().data;
+  return result;
+}
+
+int MainDedupMix(const po::variables_map& variables) {
+  const uint64_t kValueSize(variables["dedup-value-size"].as<uint64_t>());
+  const double kRepeatFraction(variables["dedup-repeat-fraction"].as<double>());
+  const uint64_t kOpCount(variables["dedup-ops"].as<uint64_t>());
+  if (kValueSize == 0 || kRepeatFraction < 0.0 || kRepeatFraction > 1.0) {
+    std::cout << "--dedup-value-size must be non-zero and --dedup-repeat-fraction in [0, 1].\n";
+    return 1;
+  }
+  KeyValueBuffer::Options off, on;
+  on.deduplicate_disk_values = true;
+  std::vector<DedupResult> results;
+  try {
+    results.push_back(RunDedupMix("off", off, kValueSize, kRepeatFraction, kOpCount));
+    results.push_back(RunDedupMix("on", on, kValueSize, kRepeatFraction, kOpCount));
+  }
+  catch(const std::exception& e) {
+    std::cout << "Run failed: " << e.what() << '\n';
+    return 1;
+  }
+  std::cout << std::left << std::setw(8) << "dedup" << std::right << std::setw(10) << "stores/s"
+            << std::setw(10) << "written" << std::setw(10) << "skipped" << std::setw(12)
+            << "disk MB" << std::setw(8) << "ratio" << '\n';
+  for (auto& result : results) {
+    const double kWritten(static_cast<double>(std::max<uint64_t>(result.stats.bytes_spilled, 1)));
+    std::cout << std::left << std::setw(8) << result.name << std::right << std::fixed
+              << std::setprecision(0) << std::setw(10)
+              << static_cast<double>(result.stats.values_spilled +
+                                     result.stats.values_deduplicated) / result.seconds
+              << std::setw(10) << result.stats.values_spilled << std::setw(10)
+              << result.stats.values_deduplicated << std::setprecision(1) << std::setw(12)
+              << static_cast<double>(result.disk_usage) / (1024.0 * 1024.0)
+              << std::setprecision(2) << std::setw(8)
+              << (static_cast<double>(result.stats.bytes_spilled +
+                                      result.stats.bytes_deduplicated) / kWritten) << '\n';
+    std::cout.unsetf(std::ios::fixed);
+  }
+  std::cout << std::setprecision(6) << std::flush;
+  return 0;
+}
+
+// Reads 'length' bytes at a random offset within a random one of the values held under 'keys' on
+// each of 'op_count' reads, either by reading the whole value with Get or GetView and taking the
+// bytes from that, or with GetRange.
+RangeResult RunRangeReads(const std::string& name,
+                          KeyValueBuffer& buffer,
+                          const std::vector<Identity>& keys,
+                          uint64_t value_size,
+                          size_t length,
+                          uint64_t op_count) {
+  std::mt19937_64 engine(0);
+  std::uniform_int_distribution<uint64_t> offsets(0, value_size - length);
+  RangeResult result;
+  result.name = name;
+  result.bytes = 0;
+  Clock::time_point start(Clock::now());
+  for (uint64_t i(0); i != op_count; ++i) {
+    const Identity& key(keys[engine() % keys.size()]);
+    const uint64_t kOffset(offsets(engine));
+    if (name == "get") {
+      NonEmptyString value(buffer.Get(key));
+      result.bytes += std::string(value.string(), kOffset, length).size();
+    } else if (name == "view") {
+      KeyValueBuffer::ValueView view(buffer.GetView(key));
+      result.bytes += std::string(view.data() + kOffset, length).size();
+    } else {
+      KeyValueBuffer::ValueView view(buffer.GetRange(key, kOffset, length));
+      result.bytes += std::string(view.data(), view.size()).size();
+    }
+  }
+  result.seconds = static_cast<double>(ElapsedNanoseconds(start)) / 1e9;
+  return result;
+}
+
+int MainRangeReads(const po::variables_map& variables) {
+  const uint64_t kValueSize(variables["range-value-size"].as<uint64_t>());
+  const size_t kLength(variables["range-length"].as<size_t>());
+  const uint64_t kOpCount(variables["range-ops"].as<uint64_t>());
+  const size_t kValueCount(32);
+  if (kLength == 0 || kLength > kValueSize) {
+    std::cout << "--range-length must be non-zero and no more than --range-value-size.\n";
+    return 1;
+  }
+  std::vector<RangeResult> results;
+  try {
+    // The memory buffer has room for just one value, so the rest are read from disk.
+    KeyValueBuffer buffer(MemoryUsage(kValueSize), DiskUsage(2 * kValueCount * kValueSize),
+                          KeyValueBuffer::PopFunctor());
+    std::vector<Identity> keys;
+    while (keys.size() != kValueCount) {
+      keys.push_back(Identity(RandomString(64)));
+      buffer.Store(keys.back(), NonEmptyString(RandomString(static_cast<size_t>(kValueSize))));
+    }
+    for (const char* name : { "get", "view", "range" })
+      results.push_back(RunRangeReads(name, buffer, keys, kValueSize, kLength, kOpCount));
+  }
+  catch(const std::exception& e) {
+    std::cout << "Run failed: " << e.what() << '\n';
+    return 1;
+  }
+  std::cout << std::left << std::setw(8) << "read" << std::right << std::setw(12) << "ops/s"
+            << std::setw(12) << "us/op" << std::setw(12) << "MB/s" << '\n';
+  for (auto& result : results) {
+    std::cout << std::left << std::setw(8) << result.name << std::right << std::fixed
+              << std::setprecision(0) << std::setw(12)
+              << static_cast<double>(kOpCount) / result.seconds << std::setprecision(1)
+              << std::setw(12) << 1e6 * result.seconds / static_cast<double>(kOpCount)
+              << std::setw(12)
+              << static_cast<double>(result.bytes) / result.seconds / (1024.0 * 1024.0) << '\n';
+    std::cout.unsetf(std::ios::fixed);
+  }
+  std::cout << std::setprecision(6) << std::flush;
+  return 0;
+}
+
+int Main(int argc, char** argv) {
+  po::options_description description("KeyValueBuffer benchmark options");
+  description.add_options()
+      ("help,h", "Print this help message.")
+      ("value-sizes", po::value<std::string>()->default_value("1024,16384"),
+       "Value sizes in bytes.")
+      ("memory-ratios", po::value<std::string>()->default_value("0.1,0.5"),
+       "Max memory usage as a fraction of max disk usage.")
+      ("readers", po::value<std::string>()->default_value("1,4"), "Reader thread counts.")
+      ("writers", po::value<std::string>()->default_value("1,4"), "Writer thread counts.")
+      ("zipf", po::value<std::string>()->default_value("0,0.99"),
+       "Zipfian key skews; 0 is uniform.")
+      ("pop", po::value<std::string>()->default_value("off,on"),
+       "Whether a pop functor is set.  With it, the disk buffer holds half of the keys.")
+      ("direct-io", po::value<std::string>()->default_value("off"),
+       "Whether the disk buffer bypasses the page cache.  Only with the file_per_key layout.")
+      ("layouts", po::value<std::string>()->default_value("file_per_key"),
+       "Disk layouts: file_per_key, segment_file.")
+      ("evictions", po::value<std::string>()->default_value("insertion"),
+       "Eviction policies for both buffers: insertion, lru, lfu, arc, gdsf.")
+      ("spill-writers", po::value<std::string>()->default_value("1"), "Spill writer counts.")
+      ("shards", po::value<std::string>()->default_value("0"),
+       "Shard counts; 0 uses a KeyValueBuffer rather than a ShardedKeyValueBuffer.")
+      ("keys", po::value<size_t>()->default_value(1000), "Number of distinct keys.")
+      ("duration-ms", po::value<uint32_t>()->default_value(1000),
+       "Measured duration of each run in milliseconds.")
+      ("reader-scaling", po::bool_switch(),
+       "Sweep readers over 1,2,4,8,16,32 with the memory buffer as large as the disk buffer, "
+       "ignoring --readers and --memory-ratios, then print each run's get rate relative to one "
+       "reader.")
+      ("eviction-entries", po::value<std::string>(),
+       "Instead of the sweep, measure the cost of evicting a value from a file_per_key disk buffer "
+       "holding each of these numbers of values, e.g. 100000,5000000.")
+      ("eviction-value-size", po::value<uint64_t>()->default_value(64),
+       "Value size in bytes for --eviction-entries.")
+      ("eviction-root", po::value<std::string>(),
+       "Directory in which --eviction-entries writes its values; defaults to the temp directory.")
+      ("admission-mix", po::bool_switch(),
+       "Instead of the sweep, compare the memory hit rate of Gets of small values amid stores of "
+       "large ones with no memory admission control, a size limit, a frequency sketch and both.")
+      ("admission-ops", po::value<uint64_t>()->default_value(50000),
+       "Number of operations in each --admission-mix run.")
+      ("range-reads", po::bool_switch(),
+       "Instead of the sweep, compare reading part of each of a set of values held on disk using "
+       "Get, GetView and GetRange.")
+      ("range-value-size", po::value<uint64_t>()->default_value(1024 * 1024),
+       "Value size in bytes for --range-reads.")
+      ("range-length", po::value<size_t>()->default_value(4096),
+       "Bytes read from each value by --range-reads.")
+      ("range-ops", po::value<uint64_t>()->default_value(2000),
+       "Number of reads of each kind made by --range-reads.")
+      ("dedup-mix", po::bool_switch(),
+       "Instead of the sweep, compare the disk writes and space taken by values of which some "
+       "repeat, with and without disk deduplication.")
+      ("dedup-value-size", po::value<uint64_t>()->default_value(16 * 1024),
+       "Value size in bytes for --dedup-mix.")
+      ("dedup-repeat-fraction", po::value<double>()->default_value(0.5),
+       "Fraction of the values stored by --dedup-mix which repeat an earlier one.")
+      ("dedup-ops", po::value<uint64_t>()->default_value(20000),
+       "Number of values stored in each --dedup-mix run.")
+      ("json", po::value<std::string>(), "Also write the results as JSON to this file.");
+
+  po::variables_map variables;
+  std::vector<Config> configs;
+  try {
+    po::store(po::command_line_parser(argc, argv).options(description).allow_unregistered().run(),
+              variables);
+    po::notify(variables);
+    if (variables.count("help")) {
+      std::cout << description << '\n';
+      return 0;
+    }
+    if (variables.count("eviction-entries"))
+      return MainEvictionCost(variables);
+    if (variables["admission-mix"].as<bool>())
+      return MainAdmissionMix(variables);
+    if (variables["range-reads"].as<bool>())
+      return MainRangeReads(variables);
+    if (variables["dedup-mix"].as<bool>())
+      return MainDedupMix(variables);
+    configs = ParseConfigs(variables);
+    if (variables["keys"].as<size_t>() == 0)
+      throw std::invalid_argument("Key count must be non-zero");
+  }
+  catch(const std::exception& e) {
+    std::cout << "Invalid options: " << e.what() << "\n\n" << description << '\n';
+    return 1;
+  }
+
+  const size_t kKeyCount(variables["keys"].as<size_t>());
+  const std::chrono::milliseconds kDuration(variables["duration-ms"].as<uint32_t>());
+  std::vector<Result> results;
+  PrintHeader();
+  for (auto& config : configs) {
+    try {
+      results.push_back(Run(config, kKeyCount, kDuration));
+      PrintRow(results.back());
+    }
+    catch(const std::exception& e) {
+      std::cout << "Run failed: " << e.what() << '\n';
+      return 1;
+    }
+  }
+
+  if (variables["reader-scaling"].as<bool>())
+    PrintReaderScaling(results);
+
+  if (variables.count("json")) {
+    std::ofstream json(variables["json"].as<std::string>());
+    WriteJson(json, results);
+    if (!json) {
+      std::cout << "Failed to write " << variables["json"].as<std::string>() << '\n';
+      return 1;
+    }
+  }
+  return 0;
+}
+
+}  // unnamed namespace
+
+}  // namespace benchmark
+
+}  // namespace maidsafe
+
+int main(int argc, char** argv) {
+  maidsafe::log::Logging::Instance().Initialise(argc, argv);
+  return maidsafe::benchmark::Main(argc, argv);
+}
@@ -0,0 +1,94 @@
+/* Copyright 2012 MaidSafe.net limited
+
+This MaidSafe Software is licensed under the MaidSafe.net Commercial License, version 1.0 or later,
+and The General Public License (GPL), version 3. By contributing code to this project You agree to
+the terms laid out in the MaidSafe Contributor Agreement, version 1.0, found in the root directory
+of this project at LICENSE, COPYING and CONTRIBUTOR respectively and also available at:
+
+http://www.novinet.com/license
+
+Unless required by applicable law or agreed to in writing, software distributed under the License is
+distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or
+implied. See the License for the specific language governing permissions and limitations under the
+License.
+*/
+
+#include "maidsafe/common/counting_bloom_filter.h"
+
+#include <functional>
+#include <string>
+
+#include "maidsafe/common/error.h"
+#include "maidsafe/common/log.h"
+
+
+namespace maidsafe {
+
+namespace detail {
+
+namespace {
+
+// With seven hashes, ten slots per key gives a false positive rate of about 1%.
+const uint64_t kSlotsPerKey(10);
+const uint8_t kMaxCount(255);
+
+// The SplitMix64 finaliser, used to derive a second independent hash from the first.
+uint64_t Mix(uint64_t value) {
+  value = (value ^ (value >> 30)) * 0xbf58476d1ce4e5b9ULL;
+  value = (value ^ (value >> 27)) * 0x94d049bb133111ebULL;
+  return value ^ (value >> 31);
+}
+
+}  // unnamed namespace
+
+CountingBloomFilter::CountingBloomFilter(uint64_t capacity) : counts_() {
+  if (capacity == 0) {
+    LOG(kError) << "Bloom filter capacity must be non-zero.";
+    ThrowError(CommonErrors::invalid_parameter);
+  }
+  std::vector<std::atomic<uint8_t>> counts(static_cast<size_t>(capacity * kSlotsPerKey));
+  counts_.swap(counts);
+  for (auto& count : counts_)
+    count.store(0);
+}
+
+void CountingBloomFilter::Add(const Identity& key) {
+  size_t slots[kHashCount];
+  GetSlots(key, slots);
+  for (auto slot : slots) {
+    uint8_t count(counts_[slot].load());
+    while (count != kMaxCount && !counts_[slot].compare_exchange_weak(count, count + 1)) {}
+  }
+}
+
+void CountingBloomFilter::Remove(const Identity& key) {
+  size_t slots[kHashCount];
+  GetSlots(key, slots);
+  for (auto slot : slots) {
+    uint8_t count(counts_[slot].load());
+    while (count != kMaxCount && count != 0 &&
+           !counts_[slot].compare_exchange_weak(count, count - 1)) {}
+  }
+}
+
+bool CountingBloomFilter::MayContain(const Identity& key) const {
+  size_t slots[kHashCount];
+  GetSlots(key, slots);
+  for (auto slot : slots) {
+    if (counts_[slot].load() == 0)
+      return false;
+  }
+  return true;
+}
+
+void CountingBloomFilter::GetSlots(const Identity& key, size_t (&slots)[kHashCount]) const {
+  // Double hashing: the i-th slot is derived from first + i * second.
+  uint64_t first(std::hash<std::string>()(key.string()));
+  uint64_t second(Mix(first) | 1);
+  for (int i(0); i != kHashCount; ++i)
+    slots[i] = static_cast<size_t>((first + i * second) % counts_.size());
+}
+
+}  // namespace detail
+
+}  // namespace maidsafe
@@ -0,0 +1,60 @@
+/* Copyright 2012 MaidSafe.net limited
+
+This MaidSafe Software is licensed under the MaidSafe.net Commercial License, version 1.0 or later,
+and The General Public License (GPL), version 3. By contributing code to this project You agree to
+the terms laid out in the MaidSafe Contributor Agreement, version 1.0, found in the root directory
+of this project at LICENSE, COPYING and CONTRIBUTOR respectively and also available at:
+
+http://www.novinet.com/license
+
+Unless required by applicable law or agreed to in writing, software distributed under the License is
+distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or
+implied. See the License for the specific language governing permissions and limitations under the
+License.
+*/
+
+#ifndef MAIDSAFE_COMMON_COUNTING_BLOOM_FILTER_H_
+#define MAIDSAFE_COMMON_COUNTING_BLOOM_FILTER_H_
+
+#include <atomic>
+#include <cstdint>
+#include <vector>
+
+#include "maidsafe/common/types.h"
+
+
+namespace maidsafe {
+
+namespace detail {
+
+// A Bloom filter over keys which also supports removal, by keeping a small count rather than a bit
+// in each slot.  All functions may be called concurrently.  A count which reaches its maximum is
+// never changed again, so a key which has been added more times than removed is always reported as
+// possibly present.
+class CountingBloomFilter {
+ public:
+  // Sized for a false positive rate of about 1% while holding 'capacity' keys.  Throws if capacity
+  // is 0.
+  explicit CountingBloomFilter(uint64_t capacity);
+  void Add(const Identity& key);
+  // 'key' must have been added more times than it has been removed.
+  void Remove(const Identity& key);
+  // Returns false only if 'key' definitely hasn't been added more times than it has been removed.
+  bool MayContain(const Identity& key) const;
+
+ private:
+  CountingBloomFilter(const CountingBloomFilter&);
+  CountingBloomFilter& operator=(const CountingBloomFilter&);
+
+  static const int kHashCount = 7;
+  void GetSlots(const Identity& key, size_t (&slots)[kHashCount]) const;
+
+  std::vector<std::atomic<uint8_t>> counts_;
+};
+
+}  // namespace detail
+
+}  // namespace maidsafe
+
+
+#endif  // MAIDSAFE_COMMON_COUNTING_BLOOM_FILTER_H_
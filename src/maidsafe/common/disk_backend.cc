@@ -0,0 +1,1015 @@
+/* Copyright 2012 MaidSafe.net limited
+
+This MaidSafe Software is licensed under the MaidSafe.net Commercial License, version 1.0 or later,
+and The General Public License (GPL), version 3. By contributing code to this project You agree to
+the terms laid out in the MaidSafe Contributor Agreement, version 1.0, found in the root directory
+of this project at LICENSE, COPYING and CONTRIBUTOR respectively and also available at:
+
+http://www.novinet.com/license
+
+Unless required by applicable law or agreed to in writing, software distributed under the License is
+distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or
+implied. See the License for the specific language governing permissions and limitations under the
+License.
+*/
+
+#include "maidsafe/common/disk_backend.h"
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#ifdef MAIDSAFE_WIN32
+#  include <io.h>
+#  include <windows.h>
+#else
+#  include <sys/mman.h>
+#  include <unistd.h>
+#endif
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <new>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "boost/filesystem/operations.hpp"
+
+#include "maidsafe/common/error.h"
+#include "maidsafe/common/log.h"
+#include "maidsafe/common/utils.h"
+
+
+namespace fs = boost::filesystem;
+
+namespace maidsafe {
+
+namespace detail {
+
+namespace {
+
+// Each record in a segment file is the key, followed by the value's size as 4 little-endian bytes,
+// followed by the value.
+const size_t kKeySize(64);
+const size_t kRecordHeaderSize(kKeySize + 4);
+const uint64_t kMaxSegmentValueSize(0xFFFFFFFF);
+const std::string kSegmentPrefix("segment_");
+// The saved segment index is the record count as 8 bytes, followed by each record's key, segment
+// (4 bytes), offset (8 bytes) and value size (4 bytes).  All numbers are little-endian.
+const std::string kSegmentIndexName("segments.index");
+const size_t kIndexRecordSize(kKeySize + 16);
+// A manifest is kManifestMagic, the layout as 4 bytes and the entry count as 8 bytes, followed by
+// each entry's key and value size (8 bytes).
+const std::string kManifestMagic("KVBM");
+const size_t kManifestHeaderSize(16);
+const size_t kManifestRecordSize(kKeySize + 8);
+// FilePerKeyDiskBackend has a subdirectory for each value of a key's first byte.
+const size_t kSubdirectoryCount(256);
+
+size_t SubdirectoryIndex(const Identity& key) {
+  return static_cast<unsigned char>(key.string()[0]);
+}
+
+uint64_t RecordSize(uint32_t value_size) {
+  return kRecordHeaderSize + value_size;
+}
+
+void AppendLittleEndian(uint64_t value, size_t byte_count, std::string& output) {
+  for (size_t i(0); i != byte_count; ++i)
+    output.push_back(static_cast<char>((value >> (8 * i)) & 0xFF));
+}
+
+uint64_t ParseLittleEndian(const char* data, size_t byte_count) {
+  uint64_t value(0);
+  for (size_t i(0); i != byte_count; ++i)
+    value |= static_cast<uint64_t>(static_cast<unsigned char>(data[i])) << (8 * i);
+  return value;
+}
+
+int OpenSegmentFile(const fs::path& path) {
+#ifdef MAIDSAFE_WIN32
+  return _wopen(path.c_str(), _O_RDWR | _O_CREAT | _O_BINARY, _S_IREAD | _S_IWRITE);
+#else
+  return open(path.c_str(), O_RDWR | O_CREAT, S_IRUSR | S_IWUSR);
+#endif
+}
+
+int OpenForReading(const fs::path& path) {
+#ifdef MAIDSAFE_WIN32
+  return _wopen(path.c_str(), _O_RDONLY | _O_BINARY);
+#else
+  return open(path.c_str(), O_RDONLY);
+#endif
+}
+
+void CloseFile(int descriptor) {
+#ifdef MAIDSAFE_WIN32
+  _close(descriptor);
+#else
+  close(descriptor);
+#endif
+}
+
+// Both transfers are positional, so several threads may use the same descriptor at once.
+bool WriteAt(int descriptor, uint64_t offset, const char* data, size_t size) {
+  while (size != 0) {
+#ifdef MAIDSAFE_WIN32
+    OVERLAPPED overlapped = {};
+    overlapped.Offset = static_cast<DWORD>(offset);
+    overlapped.OffsetHigh = static_cast<DWORD>(offset >> 32);
+    DWORD written(0);
+    if (!WriteFile(reinterpret_cast<HANDLE>(_get_osfhandle(descriptor)), data,
+                   static_cast<DWORD>(std::min<size_t>(size, 1 << 30)), &written, &overlapped)) {
+      return false;
+    }
+#else
+    ssize_t written(pwrite(descriptor, data, size, static_cast<off_t>(offset)));
+#endif
+    if (written <= 0)
+      return false;
+    data += written;
+    offset += written;
+    size -= written;
+  }
+  return true;
+}
+
+bool ReadAt(int descriptor, uint64_t offset, char* data, size_t size) {
+  while (size != 0) {
+#ifdef MAIDSAFE_WIN32
+    OVERLAPPED overlapped = {};
+    overlapped.Offset = static_cast<DWORD>(offset);
+    overlapped.OffsetHigh = static_cast<DWORD>(offset >> 32);
+    DWORD read_count(0);
+    if (!ReadFile(reinterpret_cast<HANDLE>(_get_osfhandle(descriptor)), data,
+                  static_cast<DWORD>(std::min<size_t>(size, 1 << 30)), &read_count, &overlapped)) {
+      return false;
+    }
+#else
+    ssize_t read_count(pread(descriptor, data, size, static_cast<off_t>(offset)));
+#endif
+    if (read_count <= 0)
+      return false;
+    data += read_count;
+    offset += read_count;
+    size -= read_count;
+  }
+  return true;
+}
+
+// Reads 'length' bytes from 'offset' of the file open as 'descriptor' into a new buffer.  Returns
+// null on failure.
+std::shared_ptr<const char> ReadRegion(int descriptor, uint64_t offset, size_t length) {
+  std::shared_ptr<char> buffer(new char[std::max<size_t>(length, 1)],
+                               std::default_delete<char[]>());
+  if (!ReadAt(descriptor, offset, buffer.get(), length))
+    return std::shared_ptr<const char>();
+  return buffer;
+}
+
+// Returns the size of the file open as 'descriptor', or -1 on failure.  Asking the open file
+// rather than the filesystem saves looking the path up a second time.
+int64_t OpenFileSize(int descriptor) {
+#ifdef MAIDSAFE_WIN32
+  return _filelengthi64(descriptor);
+#else
+  struct stat status;
+  return fstat(descriptor, &status) == 0 ? static_cast<int64_t>(status.st_size) : -1;
+#endif
+}
+
+// Opens the file at path for reading, setting 'size' to its size.  Throws on failure.
+int OpenWithSize(const fs::path& path, uint64_t& size) {
+  int descriptor(OpenForReading(path));
+  int64_t file_size(descriptor < 0 ? -1 : OpenFileSize(descriptor));
+  if (file_size < 0) {
+    int error(errno);
+    if (descriptor >= 0)
+      CloseFile(descriptor);
+    LOG(kError) << "Failed to open " << path << ": " << std::strerror(error);
+    ThrowError(CommonErrors::filesystem_io_error);
+  }
+  size = static_cast<uint64_t>(file_size);
+  return descriptor;
+}
+
+// Reads the whole of the file at path straight into the returned string.
+std::string ReadWholeFile(const fs::path& path) {
+  uint64_t size(0);
+  int descriptor(OpenWithSize(path, size));
+  std::string content(static_cast<size_t>(size), 0);
+  bool read(ReadAt(descriptor, 0, &content[0], content.size()));
+  CloseFile(descriptor);
+  if (!read) {
+    LOG(kError) << "Failed to read " << path;
+    ThrowError(CommonErrors::filesystem_io_error);
+  }
+  return content;
+}
+
+#ifdef O_DIRECT
+// O_DIRECT transfers must be aligned to the device's logical block size, in memory and in the file,
+// and must be a whole number of blocks.  4096 bytes suits all common devices.
+const size_t kDirectIoAlignment(4096);
+
+enum class DirectIoResult { kDone, kUnsupported, kFailed };
+
+size_t AlignUp(size_t size) {
+  return (size + kDirectIoAlignment - 1) / kDirectIoAlignment * kDirectIoAlignment;
+}
+
+std::unique_ptr<char, void(*)(void*)> AllocateAligned(size_t size) {
+  void* memory(nullptr);
+  if (posix_memalign(&memory, kDirectIoAlignment, std::max(size, kDirectIoAlignment)) != 0)
+    throw std::bad_alloc();
+  return std::unique_ptr<char, void(*)(void*)>(static_cast<char*>(memory), &free);
+}
+
+// Returns kUnsupported if the filesystem rejects O_DIRECT.  The last block is written padded, then
+// the file is truncated to the content's size.
+DirectIoResult WriteFileDirect(const fs::path& path, const std::string& content) {
+  int descriptor(open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_DIRECT, S_IRUSR | S_IWUSR));
+  if (descriptor < 0)
+    return errno == EINVAL ? DirectIoResult::kUnsupported : DirectIoResult::kFailed;
+  const size_t kPaddedSize(AlignUp(content.size()));
+  auto buffer(AllocateAligned(kPaddedSize));
+  std::memcpy(buffer.get(), content.data(), content.size());
+  std::memset(buffer.get() + content.size(), 0, kPaddedSize - content.size());
+  bool written(WriteAt(descriptor, 0, buffer.get(), kPaddedSize) &&
+               ftruncate(descriptor, static_cast<off_t>(content.size())) == 0);
+  CloseFile(descriptor);
+  return written ? DirectIoResult::kDone : DirectIoResult::kFailed;
+}
+
+// Returns kUnsupported if the filesystem rejects O_DIRECT.  Whole blocks are read, the last of
+// which is cut short by the end of the file.
+DirectIoResult ReadFileDirect(const fs::path& path, std::string& content) {
+  int descriptor(open(path.c_str(), O_RDONLY | O_DIRECT));
+  if (descriptor < 0)
+    return errno == EINVAL ? DirectIoResult::kUnsupported : DirectIoResult::kFailed;
+  struct stat status;
+  bool read(fstat(descriptor, &status) == 0);
+  if (read) {
+    const size_t kSize(static_cast<size_t>(status.st_size));
+    const size_t kPaddedSize(AlignUp(kSize));
+    auto buffer(AllocateAligned(kPaddedSize));
+    size_t total(0);
+    while (read && total < kSize) {
+      ssize_t read_count(pread(descriptor, buffer.get() + total, kPaddedSize - total,
+                               static_cast<off_t>(total)));
+      read = (read_count > 0);
+      total += read ? static_cast<size_t>(read_count) : 0;
+    }
+    if (read)
+      content.assign(buffer.get(), kSize);
+  }
+  CloseFile(descriptor);
+  return read ? DirectIoResult::kDone : DirectIoResult::kFailed;
+}
+
+// Returns kUnsupported if the filesystem rejects O_DIRECT.  The whole blocks spanning the 'length'
+// bytes from 'offset' are read, and 'range' is set to point to those bytes within them.
+DirectIoResult ReadRangeDirect(const fs::path& path, uint64_t offset, size_t length,
+                               std::shared_ptr<const char>& range) {
+  int descriptor(open(path.c_str(), O_RDONLY | O_DIRECT));
+  if (descriptor < 0)
+    return errno == EINVAL ? DirectIoResult::kUnsupported : DirectIoResult::kFailed;
+  const uint64_t kStart(offset - offset % kDirectIoAlignment);
+  const size_t kWanted(static_cast<size_t>(offset - kStart) + length);
+  const size_t kPaddedSize(AlignUp(kWanted));
+  std::shared_ptr<char> buffer(AllocateAligned(kPaddedSize));
+  bool read(true);
+  size_t total(0);
+  while (read && total < kWanted) {
+    ssize_t read_count(pread(descriptor, buffer.get() + total, kPaddedSize - total,
+                             static_cast<off_t>(kStart + total)));
+    read = (read_count > 0);
+    total += read ? static_cast<size_t>(read_count) : 0;
+  }
+  CloseFile(descriptor);
+  if (read)
+    range = std::shared_ptr<const char>(buffer, buffer.get() + (offset - kStart));
+  return read ? DirectIoResult::kDone : DirectIoResult::kFailed;
+}
+#endif
+
+#ifndef MAIDSAFE_WIN32
+// Maps 'size' bytes from 'offset' of the file open as 'descriptor'.  The mapping stays valid once
+// the descriptor is closed and the file removed, but the file mustn't be truncated meanwhile.
+std::shared_ptr<const char> MapRegion(int descriptor, uint64_t offset, size_t size) {
+  static const uint64_t kPageSize(static_cast<uint64_t>(sysconf(_SC_PAGESIZE)));
+  uint64_t aligned_offset(offset - offset % kPageSize);
+  size_t mapped_size(static_cast<size_t>(offset - aligned_offset) + size);
+  void* address(mmap(nullptr, mapped_size, PROT_READ, MAP_PRIVATE, descriptor,
+                     static_cast<off_t>(aligned_offset)));
+  if (address == MAP_FAILED) {
+    LOG(kError) << "Failed to map " << size << " bytes at offset " << offset;
+    ThrowError(CommonErrors::filesystem_io_error);
+  }
+  std::shared_ptr<const char> mapping(static_cast<const char*>(address),
+                                      [mapped_size](const char* address) {
+      munmap(const_cast<char*>(address), mapped_size);
+  });
+  return std::shared_ptr<const char>(mapping, mapping.get() + (offset - aligned_offset));
+}
+#endif
+
+}  // unnamed namespace
+
+std::pair<std::shared_ptr<const char>, size_t> DiskBackend::Map(const Identity& key) {
+  std::shared_ptr<const NonEmptyString> value(std::make_shared<const NonEmptyString>(Get(key)));
+  return std::make_pair(std::shared_ptr<const char>(value, value->string().data()),
+                        value->string().size());
+}
+
+std::pair<std::shared_ptr<const char>, size_t> DiskBackend::ReadRange(const Identity& key,
+                                                                      uint64_t offset,
+                                                                      size_t length) {
+  std::pair<std::shared_ptr<const char>, size_t> mapped(Map(key));
+  return std::make_pair(std::shared_ptr<const char>(mapped.first, mapped.first.get() + offset),
+                        length);
+}
+
+void WriteDiskManifest(const fs::path& path, uint32_t layout, const DiskManifest& manifest) {
+  std::string content(kManifestMagic);
+  content.reserve(kManifestHeaderSize + manifest.size() * kManifestRecordSize);
+  AppendLittleEndian(layout, 4, content);
+  AppendLittleEndian(manifest.size(), 8, content);
+  for (auto& entry : manifest) {
+    content += entry.first.string();
+    AppendLittleEndian(entry.second, 8, content);
+  }
+  if (!WriteFile(path, content)) {
+    LOG(kError) << "Failed to write disk manifest " << path;
+    ThrowError(CommonErrors::filesystem_io_error);
+  }
+}
+
+bool ReadDiskManifest(const fs::path& path, uint32_t layout, DiskManifest& manifest) {
+  boost::system::error_code error_code;
+  std::string content;
+  if (!fs::exists(path, error_code) || !ReadFile(path, &content))
+    return false;
+  if (content.size() < kManifestHeaderSize ||
+      content.compare(0, kManifestMagic.size(), kManifestMagic) != 0) {
+    LOG(kWarning) << path << " is not a disk manifest.";
+    return false;
+  }
+  if (ParseLittleEndian(&content[4], 4) != layout) {
+    LOG(kWarning) << path << " was saved for a different disk layout.";
+    return false;
+  }
+  uint64_t count(ParseLittleEndian(&content[8], 8));
+  if ((content.size() - kManifestHeaderSize) / kManifestRecordSize != count ||
+      (content.size() - kManifestHeaderSize) % kManifestRecordSize != 0) {
+    LOG(kWarning) << path << " is truncated.";
+    return false;
+  }
+  manifest.clear();
+  manifest.reserve(static_cast<size_t>(count));
+  for (size_t offset(kManifestHeaderSize); offset != content.size();
+       offset += kManifestRecordSize) {
+    manifest.emplace_back(Identity(content.substr(offset, kKeySize)),
+                          ParseLittleEndian(&content[offset + kKeySize], 8));
+  }
+  return true;
+}
+
+FilePerKeyDiskBackend::FilePerKeyDiskBackend(const fs::path& root, bool direct_io)
+    : kRoot_(root),
+      direct_io_(direct_io),
+      directory_created_() {
+  std::vector<std::atomic<bool>> directory_created(kSubdirectoryCount);
+  directory_created_.swap(directory_created);
+  for (auto& created : directory_created_)
+    created.store(false);
+  MoveUnspreadFiles();
+}
+
+void FilePerKeyDiskBackend::Put(const Identity& key, const NonEmptyString& value) {
+  CreateDirectoryFor(key);
+  fs::path path(GetFilename(key));
+#ifdef O_DIRECT
+  if (direct_io_) {
+    DirectIoResult result(WriteFileDirect(path, value.string()));
+    if (result == DirectIoResult::kDone)
+      return;
+    if (result == DirectIoResult::kFailed) {
+      LOG(kError) << "Failed to write " << HexSubstr(key) << " to disk.";
+      ThrowError(CommonErrors::filesystem_io_error);
+    }
+    DisableDirectIo();
+  }
+#endif
+  if (!WriteFile(path, value.string())) {
+    LOG(kError) << "Failed to write " << HexSubstr(key) << " to disk.";
+    ThrowError(CommonErrors::filesystem_io_error);
+  }
+}
+
+NonEmptyString FilePerKeyDiskBackend::Get(const Identity& key) {
+  return NonEmptyString(Read(GetFilename(key)));
+}
+
+std::pair<std::shared_ptr<const char>, size_t> FilePerKeyDiskBackend::Map(const Identity& key) {
+#ifdef MAIDSAFE_WIN32
+  // A mapped file can't be removed on Windows, so the value is read instead.
+  return DiskBackend::Map(key);
+#else
+  // Mapping would bring the value into the page cache.
+  if (direct_io_)
+    return DiskBackend::Map(key);
+  uint64_t size(0);
+  int descriptor(OpenWithSize(GetFilename(key), size));
+  try {
+    auto mapping(MapRegion(descriptor, 0, static_cast<size_t>(size)));
+    CloseFile(descriptor);
+    return std::make_pair(mapping, static_cast<size_t>(size));
+  }
+  catch(...) {
+    CloseFile(descriptor);
+    throw;
+  }
+#endif
+}
+
+std::pair<std::shared_ptr<const char>, size_t> FilePerKeyDiskBackend::ReadRange(
+    const Identity& key,
+    uint64_t offset,
+    size_t length) {
+  fs::path path(GetFilename(key));
+#ifdef O_DIRECT
+  if (direct_io_) {
+    std::shared_ptr<const char> range;
+    DirectIoResult result(ReadRangeDirect(path, offset, length, range));
+    if (result == DirectIoResult::kDone)
+      return std::make_pair(range, length);
+    if (result == DirectIoResult::kFailed) {
+      LOG(kError) << "Failed to read " << length << " bytes at offset " << offset << " of " << path;
+      ThrowError(CommonErrors::filesystem_io_error);
+    }
+    DisableDirectIo();
+  }
+#endif
+  int descriptor(OpenForReading(path));
+  if (descriptor < 0) {
+    LOG(kError) << "Failed to open " << path << ": " << std::strerror(errno);
+    ThrowError(CommonErrors::filesystem_io_error);
+  }
+  std::shared_ptr<const char> range(ReadRegion(descriptor, offset, length));
+  CloseFile(descriptor);
+  if (!range) {
+    LOG(kError) << "Failed to read " << length << " bytes at offset " << offset << " of " << path;
+    ThrowError(CommonErrors::filesystem_io_error);
+  }
+  return std::make_pair(range, length);
+}
+
+void FilePerKeyDiskBackend::Remove(const Identity& key, NonEmptyString* value) {
+  fs::path path(GetFilename(key));
+  if (value)
+    *value = NonEmptyString(Read(path));
+  boost::system::error_code error_code;
+  if (!fs::remove(path, error_code) || error_code) {
+    LOG(kError) << "Error removing " << path << ": " << error_code.message();
+    ThrowError(CommonErrors::filesystem_io_error);
+  }
+}
+
+fs::path FilePerKeyDiskBackend::GetFilename(const Identity& key) const {
+  const std::string kPrefix(EncodeToHex(key.string().substr(0, 1)));
+  return kRoot_ / kPrefix.substr(0, 1) / kPrefix.substr(1, 1) / EncodeToBase32(key);
+}
+
+void FilePerKeyDiskBackend::CreateDirectoryFor(const Identity& key) {
+  std::atomic<bool>& created(directory_created_[SubdirectoryIndex(key)]);
+  if (created)
+    return;
+  // Concurrent calls for the same directory may both get here, which is harmless.  The root isn't
+  // recreated, so that a disk buffer removed from under the backend is reported as an error.
+  fs::path directory(GetFilename(key).parent_path());
+  boost::system::error_code error_code;
+  fs::create_directory(directory.parent_path(), error_code);
+  if (!error_code)
+    fs::create_directory(directory, error_code);
+  if (error_code) {
+    LOG(kError) << "Failed to create " << directory << ": " << error_code.message();
+    ThrowError(CommonErrors::filesystem_io_error);
+  }
+  created = true;
+}
+
+void FilePerKeyDiskBackend::MoveUnspreadFiles() {
+  // The names are gathered first, since moving files while iterating over them isn't portable.
+  std::vector<std::pair<fs::path, Identity>> unspread;
+  boost::system::error_code error_code;
+  for (fs::directory_iterator itr(kRoot_, error_code), end; !error_code && itr != end;
+       itr.increment(error_code)) {
+    if (!fs::is_regular_file((*itr).status()))
+      continue;
+    std::string name((*itr).path().filename().string()), decoded;
+    try {
+      decoded = DecodeFromBase32(name);
+    }
+    catch(const std::exception&) {
+      continue;
+    }
+    if (decoded.size() == kKeySize && EncodeToBase32(decoded) == name)
+      unspread.emplace_back((*itr).path(), Identity(decoded));
+  }
+  for (auto& file : unspread) {
+    CreateDirectoryFor(file.second);
+    fs::rename(file.first, GetFilename(file.second), error_code);
+    if (error_code) {
+      LOG(kError) << "Failed to move " << file.first << ": " << error_code.message();
+      ThrowError(CommonErrors::filesystem_io_error);
+    }
+  }
+  if (!unspread.empty())
+    LOG(kInfo) << "Moved " << unspread.size() << " values into subdirectories of " << kRoot_;
+}
+
+std::string FilePerKeyDiskBackend::Read(const fs::path& path) {
+#ifdef O_DIRECT
+  if (direct_io_) {
+    std::string content;
+    DirectIoResult result(ReadFileDirect(path, content));
+    if (result == DirectIoResult::kDone)
+      return content;
+    if (result == DirectIoResult::kFailed) {
+      LOG(kError) << "Failed to read " << path;
+      ThrowError(CommonErrors::filesystem_io_error);
+    }
+    DisableDirectIo();
+  }
+#endif
+  return ReadWholeFile(path);
+}
+
+void FilePerKeyDiskBackend::DisableDirectIo() {
+  if (direct_io_.exchange(false))
+    LOG(kWarning) << "Direct I/O isn't supported in " << kRoot_ << ", so buffered I/O is used.";
+}
+
+
+const uint64_t SegmentFileDiskBackend::kDefaultSegmentSize(64 * 1024 * 1024);
+
+SegmentFileDiskBackend::SegmentFile::SegmentFile(int descriptor_in, const fs::path& path_in)
+    : descriptor(descriptor_in), path(path_in), retired(false) {}
+
+SegmentFileDiskBackend::SegmentFile::~SegmentFile() {
+  CloseFile(descriptor);
+  if (!retired)
+    return;
+  boost::system::error_code error_code;
+  if (!fs::remove(path, error_code) || error_code)
+    LOG(kWarning) << "Failed to remove " << path << ": " << error_code.message();
+}
+
+SegmentFileDiskBackend::SegmentFileDiskBackend(const fs::path& root,
+                                               uint64_t segment_size,
+                                               bool recover)
+    : kRoot_(root),
+      kSegmentSize_(segment_size),
+      segments_(),
+      active_segment_(0),
+      index_(),
+      mutex_(),
+      cond_var_(),
+      running_(true),
+      compacting_(false),
+      compacting_segment_(0),
+      compactor_() {
+  if (recover) {
+    try {
+      LoadIndex();
+    }
+    catch(...) {
+      segments_.clear();
+      throw;
+    }
+  }
+  // Without a saved index, the contents of any existing segments are unreachable.
+  boost::system::error_code error_code;
+  fs::remove(kRoot_ / kSegmentIndexName, error_code);
+  RemoveSegmentFiles();
+  OpenNewSegment();
+  compactor_ = std::async(std::launch::async, &SegmentFileDiskBackend::Compact, this);
+}
+
+SegmentFileDiskBackend::~SegmentFileDiskBackend() {
+  StopCompaction();
+}
+
+void SegmentFileDiskBackend::Put(const Identity& key, const NonEmptyString& value) {
+  assert(key.string().size() == kKeySize);
+  if (value.string().size() > kMaxSegmentValueSize) {
+    LOG(kError) << "Cannot store " << HexSubstr(key) << " in a segment since its "
+                << value.string().size() << " bytes exceeds the max of " << kMaxSegmentValueSize
+                << " bytes.";
+    ThrowError(CommonErrors::cannot_exceed_limit);
+  }
+  std::shared_ptr<SegmentFile> file;
+  Location location(0, 0, 0);
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    location = Reserve(static_cast<uint32_t>(value.string().size()), file);
+  }
+  // The record's space is reserved, so it's written without holding up other callers.
+  const bool kWritten(WriteRecord(*file, location, key, value.string()));
+  bool notify(false);
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    notify = FinishWrite(key, location, kWritten, nullptr);
+  }
+  if (notify)
+    cond_var_.notify_all();
+  if (!kWritten) {
+    LOG(kError) << "Failed to append " << HexSubstr(key) << " to " << file->path;
+    ThrowError(CommonErrors::filesystem_io_error);
+  }
+}
+
+NonEmptyString SegmentFileDiskBackend::Get(const Identity& key) {
+  Location location(0, 0, 0);
+  std::shared_ptr<SegmentFile> file(Find(key, location));
+  return NonEmptyString(ReadValue(*file, location));
+}
+
+std::pair<std::shared_ptr<const char>, size_t> SegmentFileDiskBackend::Map(const Identity& key) {
+#ifdef MAIDSAFE_WIN32
+  // A mapped segment can't be removed on Windows, so the value is read instead.
+  return DiskBackend::Map(key);
+#else
+  Location location(0, 0, 0);
+  std::shared_ptr<SegmentFile> file(Find(key, location));
+  // Records are never overwritten, so the mapping outlives compaction of the segment.
+  return std::make_pair(MapRegion(file->descriptor, location.offset + kRecordHeaderSize,
+                                  location.length),
+                        static_cast<size_t>(location.length));
+#endif
+}
+
+std::pair<std::shared_ptr<const char>, size_t> SegmentFileDiskBackend::ReadRange(
+    const Identity& key,
+    uint64_t offset,
+    size_t length) {
+  Location location(0, 0, 0);
+  std::shared_ptr<SegmentFile> file(Find(key, location));
+  std::shared_ptr<const char> range(ReadRegion(file->descriptor,
+                                               location.offset + kRecordHeaderSize + offset,
+                                               length));
+  if (!range) {
+    LOG(kError) << "Failed to read from " << file->path;
+    ThrowError(CommonErrors::filesystem_io_error);
+  }
+  return std::make_pair(range, length);
+}
+
+void SegmentFileDiskBackend::Remove(const Identity& key, NonEmptyString* value) {
+  // The value is read before the lock is taken, and the index is only updated if that succeeds.
+  if (value) {
+    Location location(0, 0, 0);
+    std::shared_ptr<SegmentFile> file(Find(key, location));
+    *value = NonEmptyString(ReadValue(*file, location));
+  }
+  bool notify(false);
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto itr(index_.find(key));
+    if (itr == index_.end()) {
+      LOG(kError) << HexSubstr(key) << " is not in any segment.";
+      ThrowError(CommonErrors::no_such_element);
+    }
+    Location location(itr->second);
+    index_.erase(itr);
+    auto segment(segments_.find(location.segment));
+    segment->second.live -= RecordSize(location.length);
+    notify = ReleaseIfUnused(segment);
+  }
+  if (notify)
+    cond_var_.notify_all();
+}
+
+void SegmentFileDiskBackend::SaveIndex() {
+  // Compaction moves values between segments, so it's stopped to keep the saved index valid.
+  StopCompaction();
+  std::string content;
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    content.reserve(8 + index_.size() * kIndexRecordSize);
+    AppendLittleEndian(index_.size(), 8, content);
+    for (auto& entry : index_) {
+      content += entry.first.string();
+      AppendLittleEndian(entry.second.segment, 4, content);
+      AppendLittleEndian(entry.second.offset, 8, content);
+      AppendLittleEndian(entry.second.length, 4, content);
+    }
+  }
+  if (!WriteFile(kRoot_ / kSegmentIndexName, content)) {
+    LOG(kError) << "Failed to write segment index in " << kRoot_;
+    ThrowError(CommonErrors::filesystem_io_error);
+  }
+}
+
+void SegmentFileDiskBackend::WaitForCompaction() {
+  std::unique_lock<std::mutex> lock(mutex_);
+  uint32_t segment(0);
+  cond_var_.wait(lock, [&]()->bool {
+      return !running_ || (!compacting_ && !FindCompactionCandidate(segment));
+  });
+}
+
+size_t SegmentFileDiskBackend::segment_count() {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return segments_.size();
+}
+
+fs::path SegmentFileDiskBackend::SegmentPath(uint32_t segment) const {
+  return kRoot_ / (kSegmentPrefix + std::to_string(segment));
+}
+
+void SegmentFileDiskBackend::StopCompaction() {
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    running_ = false;
+  }
+  cond_var_.notify_all();
+  if (!compactor_.valid())
+    return;
+  try {
+    compactor_.get();
+  }
+  catch(const std::exception& e) {
+    LOG(kError) << "Segment compaction failed: " << e.what();
+  }
+}
+
+void SegmentFileDiskBackend::RemoveSegmentFiles() {
+  // Removes any segment files which aren't in segments_.
+  boost::system::error_code error_code;
+  std::vector<fs::path> unused;
+  for (fs::directory_iterator itr(kRoot_, error_code), end; !error_code && itr != end; ++itr) {
+    std::string filename((*itr).path().filename().string());
+    if (filename.compare(0, kSegmentPrefix.size(), kSegmentPrefix) != 0)
+      continue;
+    try {
+      if (segments_.count(std::stoul(filename.substr(kSegmentPrefix.size()))) != 0)
+        continue;
+    }
+    catch(const std::logic_error&) {}
+    unused.push_back((*itr).path());
+  }
+  for (auto& path : unused)
+    fs::remove(path, error_code);
+}
+
+void SegmentFileDiskBackend::LoadIndex() {
+  fs::path index_path(kRoot_ / kSegmentIndexName);
+  std::string content;
+  boost::system::error_code error_code;
+  if (!fs::exists(index_path, error_code) || !ReadFile(index_path, &content)) {
+    LOG(kError) << "No segment index in " << kRoot_;
+    ThrowError(CommonErrors::filesystem_io_error);
+  }
+  // The index is stale as soon as anything is written, so mustn't be loaded again.
+  fs::remove(index_path, error_code);
+  if (content.size() < 8 || (content.size() - 8) % kIndexRecordSize != 0 ||
+      (content.size() - 8) / kIndexRecordSize != ParseLittleEndian(&content[0], 8)) {
+    LOG(kError) << "Segment index in " << kRoot_ << " is corrupt.";
+    ThrowError(CommonErrors::parsing_error);
+  }
+
+  index_.reserve((content.size() - 8) / kIndexRecordSize);
+  for (size_t offset(8); offset != content.size(); offset += kIndexRecordSize) {
+    const char* record(&content[offset]);
+    Location location(static_cast<uint32_t>(ParseLittleEndian(record + kKeySize, 4)),
+                      ParseLittleEndian(record + kKeySize + 4, 8),
+                      static_cast<uint32_t>(ParseLittleEndian(record + kKeySize + 12, 4)));
+    index_.insert(std::make_pair(Identity(std::string(record, kKeySize)), location));
+    segments_[location.segment].live += RecordSize(location.length);
+  }
+
+  for (auto& segment : segments_) {
+    fs::path path(SegmentPath(segment.first));
+    segment.second.size = fs::file_size(path, error_code);
+    if (error_code || segment.second.size < segment.second.live) {
+      LOG(kError) << "Segment file " << path << " is missing or truncated.";
+      ThrowError(CommonErrors::filesystem_io_error);
+    }
+    int descriptor(OpenSegmentFile(path));
+    if (descriptor < 0) {
+      LOG(kError) << "Failed to open segment file " << path;
+      ThrowError(CommonErrors::filesystem_io_error);
+    }
+    segment.second.file = std::make_shared<SegmentFile>(descriptor, path);
+  }
+}
+
+void SegmentFileDiskBackend::OpenNewSegment() {
+  uint32_t segment(segments_.empty() ? 0 : segments_.rbegin()->first + 1);
+  fs::path path(SegmentPath(segment));
+  int descriptor(OpenSegmentFile(path));
+  if (descriptor < 0) {
+    LOG(kError) << "Failed to open segment file " << path;
+    ThrowError(CommonErrors::filesystem_io_error);
+  }
+  segments_[segment].file = std::make_shared<SegmentFile>(descriptor, path);
+  active_segment_ = segment;
+}
+
+std::shared_ptr<SegmentFileDiskBackend::SegmentFile> SegmentFileDiskBackend::Find(
+    const Identity& key,
+    Location& location) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  auto itr(index_.find(key));
+  if (itr == index_.end()) {
+    LOG(kError) << HexSubstr(key) << " is not in any segment.";
+    ThrowError(CommonErrors::no_such_element);
+  }
+  location = itr->second;
+  return segments_[location.segment].file;
+}
+
+SegmentFileDiskBackend::Location SegmentFileDiskBackend::Reserve(
+    uint32_t length,
+    std::shared_ptr<SegmentFile>& file) {
+  Segment* active(&segments_[active_segment_]);
+  if (active->size != 0 && active->size + RecordSize(length) > kSegmentSize_) {
+    uint32_t previous(active_segment_);
+    OpenNewSegment();
+    if (ReleaseIfUnused(segments_.find(previous)))
+      cond_var_.notify_all();
+    active = &segments_[active_segment_];
+  }
+  Location location(active_segment_, active->size, length);
+  active->size += RecordSize(length);
+  ++active->writes;
+  file = active->file;
+  return location;
+}
+
+bool SegmentFileDiskBackend::WriteRecord(const SegmentFile& file,
+                                         const Location& location,
+                                         const Identity& key,
+                                         const std::string& value) {
+  char header[kRecordHeaderSize];
+  std::copy(key.string().begin(), key.string().end(), header);
+  for (int i(0); i != 4; ++i)
+    header[kKeySize + i] = static_cast<char>((location.length >> (8 * i)) & 0xFF);
+  return WriteAt(file.descriptor, location.offset, header, kRecordHeaderSize) &&
+         WriteAt(file.descriptor, location.offset + kRecordHeaderSize, value.data(), value.size());
+}
+
+bool SegmentFileDiskBackend::FinishWrite(const Identity& key,
+                                         const Location& location,
+                                         bool written,
+                                         const Location* replacing) {
+  auto segment(segments_.find(location.segment));
+  --segment->second.writes;
+  bool notify(false);
+  if (!written) {
+    // The reserved space may hold part of a record, so the segment can't be scanned any more.
+    segment->second.intact = false;
+  } else {
+    auto itr(index_.find(key));
+    bool current(replacing == nullptr ||
+                 (itr != index_.end() && itr->second.segment == replacing->segment &&
+                  itr->second.offset == replacing->offset));
+    if (current) {
+      if (itr != index_.end()) {
+        auto old_segment(segments_.find(itr->second.segment));
+        old_segment->second.live -= RecordSize(itr->second.length);
+        if (old_segment != segment)
+          notify = ReleaseIfUnused(old_segment);
+        itr->second = location;
+      } else {
+        index_.insert(std::make_pair(key, location));
+      }
+      segment->second.live += RecordSize(location.length);
+    }
+  }
+  return ReleaseIfUnused(segment) || notify;
+}
+
+std::string SegmentFileDiskBackend::ReadValue(const SegmentFile& file, const Location& location) {
+  std::string value(location.length, 0);
+  if (!ReadAt(file.descriptor, location.offset + kRecordHeaderSize, &value[0], value.size())) {
+    LOG(kError) << "Failed to read from " << file.path;
+    ThrowError(CommonErrors::filesystem_io_error);
+  }
+  return value;
+}
+
+bool SegmentFileDiskBackend::ReleaseIfUnused(std::map<uint32_t, Segment>::iterator itr) {
+  if (itr->first == active_segment_ || (compacting_ && itr->first == compacting_segment_) ||
+      itr->second.writes != 0) {
+    return false;
+  }
+  if (itr->second.live == 0) {
+    CloseAndRemoveSegment(itr);
+    return false;
+  }
+  return NeedsCompaction(itr->second);
+}
+
+void SegmentFileDiskBackend::CloseAndRemoveSegment(std::map<uint32_t, Segment>::iterator itr) {
+  // The file is closed and removed once any reads still using it are done.
+  itr->second.file->retired = true;
+  segments_.erase(itr);
+}
+
+bool SegmentFileDiskBackend::NeedsCompaction(const Segment& segment) const {
+  // Compact once at least half of a segment is dead.
+  return segment.intact && segment.writes == 0 && segment.live * 2 <= segment.size;
+}
+
+bool SegmentFileDiskBackend::FindCompactionCandidate(uint32_t& segment) {
+  for (auto& entry : segments_) {
+    if (entry.first != active_segment_ && NeedsCompaction(entry.second)) {
+      segment = entry.first;
+      return true;
+    }
+  }
+  return false;
+}
+
+void SegmentFileDiskBackend::CompactSegment(uint32_t segment,
+                                            std::unique_lock<std::mutex>& lock) {
+  // The segment is no longer written to, so it can be scanned record by record with the lock only
+  // taken to check and update the index.  Put, Get and Remove are never held up by its I/O.
+  const std::shared_ptr<SegmentFile> kFile(segments_[segment].file);
+  const uint64_t kSize(segments_[segment].size);
+  uint64_t offset(0);
+  while (running_ && offset < kSize) {
+    char header[kRecordHeaderSize];
+    lock.unlock();
+    bool read(ReadAt(kFile->descriptor, offset, header, kRecordHeaderSize));
+    lock.lock();
+    if (!read) {
+      LOG(kError) << "Failed to read from " << kFile->path;
+      ThrowError(CommonErrors::filesystem_io_error);
+    }
+    Identity key(std::string(header, kKeySize));
+    uint32_t length(static_cast<uint32_t>(ParseLittleEndian(header + kKeySize, 4)));
+    Location location(segment, offset, length);
+
+    auto itr(index_.find(key));
+    if (itr != index_.end() && itr->second.segment == segment && itr->second.offset == offset) {
+      // The copy only replaces the index entry if the value wasn't removed or replaced meanwhile.
+      std::shared_ptr<SegmentFile> target;
+      Location moved(Reserve(length, target));
+      lock.unlock();
+      std::string value(length, 0);
+      bool written(ReadAt(kFile->descriptor, offset + kRecordHeaderSize, &value[0], length) &&
+                   WriteRecord(*target, moved, key, value));
+      lock.lock();
+      if (FinishWrite(key, moved, written, &location))
+        cond_var_.notify_all();
+      if (!written) {
+        LOG(kError) << "Failed to move " << HexSubstr(key) << " from " << kFile->path;
+        ThrowError(CommonErrors::filesystem_io_error);
+      }
+    }
+    offset += RecordSize(length);
+  }
+  if (!running_)
+    return;
+  auto itr(segments_.find(segment));
+  if (itr->second.live == 0) {
+    CloseAndRemoveSegment(itr);
+  } else {
+    // Can only happen if the segment's records don't match the index.
+    LOG(kWarning) << kFile->path << " still holds live values after compaction.";
+    itr->second.intact = false;
+  }
+}
+
+void SegmentFileDiskBackend::Compact() {
+  std::unique_lock<std::mutex> lock(mutex_);
+  for (;;) {
+    uint32_t segment(0);
+    cond_var_.wait(lock, [&]()->bool { return !running_ || FindCompactionCandidate(segment); });
+    if (!running_)
+      return;
+    compacting_ = true;
+    compacting_segment_ = segment;
+    try {
+      CompactSegment(segment, lock);
+    }
+    catch(...) {
+      // Leave the segments as they are; they'll still be served, just not compacted.
+      compacting_ = false;
+      running_ = false;
+      cond_var_.notify_all();
+      throw;
+    }
+    compacting_ = false;
+    cond_var_.notify_all();
+  }
+}
+
+}  // namespace detail
+
+}  // namespace maidsafe
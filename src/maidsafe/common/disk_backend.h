@@ -0,0 +1,228 @@
+/* Copyright 2012 MaidSafe.net limited
+
+This MaidSafe Software is licensed under the MaidSafe.net Commercial License, version 1.0 or later,
+and The General Public License (GPL), version 3. By contributing code to this project You agree to
+the terms laid out in the MaidSafe Contributor Agreement, version 1.0, found in the root directory
+of this project at LICENSE, COPYING and CONTRIBUTOR respectively and also available at:
+
+http://www.novinet.com/license
+
+Unless required by applicable law or agreed to in writing, software distributed under the License is
+distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or
+implied. See the License for the specific language governing permissions and limitations under the
+License.
+*/
+
+#ifndef MAIDSAFE_COMMON_DISK_BACKEND_H_
+#define MAIDSAFE_COMMON_DISK_BACKEND_H_
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <functional>
+#include <future>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include "boost/filesystem/path.hpp"
+
+#include "maidsafe/common/types.h"
+
+
+namespace maidsafe {
+
+namespace detail {
+
+// Storage used by the disk tier of KeyValueBuffer.  All functions throw a maidsafe error on
+// failure.  KeyValueBuffer may call Put concurrently with other calls, but never for a key which is
+// already being put, read or removed.
+class DiskBackend {
+ public:
+  virtual ~DiskBackend() {}
+  // Writes value under key.  The key must not already be held.
+  virtual void Put(const Identity& key, const NonEmptyString& value) = 0;
+  virtual NonEmptyString Get(const Identity& key) = 0;
+  // Returns a pointer to the bytes of the value held under key, and their count.  The bytes stay
+  // valid while the pointer is held, even once the value has been removed.  Backends may map the
+  // file holding the value rather than copying it; the default just wraps the result of Get.
+  virtual std::pair<std::shared_ptr<const char>, size_t> Map(const Identity& key);
+  // Returns a pointer to the 'length' bytes of the value held under key which start at 'offset',
+  // and their count.  The caller ensures that they lie within the value.  The bytes stay valid
+  // while the pointer is held.  Backends may read just those bytes; the default takes them from
+  // the result of Map.
+  virtual std::pair<std::shared_ptr<const char>, size_t> ReadRange(const Identity& key,
+                                                                   uint64_t offset,
+                                                                   size_t length);
+  // Removes the value held under key.  If value is non-null, it is set to the removed value.  The
+  // caller keeps each value's size, so backends needn't look it up.
+  virtual void Remove(const Identity& key, NonEmptyString* value) = 0;
+  // Saves whatever a backend constructed over the same root in recovery mode needs in order to
+  // serve the same values.  Called once, after all other calls have completed.
+  virtual void SaveIndex() {}
+};
+
+// The keys and sizes of the values held on disk by KeyValueBuffer, oldest first.  It's saved on
+// destruction so that a later KeyValueBuffer using the same folder can resume with those values.
+typedef std::vector<std::pair<Identity, uint64_t>> DiskManifest;
+
+// 'layout' identifies the backend which holds the values.
+void WriteDiskManifest(const boost::filesystem::path& path,
+                       uint32_t layout,
+                       const DiskManifest& manifest);
+// Returns false if there's no valid manifest at path, or if it was saved for a different layout.
+bool ReadDiskManifest(const boost::filesystem::path& path,
+                      uint32_t layout,
+                      DiskManifest& manifest);
+
+// Writes each value to its own file, named with the Base32 encoding of its key.  So that no
+// directory grows too large to search quickly, the files are spread over two levels of
+// subdirectories of root, named with the first and second hex digits of the key's first byte.
+// Each subdirectory is created when first needed.  Files left directly in root by earlier versions
+// are moved into their subdirectories on construction.  If 'direct_io' is true, files are written
+// and read with O_DIRECT so that values don't also occupy the page cache, and Map reads rather
+// than maps.  Where O_DIRECT isn't available, or the first time the filesystem rejects it, the
+// backend falls back to buffered I/O.
+class FilePerKeyDiskBackend : public DiskBackend {
+ public:
+  explicit FilePerKeyDiskBackend(const boost::filesystem::path& root, bool direct_io = false);
+  virtual void Put(const Identity& key, const NonEmptyString& value);
+  virtual NonEmptyString Get(const Identity& key);
+  virtual std::pair<std::shared_ptr<const char>, size_t> Map(const Identity& key);
+  virtual std::pair<std::shared_ptr<const char>, size_t> ReadRange(const Identity& key,
+                                                                   uint64_t offset,
+                                                                   size_t length);
+  virtual void Remove(const Identity& key, NonEmptyString* value);
+  // Returns the path of the file which holds, or would hold, the value for key.
+  boost::filesystem::path GetFilename(const Identity& key) const;
+
+ private:
+  FilePerKeyDiskBackend(const FilePerKeyDiskBackend&);
+  FilePerKeyDiskBackend& operator=(const FilePerKeyDiskBackend&);
+
+  void CreateDirectoryFor(const Identity& key);
+  void MoveUnspreadFiles();
+  std::string Read(const boost::filesystem::path& path);
+  void DisableDirectIo();
+
+  const boost::filesystem::path kRoot_;
+  std::atomic<bool> direct_io_;
+  // Whether each subdirectory is known to exist, indexed by the key's first byte.
+  std::vector<std::atomic<bool>> directory_created_;
+};
+
+// Appends values to a sequence of segment files in root, keeping the location of each value in
+// memory.  Removing a value only updates the index; a background thread copies the remaining live
+// values out of mostly-dead segments and deletes them.  Unless 'recover' is true, any segment files
+// already in root when this is constructed are deleted.  If it's true, the index written by
+// SaveIndex is loaded instead, and the constructor throws if that isn't possible.  Put throws for a
+// value of 4 GiB or more.
+//
+// The lock is only held to look up or update the index; reads and writes of the segment files are
+// done outside it, keeping the file open until they finish.  Dead records aren't counted by the
+// buffer's DiskUsage, so the files can take up to about twice the limit until they're compacted.
+class SegmentFileDiskBackend : public DiskBackend {
+ public:
+  static const uint64_t kDefaultSegmentSize;
+  SegmentFileDiskBackend(const boost::filesystem::path& root,
+                         uint64_t segment_size,
+                         bool recover = false);
+  virtual ~SegmentFileDiskBackend();
+  virtual void Put(const Identity& key, const NonEmptyString& value);
+  virtual NonEmptyString Get(const Identity& key);
+  virtual std::pair<std::shared_ptr<const char>, size_t> Map(const Identity& key);
+  virtual std::pair<std::shared_ptr<const char>, size_t> ReadRange(const Identity& key,
+                                                                   uint64_t offset,
+                                                                   size_t length);
+  virtual void Remove(const Identity& key, NonEmptyString* value);
+  virtual void SaveIndex();
+  // Blocks until the background compaction has nothing left to do.  Intended for tests.
+  void WaitForCompaction();
+  size_t segment_count();
+
+ private:
+  SegmentFileDiskBackend(const SegmentFileDiskBackend&);
+  SegmentFileDiskBackend& operator=(const SegmentFileDiskBackend&);
+
+  struct Location {
+    Location(uint32_t segment_in, uint64_t offset_in, uint32_t length_in)
+        : segment(segment_in), offset(offset_in), length(length_in) {}
+    uint32_t segment;
+    uint64_t offset;  // Offset of the record header.
+    uint32_t length;  // Length of the value.
+  };
+
+  // An open segment file.  It's closed when the last holder lets go, and then removed if retired.
+  struct SegmentFile {
+    SegmentFile(int descriptor_in, const boost::filesystem::path& path_in);
+    ~SegmentFile();
+    const int descriptor;
+    const boost::filesystem::path path;
+    bool retired;
+   private:
+    SegmentFile(const SegmentFile&);
+    SegmentFile& operator=(const SegmentFile&);
+  };
+
+  struct Segment {
+    Segment() : file(), size(0), live(0), writes(0), intact(true) {}
+    std::shared_ptr<SegmentFile> file;
+    uint64_t size, live;  // Bytes reserved in the segment, and those referenced by the index.
+    uint32_t writes;  // Records reserved but not yet written.
+    bool intact;  // False if the segment may hold a gap, so can't be scanned for compaction.
+  };
+
+  struct IdentityHash {
+    size_t operator()(const Identity& key) const { return std::hash<std::string>()(key.string()); }
+  };
+
+  boost::filesystem::path SegmentPath(uint32_t segment) const;
+  void StopCompaction();
+  void RemoveSegmentFiles();
+  void LoadIndex();
+  void OpenNewSegment();
+  // Takes the lock to find key, returning its file.  Throws if it isn't in any segment.
+  std::shared_ptr<SegmentFile> Find(const Identity& key, Location& location);
+  // Reserves space for a record in the active segment.  Called with the lock held.
+  Location Reserve(uint32_t length, std::shared_ptr<SegmentFile>& file);
+  static bool WriteRecord(const SegmentFile& file,
+                          const Location& location,
+                          const Identity& key,
+                          const std::string& value);
+  // Ends a write started by Reserve, indexing the record if it was written and, where 'replacing'
+  // is given, key is still at that location.  Called with the lock held.  Returns true if a segment
+  // now needs compacting.
+  bool FinishWrite(const Identity& key,
+                   const Location& location,
+                   bool written,
+                   const Location* replacing);
+  static std::string ReadValue(const SegmentFile& file, const Location& location);
+  // Removes the segment if nothing refers to it.  Returns true if it needs compacting instead.
+  bool ReleaseIfUnused(std::map<uint32_t, Segment>::iterator itr);
+  void CloseAndRemoveSegment(std::map<uint32_t, Segment>::iterator itr);
+  bool NeedsCompaction(const Segment& segment) const;
+  bool FindCompactionCandidate(uint32_t& segment);
+  void CompactSegment(uint32_t segment, std::unique_lock<std::mutex>& lock);
+  void Compact();
+
+  const boost::filesystem::path kRoot_;
+  const uint64_t kSegmentSize_;
+  std::map<uint32_t, Segment> segments_;
+  uint32_t active_segment_;
+  std::unordered_map<Identity, Location, IdentityHash> index_;
+  std::mutex mutex_;
+  std::condition_variable cond_var_;
+  bool running_, compacting_;
+  uint32_t compacting_segment_;
+  std::future<void> compactor_;
+};
+
+}  // namespace detail
+
+}  // namespace maidsafe
+
+#endif  // MAIDSAFE_COMMON_DISK_BACKEND_H_
@@ -0,0 +1,260 @@
+/* Copyright 2012 MaidSafe.net limited
+
+This MaidSafe Software is licensed under the MaidSafe.net Commercial License, version 1.0 or later,
+and The General Public License (GPL), version 3. By contributing code to this project You agree to
+the terms laid out in the MaidSafe Contributor Agreement, version 1.0, found in the root directory
+of this project at LICENSE, COPYING and CONTRIBUTOR respectively and also available at:
+
+http://www.novinet.com/license
+
+Unless required by applicable law or agreed to in writing, software distributed under the License is
+distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or
+implied. See the License for the specific language governing permissions and limitations under the
+License.
+*/
+
+#include "maidsafe/common/eviction_queue.h"
+
+#include <algorithm>
+#include <iterator>
+#include <thread>
+
+#include "maidsafe/common/error.h"
+#include "maidsafe/common/log.h"
+
+
+namespace maidsafe {
+
+namespace detail {
+
+namespace {
+
+void ThrowIfEmpty(const EvictionQueue& queue) {
+  if (queue.empty()) {
+    LOG(kError) << "There are no candidates for eviction.";
+    ThrowError(CommonErrors::no_such_element);
+  }
+}
+
+}  // unnamed namespace
+
+LruEvictionQueue::LruEvictionQueue() : order_(), lookup_() {}
+
+void LruEvictionQueue::Add(const Identity& key, uint64_t /*size*/) {
+  order_.push_back(key);
+  lookup_[key] = std::prev(order_.end());
+}
+
+void LruEvictionQueue::Touch(const Identity& key) {
+  auto itr(lookup_.find(key));
+  if (itr != lookup_.end())
+    order_.splice(order_.end(), order_, itr->second);
+}
+
+void LruEvictionQueue::Remove(const Identity& key) {
+  auto itr(lookup_.find(key));
+  if (itr == lookup_.end())
+    return;
+  order_.erase(itr->second);
+  lookup_.erase(itr);
+}
+
+Identity LruEvictionQueue::Pop() {
+  ThrowIfEmpty(*this);
+  Identity key(order_.front());
+  order_.pop_front();
+  lookup_.erase(key);
+  return key;
+}
+
+bool LruEvictionQueue::empty() const {
+  return order_.empty();
+}
+
+
+LfuEvictionQueue::LfuEvictionQueue() : ranking_(), lookup_(), clock_(0) {}
+
+void LfuEvictionQueue::Add(const Identity& key, uint64_t /*size*/) {
+  lookup_[key] = ranking_.insert(std::make_pair(std::make_pair(0, clock_++), key)).first;
+}
+
+void LfuEvictionQueue::Touch(const Identity& key) {
+  auto itr(lookup_.find(key));
+  if (itr == lookup_.end())
+    return;
+  uint64_t count(itr->second->first.first + 1);
+  ranking_.erase(itr->second);
+  itr->second = ranking_.insert(std::make_pair(std::make_pair(count, clock_++), key)).first;
+}
+
+void LfuEvictionQueue::Remove(const Identity& key) {
+  auto itr(lookup_.find(key));
+  if (itr == lookup_.end())
+    return;
+  ranking_.erase(itr->second);
+  lookup_.erase(itr);
+}
+
+Identity LfuEvictionQueue::Pop() {
+  ThrowIfEmpty(*this);
+  Identity key(ranking_.begin()->second);
+  ranking_.erase(ranking_.begin());
+  lookup_.erase(key);
+  return key;
+}
+
+bool LfuEvictionQueue::empty() const {
+  return ranking_.empty();
+}
+
+
+ArcEvictionQueue::ArcEvictionQueue() : lists_(), lookup_(), capacity_(0), target_recent_(0) {}
+
+void ArcEvictionQueue::Add(const Identity& key, uint64_t /*size*/) {
+  capacity_ = std::max(capacity_, lists_[kRecent].size() + lists_[kFrequent].size() + 1);
+  auto itr(lookup_.find(key));
+  if (itr == lookup_.end()) {
+    MoveToFront(key, kRecent);
+    return;
+  }
+
+  const size_t kRecentGhosts(lists_[kRecentGhost].size());
+  const size_t kFrequentGhosts(lists_[kFrequentGhost].size());
+  if (itr->second.first == kRecentGhost) {
+    // Recently used candidates are being evicted too soon.
+    size_t delta(std::max<size_t>(1, kFrequentGhosts / kRecentGhosts));
+    target_recent_ = std::min(target_recent_ + delta, capacity_);
+  } else if (itr->second.first == kFrequentGhost) {
+    // Frequently used candidates are being evicted too soon.
+    size_t delta(std::max<size_t>(1, kRecentGhosts / kFrequentGhosts));
+    target_recent_ -= std::min(delta, target_recent_);
+  }
+  MoveToFront(key, kFrequent);
+}
+
+void ArcEvictionQueue::Touch(const Identity& key) {
+  auto itr(lookup_.find(key));
+  if (itr != lookup_.end() && (itr->second.first == kRecent || itr->second.first == kFrequent))
+    MoveToFront(key, kFrequent);
+}
+
+void ArcEvictionQueue::Remove(const Identity& key) {
+  auto itr(lookup_.find(key));
+  if (itr != lookup_.end() && (itr->second.first == kRecent || itr->second.first == kFrequent))
+    Erase(key);
+}
+
+Identity ArcEvictionQueue::Pop() {
+  ThrowIfEmpty(*this);
+  bool from_recent(!lists_[kRecent].empty() &&
+                   (lists_[kRecent].size() > target_recent_ || lists_[kFrequent].empty()));
+  Identity key(lists_[from_recent ? kRecent : kFrequent].back());
+  MoveToFront(key, from_recent ? kRecentGhost : kFrequentGhost);
+  TrimGhosts();
+  return key;
+}
+
+bool ArcEvictionQueue::empty() const {
+  return lists_[kRecent].empty() && lists_[kFrequent].empty();
+}
+
+void ArcEvictionQueue::MoveToFront(const Identity& key, ListId list_id) {
+  auto itr(lookup_.find(key));
+  if (itr == lookup_.end()) {
+    lists_[list_id].push_front(key);
+    lookup_[key] = std::make_pair(list_id, lists_[list_id].begin());
+  } else {
+    lists_[list_id].splice(lists_[list_id].begin(), lists_[itr->second.first], itr->second.second);
+    itr->second.first = list_id;
+  }
+}
+
+void ArcEvictionQueue::Erase(const Identity& key) {
+  auto itr(lookup_.find(key));
+  lists_[itr->second.first].erase(itr->second.second);
+  lookup_.erase(itr);
+}
+
+void ArcEvictionQueue::TrimGhosts() {
+  for (auto list_id : { kRecentGhost, kFrequentGhost }) {
+    while (lists_[list_id].size() > capacity_)
+      Erase(lists_[list_id].back());
+  }
+}
+
+
+GdsfEvictionQueue::GdsfEvictionQueue() : ranking_(), lookup_(), inflation_(0.0), clock_(0) {}
+
+void GdsfEvictionQueue::Add(const Identity& key, uint64_t size) {
+  Entry entry = { std::max<uint64_t>(size, 1), 1 };
+  Rank(key, entry);
+}
+
+void GdsfEvictionQueue::Touch(const Identity& key) {
+  auto itr(lookup_.find(key));
+  if (itr == lookup_.end())
+    return;
+  Entry entry(itr->second.first);
+  ++entry.count;
+  ranking_.erase(itr->second.second);
+  lookup_.erase(itr);
+  Rank(key, entry);
+}
+
+void GdsfEvictionQueue::Remove(const Identity& key) {
+  auto itr(lookup_.find(key));
+  if (itr == lookup_.end())
+    return;
+  ranking_.erase(itr->second.second);
+  lookup_.erase(itr);
+}
+
+Identity GdsfEvictionQueue::Pop() {
+  ThrowIfEmpty(*this);
+  inflation_ = ranking_.begin()->first.first;
+  Identity key(ranking_.begin()->second);
+  ranking_.erase(ranking_.begin());
+  lookup_.erase(key);
+  return key;
+}
+
+bool GdsfEvictionQueue::empty() const {
+  return ranking_.empty();
+}
+
+void GdsfEvictionQueue::Rank(const Identity& key, Entry entry) {
+  double priority(inflation_ + static_cast<double>(entry.count) / static_cast<double>(entry.size));
+  auto ranked(ranking_.insert(std::make_pair(std::make_pair(priority, clock_++), key)).first);
+  lookup_[key] = std::make_pair(entry, ranked);
+}
+
+
+const size_t PendingTouches::kStripes;
+const size_t PendingTouches::kMaxPerStripe;
+
+PendingTouches::PendingTouches() : stripes_() {}
+
+bool PendingTouches::Record(const Identity& key) {
+  Stripe& stripe(stripes_[std::hash<std::thread::id>()(std::this_thread::get_id()) % kStripes]);
+  std::lock_guard<std::mutex> lock(stripe.mutex);
+  if (stripe.keys.size() < kMaxPerStripe)
+    stripe.keys.push_back(key);
+  return stripe.keys.size() == kMaxPerStripe;
+}
+
+void PendingTouches::Apply(EvictionQueue& queue) {
+  std::vector<Identity> keys;
+  for (auto& stripe : stripes_) {
+    {
+      std::lock_guard<std::mutex> lock(stripe.mutex);
+      keys.swap(stripe.keys);
+    }
+    for (auto& key : keys)
+      queue.Touch(key);
+    keys.clear();
+  }
+}
+
+}  // namespace detail
+
+}  // namespace maidsafe
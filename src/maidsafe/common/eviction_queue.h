@@ -0,0 +1,180 @@
+/* Copyright 2012 MaidSafe.net limited
+
+This MaidSafe Software is licensed under the MaidSafe.net Commercial License, version 1.0 or later,
+and The General Public License (GPL), version 3. By contributing code to this project You agree to
+the terms laid out in the MaidSafe Contributor Agreement, version 1.0, found in the root directory
+of this project at LICENSE, COPYING and CONTRIBUTOR respectively and also available at:
+
+http://www.novinet.com/license
+
+Unless required by applicable law or agreed to in writing, software distributed under the License is
+distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or
+implied. See the License for the specific language governing permissions and limitations under the
+License.
+*/
+
+#ifndef MAIDSAFE_COMMON_EVICTION_QUEUE_H_
+#define MAIDSAFE_COMMON_EVICTION_QUEUE_H_
+
+#include <cstdint>
+#include <functional>
+#include <list>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include "maidsafe/common/types.h"
+
+
+namespace maidsafe {
+
+namespace detail {
+
+// Orders the values in one tier of KeyValueBuffer which may be evicted, so that the tier can ask
+// which to evict next.  Not thread-safe; KeyValueBuffer calls it with the tier's lock held.
+class EvictionQueue {
+ public:
+  virtual ~EvictionQueue() {}
+  // 'key' becomes a candidate for eviction.  It must not already be one.
+  virtual void Add(const Identity& key, uint64_t size) = 0;
+  // Records a read of 'key'.  Keys which aren't candidates are ignored.
+  virtual void Touch(const Identity& key) = 0;
+  // 'key' is no longer a candidate, having been deleted rather than evicted.  Keys which aren't
+  // candidates are ignored.
+  virtual void Remove(const Identity& key) = 0;
+  // Removes and returns the candidate to be evicted next.  Throws if there are none.
+  virtual Identity Pop() = 0;
+  virtual bool empty() const = 0;
+};
+
+struct EvictionQueueIdentityHash {
+  size_t operator()(const Identity& key) const { return std::hash<std::string>()(key.string()); }
+};
+
+// Evicts the least recently added or read candidate.
+class LruEvictionQueue : public EvictionQueue {
+ public:
+  LruEvictionQueue();
+  virtual void Add(const Identity& key, uint64_t size);
+  virtual void Touch(const Identity& key);
+  virtual void Remove(const Identity& key);
+  virtual Identity Pop();
+  virtual bool empty() const;
+
+ private:
+  std::list<Identity> order_;
+  std::unordered_map<Identity, std::list<Identity>::iterator, EvictionQueueIdentityHash> lookup_;
+};
+
+// Evicts the least frequently read candidate, the least recently used of those if there's a tie.
+class LfuEvictionQueue : public EvictionQueue {
+ public:
+  LfuEvictionQueue();
+  virtual void Add(const Identity& key, uint64_t size);
+  virtual void Touch(const Identity& key);
+  virtual void Remove(const Identity& key);
+  virtual Identity Pop();
+  virtual bool empty() const;
+
+ private:
+  // Ordered by (use count, time of last use).
+  typedef std::map<std::pair<uint64_t, uint64_t>, Identity> Ranking;
+  Ranking ranking_;
+  std::unordered_map<Identity, Ranking::iterator, EvictionQueueIdentityHash> lookup_;
+  uint64_t clock_;
+};
+
+// Adaptive Replacement Cache (Megiddo and Modha).  Candidates read only once since being added are
+// kept apart from those read again, and the share of each is adapted using the keys of recently
+// evicted candidates: one which is added again soon after eviction shows that its list was
+// evicted from too eagerly.
+class ArcEvictionQueue : public EvictionQueue {
+ public:
+  ArcEvictionQueue();
+  virtual void Add(const Identity& key, uint64_t size);
+  virtual void Touch(const Identity& key);
+  virtual void Remove(const Identity& key);
+  virtual Identity Pop();
+  virtual bool empty() const;
+
+ private:
+  enum ListId { kRecent, kFrequent, kRecentGhost, kFrequentGhost, kListCount };
+  typedef std::pair<ListId, std::list<Identity>::iterator> Position;
+  void MoveToFront(const Identity& key, ListId list_id);
+  void Erase(const Identity& key);
+  void TrimGhosts();
+
+  // In each list, the most recent key is at the front.
+  std::list<Identity> lists_[kListCount];
+  std::unordered_map<Identity, Position, EvictionQueueIdentityHash> lookup_;
+  // The most candidates held at once, which bounds each ghost list and the target size of the
+  // kRecent list.
+  size_t capacity_, target_recent_;
+};
+
+// Greedy-Dual-Size-Frequency.  Evicts the candidate with the lowest priority, which is its use
+// count divided by its size plus an inflation value.  The inflation value rises to the priority
+// of each evicted candidate, so that candidates which were popular long ago eventually go too.
+class GdsfEvictionQueue : public EvictionQueue {
+ public:
+  GdsfEvictionQueue();
+  virtual void Add(const Identity& key, uint64_t size);
+  virtual void Touch(const Identity& key);
+  virtual void Remove(const Identity& key);
+  virtual Identity Pop();
+  virtual bool empty() const;
+
+ private:
+  struct Entry {
+    uint64_t size, count;
+  };
+  // Ordered by (priority, time of last use).
+  typedef std::map<std::pair<double, uint64_t>, Identity> Ranking;
+  void Rank(const Identity& key, Entry entry);
+
+  Ranking ranking_;
+  std::unordered_map<Identity, std::pair<Entry, Ranking::iterator>, EvictionQueueIdentityHash>
+      lookup_;
+  double inflation_;
+  uint64_t clock_;
+};
+
+// Collects the keys read by threads which don't hold the lock guarding an EvictionQueue, for the
+// next holder of that lock to pass to Touch.  Record may be called concurrently from any thread,
+// and only ever takes a lock private to one of several stripes, chosen by thread so that readers
+// rarely contend.  A stripe holds at most kMaxPerStripe keys; further reads recorded in it are
+// dropped until it is applied, so under heavy load some reads may go unrecorded.
+class PendingTouches {
+ public:
+  static const size_t kStripes = 16;
+  static const size_t kMaxPerStripe = 256;
+
+  PendingTouches();
+  // Returns true if the key's stripe is full, in which case the caller should Apply soon.
+  bool Record(const Identity& key);
+  // Touches 'queue' with each key recorded since the last call, in the order recorded within each
+  // stripe.  Must be called with the lock guarding 'queue' held.
+  void Apply(EvictionQueue& queue);
+
+ private:
+  PendingTouches(const PendingTouches&);
+  PendingTouches& operator=(const PendingTouches&);
+
+  struct Stripe {
+    Stripe() : keys(), mutex() {}
+    std::vector<Identity> keys;
+    std::mutex mutex;
+  };
+  Stripe stripes_[kStripes];
+};
+
+}  // namespace detail
+
+}  // namespace maidsafe
+
+
+#endif  // MAIDSAFE_COMMON_EVICTION_QUEUE_H_
@@ -0,0 +1,110 @@
+/* Copyright 2012 MaidSafe.net limited
+
+This MaidSafe Software is licensed under the MaidSafe.net Commercial License, version 1.0 or later,
+and The General Public License (GPL), version 3. By contributing code to this project You agree to
+the terms laid out in the MaidSafe Contributor Agreement, version 1.0, found in the root directory
+of this project at LICENSE, COPYING and CONTRIBUTOR respectively and also available at:
+
+http://www.novinet.com/license
+
+Unless required by applicable law or agreed to in writing, software distributed under the License is
+distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or
+implied. See the License for the specific language governing permissions and limitations under the
+License.
+*/
+
+#include "maidsafe/common/frequency_sketch.h"
+
+#include <functional>
+#include <string>
+
+#include "maidsafe/common/error.h"
+#include "maidsafe/common/log.h"
+
+
+namespace maidsafe {
+
+namespace detail {
+
+namespace {
+
+// Each key's use is recorded ten times over before the counts are halved.
+const uint64_t kSamplesPerKey(10);
+
+// The SplitMix64 finaliser, used to derive a second independent hash from the first.
+uint64_t Mix(uint64_t value) {
+  value = (value ^ (value >> 30)) * 0xbf58476d1ce4e5b9ULL;
+  value = (value ^ (value >> 27)) * 0x94d049bb133111ebULL;
+  return value ^ (value >> 31);
+}
+
+// Returns the smallest power of two which is at least 'capacity', so slots are found by masking.
+size_t RowSize(uint64_t capacity) {
+  if (capacity == 0) {
+    LOG(kError) << "Frequency sketch capacity must be non-zero.";
+    ThrowError(CommonErrors::invalid_parameter);
+  }
+  size_t row_size(1);
+  while (row_size < capacity)
+    row_size <<= 1;
+  return row_size;
+}
+
+}  // unnamed namespace
+
+const uint32_t FrequencySketch::kMaxFrequency;
+
+FrequencySketch::FrequencySketch(uint64_t capacity)
+    : kRowSize_(RowSize(capacity)),
+      kSampleSize_(capacity * kSamplesPerKey),
+      counts_(),
+      samples_(0) {
+  std::vector<std::atomic<uint8_t>> counts(kRowSize_ * kRowCount);
+  counts_.swap(counts);
+  for (auto& count : counts_)
+    count.store(0);
+}
+
+void FrequencySketch::Record(const Identity& key) {
+  size_t slots[kRowCount];
+  GetSlots(key, slots);
+  for (auto slot : slots) {
+    uint8_t count(counts_[slot].load());
+    while (count != kMaxFrequency && !counts_[slot].compare_exchange_weak(count, count + 1)) {}
+  }
+  // Only the use which completes a sample ages the counts.
+  if (samples_.fetch_add(1) + 1 == kSampleSize_)
+    Age();
+}
+
+uint32_t FrequencySketch::Estimate(const Identity& key) const {
+  size_t slots[kRowCount];
+  GetSlots(key, slots);
+  uint32_t estimate(kMaxFrequency);
+  for (auto slot : slots) {
+    uint32_t count(counts_[slot].load());
+    if (count < estimate)
+      estimate = count;
+  }
+  return estimate;
+}
+
+void FrequencySketch::GetSlots(const Identity& key, size_t (&slots)[kRowCount]) const {
+  // Double hashing: the slot in row i is derived from first + i * second.
+  uint64_t first(std::hash<std::string>()(key.string()));
+  uint64_t second(Mix(first) | 1);
+  for (int i(0); i != kRowCount; ++i)
+    slots[i] = i * kRowSize_ + static_cast<size_t>((first + i * second) & (kRowSize_ - 1));
+}
+
+void FrequencySketch::Age() {
+  for (auto& count : counts_) {
+    uint8_t value(count.load());
+    while (!count.compare_exchange_weak(value, value / 2)) {}
+  }
+  samples_ -= kSampleSize_ / 2;
+}
+
+}  // namespace detail
+
+}  // namespace maidsafe
@@ -0,0 +1,65 @@
+/* Copyright 2012 MaidSafe.net limited
+
+This MaidSafe Software is licensed under the MaidSafe.net Commercial License, version 1.0 or later,
+and The General Public License (GPL), version 3. By contributing code to this project You agree to
+the terms laid out in the MaidSafe Contributor Agreement, version 1.0, found in the root directory
+of this project at LICENSE, COPYING and CONTRIBUTOR respectively and also available at:
+
+http://www.novinet.com/license
+
+Unless required by applicable law or agreed to in writing, software distributed under the License is
+distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or
+implied. See the License for the specific language governing permissions and limitations under the
+License.
+*/
+
+#ifndef MAIDSAFE_COMMON_FREQUENCY_SKETCH_H_
+#define MAIDSAFE_COMMON_FREQUENCY_SKETCH_H_
+
+#include <atomic>
+#include <cstdint>
+#include <vector>
+
+#include "maidsafe/common/types.h"
+
+
+namespace maidsafe {
+
+namespace detail {
+
+// Estimates how often each key has been used recently, as TinyLFU does, in a fixed amount of memory
+// however many keys are seen.  Each use increments a small count in each of four rows (a count-min
+// sketch), and a key's estimate is the smallest of its counts, so collisions can only inflate it.
+// Once ten uses per key of capacity have been recorded, every count is halved, so that keys which
+// were popular long ago don't stay popular forever.  All functions may be called concurrently.
+class FrequencySketch {
+ public:
+  // The most an estimate can reach.
+  static const uint32_t kMaxFrequency = 15;
+
+  // Sized for about 'capacity' distinct keys.  Throws if capacity is 0.
+  explicit FrequencySketch(uint64_t capacity);
+  void Record(const Identity& key);
+  uint32_t Estimate(const Identity& key) const;
+
+ private:
+  FrequencySketch(const FrequencySketch&);
+  FrequencySketch& operator=(const FrequencySketch&);
+
+  static const int kRowCount = 4;
+  void GetSlots(const Identity& key, size_t (&slots)[kRowCount]) const;
+  void Age();
+
+  // The rows are laid end to end, each kRowSize_ counts long.
+  const size_t kRowSize_;
+  const uint64_t kSampleSize_;
+  std::vector<std::atomic<uint8_t>> counts_;
+  std::atomic<uint64_t> samples_;
+};
+
+}  // namespace detail
+
+}  // namespace maidsafe
+
+
+#endif  // MAIDSAFE_COMMON_FREQUENCY_SKETCH_H_
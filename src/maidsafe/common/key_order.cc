@@ -0,0 +1,130 @@
+/* Copyright 2012 MaidSafe.net limited
+
+This MaidSafe Software is licensed under the MaidSafe.net Commercial License, version 1.0 or later,
+and The General Public License (GPL), version 3. By contributing code to this project You agree to
+the terms laid out in the MaidSafe Contributor Agreement, version 1.0, found in the root directory
+of this project at LICENSE, COPYING and CONTRIBUTOR respectively and also available at:
+
+http://www.novinet.com/license
+
+Unless required by applicable law or agreed to in writing, software distributed under the License is
+distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or
+implied. See the License for the specific language governing permissions and limitations under the
+License.
+*/
+
+#include "maidsafe/common/key_order.h"
+
+#include <algorithm>
+
+
+namespace maidsafe {
+
+namespace detail {
+
+namespace {
+
+// The size of every Identity.
+const size_t kKeySize(64);
+// The table starts with 2^kMinBucketBits buckets, doubles once it holds two keys per bucket on
+// average, and halves once it holds fewer than one per eight.
+const int kMinBucketBits(4);
+const size_t kMaxLoad(2), kMinLoadDivisor(8);
+
+}  // unnamed namespace
+
+KeyOrder::Entry::Entry(const Identity& key_in, uint64_t sequence_in)
+    : leading_bytes(0), key(&key_in), sequence(sequence_in) {
+  const std::string& key_string(key_in.string());
+  for (size_t i(0); i != sizeof(leading_bytes) && i != key_string.size(); ++i)
+    leading_bytes |= uint64_t(static_cast<unsigned char>(key_string[i])) << (56 - 8 * i);
+}
+
+KeyOrder::KeyOrder()
+    : bucket_bits_(kMinBucketBits),
+      buckets_(size_t(1) << kMinBucketBits),
+      size_(0) {}
+
+size_t KeyOrder::EntrySize() {
+  // A bucket's capacity may be up to twice its size, and there are at most as many buckets as
+  // entries once the table has grown.
+  return 2 * sizeof(Entry) + sizeof(Bucket);
+}
+
+bool KeyOrder::Less(const Entry& lhs, const Entry& rhs) {
+  if (lhs.leading_bytes != rhs.leading_bytes)
+    return lhs.leading_bytes < rhs.leading_bytes;
+  return *lhs.key < *rhs.key;
+}
+
+size_t KeyOrder::BucketIndex(uint64_t leading_bytes) const {
+  return static_cast<size_t>(leading_bytes >> (64 - bucket_bits_));
+}
+
+void KeyOrder::Insert(const Identity& key, uint64_t sequence) {
+  Entry entry(key, sequence);
+  Bucket& bucket(buckets_[BucketIndex(entry.leading_bytes)]);
+  for (const auto& held : bucket) {
+    if (held.leading_bytes == entry.leading_bytes && *held.key == key)
+      return;
+  }
+  bucket.push_back(entry);
+  if (++size_ > kMaxLoad * buckets_.size() && bucket_bits_ < 8 * static_cast<int>(sizeof(size_t)))
+    Rehash(bucket_bits_ + 1);
+}
+
+void KeyOrder::Erase(const Identity& key) {
+  Entry entry(key, 0);
+  Bucket& bucket(buckets_[BucketIndex(entry.leading_bytes)]);
+  for (auto itr(bucket.begin()); itr != bucket.end(); ++itr) {
+    if ((*itr).leading_bytes == entry.leading_bytes && *(*itr).key == key) {
+      *itr = bucket.back();
+      bucket.pop_back();
+      if (--size_ < buckets_.size() / kMinLoadDivisor && bucket_bits_ > kMinBucketBits)
+        Rehash(bucket_bits_ - 1);
+      return;
+    }
+  }
+}
+
+void KeyOrder::Rehash(int bucket_bits) {
+  std::vector<Bucket> old_buckets(size_t(1) << bucket_bits);
+  old_buckets.swap(buckets_);
+  bucket_bits_ = bucket_bits;
+  for (const auto& bucket : old_buckets) {
+    for (const auto& entry : bucket)
+      buckets_[BucketIndex(entry.leading_bytes)].push_back(entry);
+  }
+}
+
+bool KeyOrder::Find(const Identity& after, const std::string& prefix, size_t batch_size,
+                    std::vector<std::pair<Identity, uint64_t>>& batch) const {
+  // Every key beginning with 'prefix' lies between the prefix padded out with zero bytes and the
+  // prefix padded out with 0xff bytes.
+  const Identity kFirst(prefix + std::string(kKeySize - prefix.size(), '\0'));
+  const Identity kLast(prefix + std::string(kKeySize - prefix.size(), '\xff'));
+  const Entry kStart(after.IsInitialised() ? after : kFirst, 0), kEnd(kLast, 0);
+  std::vector<const Entry*> candidates;
+  for (size_t index(BucketIndex(kStart.leading_bytes)); index <= BucketIndex(kEnd.leading_bytes);
+       ++index) {
+    candidates.clear();
+    for (const auto& entry : buckets_[index]) {
+      if ((after.IsInitialised() ? Less(kStart, entry) : !Less(entry, kStart)) &&
+          !Less(kEnd, entry)) {
+        candidates.push_back(&entry);
+      }
+    }
+    std::sort(candidates.begin(), candidates.end(),
+              [](const Entry* lhs, const Entry* rhs) { return Less(*lhs, *rhs); });
+    for (const Entry* entry : candidates) {
+      if (batch.size() == batch_size)
+        return false;
+      batch.emplace_back(*entry->key, entry->sequence);
+    }
+  }
+  return true;
+}
+
+}  // namespace detail
+
+}  // namespace maidsafe
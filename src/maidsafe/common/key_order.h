@@ -0,0 +1,81 @@
+/* Copyright 2012 MaidSafe.net limited
+
+This MaidSafe Software is licensed under the MaidSafe.net Commercial License, version 1.0 or later,
+and The General Public License (GPL), version 3. By contributing code to this project You agree to
+the terms laid out in the MaidSafe Contributor Agreement, version 1.0, found in the root directory
+of this project at LICENSE, COPYING and CONTRIBUTOR respectively and also available at:
+
+http://www.novinet.com/license
+
+Unless required by applicable law or agreed to in writing, software distributed under the License is
+distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or
+implied. See the License for the specific language governing permissions and limitations under the
+License.
+*/
+
+#ifndef MAIDSAFE_COMMON_KEY_ORDER_H_
+#define MAIDSAFE_COMMON_KEY_ORDER_H_
+
+#include <cstdint>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "maidsafe/common/types.h"
+
+
+namespace maidsafe {
+
+namespace detail {
+
+// Holds a set of keys, each with the sequence of the value it's held for, so that they can be
+// walked in ascending order a batch at a time.  It's a hash table whose hash is a key's leading
+// bits, so the buckets are in key order; only the buckets a batch is taken from need sorting, and
+// inserting or erasing a key costs no more than in any other hash table.  The keys of a store are
+// hashes, so they spread evenly over the buckets.  An entry refers to its key rather than copying
+// it and keeps the key's first eight bytes alongside, so most comparisons are settled without
+// following that reference.  Calls must be serialised by the caller.
+class KeyOrder {
+ public:
+  KeyOrder();
+  // The most bytes taken by each entry, counting its share of the buckets.
+  static size_t EntrySize();
+  // 'key' mustn't be destroyed or changed until it's erased.  Does nothing if 'key' is already
+  // held.
+  void Insert(const Identity& key, uint64_t sequence);
+  void Erase(const Identity& key);
+  // Appends up to 'batch_size' keys which begin with 'prefix', and their sequences, to 'batch' in
+  // ascending order.  They follow 'after', or if that's uninitialised, begin with the first such
+  // key.  Returns true if there are no more keys beginning with 'prefix' to find.  'prefix' mustn't
+  // be longer than a key.
+  bool Find(const Identity& after, const std::string& prefix, size_t batch_size,
+            std::vector<std::pair<Identity, uint64_t>>& batch) const;
+  size_t size() const { return size_; }
+
+ private:
+  KeyOrder(const KeyOrder&);
+  KeyOrder& operator=(const KeyOrder&);
+
+  struct Entry {
+    Entry(const Identity& key_in, uint64_t sequence_in);
+    uint64_t leading_bytes;  // The key's first eight bytes, read big-endian.
+    const Identity* key;
+    uint64_t sequence;
+  };
+  typedef std::vector<Entry> Bucket;
+
+  static bool Less(const Entry& lhs, const Entry& rhs);
+  size_t BucketIndex(uint64_t leading_bytes) const;
+  void Rehash(int bucket_bits);
+
+  int bucket_bits_;
+  std::vector<Bucket> buckets_;
+  size_t size_;
+};
+
+}  // namespace detail
+
+}  // namespace maidsafe
+
+
+#endif  // MAIDSAFE_COMMON_KEY_ORDER_H_
@@ -15,10 +15,22 @@ License.
 
 #include "maidsafe/common/key_value_buffer.h"
 
+#include <algorithm>
 #include <chrono>
+#include <iterator>
+
 #include "boost/filesystem/convenience.hpp"
 
+#include "maidsafe/common/active.h"
+#include "maidsafe/common/counting_bloom_filter.h"
+#include "maidsafe/common/crypto.h"
+#include "maidsafe/common/disk_backend.h"
+#include "maidsafe/common/eviction_queue.h"
+#include "maidsafe/common/frequency_sketch.h"
+#include "maidsafe/common/key_order.h"
 #include "maidsafe/common/log.h"
+#include "maidsafe/common/read_index.h"
+#include "maidsafe/common/timing_wheel.h"
 #include "maidsafe/common/utils.h"
 
 
@@ -28,6 +40,108 @@ namespace maidsafe {
 
 namespace {
 
+// Disk hits arriving while this many are already waiting to be promoted are not promoted.
+const size_t kMaxQueuedPromotions(64);
+
+// The resolution of values' times to live; a value is removed up to this long after it expires.
+const std::chrono::milliseconds kExpiryTick(10);
+
+// The size of every key, which is too long to be held within its string object.
+const size_t kKeySize(64);
+
+// Estimates the bytes a general-purpose heap takes for a block of 'size' bytes: a word of header,
+// rounded up to 16 bytes.
+uint64_t HeapBlockSize(size_t size) {
+  return std::max<uint64_t>(32, (size + sizeof(void*) + 15) / 16 * 16);
+}
+
+// Name of the file in the disk buffer listing the values to be recovered.
+const char kManifestName[] = "manifest";
+
+// Name of the file in a deduplicated disk buffer listing the content held for each of the values
+// in the manifest, in the same order.
+const char kContentsName[] = "contents";
+
+// Added to the disk layout recorded in the manifest when values are written with compression, and
+// when they're deduplicated.
+const uint32_t kCompressedDiskFormat(0x100);
+const uint32_t kDeduplicatedDiskFormat(0x200);
+
+// When compression is enabled, each value on disk starts with one of these.
+const char kUncompressedTag('\0');
+const char kCompressedTag('\1');
+
+// Returns the position in 'list' before which an element with 'sequence' keeps it in order.  New
+// elements usually belong at or near the end.
+template<typename List>
+typename List::iterator SequencePosition(List& list, uint64_t sequence) {
+  auto position(list.end());
+  while (position != list.begin() && std::prev(position)->sequence > sequence)
+    --position;
+  return position;
+}
+
+std::unique_ptr<detail::EvictionQueue> MakeEvictionQueue(KeyValueBuffer::EvictionPolicy policy) {
+  switch (policy) {
+    case KeyValueBuffer::EvictionPolicy::kInsertionOrder:
+      return nullptr;
+    case KeyValueBuffer::EvictionPolicy::kLru:
+      return std::unique_ptr<detail::EvictionQueue>(new detail::LruEvictionQueue);
+    case KeyValueBuffer::EvictionPolicy::kLfu:
+      return std::unique_ptr<detail::EvictionQueue>(new detail::LfuEvictionQueue);
+    case KeyValueBuffer::EvictionPolicy::kArc:
+      return std::unique_ptr<detail::EvictionQueue>(new detail::ArcEvictionQueue);
+    case KeyValueBuffer::EvictionPolicy::kGdsf:
+      return std::unique_ptr<detail::EvictionQueue>(new detail::GdsfEvictionQueue);
+    default:
+      LOG(kError) << "Invalid eviction policy.";
+      ThrowError(CommonErrors::invalid_parameter);
+      return nullptr;
+  }
+}
+
+std::unique_ptr<detail::PendingTouches> MakePendingTouches(
+    KeyValueBuffer::EvictionPolicy eviction_policy) {
+  if (eviction_policy == KeyValueBuffer::EvictionPolicy::kInsertionOrder)
+    return nullptr;
+  return std::unique_ptr<detail::PendingTouches>(new detail::PendingTouches);
+}
+
+std::unique_ptr<detail::CountingBloomFilter> MakeKeyFilter(uint64_t capacity) {
+  if (capacity == 0)
+    return nullptr;
+  return std::unique_ptr<detail::CountingBloomFilter>(new detail::CountingBloomFilter(capacity));
+}
+
+std::unique_ptr<detail::FrequencySketch> MakeAdmissionSketch(uint64_t capacity) {
+  if (capacity == 0)
+    return nullptr;
+  return std::unique_ptr<detail::FrequencySketch>(new detail::FrequencySketch(capacity));
+}
+
+KeyValueBuffer::ValueView ViewOf(const KeyValueBuffer::SharedValue& value) {
+  return KeyValueBuffer::ValueView(std::shared_ptr<const char>(value, value->string().data()),
+                                   value->string().size());
+}
+
+// Returns how many of the 'length' bytes from 'offset' lie within a value of 'size' bytes.  Throws
+// if offset is beyond the end of the value.
+size_t RangeLength(uint64_t size, uint64_t offset, size_t length) {
+  if (offset > size) {
+    LOG(kError) << "Offset " << offset << " is beyond the end of the " << size << "-byte value.";
+    ThrowError(CommonErrors::invalid_parameter);
+  }
+  return static_cast<size_t>(std::min(static_cast<uint64_t>(length), size - offset));
+}
+
+KeyValueBuffer::ValueView RangeOf(const KeyValueBuffer::SharedValue& value,
+                                  uint64_t offset,
+                                  size_t length) {
+  length = RangeLength(value->string().size(), offset, length);
+  return KeyValueBuffer::ValueView(
+      std::shared_ptr<const char>(value, value->string().data() + offset), length);
+}
+
 void InitialiseDiskRoot(const fs::path& disk_root) {
   boost::system::error_code error_code;
   if (!fs::exists(disk_root, error_code)) {
@@ -51,38 +165,300 @@ void InitialiseDiskRoot(const fs::path& disk_root) {
 
 KeyValueBuffer::KeyValueBuffer(MemoryUsage max_memory_usage,
                                DiskUsage max_disk_usage,
-                               PopFunctor pop_functor)
+                               PopFunctor pop_functor,
+                               const Options& options)
     : memory_store_(max_memory_usage),
       disk_store_(max_disk_usage),
       kPopFunctor_(pop_functor),
       kDiskBuffer_(fs::unique_path(fs::temp_directory_path() / "KVB-%%%%-%%%%-%%%%-%%%%")),
       kShouldRemoveRoot_(true),
+      kRecoverDiskBuffer_(false),
+      kDiskLayout_(options.disk_layout),
+      kDiskCompressionLevel_(options.disk_compression_level),
+      kDeduplicateDiskValues_(options.deduplicate_disk_values),
+      kAccountMemoryOverhead_(options.account_memory_overhead),
+      kMemoryAdmissionMaxSize_(options.memory_admission_max_size),
+      kMemoryAdmissionMinFrequency_(options.memory_admission_min_frequency),
+      admission_sketch_(MakeAdmissionSketch(options.admission_sketch_capacity)),
+      disk_backend_(),
+      memory_eviction_(MakeEvictionQueue(options.memory_eviction_policy)),
+      disk_eviction_(MakeEvictionQueue(options.disk_eviction_policy)),
+      pending_memory_touches_(MakePendingTouches(options.memory_eviction_policy)),
+      pending_disk_touches_(MakePendingTouches(options.disk_eviction_policy)),
+      memory_read_index_(new detail::ReadIndex),
+      memory_key_order_(new detail::KeyOrder),
+      disk_key_order_(new detail::KeyOrder),
+      key_filter_(MakeKeyFilter(options.key_filter_capacity)),
       running_(true),
-      worker_() {
-  Init();
+      kSpillBatchSize_(options.spill_batch_size),
+      spill_batches_taken_(0),
+      spill_batches_reserved_(0),
+      next_sequence_(0),
+      workers_(),
+      worker_error_mutex_(),
+      worker_error_(),
+      kPromoteDiskHits_(options.promote_disk_hits),
+      promotion_queue_(),
+      promotion_mutex_(),
+      promotion_cond_var_(),
+      promoter_(),
+      kPopQueueSize_(std::max<uint32_t>(options.pop_queue_size, 1)),
+      pop_queue_(),
+      undelivered_pops_(0),
+      pop_mutex_(),
+      pop_cond_var_(),
+      pop_deliverer_(),
+      kDefaultTimeToLive_(options.default_time_to_live),
+      expiry_wheel_(),
+      expiry_mutex_(),
+      expiry_cond_var_(),
+      expirer_(),
+      memory_hits_(0),
+      disk_hits_(0),
+      misses_(0),
+      promotions_(0),
+      bytes_spilled_(0),
+      values_spilled_(0),
+      spills_skipped_(0),
+      expirations_(0),
+      admissions_bypassed_(0),
+      admissions_refused_(0),
+      values_deduplicated_(0),
+      bytes_deduplicated_(0),
+      kAsyncHighWaterMark_(options.async_high_water_mark),
+      kBackpressureFunctor_(options.backpressure_functor),
+      async_mutex_(),
+      pending_async_operations_(0),
+      pending_async_bytes_(0),
+      above_high_water_(false),
+      backpressure_mutex_(),
+      backpressure_reported_(false),
+      async_active_() {
+  Init(options);
 }
 
 KeyValueBuffer::KeyValueBuffer(MemoryUsage max_memory_usage,
                                DiskUsage max_disk_usage,
                                PopFunctor pop_functor,
-                               const boost::filesystem::path& disk_buffer)
+                               const boost::filesystem::path& disk_buffer,
+                               const Options& options)
     : memory_store_(max_memory_usage),
       disk_store_(max_disk_usage),
       kPopFunctor_(pop_functor),
       kDiskBuffer_(disk_buffer),
       kShouldRemoveRoot_(false),
+      kRecoverDiskBuffer_(options.recover_disk_buffer),
+      kDiskLayout_(options.disk_layout),
+      kDiskCompressionLevel_(options.disk_compression_level),
+      kDeduplicateDiskValues_(options.deduplicate_disk_values),
+      kAccountMemoryOverhead_(options.account_memory_overhead),
+      kMemoryAdmissionMaxSize_(options.memory_admission_max_size),
+      kMemoryAdmissionMinFrequency_(options.memory_admission_min_frequency),
+      admission_sketch_(MakeAdmissionSketch(options.admission_sketch_capacity)),
+      disk_backend_(),
+      memory_eviction_(MakeEvictionQueue(options.memory_eviction_policy)),
+      disk_eviction_(MakeEvictionQueue(options.disk_eviction_policy)),
+      pending_memory_touches_(MakePendingTouches(options.memory_eviction_policy)),
+      pending_disk_touches_(MakePendingTouches(options.disk_eviction_policy)),
+      memory_read_index_(new detail::ReadIndex),
+      memory_key_order_(new detail::KeyOrder),
+      disk_key_order_(new detail::KeyOrder),
+      key_filter_(MakeKeyFilter(options.key_filter_capacity)),
       running_(true),
-      worker_() {
-  Init();
+      kSpillBatchSize_(options.spill_batch_size),
+      spill_batches_taken_(0),
+      spill_batches_reserved_(0),
+      next_sequence_(0),
+      workers_(),
+      worker_error_mutex_(),
+      worker_error_(),
+      kPromoteDiskHits_(options.promote_disk_hits),
+      promotion_queue_(),
+      promotion_mutex_(),
+      promotion_cond_var_(),
+      promoter_(),
+      kPopQueueSize_(std::max<uint32_t>(options.pop_queue_size, 1)),
+      pop_queue_(),
+      undelivered_pops_(0),
+      pop_mutex_(),
+      pop_cond_var_(),
+      pop_deliverer_(),
+      kDefaultTimeToLive_(options.default_time_to_live),
+      expiry_wheel_(),
+      expiry_mutex_(),
+      expiry_cond_var_(),
+      expirer_(),
+      memory_hits_(0),
+      disk_hits_(0),
+      misses_(0),
+      promotions_(0),
+      bytes_spilled_(0),
+      values_spilled_(0),
+      spills_skipped_(0),
+      expirations_(0),
+      admissions_bypassed_(0),
+      admissions_refused_(0),
+      values_deduplicated_(0),
+      bytes_deduplicated_(0),
+      kAsyncHighWaterMark_(options.async_high_water_mark),
+      kBackpressureFunctor_(options.backpressure_functor),
+      async_mutex_(),
+      pending_async_operations_(0),
+      pending_async_bytes_(0),
+      above_high_water_(false),
+      backpressure_mutex_(),
+      backpressure_reported_(false),
+      async_active_() {
+  Init(options);
 }
 
-void KeyValueBuffer::Init() {
+void KeyValueBuffer::Init(const Options& options) {
   if (memory_store_.max > disk_store_.max) {
     LOG(kError) << "Max memory usage must be < max disk usage.";
     ThrowError(CommonErrors::invalid_parameter);
   }
+  if (options.spill_writer_count == 0 || options.spill_batch_size == 0) {
+    LOG(kError) << "Spill writer count and batch size must be non-zero.";
+    ThrowError(CommonErrors::invalid_parameter);
+  }
+  if (kDiskCompressionLevel_ > crypto::kMaxCompressionLevel) {
+    LOG(kError) << "Disk compression level must be <= " << crypto::kMaxCompressionLevel;
+    ThrowError(CommonErrors::invalid_parameter);
+  }
+  if (options.direct_disk_io && kDiskLayout_ != DiskLayout::kFilePerKey) {
+    LOG(kError) << "Direct disk I/O is only available with the file-per-key layout.";
+    ThrowError(CommonErrors::invalid_parameter);
+  }
+  if (kDefaultTimeToLive_ < std::chrono::milliseconds(0)) {
+    LOG(kError) << "Default time to live can't be negative.";
+    ThrowError(CommonErrors::invalid_parameter);
+  }
+  if (admission_sketch_ && kMemoryAdmissionMinFrequency_ > detail::FrequencySketch::kMaxFrequency) {
+    LOG(kError) << "Memory admission frequency must be <= "
+                << detail::FrequencySketch::kMaxFrequency;
+    ThrowError(CommonErrors::invalid_parameter);
+  }
   InitialiseDiskRoot(kDiskBuffer_);
-  worker_ = std::async(std::launch::async, &KeyValueBuffer::CopyQueueToDisk, this);
+  detail::DiskManifest manifest, contents;
+  bool recovering(false);
+  if (!kShouldRemoveRoot_) {
+    const fs::path kManifestPath(kDiskBuffer_ / kManifestName);
+    const fs::path kContentsPath(kDiskBuffer_ / kContentsName);
+    recovering = kRecoverDiskBuffer_ &&
+                 detail::ReadDiskManifest(kManifestPath, DiskFormat(), manifest) &&
+                 (!kDeduplicateDiskValues_ ||
+                  (detail::ReadDiskManifest(kContentsPath, DiskFormat(), contents) &&
+                   contents.size() == manifest.size()));
+    // The manifests are stale as soon as anything is written, so mustn't be loaded again.
+    boost::system::error_code error_code;
+    fs::remove(kManifestPath, error_code);
+    fs::remove(kContentsPath, error_code);
+  }
+
+  if (kDiskLayout_ == DiskLayout::kSegmentFile) {
+    try {
+      disk_backend_.reset(new detail::SegmentFileDiskBackend(
+          kDiskBuffer_, detail::SegmentFileDiskBackend::kDefaultSegmentSize, recovering));
+    }
+    catch(const std::exception& e) {
+      if (!recovering)
+        throw;
+      LOG(kWarning) << "Can't recover disk buffer " << kDiskBuffer_ << ": " << e.what();
+      recovering = false;
+      disk_backend_.reset(new detail::SegmentFileDiskBackend(
+          kDiskBuffer_, detail::SegmentFileDiskBackend::kDefaultSegmentSize));
+    }
+  } else {
+    disk_backend_.reset(new detail::FilePerKeyDiskBackend(kDiskBuffer_, options.direct_disk_io));
+  }
+  if (recovering)
+    LoadDiskIndex(manifest, contents);
+
+  for (uint32_t i(0); i != options.spill_writer_count; ++i)
+    workers_.push_back(std::async(std::launch::async, &KeyValueBuffer::CopyQueueToDisk, this));
+  if (kPromoteDiskHits_)
+    promoter_ = std::async(std::launch::async, &KeyValueBuffer::PromoteDiskHits, this);
+  if (kPopFunctor_)
+    pop_deliverer_ = std::async(std::launch::async, &KeyValueBuffer::DeliverPops, this);
+}
+
+void KeyValueBuffer::LoadDiskIndex(const detail::DiskManifest& manifest,
+                                   const detail::DiskManifest& contents) {
+  // Called before the workers are started, so no locking is needed.  With deduplication, 'contents'
+  // names the content held for each value in 'manifest', and each content's size counts once.
+  std::unordered_map<Identity, uint32_t, IdentityHash> references(contents.size());
+  uint64_t total(0);
+  for (size_t i(0); i != manifest.size(); ++i) {
+    if (contents.empty() || ++references[contents[i].first] == 1)
+      total += manifest[i].second;
+  }
+  size_t i(0);
+  for (; i != manifest.size() && total > disk_store_.max; ++i) {
+    // The disk buffer has shrunk since the values were saved, so the oldest no longer fit.
+    const Identity& name(contents.empty() ? manifest[i].first : contents[i].first);
+    const bool kLastReference(contents.empty() || --references[name] == 0);
+    if (kLastReference)
+      total -= manifest[i].second;
+    try {
+      NonEmptyString value;
+      if (kLastReference)
+        disk_backend_->Remove(name, kPopFunctor_ ? &value : nullptr);
+      else if (kPopFunctor_)
+        value = disk_backend_->Get(name);
+      if (kPopFunctor_)
+        kPopFunctor_(manifest[i].first, DecodeFromDisk(value));
+    }
+    catch(const std::exception& e) {
+      LOG(kWarning) << "Failed to remove recovered value " << HexSubstr(manifest[i].first) << ": "
+                    << e.what();
+    }
+  }
+
+  disk_store_.index.lookup.reserve(manifest.size() - i);
+  for (; i != manifest.size(); ++i) {
+    const Identity& key(manifest[i].first);
+    disk_store_.index.on_disk.emplace_back(key, contents.empty() ? Identity() : contents[i].first,
+                                           next_sequence_++, manifest[i].second);
+    DiskElement& recovered(disk_store_.index.on_disk.back());
+    recovered.state = StoringState::kCompleted;
+    if (!contents.empty()) {
+      auto content(disk_store_.index.contents.emplace(recovered.content,
+                                                      Content(recovered.size)));
+      if (!content.second)
+        ++content.first->second.references;
+      content.first->second.written = true;
+    }
+    disk_store_.index.lookup[key] = std::prev(disk_store_.index.on_disk.end());
+    disk_key_order_->Insert(recovered.key, recovered.sequence);
+    AddToKeyFilter(key);
+    if (disk_eviction_)
+      disk_eviction_->Add(key, recovered.size);
+  }
+  disk_store_.current.data = total;
+  LOG(kInfo) << "Recovered " << disk_store_.index.on_disk.size() << " values (" << total
+             << " bytes) from " << kDiskBuffer_;
+}
+
+void KeyValueBuffer::SaveDiskIndex() {
+  // Called once the workers have stopped.  Values still being written were abandoned.
+  detail::DiskManifest manifest, contents;
+  manifest.reserve(disk_store_.index.on_disk.size());
+  for (auto& element : disk_store_.index.on_disk) {
+    if (element.state != StoringState::kCompleted)
+      continue;
+    manifest.emplace_back(element.key, element.size);
+    if (kDeduplicateDiskValues_)
+      contents.emplace_back(element.content, element.size);
+  }
+  try {
+    disk_backend_->SaveIndex();
+    if (kDeduplicateDiskValues_)
+      detail::WriteDiskManifest(kDiskBuffer_ / kContentsName, DiskFormat(), contents);
+    detail::WriteDiskManifest(kDiskBuffer_ / kManifestName, DiskFormat(), manifest);
+  }
+  catch(const std::exception& e) {
+    LOG(kError) << "Failed to save disk buffer index in " << kDiskBuffer_ << ": " << e.what();
+  }
 }
 
 KeyValueBuffer::~KeyValueBuffer() {
@@ -94,15 +470,27 @@ KeyValueBuffer::~KeyValueBuffer() {
   }
   memory_store_.cond_var.notify_all();
   disk_store_.cond_var.notify_all();
-  if (worker_.valid()) {
-    try {
-      worker_.get();
-    }
-    catch(const std::exception& e) {
-      LOG(kError) << e.what();
-    }
-  }
+  { std::lock_guard<std::mutex> promotion_lock(promotion_mutex_); }  // NOLINT (Fraser)
+  promotion_cond_var_.notify_all();
+  { std::lock_guard<std::mutex> pop_lock(pop_mutex_); }  // NOLINT (Fraser)
+  pop_cond_var_.notify_all();
+  { std::lock_guard<std::mutex> expiry_lock(expiry_mutex_); }  // NOLINT (Fraser)
+  expiry_cond_var_.notify_all();
+  // Any queued asynchronous operations now fail quickly; wait for them before the workers go.
+  async_active_.reset();
+  for (auto& worker : workers_)
+    worker.wait();
+  if (promoter_.valid())
+    promoter_.wait();
+  if (expirer_.valid())
+    expirer_.wait();
+  // No more values can be popped, so the deliverer exits once it has passed those queued.
+  if (pop_deliverer_.valid())
+    pop_deliverer_.wait();
 
+  if (kRecoverDiskBuffer_)
+    SaveDiskIndex();
+  disk_backend_.reset();
   if (kShouldRemoveRoot_) {
     boost::system::error_code error_code;
     fs::remove_all(kDiskBuffer_, error_code);
@@ -112,343 +500,1781 @@ KeyValueBuffer::~KeyValueBuffer() {
 }
 
 void KeyValueBuffer::Store(const Identity& key, const NonEmptyString& value) {
-  try {
-    Delete(key);
-    LOG(kInfo) << "Re-storing value " << EncodeToBase32(value) << " with key "
+  Store(key, std::make_shared<const NonEmptyString>(value));
+}
+
+void KeyValueBuffer::Store(const Identity& key, SharedValue value) {
+  Store(key, std::move(value), kDefaultTimeToLive_);
+}
+
+void KeyValueBuffer::Store(const Identity& key,
+                           const NonEmptyString& value,
+                           std::chrono::milliseconds time_to_live) {
+  Store(key, std::make_shared<const NonEmptyString>(value), time_to_live);
+}
+
+void KeyValueBuffer::Store(const Identity& key,
+                           SharedValue value,
+                           std::chrono::milliseconds time_to_live) {
+  if (!value) {
+    LOG(kError) << "Can't store a null value with key " << EncodeToBase32(key);
+    ThrowError(CommonErrors::invalid_parameter);
+  }
+  CheckWorkerIsStillRunning();
+  RecordUse(key);
+  if (RemoveKeys(std::vector<Identity>(1, key)) != 0) {
+    LOG(kInfo) << "Re-storing value " << EncodeToBase32(*value) << " with key "
                << EncodeToBase32(key);
+  } else {
+    LOG(kInfo) << "Storing value " << EncodeToBase32(*value) << " with key "
+               << EncodeToBase32(key);
+  }
+  const Clock::time_point kExpiry(ExpiryFor(time_to_live));
+  if (!StoreInMemory(key, value, kExpiry))
+    StoreOnDisk(key, value, next_sequence_++, kExpiry);
+}
+
+void KeyValueBuffer::StoreBatch(
+    const std::vector<std::pair<Identity, NonEmptyString>>& key_values) {
+  CheckWorkerIsStillRunning();
+  std::vector<Identity> keys;
+  keys.reserve(key_values.size());
+  for (auto& key_value : key_values) {
+    keys.push_back(key_value.first);
+    RecordUse(key_value.first);
+  }
+  RemoveKeys(keys);
+
+  // Only the last copy of a repeated key is placed.  Earlier copies could otherwise go to the other
+  // buffer and outlive it.
+  std::unordered_map<Identity, size_t, IdentityHash> last_copy;
+  for (size_t i(0); i != keys.size(); ++i)
+    last_copy[keys[i]] = i;
+  std::vector<size_t> placed;
+  placed.reserve(last_copy.size());
+  for (size_t i(0); i != keys.size(); ++i) {
+    if (last_copy[keys[i]] == i)
+      placed.push_back(i);
   }
-  catch(const std::exception&) {
-    LOG(kInfo) << "Storing value " << EncodeToBase32(value) << " with key " << EncodeToBase32(key);
+
+  const Clock::time_point kExpiry(ExpiryFor(kDefaultTimeToLive_));
+  std::vector<size_t> not_for_memory;
+  bool added(false);
+  {
+    std::unique_lock<std::mutex> memory_store_lock(memory_store_.mutex);
+    for (auto i : placed) {
+      uint64_t required_space(key_values[i].second.string().size());
+      SharedValue value;
+      if (required_space <= memory_store_.max) {
+        value = std::make_shared<const NonEmptyString>(key_values[i].second);
+        required_space = MemoryFootprint(value);
+      }
+      if (required_space > memory_store_.max || RefuseAdmission(keys[i], value, required_space)) {
+        not_for_memory.push_back(i);
+        continue;
+      }
+      // The worker must know about the values already added before we wait for it to make space.
+      if (added && !HasSpace(memory_store_, required_space)) {
+        memory_store_.cond_var.notify_all();
+        added = false;
+      }
+      WaitForSpaceInMemory(required_space, memory_store_lock);
+      if (!running_)
+        break;
+      if (required_space > memory_store_.max) {
+        not_for_memory.push_back(i);
+        continue;
+      }
+
+      AddToMemory(key_values[i].first, value, kExpiry);
+      added = true;
+    }
   }
+  if (added)
+    memory_store_.cond_var.notify_all();
   CheckWorkerIsStillRunning();
-  if (!StoreInMemory(key, value))
-    StoreOnDisk(key, value);
+
+  // The values outlive the calls, so needn't be copied to be shared.
+  for (auto i : not_for_memory) {
+    StoreOnDisk(key_values[i].first,
+                SharedValue(&key_values[i].second, [](const NonEmptyString*) {}),  // NOLINT
+                next_sequence_++, kExpiry);
+  }
 }
 
-bool KeyValueBuffer::StoreInMemory(const Identity& key, const NonEmptyString& value) {
+bool KeyValueBuffer::StoreInMemory(const Identity& key,
+                                   const SharedValue& value,
+                                   Clock::time_point expiry) {
   {
-    uint64_t required_space(value.string().size());
+    uint64_t required_space(MemoryFootprint(value));
     std::unique_lock<std::mutex> memory_store_lock(memory_store_.mutex);
-    if (required_space > memory_store_.max)
+    if (required_space > memory_store_.max || RefuseAdmission(key, value, required_space))
       return false;
 
     WaitForSpaceInMemory(required_space, memory_store_lock);
 
-    if (!running_) {
-      worker_.get();
-      return true;
-    }
+    if (!running_)
+      CheckWorkerIsStillRunning();
+    if (required_space > memory_store_.max)
+      return false;
 
-    memory_store_.current.data += required_space;
-    memory_store_.index.emplace_back(key, value);
+    AddToMemory(key, value, expiry);
+  }
+  memory_store_.cond_var.notify_all();
+  return true;
+}
+
+bool KeyValueBuffer::TryStoreInMemory(const Identity& key, const SharedValue& value) {
+  {
+    const uint64_t kRequiredSpace(MemoryFootprint(value));
+    // Any earlier value of key on disk would have to be removed first, which is left to Store.  The
+    // disk lock is only tried, since it's held while the disk is read, and is kept until the value
+    // is added so that a spill writer can't copy the key to disk meanwhile.
+    std::unique_lock<std::mutex> disk_store_lock(disk_store_.mutex, std::try_to_lock);
+    if (!disk_store_lock.owns_lock() || disk_store_.index.lookup.count(key) != 0)
+      return false;
+    std::lock_guard<std::mutex> memory_store_lock(memory_store_.mutex);
+    if (!running_ || kRequiredSpace > memory_store_.max)
+      return false;
+    auto existing(memory_store_.index.lookup.find(key));
+    if (existing != memory_store_.index.lookup.end() &&
+        (*existing->second).also_on_disk != StoringState::kNotStarted) {
+      return false;
+    }
+    // A value which admission control might refuse is left for Store, which records the use.
+    if (ExceedsAdmissionSize(value) ||
+        (admission_sketch_ && !HasSpace(memory_store_, kRequiredSpace))) {
+      return false;
+    }
+    if (!MakeSpaceInMemory(kRequiredSpace))
+      return false;
+    // Replaces any earlier value of key, which hasn't been copied to disk.
+    AddToMemory(key, value, ExpiryFor(kDefaultTimeToLive_));
   }
+  RecordUse(key);
   memory_store_.cond_var.notify_all();
   return true;
 }
 
+bool KeyValueBuffer::ExceedsAdmissionSize(const SharedValue& value) const {
+  return kMemoryAdmissionMaxSize_ != 0 && value->string().size() > kMemoryAdmissionMaxSize_;
+}
+
+bool KeyValueBuffer::RefuseAdmission(const Identity& key,
+                                     const SharedValue& value,
+                                     const uint64_t& required_space) {
+  // Called with the memory lock held, when required_space doesn't exceed the max memory usage.
+  if (ExceedsAdmissionSize(value)) {
+    ++admissions_bypassed_;
+    return true;
+  }
+  // Room left over is given to any value; only displacing others needs the key to be popular.
+  if (admission_sketch_ && !HasSpace(memory_store_, required_space) &&
+      admission_sketch_->Estimate(key) < kMemoryAdmissionMinFrequency_) {
+    ++admissions_refused_;
+    return true;
+  }
+  return false;
+}
+
+void KeyValueBuffer::RecordUse(const Identity& key) {
+  if (admission_sketch_)
+    admission_sketch_->Record(key);
+}
+
+void KeyValueBuffer::AddToMemory(const Identity& key,
+                                 const SharedValue& value,
+                                 Clock::time_point expiry) {
+  // A concurrent Store of the same key may have beaten us here; the latest value wins.  The read
+  // index entry is replaced before the old element is erased, so readers never miss the key.
+  const uint64_t kSequence(next_sequence_++);
+  memory_read_index_->Insert(key, kSequence, value);
+  auto existing(memory_store_.index.lookup.find(key));
+  if (existing != memory_store_.index.lookup.end())
+    EraseFromMemory(existing->second);
+
+  memory_store_.current.data += MemoryFootprint(value);
+  memory_store_.index.unwritten.Add(MaxDiskSize(value));
+  memory_store_.index.not_on_disk.emplace_back(key, value, kSequence);
+  MemoryElement& added(memory_store_.index.not_on_disk.back());
+  added.expiry = expiry;
+  memory_store_.index.lookup[key] = std::prev(memory_store_.index.not_on_disk.end());
+  memory_key_order_->Insert(added.key, kSequence);
+  AddToKeyFilter(key);
+  if (expiry != Clock::time_point::max())
+    ScheduleExpiry(key, added.sequence, expiry);
+}
+
+uint64_t KeyValueBuffer::MemoryFootprint(const SharedValue& value) const {
+  const std::string& bytes(value->string());
+  if (!kAccountMemoryOverhead_)
+    return bytes.size();
+  // The list and lookup nodes come from the slabs, the rest from the heap: the read index's entry,
+  // the three copies of the key, and the value's string object along with its shared_ptr control
+  // block.
+  static const uint64_t kEntryOverhead(
+      detail::SlabAllocator::BlockSize(sizeof(MemoryElement) + 2 * sizeof(void*)) +
+      detail::SlabAllocator::BlockSize(sizeof(MemoryIndex::LookupEntry) + 2 * sizeof(void*)) +
+      sizeof(void*) +  // The lookup table's bucket.
+      detail::KeyOrder::EntrySize() +
+      sizeof(Identity) + sizeof(uint64_t) + sizeof(SharedValue) +
+      3 * HeapBlockSize(kKeySize + 1) +
+      HeapBlockSize(sizeof(NonEmptyString) + 2 * sizeof(void*)));
+  // A short string's bytes may be held within the string object rather than in a block apart.
+  const char* const kObject(reinterpret_cast<const char*>(&bytes));
+  const bool kHeldInObject(bytes.data() >= kObject && bytes.data() < kObject + sizeof(bytes));
+  return kEntryOverhead + (kHeldInObject ? 0 : HeapBlockSize(bytes.capacity() + 1));
+}
+
+uint64_t KeyValueBuffer::MaxDiskSize(const SharedValue& value) const {
+  // A value which doesn't compress is written with a tag byte added.
+  return value->string().size() + (kDiskCompressionLevel_ != 0 ? 1 : 0);
+}
+
+bool KeyValueBuffer::MakeSpaceInMemory(const uint64_t& required_space) {
+  if (required_space > memory_store_.max)
+    return false;
+  // Only values which are already on disk can be dropped without waiting.
+  while (!HasSpace(memory_store_, required_space) && !memory_store_.index.on_disk.empty())
+    EraseFromMemory(MemoryEvictionCandidate());
+  return HasSpace(memory_store_, required_space);
+}
+
 void KeyValueBuffer::WaitForSpaceInMemory(const uint64_t& required_space,
                                           std::unique_lock<std::mutex>& memory_store_lock) {
-  while (!HasSpace(memory_store_, required_space)) {
+  // Gives up if the max is lowered below required_space meanwhile, so callers must check for that.
+  while (!HasSpace(memory_store_, required_space) && required_space <= memory_store_.max) {
     auto itr(FindMemoryRemovalCandidate(required_space, memory_store_lock));
     if (!running_)
       return;
 
-    if (itr != memory_store_.index.end()) {
-      memory_store_.current.data -= (*itr).value.string().size();
-      memory_store_.index.erase(itr);
-    }
+    if (itr != memory_store_.index.on_disk.end())
+      EraseFromMemory(itr);
   }
 }
 
-void KeyValueBuffer::StoreOnDisk(const Identity& key, const NonEmptyString& value) {
+bool KeyValueBuffer::StoreOnDisk(const Identity& key,
+                                 const SharedValue& value,
+                                 uint64_t sequence,
+                                 Clock::time_point expiry) {
+  const SharedValue encoded(EncodeForDisk(value));
+  const uint64_t required_space(encoded->string().size());
+  const Identity content(ContentName(encoded));
+  DiskList::iterator itr;
   {
     std::unique_lock<std::mutex> disk_store_lock(disk_store_.mutex);
-    if (value.string().size() > disk_store_.max) {
-      LOG(kError) << "Cannot store " << HexSubstr(key) << " since its " << value.string().size()
-                  << " bytes exceeds max of " << disk_store_.max << " bytes.";
-      StopRunning();
-      ThrowError(CommonErrors::cannot_exceed_limit);
+    CheckFitsOnDisk(key, required_space);
+    itr = RegisterOnDisk(key, content, sequence, required_space);
+    if (expiry != Clock::time_point::max())
+      ScheduleExpiry(key, sequence, expiry);
+    if (ReserveSpaceOnDisk(itr, required_space, disk_store_lock, false) != Reservation::kReserved) {
+      // Reports the max having been lowered below the value's size while waiting for space.
+      CheckFitsOnDisk(key, required_space);
+      return false;
     }
-    disk_store_.index.emplace_back(key);
-
-    bool cancelled(false);
-    WaitForSpaceOnDisk(key, value.string().size(), disk_store_lock, cancelled);
-    if (!running_)
-      return;
-
-    if (!cancelled) {
-      if (!WriteFile(GetFilename(key), value.string())) {
-        LOG(kError) << "Failed to move " << HexSubstr(key) << " to disk.";
-        StopRunning();
-        ThrowError(CommonErrors::filesystem_io_error);
-      }
-      auto itr(FindStartedToStoreOnDisk(key));
-      if (itr != disk_store_.index.end())
-        (*itr).state = StoringState::kCompleted;
+  }
 
-      disk_store_.current.data += value.string().size();
+  // The write is done without the lock, so that spill writers can write at the same time.
+  try {
+    WriteToBackend(*itr, encoded);
+  }
+  catch(const std::exception& e) {
+    LOG(kError) << "Failed to store " << HexSubstr(key) << " on disk: " << e.what();
+    {
+      std::lock_guard<std::mutex> disk_store_lock(disk_store_.mutex);
+      AbandonWritingToDisk(itr);
     }
+    disk_store_.cond_var.notify_all();
+    ThrowError(CommonErrors::filesystem_io_error);
+  }
+
+  bool stored(false);
+  {
+    std::lock_guard<std::mutex> disk_store_lock(disk_store_.mutex);
+    stored = FinishWritingToDisk(itr);
   }
   disk_store_.cond_var.notify_all();
+  return stored;
 }
 
-void KeyValueBuffer::WaitForSpaceOnDisk(const Identity& key,
-                                        const uint64_t& required_space,
-                                        std::unique_lock<std::mutex>& disk_store_lock,
-                                        bool& cancelled) {
-  while (!HasSpace(disk_store_, required_space) && running_) {
-    auto itr(Find(disk_store_, key));
-    if (itr == disk_store_.index.end()) {
-      cancelled = true;
-      return;
-    }
-
-    if ((*itr).state == StoringState::kCancelled) {
-      disk_store_.index.erase(itr);
-      cancelled = true;
-      return;
-    }
+uint32_t KeyValueBuffer::DiskFormat() const {
+  return static_cast<uint32_t>(kDiskLayout_) |
+         (kDiskCompressionLevel_ != 0 ? kCompressedDiskFormat : 0) |
+         (kDeduplicateDiskValues_ ? kDeduplicatedDiskFormat : 0);
+}
 
-    if (kPopFunctor_) {
-      itr = FindOldestOnDisk();
-      assert((*itr).state != StoringState::kStarted);
-      if ((*itr).state == StoringState::kCompleted) {
-        Identity oldest_key((*itr).key);
-        NonEmptyString oldest_value;
-        RemoveFile((*itr).key, &oldest_value);
-        disk_store_.index.erase(itr);
-        kPopFunctor_(oldest_key, oldest_value);
-      }
-    } else {
-      // Rely on client of this class to call Delete until enough space becomes available
-      if (running_)
-        disk_store_.cond_var.wait(disk_store_lock);
-    }
+KeyValueBuffer::SharedValue KeyValueBuffer::EncodeForDisk(const SharedValue& value) const {
+  if (kDiskCompressionLevel_ == 0)
+    return value;
+  crypto::CompressedText compressed(crypto::Compress(*value, kDiskCompressionLevel_));
+  std::string stored;
+  if (compressed.string().size() < value->string().size()) {
+    stored.reserve(compressed.string().size() + 1);
+    stored.push_back(kCompressedTag);
+    stored.append(compressed.string());
+  } else {
+    stored.reserve(value->string().size() + 1);
+    stored.push_back(kUncompressedTag);
+    stored.append(value->string());
   }
+  return std::make_shared<const NonEmptyString>(std::move(stored));
 }
 
-NonEmptyString KeyValueBuffer::Get(const Identity& key) {
-  CheckWorkerIsStillRunning();
-  {
-    std::lock_guard<std::mutex> memory_store_lock(memory_store_.mutex);
-    auto itr(Find(memory_store_, key));
-    if (itr != memory_store_.index.end())
-      return (*itr).value;
-  }
-  std::unique_lock<std::mutex> disk_store_lock(disk_store_.mutex);
-  auto itr(FindAndThrowIfCancelled(key));
-  if ((*itr).state == StoringState::kStarted) {
-    disk_store_.cond_var.wait(disk_store_lock, [this, &key]()->bool {
-        auto itr(Find(disk_store_, key));
-        return (itr == disk_store_.index.end() || (*itr).state != StoringState::kStarted);
-    });
-    itr = FindAndThrowIfCancelled(key);
+NonEmptyString KeyValueBuffer::DecodeFromDisk(NonEmptyString stored) const {
+  if (kDiskCompressionLevel_ == 0)
+    return stored;
+  const std::string& encoded(stored.string());
+  if (encoded.size() < 2 || (encoded[0] != kCompressedTag && encoded[0] != kUncompressedTag)) {
+    LOG(kError) << "Value read from disk has an invalid encoding.";
+    ThrowError(CommonErrors::parsing_error);
   }
-  return ReadFile(GetFilename(key));
-  // TODO(Fraser#5#): 2012-11-23 - There should maybe be another background task moving the item
-  //                               from wherever it's found to the back of the memory index.
+  if (encoded[0] == kUncompressedTag)
+    return NonEmptyString(encoded.substr(1));
+  return crypto::Uncompress(crypto::CompressedText(encoded.substr(1)));
 }
 
-void KeyValueBuffer::Delete(const Identity& key) {
-  CheckWorkerIsStillRunning();
-  StoringState also_on_disk(StoringState::kNotStarted);
-  DeleteFromMemory(key, also_on_disk);
-  if (also_on_disk != StoringState::kNotStarted)
-    DeleteFromDisk(key);
+Identity KeyValueBuffer::ContentName(const SharedValue& stored) const {
+  // Any collision would serve one key's value for another, so the name must be a cryptographic
+  // hash of every byte written; a cheaper hash checked against the bytes already held would need
+  // those read back from disk.
+  if (!kDeduplicateDiskValues_)
+    return Identity();
+  return Identity(crypto::Hash<crypto::SHA512>(*stored));
 }
 
-void KeyValueBuffer::DeleteFromMemory(const Identity& key, StoringState& also_on_disk) {
-  bool changed(false);
-  {
-    std::lock_guard<std::mutex> memory_store_lock(memory_store_.mutex);
-    auto itr(Find(memory_store_, key));
-    if (itr != memory_store_.index.end()) {
-      also_on_disk = (*itr).also_on_disk;
-      memory_store_.current.data -= (*itr).value.string().size();
-      memory_store_.index.erase(itr);
-      changed = true;
-    } else {
-      // Assume it's on disk so as to invoke a DeleteFromDisk
-      also_on_disk = StoringState::kCompleted;
-    }
-  }
-  if (changed)
-    memory_store_.cond_var.notify_all();
+const Identity& KeyValueBuffer::DiskName(const DiskElement& element) {
+  return element.content.IsInitialised() ? element.content : element.key;
 }
 
-void KeyValueBuffer::DeleteFromDisk(const Identity& key) {
-  {
-    std::lock_guard<std::mutex> disk_store_lock(disk_store_.mutex);
-    auto itr(Find(disk_store_, key));
-    if (itr == disk_store_.index.end()) {
-      LOG(kError) << HexSubstr(key) << " is not in the disk index.";
-      ThrowError(CommonErrors::no_such_element);
-    }
-
-    if ((*itr).state == StoringState::kStarted) {
-      (*itr).state = StoringState::kCancelled;
-    } else if ((*itr).state == StoringState::kCompleted) {
-      RemoveFile((*itr).key, nullptr);
-      disk_store_.index.erase(itr);
-    }
+void KeyValueBuffer::CheckFitsOnDisk(const Identity& key, const uint64_t& required_space) {
+  // Called with the disk lock held.
+  if (required_space > disk_store_.max) {
+    LOG(kError) << "Cannot store " << HexSubstr(key) << " since its " << required_space
+                << " bytes exceeds max of " << disk_store_.max << " bytes.";
+    StopRunning();
+    ThrowError(CommonErrors::cannot_exceed_limit);
   }
-  disk_store_.cond_var.notify_all();
 }
 
-void KeyValueBuffer::RemoveFile(const Identity& key, NonEmptyString* value) {
-  fs::path path(GetFilename(key));
-  boost::system::error_code error_code;
-  uint64_t size(fs::file_size(path, error_code));
-  if (error_code) {
-    LOG(kError) << "Error getting file size of " << path << ": " << error_code.message();
-    ThrowError(CommonErrors::filesystem_io_error);
-  }
-  if (value)
-    *value = ReadFile(path);
-  if (!fs::remove(path, error_code) || error_code) {
-    LOG(kError) << "Error removing " << path << ": " << error_code.message();
-    ThrowError(CommonErrors::filesystem_io_error);
-  }
-  disk_store_.current.data -= size;
+bool KeyValueBuffer::AwaitingSpill(const Identity& key, uint64_t sequence) {
+  // Called with the disk lock held.
+  std::lock_guard<std::mutex> memory_store_lock(memory_store_.mutex);
+  auto itr(memory_store_.index.lookup.find(key));
+  return itr != memory_store_.index.lookup.end() &&
+         (*itr->second).also_on_disk == StoringState::kStarted &&
+         (*itr->second).sequence == sequence;
 }
 
-void KeyValueBuffer::CopyQueueToDisk() {
-  Identity key;
-  NonEmptyString value;
+KeyValueBuffer::DiskList::iterator KeyValueBuffer::RegisterOnDisk(const Identity& key,
+                                                                  const Identity& content,
+                                                                  uint64_t sequence,
+                                                                  uint64_t size) {
+  // Called with the disk lock held.
+  auto existing(disk_store_.index.lookup.find(key));
+  if (existing != disk_store_.index.lookup.end())
+    CancelOrRemoveFromDisk(existing->second);
+  disk_store_.index.storing.emplace_back(key, content, sequence, size);
+  disk_store_.index.unwritten.Add(size);
+  auto itr(std::prev(disk_store_.index.storing.end()));
+  disk_store_.index.lookup[key] = itr;
+  disk_key_order_->Insert((*itr).key, sequence);
+  AddToKeyFilter(key);
+  return itr;
+}
+
+KeyValueBuffer::Reservation KeyValueBuffer::ReserveSpaceOnDisk(
+    DiskList::iterator storing_itr,
+    const uint64_t& required_space,
+    std::unique_lock<std::mutex>& disk_store_lock,
+    bool holding_reservations) {
   for (;;) {
-    {
-      // Get oldest value not yet stored to disk
-      std::unique_lock<std::mutex> memory_store_lock(memory_store_.mutex);
-      auto itr(memory_store_.index.end());
-      memory_store_.cond_var.wait(memory_store_lock, [this, &itr]()->bool {
-          itr = FindOldestInMemoryOnly();
-          return itr != memory_store_.index.end() || !running_;
-      });
-      if (!running_)
-        return;
+    if ((*storing_itr).state == StoringState::kCancelled || !running_) {
+      UnregisterFromDisk(storing_itr);
+      return Reservation::kAbandoned;
+    }
 
-      key = (*itr).key;
-      value = (*itr).value;
-      (*itr).also_on_disk = StoringState::kStarted;
+    // The max may have been lowered below the value's size since it was registered, in which case
+    // the value can never be held, and the buffer fails as it would have on registering it.
+    if (required_space > disk_store_.max) {
+      LOG(kError) << "Cannot store " << HexSubstr((*storing_itr).key) << " since its "
+                  << required_space << " bytes exceeds max of " << disk_store_.max << " bytes.";
+      StopRunning();
+      continue;
     }
-    StoreOnDisk(key, value);
-    {
-      std::lock_guard<std::mutex> memory_store_lock(memory_store_.mutex);
-      auto itr(Find(memory_store_, key));
-      if (itr != memory_store_.index.end())
-        (*itr).also_on_disk = StoringState::kCompleted;
+
+    // A cancelled write of an earlier value for this key may still be in progress.
+    if (disk_store_.index.writing.count((*storing_itr).key) != 0) {
+      if (holding_reservations)
+        return Reservation::kWouldBlock;
+      disk_store_.cond_var.wait(disk_store_lock);
+      continue;
     }
-    memory_store_.cond_var.notify_all();
-  }
-}
 
-void KeyValueBuffer::CheckWorkerIsStillRunning() {
-  // if this goes ready then we have an exception so get that (throw basically)
-  if (worker_.wait_for(std::chrono::nanoseconds(1)) == std::future_status::ready &&
-      worker_.valid())
-     worker_.get();
-  if (!running_) {
-    LOG(kError) << "Worker is no longer running.";
-    ThrowError(CommonErrors::filesystem_io_error);
+    // Content already held for another key takes no more space, and content still being written
+    // for another key is waited for just like an earlier value for this key.
+    auto content((*storing_itr).content.IsInitialised() ?
+                 disk_store_.index.contents.find((*storing_itr).content) :
+                 disk_store_.index.contents.end());
+    if (content != disk_store_.index.contents.end() && !content->second.written) {
+      if (holding_reservations)
+        return Reservation::kWouldBlock;
+      disk_store_.cond_var.wait(disk_store_lock);
+      continue;
+    }
+
+    const bool kSharesContent(content != disk_store_.index.contents.end());
+    if (kSharesContent || HasSpace(disk_store_, required_space)) {
+      if (kSharesContent) {
+        ++content->second.references;
+        (*storing_itr).shares_content = true;
+      } else {
+        disk_store_.current.data += required_space;
+        if ((*storing_itr).content.IsInitialised())
+          disk_store_.index.contents.emplace((*storing_itr).content, Content(required_space));
+      }
+      disk_store_.index.writing.insert((*storing_itr).key);
+      disk_store_.index.unwritten.Remove((*storing_itr).size);
+      disk_store_.index.on_disk.splice(
+          SequencePosition(disk_store_.index.on_disk, (*storing_itr).sequence),
+          disk_store_.index.storing, storing_itr);
+      return Reservation::kReserved;
+    }
+
+    // Another thread is reading back the value it popped, and may free enough space.
+    if (disk_store_.index.popping) {
+      if (holding_reservations)
+        return Reservation::kWouldBlock;
+      disk_store_.cond_var.wait(disk_store_lock);
+      continue;
+    }
+
+    // If the pop functor has fallen behind, nothing more is popped.
+    const bool kPopQueueFull(kPopFunctor_ && PopQueueFull());
+    auto victim(kPopFunctor_ && !kPopQueueFull ? DiskEvictionCandidate() :
+                                                 disk_store_.index.on_disk.end());
+    if (victim != disk_store_.index.on_disk.end()) {
+      PopFromDisk(victim, disk_store_lock);
+    } else if (kPopQueueFull && !holding_reservations) {
+      disk_store_lock.unlock();
+      WaitForSpaceInPopQueue();
+      disk_store_lock.lock();
+    } else if (holding_reservations) {
+      // The oldest value may be one of the caller's own, which it has yet to write.
+      return Reservation::kWouldBlock;
+    } else {
+      // Rely on client of this class to call Delete until enough space becomes available, or on
+      // an in-progress write completing so that the oldest value can be popped.
+      disk_store_.cond_var.wait(disk_store_lock);
+    }
   }
 }
 
-void KeyValueBuffer::StopRunning() {
-  running_ = false;
-  memory_store_.cond_var.notify_all();
-  disk_store_.cond_var.notify_all();
+void KeyValueBuffer::UnregisterFromDisk(DiskList::iterator storing_itr) {
+  // Called with the disk lock held.
+  if ((*storing_itr).state != StoringState::kCancelled) {
+    disk_store_.index.lookup.erase((*storing_itr).key);
+    disk_key_order_->Erase((*storing_itr).key);
+    RemoveFromKeyFilter((*storing_itr).key);
+  } else {
+    // Deleted or replaced while waiting for space.
+    ++spills_skipped_;
+  }
+  disk_store_.index.unwritten.Remove((*storing_itr).size);
+  disk_store_.index.storing.erase(storing_itr);
 }
 
-void KeyValueBuffer::SetMaxMemoryUsage(MemoryUsage max_memory_usage) {
-  {
-    std::lock_guard<std::mutex> memory_store_lock(memory_store_.mutex);
-    if (max_memory_usage > disk_store_.max) {
-      LOG(kError) << "Max memory usage must be <= max disk usage.";
-      ThrowError(CommonErrors::invalid_parameter);
+void KeyValueBuffer::PopFromDisk(DiskList::iterator victim,
+                                 std::unique_lock<std::mutex>& disk_store_lock) {
+  // Called with the disk lock held, which is released while the value is read back.  The victim's
+  // space stays reserved until then, and its key stays in 'writing' so that a new value for it
+  // isn't written in the meantime.  A copy still held in memory saves reading it back.
+  const DiskElement kVictim(*victim);
+  disk_store_.index.lookup.erase(kVictim.key);
+  disk_key_order_->Erase(kVictim.key);
+  RemoveFromKeyFilter(kVictim.key);
+  disk_store_.index.on_disk.erase(victim);
+  SharedValue value(EraseMemoryCopy(kVictim.key));
+  if (!value) {
+    disk_store_.index.writing.insert(kVictim.key);
+    disk_store_.index.popping = true;
+    disk_store_lock.unlock();
+    std::exception_ptr read_error;
+    try {
+      value = std::make_shared<const NonEmptyString>(
+          DecodeFromDisk(disk_backend_->Get(DiskName(kVictim))));
+    }
+    catch(const std::exception&) {
+      read_error = std::current_exception();
+    }
+    disk_store_lock.lock();
+    disk_store_.index.writing.erase(kVictim.key);
+    disk_store_.index.popping = false;
+    disk_store_.cond_var.notify_all();
+    if (read_error) {
+      ReleaseDiskSpace(kVictim);
+      std::rethrow_exception(read_error);
     }
-    memory_store_.max = max_memory_usage;
   }
-  memory_store_.cond_var.notify_all();
+  RemoveFromBackend(kVictim, nullptr);
+  QueuePop(kVictim.key, value);
 }
 
-void KeyValueBuffer::SetMaxDiskUsage(DiskUsage max_disk_usage) {
-  bool increased(false);
-  {
-    std::lock_guard<std::mutex> disk_store_lock(disk_store_.mutex);
-    if (memory_store_.max > max_disk_usage) {
-      LOG(kError) << "Max memory usage must be <= max disk usage.";
-      ThrowError(CommonErrors::invalid_parameter);
-    }
-    increased = (max_disk_usage > disk_store_.max);
-    disk_store_.max = max_disk_usage;
+void KeyValueBuffer::WriteToBackend(const DiskElement& element, const SharedValue& stored) {
+  // Called without the disk lock, once the element's space is reserved.
+  if (element.shares_content) {
+    ++values_deduplicated_;
+    bytes_deduplicated_ += element.size;
+    return;
   }
-  if (increased)
-    disk_store_.cond_var.notify_all();
+  disk_backend_->Put(DiskName(element), *stored);
+  ++values_spilled_;
+  bytes_spilled_ += element.size;
 }
 
-fs::path KeyValueBuffer::GetFilename(const Identity& key) const {
-  return kDiskBuffer_ / EncodeToBase32(key);
+bool KeyValueBuffer::FinishWritingToDisk(DiskList::iterator itr) {
+  // Called with the disk lock held.
+  disk_store_.index.writing.erase((*itr).key);
+  if ((*itr).content.IsInitialised())
+    disk_store_.index.contents.at((*itr).content).written = true;
+  if ((*itr).state == StoringState::kCancelled) {
+    // Deleted or replaced while being written.
+    RemoveFromBackend(*itr, nullptr);
+    disk_store_.index.on_disk.erase(itr);
+    return false;
+  }
+  (*itr).state = StoringState::kCompleted;
+  if (disk_eviction_)
+    disk_eviction_->Add((*itr).key, (*itr).size);
+  return true;
 }
 
-template<typename T>
-bool KeyValueBuffer::HasSpace(const T& store, const uint64_t& required_space) {
-  assert(store.max >= required_space);
-  return store.current <= store.max - required_space;
+void KeyValueBuffer::AbandonWritingToDisk(DiskList::iterator itr) {
+  // Called with the disk lock held.
+  ReleaseDiskSpace(*itr);
+  disk_store_.index.writing.erase((*itr).key);
+  if ((*itr).state != StoringState::kCancelled) {
+    disk_store_.index.lookup.erase((*itr).key);
+    disk_key_order_->Erase((*itr).key);
+    RemoveFromKeyFilter((*itr).key);
+  }
+  disk_store_.index.on_disk.erase(itr);
+  StopRunning();
 }
 
-template<typename T>
-typename T::index_type::iterator KeyValueBuffer::Find(T& store, const Identity& key) {
-  return std::find_if(store.index.begin(),
-                      store.index.end(),
-                      [&key](const typename T::index_type::value_type& key_value) {
-                          return key_value.key == key;
-                      });
+bool KeyValueBuffer::CancelledBeforeWriting(DiskList::iterator itr) {
+  // Called without the disk lock, for an element whose space is reserved.  Such an element stays in
+  // 'on_disk' until the thread writing it erases it, so 'itr' remains valid.
+  std::lock_guard<std::mutex> disk_store_lock(disk_store_.mutex);
+  return (*itr).state == StoringState::kCancelled;
 }
 
-KeyValueBuffer::MemoryIndex::iterator KeyValueBuffer::FindOldestInMemoryOnly() {
-  return std::find_if(memory_store_.index.begin(),
-                      memory_store_.index.end(),
-                      [](const MemoryElement& key_value) {
-                          return key_value.also_on_disk == StoringState::kNotStarted;
-                      });
+void KeyValueBuffer::SkipWritingToDisk(DiskList::iterator itr) {
+  // Called with the disk lock held, for a cancelled element which was never written.
+  assert((*itr).state == StoringState::kCancelled);
+  ReleaseDiskSpace(*itr);
+  disk_store_.index.writing.erase((*itr).key);
+  disk_store_.index.on_disk.erase(itr);
+  ++spills_skipped_;
 }
 
-KeyValueBuffer::MemoryIndex::iterator KeyValueBuffer::FindMemoryRemovalCandidate(
-    const uint64_t& required_space,
-    std::unique_lock<std::mutex>& memory_store_lock) {
-  auto itr(memory_store_.index.end());
-  memory_store_.cond_var.wait(memory_store_lock, [this, &itr, &required_space]()->bool {
-      itr = std::find_if(memory_store_.index.begin(),
-                         memory_store_.index.end(),
-                         [](const MemoryElement& key_value) {
-                             return key_value.also_on_disk == StoringState::kCompleted;
-                         });
-      return itr != memory_store_.index.end() ||
+void KeyValueBuffer::ReleaseDiskSpace(const DiskElement& element) {
+  // Called with the disk lock held, for an element whose space is reserved.  Shared content's space
+  // is only freed along with the last element holding it.
+  if (!element.content.IsInitialised()) {
+    disk_store_.current.data -= element.size;
+    return;
+  }
+  auto content(disk_store_.index.contents.find(element.content));
+  assert(content != disk_store_.index.contents.end());
+  if (--content->second.references != 0)
+    return;
+  disk_store_.current.data -= content->second.size;
+  disk_store_.index.contents.erase(content);
+}
+
+NonEmptyString KeyValueBuffer::Get(const Identity& key) {
+  return *GetShared(key);
+}
+
+KeyValueBuffer::SharedValue KeyValueBuffer::GetShared(const Identity& key) {
+  CheckWorkerIsStillRunning();
+  RecordUse(key);
+  ThrowIfDefinitelyAbsent(key);
+  SharedValue value;
+  if (GetFromMemory(key, value))
+    return value;
+  if (!GetFromDisk(key, value)) {
+    LOG(kError) << HexSubstr(key) << " is not in the disk index or is cancelled.";
+    ThrowError(CommonErrors::no_such_element);
+  }
+  return value;
+}
+
+bool KeyValueBuffer::ReadFromDisk(const Identity& key,
+                                  const std::function<void(const Identity&, uint64_t)>& read,
+                                  uint64_t& sequence) {
+  for (;;) {
+    Identity name;
+    uint64_t size(0);
+    {
+      std::unique_lock<std::mutex> disk_store_lock(disk_store_.mutex);
+      WaitWhileStoring(key, disk_store_lock);
+      auto itr(disk_store_.index.lookup.find(key));
+      if (itr == disk_store_.index.lookup.end()) {
+        ++misses_;
+        return false;
+      }
+      name = DiskName(*itr->second);
+      size = (*itr->second).size;
+      sequence = (*itr->second).sequence;
+      if (disk_eviction_)
+        disk_eviction_->Touch(key);
+    }
+    // The backend is read without the lock, so the value may be deleted or replaced meanwhile.  A
+    // failed read is only reported if the value it was for is still the current one.
+    try {
+      read(name, size);
+      return true;
+    }
+    catch(...) {
+      std::lock_guard<std::mutex> disk_store_lock(disk_store_.mutex);
+      auto itr(disk_store_.index.lookup.find(key));
+      if (itr == disk_store_.index.lookup.end()) {
+        ++misses_;
+        return false;
+      }
+      if ((*itr->second).sequence == sequence)
+        throw;
+    }
+  }
+}
+
+KeyValueBuffer::ValueView KeyValueBuffer::GetView(const Identity& key) {
+  if (kDiskCompressionLevel_ != 0 || kPromoteDiskHits_)
+    return ViewOf(GetShared(key));
+  CheckWorkerIsStillRunning();
+  RecordUse(key);
+  ThrowIfDefinitelyAbsent(key);
+  SharedValue value;
+  if (GetFromMemory(key, value))
+    return ViewOf(value);
+
+  std::pair<std::shared_ptr<const char>, size_t> mapped;
+  uint64_t sequence(0);
+  if (!ReadFromDisk(key, [&](const Identity& name, uint64_t /*size*/) {
+                      mapped = disk_backend_->Map(name);
+                    }, sequence)) {
+    LOG(kError) << HexSubstr(key) << " is not in the disk index or is cancelled.";
+    ThrowError(CommonErrors::no_such_element);
+  }
+  ++disk_hits_;
+  return ValueView(mapped.first, mapped.second);
+}
+
+KeyValueBuffer::ValueView KeyValueBuffer::GetRange(const Identity& key,
+                                                   uint64_t offset,
+                                                   size_t length) {
+  // A compressed value has to be read whole to be uncompressed.
+  if (kDiskCompressionLevel_ != 0)
+    return RangeOf(GetShared(key), offset, length);
+  CheckWorkerIsStillRunning();
+  RecordUse(key);
+  ThrowIfDefinitelyAbsent(key);
+  SharedValue value;
+  if (GetFromMemory(key, value))
+    return RangeOf(value, offset, length);
+
+  std::pair<std::shared_ptr<const char>, size_t> range;
+  uint64_t sequence(0);
+  if (!ReadFromDisk(key, [&](const Identity& name, uint64_t size) {
+                      // Uncompressed, the size written is the value's own.
+                      range = disk_backend_->ReadRange(name, offset,
+                                                       RangeLength(size, offset, length));
+                    }, sequence)) {
+    LOG(kError) << HexSubstr(key) << " is not in the disk index or is cancelled.";
+    ThrowError(CommonErrors::no_such_element);
+  }
+  ++disk_hits_;
+  return ValueView(range.first, range.second);
+}
+
+bool KeyValueBuffer::TryGet(const Identity& key, NonEmptyString& value) {
+  CheckWorkerIsStillRunning();
+  RecordUse(key);
+  if (DefinitelyAbsent(key)) {
+    ++misses_;
+    return false;
+  }
+  SharedValue shared;
+  if (!GetFromMemory(key, shared) && !GetFromDisk(key, shared))
+    return false;
+  value = *shared;
+  return true;
+}
+
+bool KeyValueBuffer::Contains(const Identity& key) {
+  CheckWorkerIsStillRunning();
+  if (DefinitelyAbsent(key))
+    return false;
+  if (memory_read_index_->Contains(key))
+    return true;
+  // A value is only dropped from memory once it's on disk, so it can't be missed between the two.
+  std::lock_guard<std::mutex> disk_store_lock(disk_store_.mutex);
+  return disk_store_.index.lookup.count(key) != 0;
+}
+
+bool KeyValueBuffer::GetFromMemory(const Identity& key, SharedValue& value) {
+  // No lock is taken, so the read never waits for a writer.
+  if (!memory_read_index_->Find(key, value))
+    return false;
+  ++memory_hits_;
+  RecordMemoryUse(key);
+  RecordDiskUse(key);
+  return true;
+}
+
+bool KeyValueBuffer::GetFromDisk(const Identity& key, SharedValue& value) {
+  // Waits for the value if it's being written to disk.
+  NonEmptyString stored;
+  uint64_t sequence(0);
+  if (!ReadFromDisk(key, [&](const Identity& name, uint64_t /*size*/) {
+                      stored = disk_backend_->Get(name);
+                    }, sequence)) {
+    return false;
+  }
+  value = std::make_shared<const NonEmptyString>(DecodeFromDisk(std::move(stored)));
+  ++disk_hits_;
+  if (kPromoteDiskHits_)
+    QueuePromotion(key, value, sequence);
+  return true;
+}
+
+std::vector<NonEmptyString> KeyValueBuffer::GetBatch(const std::vector<Identity>& keys) {
+  CheckWorkerIsStillRunning();
+  std::vector<NonEmptyString> values(keys.size());
+  std::vector<size_t> not_in_memory;
+  for (size_t i(0); i != keys.size(); ++i) {
+    RecordUse(keys[i]);
+    if (DefinitelyAbsent(keys[i])) {
+      ++misses_;
+      continue;
+    }
+    SharedValue value;
+    if (GetFromMemory(keys[i], value))
+      values[i] = *value;
+    else
+      not_in_memory.push_back(i);
+  }
+  if (not_in_memory.empty())
+    return values;
+
+  // The values are found under a single taking of the disk lock, then read without it.
+  std::vector<Identity> names(keys.size());
+  std::vector<uint64_t> sequences(keys.size(), 0);
+  std::vector<size_t> on_disk;
+  {
+    std::unique_lock<std::mutex> disk_store_lock(disk_store_.mutex);
+    for (auto i : not_in_memory) {
+      auto itr(disk_store_.index.lookup.find(keys[i]));
+      if (itr != disk_store_.index.lookup.end() &&
+          (*itr->second).state == StoringState::kStarted) {
+        WaitWhileStoring(keys[i], disk_store_lock);
+        itr = disk_store_.index.lookup.find(keys[i]);
+      }
+      if (itr == disk_store_.index.lookup.end()) {
+        ++misses_;
+        continue;
+      }
+      names[i] = DiskName(*itr->second);
+      sequences[i] = (*itr->second).sequence;
+      on_disk.push_back(i);
+      if (disk_eviction_)
+        disk_eviction_->Touch(keys[i]);
+    }
+  }
+  for (auto i : on_disk) {
+    try {
+      values[i] = disk_backend_->Get(names[i]);
+    }
+    catch(...) {
+      // The value may have been deleted or replaced since it was found, so is looked up again.
+      if (!ReadFromDisk(keys[i], [&](const Identity& name, uint64_t /*size*/) {
+                          values[i] = disk_backend_->Get(name);
+                        }, sequences[i])) {
+        continue;
+      }
+    }
+    ++disk_hits_;
+  }
+  // Decompression is done without the lock.
+  if (kDiskCompressionLevel_ != 0) {
+    for (auto i : not_in_memory) {
+      if (values[i].IsInitialised())
+        values[i] = DecodeFromDisk(std::move(values[i]));
+    }
+  }
+  if (kPromoteDiskHits_) {
+    for (auto i : not_in_memory) {
+      if (values[i].IsInitialised())
+        QueuePromotion(keys[i], std::make_shared<const NonEmptyString>(values[i]), sequences[i]);
+    }
+  }
+  return values;
+}
+
+void KeyValueBuffer::WaitWhileStoring(const Identity& key,
+                                      std::unique_lock<std::mutex>& disk_store_lock) {
+  disk_store_.cond_var.wait(disk_store_lock, [this, &key]()->bool {
+      auto itr(disk_store_.index.lookup.find(key));
+      return (itr == disk_store_.index.lookup.end() ||
+              (*itr->second).state != StoringState::kStarted);
+  });
+}
+
+void KeyValueBuffer::Delete(const Identity& key) {
+  CheckWorkerIsStillRunning();
+  if (RemoveKeys(std::vector<Identity>(1, key)) == 0) {
+    LOG(kError) << HexSubstr(key) << " is not in the buffer.";
+    ThrowError(CommonErrors::no_such_element);
+  }
+}
+
+void KeyValueBuffer::DeleteBatch(const std::vector<Identity>& keys) {
+  CheckWorkerIsStillRunning();
+  RemoveKeys(keys);
+}
+
+KeyValueBuffer::ScanCursor KeyValueBuffer::BeginScan(const std::string& prefix) {
+  if (prefix.size() > kKeySize) {
+    LOG(kError) << "Scan prefix can't be longer than a key.";
+    ThrowError(CommonErrors::invalid_parameter);
+  }
+  CheckWorkerIsStillRunning();
+  ScanCursor cursor;
+  cursor.snapshot_ = next_sequence_;
+  cursor.prefix_ = prefix;
+  cursor.done_ = false;
+  return cursor;
+}
+
+std::vector<Identity> KeyValueBuffer::Scan(ScanCursor& cursor, size_t batch_size) {
+  if (batch_size == 0) {
+    LOG(kError) << "Scan batch size must be non-zero.";
+    ThrowError(CommonErrors::invalid_parameter);
+  }
+  CheckWorkerIsStillRunning();
+  std::vector<Identity> keys;
+  while (keys.empty() && !cursor.done_) {
+    // The buffers are searched one after the other rather than with both locks held.  A value
+    // leaves memory only once it's on disk, so a key held throughout is found in at least one.
+    std::vector<std::pair<Identity, uint64_t>> in_memory, on_disk;
+    bool memory_exhausted(false), disk_exhausted(false);
+    {
+      std::lock_guard<std::mutex> memory_store_lock(memory_store_.mutex);
+      memory_exhausted = memory_key_order_->Find(cursor.last_, cursor.prefix_, batch_size,
+                                                 in_memory);
+    }
+    {
+      std::lock_guard<std::mutex> disk_store_lock(disk_store_.mutex);
+      disk_exhausted = disk_key_order_->Find(cursor.last_, cursor.prefix_, batch_size, on_disk);
+    }
+
+    // Beyond the last key found in a buffer with more to give, that buffer hasn't been searched, so
+    // this batch mustn't go past the lower of those keys.
+    const Identity* limit(nullptr);
+    if (!memory_exhausted)
+      limit = &in_memory.back().first;
+    if (!disk_exhausted && (!limit || on_disk.back().first < *limit))
+      limit = &on_disk.back().first;
+
+    // Merge the two, taking the later sequence for a key in both: the memory value has replaced
+    // the disk one unless the two share a sequence, as a promoted copy is given that of the value
+    // it was copied from in memory_key_order_.
+    auto memory_itr(in_memory.begin()), disk_itr(on_disk.begin());
+    Identity last;
+    while ((memory_itr != in_memory.end() || disk_itr != on_disk.end()) &&
+           keys.size() != batch_size) {
+      std::pair<Identity, uint64_t> next;
+      if (disk_itr == on_disk.end() ||
+          (memory_itr != in_memory.end() && memory_itr->first < disk_itr->first)) {
+        next = *memory_itr++;
+      } else if (memory_itr == in_memory.end() || disk_itr->first < memory_itr->first) {
+        next = *disk_itr++;
+      } else {
+        next = std::make_pair(memory_itr->first, std::max(memory_itr->second, disk_itr->second));
+        ++memory_itr;
+        ++disk_itr;
+      }
+      if (limit && *limit < next.first)
+        break;
+      last = next.first;
+      // Values stored since the scan began have later sequences.
+      if (next.second < cursor.snapshot_)
+        keys.push_back(next.first);
+    }
+
+    if (keys.size() == batch_size)
+      cursor.last_ = last;
+    else if (limit)
+      cursor.last_ = *limit;
+    else
+      cursor.done_ = true;
+  }
+  return keys;
+}
+
+size_t KeyValueBuffer::RemoveKeys(const std::vector<Identity>& keys) {
+  std::vector<char> found(keys.size(), 0);
+  bool erased(false);
+  {
+    std::lock_guard<std::mutex> memory_store_lock(memory_store_.mutex);
+    for (size_t i(0); i != keys.size(); ++i) {
+      auto itr(memory_store_.index.lookup.find(keys[i]));
+      if (itr == memory_store_.index.lookup.end())
+        continue;
+      found[i] = 1;
+      EraseFromMemory(itr->second);
+      erased = true;
+    }
+  }
+  if (erased)
+    memory_store_.cond_var.notify_all();
+
+  // Every key is looked for on disk too, even one whose memory copy was never spilled: a spill
+  // writer may have already written an older value for the key which this memory copy replaced.
+  {
+    std::lock_guard<std::mutex> disk_store_lock(disk_store_.mutex);
+    for (size_t i(0); i != keys.size(); ++i) {
+      auto itr(disk_store_.index.lookup.find(keys[i]));
+      if (itr != disk_store_.index.lookup.end()) {
+        found[i] = 1;
+        CancelOrRemoveFromDisk(itr->second);
+      }
+    }
+  }
+  disk_store_.cond_var.notify_all();
+  return static_cast<size_t>(std::count(found.begin(), found.end(), 1));
+}
+
+void KeyValueBuffer::EraseFromMemory(MemoryList::iterator itr) {
+  if (memory_eviction_ && (*itr).also_on_disk == StoringState::kCompleted)
+    memory_eviction_->Remove((*itr).key);
+  // A value not yet taken by a spill writer is dropped without ever being written.
+  if ((*itr).also_on_disk == StoringState::kNotStarted)
+    ++spills_skipped_;
+  if ((*itr).also_on_disk != StoringState::kCompleted)
+    memory_store_.index.unwritten.Remove(MaxDiskSize((*itr).value));
+  memory_store_.current.data -= MemoryFootprint((*itr).value);
+  memory_store_.index.lookup.erase((*itr).key);
+  memory_key_order_->Erase((*itr).key);
+  memory_read_index_->Erase((*itr).key, (*itr).sequence);
+  RemoveFromKeyFilter((*itr).key);
+  MemoryListFor((*itr).also_on_disk).erase(itr);
+}
+
+void KeyValueBuffer::CancelOrRemoveFromDisk(DiskList::iterator itr) {
+  // Cancelled elements are left in their list for the thread storing them to erase.
+  disk_store_.index.lookup.erase((*itr).key);
+  disk_key_order_->Erase((*itr).key);
+  RemoveFromKeyFilter((*itr).key);
+  if ((*itr).state == StoringState::kStarted) {
+    (*itr).state = StoringState::kCancelled;
+  } else if ((*itr).state == StoringState::kCompleted) {
+    if (disk_eviction_)
+      disk_eviction_->Remove((*itr).key);
+    RemoveFromBackend(*itr, nullptr);
+    EraseMemoryCopy((*itr).key);
+    disk_store_.index.on_disk.erase(itr);
+  }
+}
+
+void KeyValueBuffer::RemoveFromBackend(const DiskElement& element, NonEmptyString* value) {
+  // The element's size is that written, so the backend needn't be asked for it.  Content still held
+  // for another key is left in place, and only read if the value is wanted.
+  const auto kContent(element.content.IsInitialised() ?
+                      disk_store_.index.contents.find(element.content) :
+                      disk_store_.index.contents.end());
+  if (kContent != disk_store_.index.contents.end() && kContent->second.references > 1) {
+    if (value)
+      *value = disk_backend_->Get(element.content);
+  } else {
+    disk_backend_->Remove(DiskName(element), value);
+  }
+  ReleaseDiskSpace(element);
+}
+
+void KeyValueBuffer::CopyQueueToDisk() {
+  std::vector<MemoryElement> batch;
+  try {
+    for (;;) {
+      batch.clear();
+      uint64_t batch_number(0);
+      bool expired(false);
+      {
+        // Take the oldest values not yet stored to disk
+        std::unique_lock<std::mutex> memory_store_lock(memory_store_.mutex);
+        memory_store_.cond_var.wait(memory_store_lock, [this]()->bool {
+            return !memory_store_.index.not_on_disk.empty() || !running_;
+        });
+        if (!running_)
+          return;
+
+        const Clock::time_point kNow(Clock::now());
+        while (!memory_store_.index.not_on_disk.empty() && batch.size() < kSpillBatchSize_) {
+          auto itr(memory_store_.index.not_on_disk.begin());
+          // An expired value is dropped rather than spilled, ahead of the expirer.
+          if ((*itr).expiry <= kNow) {
+            EraseFromMemory(itr);
+            ++expirations_;
+            expired = true;
+            continue;
+          }
+          (*itr).also_on_disk = StoringState::kStarted;
+          batch.push_back(*itr);
+          memory_store_.index.storing_to_disk.splice(memory_store_.index.storing_to_disk.end(),
+                                                     memory_store_.index.not_on_disk, itr);
+        }
+        if (!batch.empty())
+          batch_number = spill_batches_taken_++;
+      }
+      if (expired)
+        memory_store_.cond_var.notify_all();
+      if (!batch.empty())
+        SpillBatch(batch, batch_number);
+    }
+  }
+  catch(...) {
+    {
+      std::lock_guard<std::mutex> worker_error_lock(worker_error_mutex_);
+      if (!worker_error_)
+        worker_error_ = std::current_exception();
+    }
+    StopRunning();
+  }
+}
+
+void KeyValueBuffer::SpillBatch(const std::vector<MemoryElement>& batch, uint64_t batch_number) {
+  // Values are compressed and hashed (if enabled) before taking the lock, so that writers do it in
+  // parallel.
+  std::vector<SharedValue> stored;
+  std::vector<Identity> contents;
+  stored.reserve(batch.size());
+  contents.reserve(batch.size());
+  for (auto& element : batch) {
+    stored.push_back(EncodeForDisk(element.value));
+    contents.push_back(ContentName(stored.back()));
+  }
+
+  std::unique_lock<std::mutex> disk_store_lock(disk_store_.mutex);
+  // Batches reserve their space in the order they were taken from memory, so that 'on_disk' is
+  // only ever appended to by spills and values are popped in the order they were stored.
+  disk_store_.cond_var.wait(disk_store_lock, [this, batch_number]()->bool {
+      return spill_batches_reserved_ == batch_number || !running_;
+  });
+
+  // Each reservation holds the index into 'batch' and 'stored' of the value it's for.
+  std::vector<std::pair<size_t, DiskList::iterator>> reserved;
+  size_t next(0);
+  bool registered(false);
+  DiskList::iterator storing_itr;
+  while (running_ && next != batch.size()) {
+    // Reserve space for as much of the batch as can be had without waiting on its own writes.
+    reserved.clear();
+    while (running_ && next != batch.size()) {
+      const MemoryElement& element(batch[next]);
+      const uint64_t required_space(stored[next]->string().size());
+      if (!registered) {
+        CheckFitsOnDisk(element.key, required_space);
+        // The value may have been deleted or replaced since the batch was taken from memory, in
+        // which case the disk index has already been checked for it and it mustn't be added now.
+        if (!AwaitingSpill(element.key, element.sequence)) {
+          ++spills_skipped_;
+          ++next;
+          continue;
+        }
+        storing_itr = RegisterOnDisk(element.key, contents[next], element.sequence,
+                                     required_space);
+        registered = true;
+      }
+      Reservation reservation(ReserveSpaceOnDisk(storing_itr, required_space, disk_store_lock,
+                                                 !reserved.empty()));
+      if (reservation == Reservation::kWouldBlock)
+        break;
+      registered = false;
+      if (reservation == Reservation::kReserved)
+        reserved.emplace_back(next, storing_itr);
+      ++next;
+    }
+
+    // Write the reserved values without the lock, so that other writers can proceed.  A value
+    // deleted or replaced since its space was reserved is dropped rather than written.
+    disk_store_lock.unlock();
+    std::vector<char> written(reserved.size(), 0);
+    size_t current(0);
+    try {
+      for (; current != reserved.size(); ++current) {
+        if (CancelledBeforeWriting(reserved[current].second))
+          continue;
+        WriteToBackend(*reserved[current].second, stored[reserved[current].first]);
+        written[current] = 1;
+      }
+    }
+    catch(const std::exception& e) {
+      LOG(kError) << "Failed to move " << HexSubstr(batch[reserved[current].first].key)
+                  << " to disk: " << e.what();
+      disk_store_lock.lock();
+      for (size_t i(0); i != reserved.size(); ++i) {
+        if (written[i]) {
+          FinishWritingToDisk(reserved[i].second);
+        } else {
+          AbandonWritingToDisk(reserved[i].second);
+        }
+      }
+      disk_store_lock.unlock();
+      disk_store_.cond_var.notify_all();
+      ThrowError(CommonErrors::filesystem_io_error);
+    }
+
+    disk_store_lock.lock();
+    std::vector<const MemoryElement*> spilled;
+    for (size_t i(0); i != reserved.size(); ++i) {
+      if (!written[i])
+        SkipWritingToDisk(reserved[i].second);
+      else if (FinishWritingToDisk(reserved[i].second))
+        spilled.push_back(&batch[reserved[i].first]);
+    }
+    disk_store_lock.unlock();
+    disk_store_.cond_var.notify_all();
+    for (auto element : spilled)
+      MarkSpilled(*element);
+    disk_store_lock.lock();
+  }
+
+  if (registered)
+    UnregisterFromDisk(storing_itr);
+  ++spill_batches_reserved_;
+  disk_store_lock.unlock();
+  disk_store_.cond_var.notify_all();
+}
+
+void KeyValueBuffer::MarkSpilled(const MemoryElement& element) {
+  {
+    std::lock_guard<std::mutex> memory_store_lock(memory_store_.mutex);
+    auto itr(memory_store_.index.lookup.find(element.key));
+    // If the key has been deleted and re-stored meanwhile, the lookup holds a different element.
+    if (itr != memory_store_.index.lookup.end() &&
+        (*itr->second).also_on_disk == StoringState::kStarted &&
+        (*itr->second).sequence == element.sequence) {
+      (*itr->second).also_on_disk = StoringState::kCompleted;
+      memory_store_.index.unwritten.Remove(MaxDiskSize(element.value));
+      memory_store_.index.on_disk.splice(
+          SequencePosition(memory_store_.index.on_disk, element.sequence),
+          memory_store_.index.storing_to_disk, itr->second);
+      if (memory_eviction_)
+        memory_eviction_->Add(element.key, MemoryFootprint(element.value));
+    }
+  }
+  memory_store_.cond_var.notify_all();
+}
+
+bool KeyValueBuffer::PopQueueFull() {
+  std::lock_guard<std::mutex> pop_lock(pop_mutex_);
+  return undelivered_pops_ >= kPopQueueSize_;
+}
+
+void KeyValueBuffer::WaitForSpaceInPopQueue() {
+  std::unique_lock<std::mutex> pop_lock(pop_mutex_);
+  pop_cond_var_.wait(pop_lock, [this]()->bool {
+      return undelivered_pops_ < kPopQueueSize_ || !running_;
+  });
+}
+
+void KeyValueBuffer::QueuePop(const Identity& key, const SharedValue& value) {
+  {
+    std::lock_guard<std::mutex> pop_lock(pop_mutex_);
+    pop_queue_.emplace_back(key, value);
+    ++undelivered_pops_;
+  }
+  pop_cond_var_.notify_all();
+}
+
+void KeyValueBuffer::DeliverPops() {
+  std::deque<std::pair<Identity, SharedValue>> batch;
+  for (;;) {
+    {
+      std::unique_lock<std::mutex> pop_lock(pop_mutex_);
+      pop_cond_var_.wait(pop_lock, [this]()->bool {
+          return !pop_queue_.empty() || !running_;
+      });
+      // Values popped before stopping are still delivered.
+      if (pop_queue_.empty())
+        return;
+      batch.swap(pop_queue_);
+    }
+    for (auto& popped : batch) {
+      try {
+        kPopFunctor_(popped.first, *popped.second);
+      }
+      catch(const std::exception& e) {
+        LOG(kError) << "Pop functor threw for " << HexSubstr(popped.first) << ": " << e.what();
+      }
+    }
+    {
+      std::lock_guard<std::mutex> pop_lock(pop_mutex_);
+      undelivered_pops_ -= batch.size();
+    }
+    pop_cond_var_.notify_all();
+    batch.clear();
+  }
+}
+
+void KeyValueBuffer::QueuePromotion(const Identity& key,
+                                    const SharedValue& value,
+                                    uint64_t sequence) {
+  if (ExceedsAdmissionSize(value))
+    return;
+  {
+    std::lock_guard<std::mutex> promotion_lock(promotion_mutex_);
+    if (promotion_queue_.size() >= kMaxQueuedPromotions)
+      return;
+    promotion_queue_.emplace_back(key, value, sequence);
+  }
+  promotion_cond_var_.notify_one();
+}
+
+void KeyValueBuffer::PromoteDiskHits() {
+  for (;;) {
+    Promotion hit;
+    {
+      std::unique_lock<std::mutex> promotion_lock(promotion_mutex_);
+      promotion_cond_var_.wait(promotion_lock, [this]()->bool {
+          return !promotion_queue_.empty() || !running_;
+      });
+      if (!running_)
+        return;
+      hit = promotion_queue_.front();
+      promotion_queue_.pop_front();
+    }
+    try {
+      Promote(hit);
+    }
+    catch(const std::exception& e) {
+      LOG(kWarning) << "Failed to promote " << HexSubstr(hit.key) << ": " << e.what();
+    }
+  }
+}
+
+void KeyValueBuffer::Promote(const Promotion& hit) {
+  const Identity& key(hit.key);
+  const SharedValue& value(hit.value);
+  uint64_t required_space(MemoryFootprint(value));
+  {
+    // The disk lock is held throughout so that the value can't be deleted or replaced while it's
+    // being copied; removal of a disk value also removes any memory copy of it (EraseMemoryCopy).
+    // The value read may have been replaced since, in which case it's not promoted.
+    std::lock_guard<std::mutex> disk_store_lock(disk_store_.mutex);
+    auto disk_itr(disk_store_.index.lookup.find(key));
+    if (disk_itr == disk_store_.index.lookup.end() ||
+        (*disk_itr->second).state != StoringState::kCompleted ||
+        (*disk_itr->second).sequence != hit.sequence) {
+      return;
+    }
+    std::lock_guard<std::mutex> memory_store_lock(memory_store_.mutex);
+    if (!running_ || memory_store_.index.lookup.find(key) != memory_store_.index.lookup.end() ||
+        !MakeSpaceInMemory(required_space)) {
+      return;
+    }
+
+    // The promoted copy is treated as the most recently stored value.
+    uint64_t sequence(next_sequence_++);
+    memory_store_.current.data += required_space;
+    auto itr(memory_store_.index.on_disk.emplace(
+        SequencePosition(memory_store_.index.on_disk, sequence), key, value, sequence));
+    (*itr).also_on_disk = StoringState::kCompleted;
+    memory_store_.index.lookup[key] = itr;
+    // A scan sees the copy as the value it was copied from.
+    memory_key_order_->Insert((*itr).key, (*disk_itr->second).sequence);
+    memory_read_index_->Insert(key, sequence, value);
+    AddToKeyFilter(key);
+    if (memory_eviction_)
+      memory_eviction_->Add(key, required_space);
+    ++promotions_;
+  }
+  memory_store_.cond_var.notify_all();
+}
+
+KeyValueBuffer::SharedValue KeyValueBuffer::EraseMemoryCopy(const Identity& key) {
+  // Called with the disk lock held, when the disk value is removed.  Returns the erased copy.
+  SharedValue value;
+  {
+    std::lock_guard<std::mutex> memory_store_lock(memory_store_.mutex);
+    auto itr(memory_store_.index.lookup.find(key));
+    if (itr == memory_store_.index.lookup.end() ||
+        (*itr->second).also_on_disk != StoringState::kCompleted) {
+      return value;
+    }
+    value = (*itr->second).value;
+    EraseFromMemory(itr->second);
+  }
+  memory_store_.cond_var.notify_all();
+  return value;
+}
+
+KeyValueBuffer::Clock::time_point KeyValueBuffer::ExpiryFor(
+    std::chrono::milliseconds time_to_live) const {
+  if (time_to_live <= std::chrono::milliseconds(0))
+    return Clock::time_point::max();
+  return Clock::now() + time_to_live;
+}
+
+void KeyValueBuffer::ScheduleExpiry(const Identity& key,
+                                    uint64_t sequence,
+                                    Clock::time_point expiry) {
+  // Called with the memory or disk lock held.
+  {
+    std::lock_guard<std::mutex> expiry_lock(expiry_mutex_);
+    if (!expiry_wheel_) {
+      expiry_wheel_.reset(new detail::TimingWheel(kExpiryTick, Clock::now()));
+      expirer_ = std::async(std::launch::async, &KeyValueBuffer::ExpireValues, this);
+    }
+    expiry_wheel_->Add(key, sequence, expiry);
+  }
+  expiry_cond_var_.notify_one();
+}
+
+void KeyValueBuffer::ExpireValues() {
+  for (;;) {
+    std::vector<std::pair<Identity, uint64_t>> expired;
+    {
+      std::unique_lock<std::mutex> expiry_lock(expiry_mutex_);
+      if (!running_)
+        return;
+      // Woken early when a value is scheduled, in case it expires sooner.
+      const Clock::time_point kNextExpiry(expiry_wheel_->NextExpiry());
+      if (kNextExpiry == Clock::time_point::max())
+        expiry_cond_var_.wait(expiry_lock);
+      else
+        expiry_cond_var_.wait_until(expiry_lock, kNextExpiry);
+      if (!running_)
+        return;
+      expired = expiry_wheel_->Advance(Clock::now());
+    }
+    if (expired.empty())
+      continue;
+    try {
+      Expire(expired);
+    }
+    catch(const std::exception& e) {
+      LOG(kWarning) << "Failed to remove expired values: " << e.what();
+    }
+  }
+}
+
+void KeyValueBuffer::Expire(const std::vector<std::pair<Identity, uint64_t>>& expired) {
+  // Only the value each entry was scheduled for is removed; a key may have been re-stored since.
+  std::vector<char> found(expired.size(), 0);
+  bool erased(false);
+  {
+    std::lock_guard<std::mutex> memory_store_lock(memory_store_.mutex);
+    for (size_t i(0); i != expired.size(); ++i) {
+      auto itr(memory_store_.index.lookup.find(expired[i].first));
+      if (itr == memory_store_.index.lookup.end() ||
+          (*itr->second).sequence != expired[i].second) {
+        continue;
+      }
+      found[i] = 1;
+      EraseFromMemory(itr->second);
+      erased = true;
+    }
+  }
+  if (erased)
+    memory_store_.cond_var.notify_all();
+
+  {
+    std::lock_guard<std::mutex> disk_store_lock(disk_store_.mutex);
+    for (size_t i(0); i != expired.size(); ++i) {
+      auto itr(disk_store_.index.lookup.find(expired[i].first));
+      if (itr != disk_store_.index.lookup.end() &&
+          (*itr->second).sequence == expired[i].second) {
+        found[i] = 1;
+        CancelOrRemoveFromDisk(itr->second);
+      }
+    }
+  }
+  disk_store_.cond_var.notify_all();
+  expirations_ += static_cast<uint64_t>(std::count(found.begin(), found.end(), 1));
+}
+
+std::future<void> KeyValueBuffer::StoreAsync(const Identity& key, const NonEmptyString& value) {
+  std::shared_ptr<std::promise<void>> promise(std::make_shared<std::promise<void>>());
+  DoStoreAsync(key, std::make_shared<const NonEmptyString>(value),
+               [promise](std::exception_ptr error) {
+      if (error)
+        promise->set_exception(error);
+      else
+        promise->set_value();
+  });
+  return promise->get_future();
+}
+
+std::future<NonEmptyString> KeyValueBuffer::GetAsync(const Identity& key) {
+  std::shared_ptr<std::promise<NonEmptyString>> promise(
+      std::make_shared<std::promise<NonEmptyString>>());
+  DoGetAsync(key, [promise](std::exception_ptr error, const NonEmptyString& value) {
+      if (error)
+        promise->set_exception(error);
+      else
+        promise->set_value(value);
+  });
+  return promise->get_future();
+}
+
+void KeyValueBuffer::StoreAsync(const Identity& key,
+                                const NonEmptyString& value,
+                                boost::asio::io_service& io_service,
+                                StoreHandler handler) {
+  DoStoreAsync(key, std::make_shared<const NonEmptyString>(value),
+               [&io_service, handler](std::exception_ptr error) {
+      io_service.post([handler, error] { handler(error); });
+  });
+}
+
+void KeyValueBuffer::GetAsync(const Identity& key,
+                              boost::asio::io_service& io_service,
+                              GetHandler handler) {
+  DoGetAsync(key, [&io_service, handler](std::exception_ptr error, const NonEmptyString& value) {
+      io_service.post([handler, error, value] { handler(error, value); });
+  });
+}
+
+void KeyValueBuffer::DoStoreAsync(const Identity& key,
+                                  const SharedValue& value,
+                                  StoreHandler on_completion) {
+  // Only an operation which can be completed in memory is done on the caller's thread.
+  if (!AsyncOperationsPending()) {
+    try {
+      CheckWorkerIsStillRunning();
+      if (TryStoreInMemory(key, value))
+        return on_completion(std::exception_ptr());
+    }
+    catch(...) {
+      return on_completion(std::current_exception());
+    }
+  }
+  QueueAsync(value->string().size(), [this, key, value, on_completion] {
+      std::exception_ptr error;
+      try {
+        Store(key, value);
+      }
+      catch(...) {
+        error = std::current_exception();
+      }
+      FinishAsync(value->string().size());
+      on_completion(error);
+  });
+}
+
+void KeyValueBuffer::DoGetAsync(const Identity& key, GetHandler on_completion) {
+  if (!AsyncOperationsPending()) {
+    try {
+      CheckWorkerIsStillRunning();
+      SharedValue value;
+      ThrowIfDefinitelyAbsent(key);
+      if (GetFromMemory(key, value)) {
+        RecordUse(key);
+        return on_completion(std::exception_ptr(), *value);
+      }
+    }
+    catch(...) {
+      RecordUse(key);
+      return on_completion(std::current_exception(), NonEmptyString());
+    }
+  }
+  QueueAsync(0, [this, key, on_completion] {
+      std::exception_ptr error;
+      SharedValue value;
+      try {
+        value = GetShared(key);
+      }
+      catch(...) {
+        error = std::current_exception();
+      }
+      FinishAsync(0);
+      on_completion(error, value ? *value : NonEmptyString());
+  });
+}
+
+bool KeyValueBuffer::AsyncOperationsPending() {
+  std::lock_guard<std::mutex> async_lock(async_mutex_);
+  return pending_async_operations_ != 0;
+}
+
+// 'operation' must call FinishAsync before reporting its result, so that callers which have seen
+// all their operations complete find nothing queued.
+void KeyValueBuffer::QueueAsync(uint64_t value_size, std::function<void()> operation) {
+  bool crossed_high_water(false);
+  {
+    std::lock_guard<std::mutex> async_lock(async_mutex_);
+    ++pending_async_operations_;
+    pending_async_bytes_ += value_size;
+    if (kAsyncHighWaterMark_ != 0 && !above_high_water_ &&
+        pending_async_bytes_ > kAsyncHighWaterMark_) {
+      above_high_water_ = crossed_high_water = true;
+    }
+    if (!async_active_)
+      async_active_.reset(new Active);
+    async_active_->Send(operation);
+  }
+  if (crossed_high_water && kBackpressureFunctor_)
+    ReportBackpressure();
+}
+
+void KeyValueBuffer::FinishAsync(uint64_t value_size) {
+  bool crossed_low_water(false);
+  {
+    std::lock_guard<std::mutex> async_lock(async_mutex_);
+    --pending_async_operations_;
+    pending_async_bytes_ -= value_size;
+    if (above_high_water_ && pending_async_bytes_ <= kAsyncHighWaterMark_ / 2) {
+      above_high_water_ = false;
+      crossed_low_water = true;
+    }
+  }
+  if (crossed_low_water && kBackpressureFunctor_)
+    ReportBackpressure();
+}
+
+void KeyValueBuffer::ReportBackpressure() {
+  // A crossing is reported after async_mutex_ is released, so the Active thread can cross back
+  // before it is.  Reporting the current state, and only if it differs from the last one reported,
+  // keeps the calls in order and leaves the functor with the latest state.
+  std::lock_guard<std::mutex> backpressure_lock(backpressure_mutex_);
+  bool above(false);
+  {
+    std::lock_guard<std::mutex> async_lock(async_mutex_);
+    above = above_high_water_;
+  }
+  if (above == backpressure_reported_)
+    return;
+  backpressure_reported_ = above;
+  kBackpressureFunctor_(above);
+}
+
+void KeyValueBuffer::CheckWorkerIsStillRunning() {
+  if (running_)
+    return;
+  // If a worker has thrown, rethrow its exception.
+  std::exception_ptr worker_error;
+  {
+    std::lock_guard<std::mutex> worker_error_lock(worker_error_mutex_);
+    worker_error = worker_error_;
+  }
+  if (worker_error)
+    std::rethrow_exception(worker_error);
+  LOG(kError) << "Worker is no longer running.";
+  ThrowError(CommonErrors::filesystem_io_error);
+}
+
+void KeyValueBuffer::StopRunning() {
+  running_ = false;
+  memory_store_.cond_var.notify_all();
+  disk_store_.cond_var.notify_all();
+  { std::lock_guard<std::mutex> promotion_lock(promotion_mutex_); }  // NOLINT (Fraser)
+  promotion_cond_var_.notify_all();
+  { std::lock_guard<std::mutex> pop_lock(pop_mutex_); }  // NOLINT (Fraser)
+  pop_cond_var_.notify_all();
+  { std::lock_guard<std::mutex> expiry_lock(expiry_mutex_); }  // NOLINT (Fraser)
+  expiry_cond_var_.notify_all();
+}
+
+void KeyValueBuffer::SetMaxMemoryUsage(MemoryUsage max_memory_usage) {
+  {
+    std::lock_guard<std::mutex> memory_store_lock(memory_store_.mutex);
+    if (max_memory_usage > disk_store_.max) {
+      LOG(kError) << "Max memory usage must be <= max disk usage.";
+      ThrowError(CommonErrors::invalid_parameter);
+    }
+    memory_store_.max = max_memory_usage;
+  }
+  memory_store_.cond_var.notify_all();
+}
+
+void KeyValueBuffer::SetMaxDiskUsage(DiskUsage max_disk_usage) {
+  {
+    std::lock_guard<std::mutex> disk_store_lock(disk_store_.mutex);
+    if (memory_store_.max > max_disk_usage) {
+      LOG(kError) << "Max memory usage must be <= max disk usage.";
+      ThrowError(CommonErrors::invalid_parameter);
+    }
+    disk_store_.max = max_disk_usage;
+  }
+  // Waiters for space check the new max, whether it's been raised or lowered.
+  disk_store_.cond_var.notify_all();
+}
+
+MemoryUsage KeyValueBuffer::max_memory_usage() {
+  std::lock_guard<std::mutex> memory_store_lock(memory_store_.mutex);
+  return memory_store_.max;
+}
+
+DiskUsage KeyValueBuffer::max_disk_usage() {
+  std::lock_guard<std::mutex> disk_store_lock(disk_store_.mutex);
+  return disk_store_.max;
+}
+
+MemoryUsage KeyValueBuffer::CurrentMemoryUsage() {
+  std::lock_guard<std::mutex> memory_store_lock(memory_store_.mutex);
+  return memory_store_.current;
+}
+
+DiskUsage KeyValueBuffer::CurrentDiskUsage() {
+  std::lock_guard<std::mutex> disk_store_lock(disk_store_.mutex);
+  return disk_store_.current;
+}
+
+DiskUsage KeyValueBuffer::RequiredDiskUsage() {
+  std::lock_guard<std::mutex> disk_store_lock(disk_store_.mutex);
+  std::lock_guard<std::mutex> memory_store_lock(memory_store_.mutex);
+  return DiskUsage(disk_store_.current.data + disk_store_.index.unwritten.total +
+                   memory_store_.index.unwritten.total);
+}
+
+uint64_t KeyValueBuffer::LargestUnwrittenValue() {
+  std::lock_guard<std::mutex> disk_store_lock(disk_store_.mutex);
+  std::lock_guard<std::mutex> memory_store_lock(memory_store_.mutex);
+  return std::max(disk_store_.index.unwritten.largest, memory_store_.index.unwritten.largest);
+}
+
+KeyValueBuffer::Stats KeyValueBuffer::stats() const {
+  Stats result;
+  result.memory_hits = memory_hits_;
+  result.disk_hits = disk_hits_;
+  result.misses = misses_;
+  result.promotions = promotions_;
+  result.bytes_spilled = bytes_spilled_;
+  result.values_spilled = values_spilled_;
+  result.spills_skipped = spills_skipped_;
+  result.expirations = expirations_;
+  result.admissions_bypassed = admissions_bypassed_;
+  result.admissions_refused = admissions_refused_;
+  result.values_deduplicated = values_deduplicated_;
+  result.bytes_deduplicated = bytes_deduplicated_;
+  return result;
+}
+
+template<typename T>
+bool KeyValueBuffer::HasSpace(const T& store, const uint64_t& required_space) {
+  // The max may have been lowered below required_space since the caller checked it.
+  return required_space <= store.max && store.current <= store.max - required_space;
+}
+
+KeyValueBuffer::MemoryList& KeyValueBuffer::MemoryListFor(StoringState also_on_disk) {
+  switch (also_on_disk) {
+    case StoringState::kNotStarted:
+      return memory_store_.index.not_on_disk;
+    case StoringState::kStarted:
+      return memory_store_.index.storing_to_disk;
+    default:
+      assert(also_on_disk == StoringState::kCompleted);
+      return memory_store_.index.on_disk;
+  }
+}
+
+KeyValueBuffer::MemoryList::iterator KeyValueBuffer::FindMemoryRemovalCandidate(
+    const uint64_t& required_space,
+    std::unique_lock<std::mutex>& memory_store_lock) {
+  memory_store_.cond_var.wait(memory_store_lock, [this, &required_space]()->bool {
+      return !memory_store_.index.on_disk.empty() ||
              HasSpace(memory_store_, required_space) ||
+             required_space > memory_store_.max ||
              !running_;
   });
-  return itr;
+  if (memory_store_.index.on_disk.empty() || HasSpace(memory_store_, required_space) ||
+      required_space > memory_store_.max) {
+    return memory_store_.index.on_disk.end();
+  }
+  return MemoryEvictionCandidate();
+}
+
+KeyValueBuffer::MemoryList::iterator KeyValueBuffer::MemoryEvictionCandidate() {
+  // Called with the memory lock held, when memory_store_.index.on_disk isn't empty.
+  if (!memory_eviction_)
+    return memory_store_.index.on_disk.begin();
+  pending_memory_touches_->Apply(*memory_eviction_);
+  // The policy only holds keys in on_disk, so the key is always in the lookup table.
+  auto itr(memory_store_.index.lookup.find(memory_eviction_->Pop()));
+  assert(itr != memory_store_.index.lookup.end());
+  return itr->second;
+}
+
+KeyValueBuffer::DiskList::iterator KeyValueBuffer::DiskEvictionCandidate() {
+  // Called with the disk lock held.  Returns on_disk.end() if no value can be popped yet.
+  if (disk_eviction_) {
+    pending_disk_touches_->Apply(*disk_eviction_);
+    if (disk_eviction_->empty())
+      return disk_store_.index.on_disk.end();
+    auto itr(disk_store_.index.lookup.find(disk_eviction_->Pop()));
+    assert(itr != disk_store_.index.lookup.end());
+    return itr->second;
+  }
+  // The oldest value is only popped once it has been written, so that pop order is kept.
+  auto oldest(disk_store_.index.on_disk.begin());
+  if (oldest != disk_store_.index.on_disk.end() && (*oldest).state != StoringState::kCompleted)
+    return disk_store_.index.on_disk.end();
+  return oldest;
 }
 
-KeyValueBuffer::DiskIndex::iterator KeyValueBuffer::FindStartedToStoreOnDisk(const Identity& key) {
-  return std::find_if(disk_store_.index.begin(),
-                      disk_store_.index.end(),
-                      [&key](const DiskElement& entry) {
-                          return entry.state == StoringState::kStarted && entry.key == key;
-                      });
+void KeyValueBuffer::RecordMemoryUse(const Identity& key) {
+  // If the pending reads are piling up, record them now unless a writer holds the lock.
+  if (pending_memory_touches_ && pending_memory_touches_->Record(key)) {
+    std::unique_lock<std::mutex> memory_store_lock(memory_store_.mutex, std::try_to_lock);
+    if (memory_store_lock.owns_lock())
+      pending_memory_touches_->Apply(*memory_eviction_);
+  }
 }
 
-KeyValueBuffer::DiskIndex::iterator KeyValueBuffer::FindOldestOnDisk() {
-  return disk_store_.index.begin();
+void KeyValueBuffer::RecordDiskUse(const Identity& key) {
+  // A value read from memory may still be popped from disk, taking the memory copy with it.
+  if (pending_disk_touches_ && pending_disk_touches_->Record(key)) {
+    std::unique_lock<std::mutex> disk_store_lock(disk_store_.mutex, std::try_to_lock);
+    if (disk_store_lock.owns_lock())
+      pending_disk_touches_->Apply(*disk_eviction_);
+  }
 }
 
-KeyValueBuffer::DiskIndex::iterator KeyValueBuffer::FindAndThrowIfCancelled(const Identity& key) {
-  auto itr(Find(disk_store_, key));
-  if (itr == disk_store_.index.end() || (*itr).state == StoringState::kCancelled) {
+KeyValueBuffer::DiskList::iterator KeyValueBuffer::FindAndThrowIfCancelled(const Identity& key) {
+  // Cancelled elements are never in the lookup table.
+  auto itr(disk_store_.index.lookup.find(key));
+  if (itr == disk_store_.index.lookup.end()) {
+    ++misses_;
     LOG(kError) << HexSubstr(key) << " is not in the disk index or is cancelled.";
     ThrowError(CommonErrors::no_such_element);
   }
-  return itr;
+  return itr->second;
+}
+
+bool KeyValueBuffer::DefinitelyAbsent(const Identity& key) {
+  return key_filter_ && !key_filter_->MayContain(key);
+}
+
+void KeyValueBuffer::ThrowIfDefinitelyAbsent(const Identity& key) {
+  if (!DefinitelyAbsent(key))
+    return;
+  ++misses_;
+  LOG(kVerbose) << HexSubstr(key) << " is not in the buffer.";
+  ThrowError(CommonErrors::no_such_element);
+}
+
+void KeyValueBuffer::AddToKeyFilter(const Identity& key) {
+  // Called with the lock held for the buffer whose lookup table 'key' has been added to.
+  if (key_filter_)
+    key_filter_->Add(key);
+}
+
+void KeyValueBuffer::RemoveFromKeyFilter(const Identity& key) {
+  // Called with the lock held for the buffer whose lookup table 'key' has been removed from.
+  if (key_filter_)
+    key_filter_->Remove(key);
 }
 
 }  // namespace maidsafe
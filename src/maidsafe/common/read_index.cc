@@ -0,0 +1,136 @@
+/* Copyright 2012 MaidSafe.net limited
+
+This MaidSafe Software is licensed under the MaidSafe.net Commercial License, version 1.0 or later,
+and The General Public License (GPL), version 3. By contributing code to this project You agree to
+the terms laid out in the MaidSafe Contributor Agreement, version 1.0, found in the root directory
+of this project at LICENSE, COPYING and CONTRIBUTOR respectively and also available at:
+
+http://www.novinet.com/license
+
+Unless required by applicable law or agreed to in writing, software distributed under the License is
+distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or
+implied. See the License for the specific language governing permissions and limitations under the
+License.
+*/
+
+#include "maidsafe/common/read_index.h"
+
+#include <functional>
+#include <string>
+
+
+namespace maidsafe {
+
+namespace detail {
+
+namespace {
+
+const size_t kInitialBucketCount(64);
+
+size_t BucketIndex(const Identity& key, size_t bucket_count) {
+  // The bucket count is always a power of two.
+  return std::hash<std::string>()(key.string()) & (bucket_count - 1);
+}
+
+}  // unnamed namespace
+
+ReadIndex::ReadIndex() : table_(nullptr), tables_(), size_(0) {
+  tables_.emplace_back(new Table(kInitialBucketCount));
+  table_ = tables_.back().get();
+}
+
+bool ReadIndex::Find(const Identity& key, Value& value) const {
+  const Table* table(table_);
+  for (;;) {
+    std::shared_ptr<const Bucket> bucket(
+        std::atomic_load(&(*table)[BucketIndex(key, table->size())]));
+    if (bucket) {
+      for (auto& entry : *bucket) {
+        if (entry.key == key) {
+          value = entry.value;
+          return true;
+        }
+      }
+    }
+    // The table may have been emptied after growing; if so, search its replacement.
+    const Table* current(table_);
+    if (current == table)
+      return false;
+    table = current;
+  }
+}
+
+bool ReadIndex::Contains(const Identity& key) const {
+  Value value;
+  return Find(key, value);
+}
+
+void ReadIndex::Insert(const Identity& key, uint64_t sequence, const Value& value) {
+  Table& table(*table_);
+  std::shared_ptr<const Bucket>& slot(table[BucketIndex(key, table.size())]);
+  std::shared_ptr<const Bucket> old_bucket(std::atomic_load(&slot));
+  std::shared_ptr<Bucket> bucket(old_bucket ? std::make_shared<Bucket>(*old_bucket) :
+                                              std::make_shared<Bucket>());
+  bool replaced(false);
+  for (auto& entry : *bucket) {
+    if (entry.key == key) {
+      entry.sequence = sequence;
+      entry.value = value;
+      replaced = true;
+      break;
+    }
+  }
+  if (!replaced)
+    bucket->emplace_back(key, sequence, value);
+  std::atomic_store(&slot, std::shared_ptr<const Bucket>(bucket));
+  if (!replaced && ++size_ > table.size())
+    Grow();
+}
+
+void ReadIndex::Erase(const Identity& key, uint64_t sequence) {
+  Table& table(*table_);
+  std::shared_ptr<const Bucket>& slot(table[BucketIndex(key, table.size())]);
+  std::shared_ptr<const Bucket> old_bucket(std::atomic_load(&slot));
+  if (!old_bucket)
+    return;
+  for (auto itr(old_bucket->begin()); itr != old_bucket->end(); ++itr) {
+    if ((*itr).key != key)
+      continue;
+    if ((*itr).sequence != sequence)
+      return;
+    std::shared_ptr<Bucket> bucket;
+    if (old_bucket->size() != 1) {
+      bucket = std::make_shared<Bucket>(old_bucket->begin(), itr);
+      bucket->insert(bucket->end(), std::next(itr), old_bucket->end());
+    }
+    std::atomic_store(&slot, std::shared_ptr<const Bucket>(bucket));
+    --size_;
+    return;
+  }
+}
+
+void ReadIndex::Grow() {
+  Table& old_table(*table_);
+  std::vector<std::shared_ptr<Bucket>> buckets(old_table.size() * 2);
+  for (auto& slot : old_table) {
+    if (!slot)
+      continue;
+    for (auto& entry : *slot) {
+      std::shared_ptr<Bucket>& bucket(buckets[BucketIndex(entry.key, buckets.size())]);
+      if (!bucket)
+        bucket = std::make_shared<Bucket>();
+      bucket->push_back(entry);
+    }
+  }
+  tables_.emplace_back(new Table(buckets.begin(), buckets.end()));
+  table_ = tables_.back().get();
+  // Only now that the new table is visible can the old one be emptied, so that a reader which
+  // misses in it is sure to find the new one.  This frees the values' old buckets, once readers
+  // are done with them.
+  for (auto& slot : old_table)
+    std::atomic_store(&slot, std::shared_ptr<const Bucket>());
+}
+
+}  // namespace detail
+
+}  // namespace maidsafe
@@ -0,0 +1,85 @@
+/* Copyright 2012 MaidSafe.net limited
+
+This MaidSafe Software is licensed under the MaidSafe.net Commercial License, version 1.0 or later,
+and The General Public License (GPL), version 3. By contributing code to this project You agree to
+the terms laid out in the MaidSafe Contributor Agreement, version 1.0, found in the root directory
+of this project at LICENSE, COPYING and CONTRIBUTOR respectively and also available at:
+
+http://www.novinet.com/license
+
+Unless required by applicable law or agreed to in writing, software distributed under the License is
+distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or
+implied. See the License for the specific language governing permissions and limitations under the
+License.
+*/
+
+#ifndef MAIDSAFE_COMMON_READ_INDEX_H_
+#define MAIDSAFE_COMMON_READ_INDEX_H_
+
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <utility>
+#include <vector>
+
+#include "maidsafe/common/types.h"
+
+
+namespace maidsafe {
+
+namespace detail {
+
+// A hash table from keys to shared values which readers can search without waiting for the writer.
+// Each bucket is an immutable array of entries, held by a shared_ptr which is loaded and stored
+// atomically: the writer replaces a bucket with an amended copy, and a reader still holding the old
+// copy keeps it alive until done with it (read-copy-update, with the shared_ptr's count deciding
+// when the old copy is freed).  When the table grows, the new array of buckets is published and the
+// old one emptied; a reader which then misses in the old one searches the new.  The old arrays are
+// kept until destruction so that readers needn't count their uses of an array; together they take
+// up less room than the current one.  Find and Contains may be called from any thread; calls to
+// the other functions must be serialised by the caller.
+class ReadIndex {
+ public:
+  typedef std::shared_ptr<const NonEmptyString> Value;
+
+  ReadIndex();
+  // Returns false if 'key' isn't held.
+  bool Find(const Identity& key, Value& value) const;
+  bool Contains(const Identity& key) const;
+  // Replaces any entry already held for 'key' in a single step, so readers never miss the key.
+  // 'sequence' identifies the entry to Erase.
+  void Insert(const Identity& key, uint64_t sequence, const Value& value);
+  // Does nothing unless the entry held for 'key' was inserted with 'sequence', so that erasing a
+  // replaced entry can't remove its replacement.
+  void Erase(const Identity& key, uint64_t sequence);
+  size_t size() const { return size_; }
+
+ private:
+  ReadIndex(const ReadIndex&);
+  ReadIndex& operator=(const ReadIndex&);
+
+  struct Entry {
+    Entry(const Identity& key_in, uint64_t sequence_in, const Value& value_in)
+        : key(key_in), sequence(sequence_in), value(value_in) {}
+    Identity key;
+    uint64_t sequence;
+    Value value;
+  };
+  typedef std::vector<Entry> Bucket;
+  typedef std::vector<std::shared_ptr<const Bucket>> Table;
+
+  void Grow();
+
+  // The current table, whose buckets are only replaced with std::atomic_store, and each table the
+  // index has held.
+  std::atomic<Table*> table_;
+  std::vector<std::unique_ptr<Table>> tables_;
+  size_t size_;
+};
+
+}  // namespace detail
+
+}  // namespace maidsafe
+
+
+#endif  // MAIDSAFE_COMMON_READ_INDEX_H_
@@ -0,0 +1,482 @@
+/* Copyright 2012 MaidSafe.net limited
+
+This MaidSafe Software is licensed under the MaidSafe.net Commercial License, version 1.0 or later,
+and The General Public License (GPL), version 3. By contributing code to this project You agree to
+the terms laid out in the MaidSafe Contributor Agreement, version 1.0, found in the root directory
+of this project at LICENSE, COPYING and CONTRIBUTOR respectively and also available at:
+
+http://www.novinet.com/license
+
+Unless required by applicable law or agreed to in writing, software distributed under the License is
+distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or
+implied. See the License for the specific language governing permissions and limitations under the
+License.
+*/
+
+#include "maidsafe/common/sharded_key_value_buffer.h"
+
+#include <algorithm>
+#include <memory>
+#include <mutex>
+#include <string>
+
+#include "maidsafe/common/error.h"
+#include "maidsafe/common/log.h"
+
+
+namespace fs = boost::filesystem;
+
+namespace maidsafe {
+
+namespace {
+
+// Splits 'total' as evenly as possible into 'count' parts.
+std::vector<uint64_t> EvenSplit(uint64_t total, size_t count) {
+  std::vector<uint64_t> parts(count, total / count);
+  for (size_t i(0); i != total % count; ++i)
+    ++parts[i];
+  return parts;
+}
+
+// Raises each part to at least its floor, taking the difference from the parts above theirs.  The
+// parts only exceed 'total' between them if the floors do.
+void ApplyFloors(const std::vector<uint64_t>& floors, std::vector<uint64_t>& parts) {
+  uint64_t shortfall(0);
+  for (size_t i(0); i != parts.size(); ++i) {
+    if (parts[i] < floors[i]) {
+      shortfall += floors[i] - parts[i];
+      parts[i] = floors[i];
+    }
+  }
+  for (size_t i(0); i != parts.size() && shortfall != 0; ++i) {
+    const uint64_t kTaken(std::min(shortfall, parts[i] - floors[i]));
+    parts[i] -= kTaken;
+    shortfall -= kTaken;
+  }
+  if (shortfall != 0)
+    LOG(kWarning) << "Shards need " << shortfall << " bytes more than the overall limit.";
+}
+
+// Gives each shard what it currently uses plus an even share of the remainder.  If the shards
+// already use more than 'total' between them (i.e. the limit has been reduced), 'total' is split
+// in proportion to current usage.  No shard gets less than its floor.
+std::vector<uint64_t> SplitByUsage(uint64_t total,
+                                   const std::vector<uint64_t>& usage,
+                                   const std::vector<uint64_t>& floors) {
+  uint64_t used(0);
+  for (auto shard_usage : usage)
+    used += shard_usage;
+
+  if (used <= total) {
+    std::vector<uint64_t> parts(EvenSplit(total - used, usage.size()));
+    for (size_t i(0); i != parts.size(); ++i)
+      parts[i] += usage[i];
+    ApplyFloors(floors, parts);
+    return parts;
+  }
+
+  std::vector<uint64_t> parts(usage.size());
+  uint64_t allocated(0);
+  for (size_t i(0); i != parts.size(); ++i) {
+    parts[i] = static_cast<uint64_t>(static_cast<double>(total) * usage[i] / used);
+    parts[i] = std::min(parts[i], total - allocated);
+    allocated += parts[i];
+  }
+  std::vector<uint64_t> remainder(EvenSplit(total - allocated, parts.size()));
+  for (size_t i(0); i != parts.size(); ++i)
+    parts[i] += remainder[i];
+  ApplyFloors(floors, parts);
+  return parts;
+}
+
+// Counts a value towards its shard's disk usage for as long as it's being stored, since until the
+// shard has accepted it, the shard's own usage doesn't include it.
+class StoringGuard {
+ public:
+  StoringGuard(std::atomic<uint64_t>& storing, uint64_t size) : storing_(storing), size_(size) {
+    storing_ += size_;
+  }
+  ~StoringGuard() { storing_ -= size_; }
+
+ private:
+  StoringGuard(const StoringGuard&);
+  StoringGuard& operator=(const StoringGuard&);
+
+  std::atomic<uint64_t>& storing_;
+  const uint64_t size_;
+};
+
+// The most 'value' can take in a shard's disk buffer, allowing for the tag byte added if the shard
+// compresses values and this one doesn't compress.
+uint64_t MaxDiskSize(const NonEmptyString& value) {
+  return value.string().size() + 1;
+}
+
+// Each shard's key filter need only be sized for its share of the keys.
+KeyValueBuffer::Options ShardOptions(const KeyValueBuffer::Options& options,
+                                     uint32_t shard_count) {
+  KeyValueBuffer::Options shard_options(options);
+  shard_options.key_filter_capacity = (options.key_filter_capacity + shard_count - 1) / shard_count;
+  return shard_options;
+}
+
+// Wraps 'pop_functor' so that, shared by the shards, it's called by only one of them at a time.
+ShardedKeyValueBuffer::PopFunctor Serialised(ShardedKeyValueBuffer::PopFunctor pop_functor) {
+  if (!pop_functor)
+    return pop_functor;
+  std::shared_ptr<std::mutex> mutex(std::make_shared<std::mutex>());
+  return [pop_functor, mutex](const Identity& key, const NonEmptyString& value) {
+      std::lock_guard<std::mutex> lock(*mutex);
+      pop_functor(key, value);
+  };
+}
+
+}  // unnamed namespace
+
+const std::chrono::milliseconds ShardedKeyValueBuffer::kRebalanceInterval(100);
+
+ShardedKeyValueBuffer::ShardedKeyValueBuffer(MemoryUsage max_memory_usage,
+                                             DiskUsage max_disk_usage,
+                                             PopFunctor pop_functor,
+                                             uint32_t shard_count,
+                                             const KeyValueBuffer::Options& options)
+    : shards_(),
+      max_memory_usage_(max_memory_usage),
+      max_disk_usage_(max_disk_usage),
+      memory_limits_(),
+      disk_limits_(),
+      storing_bytes_(shard_count),
+      last_memory_usage_(),
+      last_disk_usage_(),
+      last_disk_floors_(),
+      mutex_(),
+      cond_var_(),
+      running_(true),
+      rebalancer_() {
+  Init(max_memory_usage, max_disk_usage, shard_count);
+  const KeyValueBuffer::Options kShardOptions(ShardOptions(options, shard_count));
+  const PopFunctor kShardPopFunctor(Serialised(pop_functor));
+  for (uint32_t i(0); i != shard_count; ++i) {
+    shards_.emplace_back(new KeyValueBuffer(MemoryUsage(memory_limits_[i]),
+                                            DiskUsage(disk_limits_[i]), kShardPopFunctor,
+                                            kShardOptions));
+  }
+  rebalancer_ = std::async(std::launch::async, &ShardedKeyValueBuffer::RunRebalancer, this);
+}
+
+ShardedKeyValueBuffer::ShardedKeyValueBuffer(MemoryUsage max_memory_usage,
+                                             DiskUsage max_disk_usage,
+                                             PopFunctor pop_functor,
+                                             const fs::path& disk_buffer,
+                                             uint32_t shard_count,
+                                             const KeyValueBuffer::Options& options)
+    : shards_(),
+      max_memory_usage_(max_memory_usage),
+      max_disk_usage_(max_disk_usage),
+      memory_limits_(),
+      disk_limits_(),
+      storing_bytes_(shard_count),
+      last_memory_usage_(),
+      last_disk_usage_(),
+      last_disk_floors_(),
+      mutex_(),
+      cond_var_(),
+      running_(true),
+      rebalancer_() {
+  Init(max_memory_usage, max_disk_usage, shard_count);
+  const KeyValueBuffer::Options kShardOptions(ShardOptions(options, shard_count));
+  const PopFunctor kShardPopFunctor(Serialised(pop_functor));
+  for (uint32_t i(0); i != shard_count; ++i) {
+    shards_.emplace_back(new KeyValueBuffer(MemoryUsage(memory_limits_[i]),
+                                            DiskUsage(disk_limits_[i]), kShardPopFunctor,
+                                            disk_buffer / std::to_string(i), kShardOptions));
+  }
+  rebalancer_ = std::async(std::launch::async, &ShardedKeyValueBuffer::RunRebalancer, this);
+}
+
+void ShardedKeyValueBuffer::Init(MemoryUsage max_memory_usage,
+                                 DiskUsage max_disk_usage,
+                                 uint32_t shard_count) {
+  if (shard_count == 0) {
+    LOG(kError) << "Shard count must be non-zero.";
+    ThrowError(CommonErrors::invalid_parameter);
+  }
+  if (max_memory_usage > max_disk_usage) {
+    LOG(kError) << "Max memory usage must be <= max disk usage.";
+    ThrowError(CommonErrors::invalid_parameter);
+  }
+  memory_limits_ = EvenSplit(max_memory_usage, shard_count);
+  disk_limits_ = EvenSplit(max_disk_usage, shard_count);
+}
+
+ShardedKeyValueBuffer::~ShardedKeyValueBuffer() {
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    running_ = false;
+  }
+  cond_var_.notify_all();
+  if (rebalancer_.valid())
+    rebalancer_.wait();
+}
+
+KeyValueBuffer& ShardedKeyValueBuffer::shard(const Identity& key) {
+  return *shards_[ShardIndex(key)];
+}
+
+size_t ShardedKeyValueBuffer::ShardIndex(const Identity& key) const {
+  const std::string& id(key.string());
+  uint32_t prefix((static_cast<uint32_t>(static_cast<unsigned char>(id[0])) << 24) |
+                  (static_cast<uint32_t>(static_cast<unsigned char>(id[1])) << 16) |
+                  (static_cast<uint32_t>(static_cast<unsigned char>(id[2])) << 8) |
+                  static_cast<uint32_t>(static_cast<unsigned char>(id[3])));
+  return prefix % shards_.size();
+}
+
+std::vector<std::vector<size_t>> ShardedKeyValueBuffer::GroupByShard(
+    const std::vector<Identity>& keys) const {
+  std::vector<std::vector<size_t>> groups(shards_.size());
+  for (size_t i(0); i != keys.size(); ++i)
+    groups[ShardIndex(keys[i])].push_back(i);
+  return groups;
+}
+
+void ShardedKeyValueBuffer::Store(const Identity& key, const NonEmptyString& value) {
+  Store(key, std::make_shared<const NonEmptyString>(value));
+}
+
+void ShardedKeyValueBuffer::Store(const Identity& key, SharedValue value) {
+  const size_t kIndex(ShardIndex(key));
+  StoringGuard guard(storing_bytes_[kIndex], value ? MaxDiskSize(*value) : 0);
+  OwnerWithRoomFor(kIndex, value ? MaxDiskSize(*value) : 0).Store(key, value);
+}
+
+void ShardedKeyValueBuffer::Store(const Identity& key,
+                                  const NonEmptyString& value,
+                                  std::chrono::milliseconds time_to_live) {
+  Store(key, std::make_shared<const NonEmptyString>(value), time_to_live);
+}
+
+void ShardedKeyValueBuffer::Store(const Identity& key,
+                                  SharedValue value,
+                                  std::chrono::milliseconds time_to_live) {
+  const size_t kIndex(ShardIndex(key));
+  StoringGuard guard(storing_bytes_[kIndex], value ? MaxDiskSize(*value) : 0);
+  OwnerWithRoomFor(kIndex, value ? MaxDiskSize(*value) : 0).Store(key, value, time_to_live);
+}
+
+KeyValueBuffer& ShardedKeyValueBuffer::OwnerWithRoomFor(size_t shard_index,
+                                                        uint64_t max_disk_size) {
+  // Make sure the owning shard's share of the disk is big enough, since otherwise it will fail
+  // permanently as the KeyValueBuffer does when given a value larger than its disk limit.  The
+  // value is already counted in storing_bytes_, so no later rebalance takes the room away again.
+  KeyValueBuffer& owner(*shards_[shard_index]);
+  if (max_disk_size > owner.max_disk_usage())
+    Rebalance(false);
+  return owner;
+}
+
+NonEmptyString ShardedKeyValueBuffer::Get(const Identity& key) {
+  return shard(key).Get(key);
+}
+
+ShardedKeyValueBuffer::SharedValue ShardedKeyValueBuffer::GetShared(const Identity& key) {
+  return shard(key).GetShared(key);
+}
+
+ShardedKeyValueBuffer::ValueView ShardedKeyValueBuffer::GetView(const Identity& key) {
+  return shard(key).GetView(key);
+}
+
+ShardedKeyValueBuffer::ValueView ShardedKeyValueBuffer::GetRange(const Identity& key,
+                                                                 uint64_t offset,
+                                                                 size_t length) {
+  return shard(key).GetRange(key, offset, length);
+}
+
+bool ShardedKeyValueBuffer::TryGet(const Identity& key, NonEmptyString& value) {
+  return shard(key).TryGet(key, value);
+}
+
+bool ShardedKeyValueBuffer::Contains(const Identity& key) {
+  return shard(key).Contains(key);
+}
+
+void ShardedKeyValueBuffer::Delete(const Identity& key) {
+  shard(key).Delete(key);
+}
+
+void ShardedKeyValueBuffer::StoreBatch(
+    const std::vector<std::pair<Identity, NonEmptyString>>& key_values) {
+  std::vector<Identity> keys;
+  keys.reserve(key_values.size());
+  for (auto& key_value : key_values)
+    keys.push_back(key_value.first);
+  auto groups(GroupByShard(keys));
+  for (size_t shard_index(0); shard_index != groups.size(); ++shard_index) {
+    if (groups[shard_index].empty())
+      continue;
+    std::vector<std::pair<Identity, NonEmptyString>> shard_key_values;
+    shard_key_values.reserve(groups[shard_index].size());
+    uint64_t total(0), largest(0);
+    for (auto i : groups[shard_index]) {
+      shard_key_values.push_back(key_values[i]);
+      total += MaxDiskSize(key_values[i].second);
+      largest = std::max(largest, MaxDiskSize(key_values[i].second));
+    }
+    StoringGuard guard(storing_bytes_[shard_index], total);
+    OwnerWithRoomFor(shard_index, largest).StoreBatch(shard_key_values);
+  }
+}
+
+std::vector<NonEmptyString> ShardedKeyValueBuffer::GetBatch(const std::vector<Identity>& keys) {
+  std::vector<NonEmptyString> values(keys.size());
+  auto groups(GroupByShard(keys));
+  for (size_t shard_index(0); shard_index != groups.size(); ++shard_index) {
+    if (groups[shard_index].empty())
+      continue;
+    std::vector<Identity> shard_keys;
+    shard_keys.reserve(groups[shard_index].size());
+    for (auto i : groups[shard_index])
+      shard_keys.push_back(keys[i]);
+    auto shard_values(shards_[shard_index]->GetBatch(shard_keys));
+    for (size_t j(0); j != shard_values.size(); ++j)
+      values[groups[shard_index][j]] = shard_values[j];
+  }
+  return values;
+}
+
+void ShardedKeyValueBuffer::DeleteBatch(const std::vector<Identity>& keys) {
+  auto groups(GroupByShard(keys));
+  for (size_t shard_index(0); shard_index != groups.size(); ++shard_index) {
+    if (groups[shard_index].empty())
+      continue;
+    std::vector<Identity> shard_keys;
+    shard_keys.reserve(groups[shard_index].size());
+    for (auto i : groups[shard_index])
+      shard_keys.push_back(keys[i]);
+    shards_[shard_index]->DeleteBatch(shard_keys);
+  }
+}
+
+ShardedKeyValueBuffer::ScanCursor ShardedKeyValueBuffer::BeginScan(const std::string& prefix) {
+  ScanCursor cursor;
+  for (auto& shard : shards_)
+    cursor.shard_cursors_.push_back(shard->BeginScan(prefix));
+  return cursor;
+}
+
+std::vector<Identity> ShardedKeyValueBuffer::Scan(ScanCursor& cursor, size_t batch_size) {
+  std::vector<Identity> keys;
+  while (keys.empty() && !cursor.done()) {
+    KeyValueBuffer::ScanCursor& shard_cursor(cursor.shard_cursors_[cursor.shard_]);
+    keys = shards_[cursor.shard_]->Scan(shard_cursor, batch_size);
+    if (shard_cursor.done())
+      ++cursor.shard_;
+  }
+  return keys;
+}
+
+void ShardedKeyValueBuffer::SetMaxMemoryUsage(MemoryUsage max_memory_usage) {
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (max_memory_usage > max_disk_usage_) {
+      LOG(kError) << "Max memory usage must be <= max disk usage.";
+      ThrowError(CommonErrors::invalid_parameter);
+    }
+    max_memory_usage_ = max_memory_usage;
+  }
+  Rebalance(false);
+}
+
+void ShardedKeyValueBuffer::SetMaxDiskUsage(DiskUsage max_disk_usage) {
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (max_memory_usage_ > max_disk_usage) {
+      LOG(kError) << "Max memory usage must be <= max disk usage.";
+      ThrowError(CommonErrors::invalid_parameter);
+    }
+    max_disk_usage_ = max_disk_usage;
+  }
+  Rebalance(false);
+}
+
+KeyValueBuffer::Stats ShardedKeyValueBuffer::stats() const {
+  KeyValueBuffer::Stats total;
+  for (auto& shard : shards_) {
+    KeyValueBuffer::Stats shard_stats(shard->stats());
+    total.memory_hits += shard_stats.memory_hits;
+    total.disk_hits += shard_stats.disk_hits;
+    total.misses += shard_stats.misses;
+    total.promotions += shard_stats.promotions;
+    total.bytes_spilled += shard_stats.bytes_spilled;
+    total.values_spilled += shard_stats.values_spilled;
+    total.spills_skipped += shard_stats.spills_skipped;
+    total.expirations += shard_stats.expirations;
+    total.admissions_bypassed += shard_stats.admissions_bypassed;
+    total.admissions_refused += shard_stats.admissions_refused;
+    total.values_deduplicated += shard_stats.values_deduplicated;
+    total.bytes_deduplicated += shard_stats.bytes_deduplicated;
+  }
+  return total;
+}
+
+void ShardedKeyValueBuffer::Rebalance() {
+  Rebalance(false);
+}
+
+void ShardedKeyValueBuffer::Rebalance(bool only_if_changed) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  // A shard's disk usage includes the values it has yet to write, and those being stored to it, so
+  // its limit never drops below what it has already accepted.
+  std::vector<uint64_t> memory_usage, disk_usage, disk_floors;
+  for (size_t i(0); i != shards_.size(); ++i) {
+    const uint64_t kStoring(storing_bytes_[i]);
+    memory_usage.push_back(shards_[i]->CurrentMemoryUsage());
+    disk_usage.push_back(shards_[i]->RequiredDiskUsage().data + kStoring);
+    disk_floors.push_back(std::max(shards_[i]->LargestUnwrittenValue(), kStoring));
+  }
+  if (only_if_changed && memory_usage == last_memory_usage_ && disk_usage == last_disk_usage_ &&
+      disk_floors == last_disk_floors_) {
+    return;
+  }
+  std::vector<uint64_t> memory_limits(SplitByUsage(max_memory_usage_, memory_usage,
+                                                   std::vector<uint64_t>(shards_.size(), 0)));
+  std::vector<uint64_t> disk_limits(SplitByUsage(max_disk_usage_, disk_usage, disk_floors));
+  // Each shard requires its memory limit to be no more than its disk limit.
+  for (size_t i(0); i != shards_.size(); ++i)
+    memory_limits[i] = std::min(memory_limits[i], disk_limits[i]);
+  ApplyLimits(memory_limits, disk_limits);
+  last_memory_usage_.swap(memory_usage);
+  last_disk_usage_.swap(disk_usage);
+  last_disk_floors_.swap(disk_floors);
+}
+
+void ShardedKeyValueBuffer::ApplyLimits(const std::vector<uint64_t>& memory_limits,
+                                        const std::vector<uint64_t>& disk_limits) {
+  for (size_t i(0); i != shards_.size(); ++i) {
+    // Order the updates so that the shard's memory limit never exceeds its disk limit.
+    shards_[i]->SetMaxMemoryUsage(MemoryUsage(std::min(memory_limits_[i], memory_limits[i])));
+    shards_[i]->SetMaxDiskUsage(DiskUsage(disk_limits[i]));
+    shards_[i]->SetMaxMemoryUsage(MemoryUsage(memory_limits[i]));
+    memory_limits_[i] = memory_limits[i];
+    disk_limits_[i] = disk_limits[i];
+  }
+}
+
+void ShardedKeyValueBuffer::RunRebalancer() {
+  for (;;) {
+    {
+      std::unique_lock<std::mutex> lock(mutex_);
+      if (cond_var_.wait_for(lock, kRebalanceInterval, [this] { return !running_; }))
+        return;
+    }
+    try {
+      Rebalance(true);
+    }
+    catch(const std::exception& e) {
+      LOG(kError) << "Failed to rebalance shards: " << e.what();
+    }
+  }
+}
+
+}  // namespace maidsafe
@@ -0,0 +1,92 @@
+/* Copyright 2012 MaidSafe.net limited
+
+This MaidSafe Software is licensed under the MaidSafe.net Commercial License, version 1.0 or later,
+and The General Public License (GPL), version 3. By contributing code to this project You agree to
+the terms laid out in the MaidSafe Contributor Agreement, version 1.0, found in the root directory
+of this project at LICENSE, COPYING and CONTRIBUTOR respectively and also available at:
+
+http://www.novinet.com/license
+
+Unless required by applicable law or agreed to in writing, software distributed under the License is
+distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or
+implied. See the License for the specific language governing permissions and limitations under the
+License.
+*/
+
+
+#include "maidsafe/common/slab_allocator.h"
+
+
+namespace maidsafe {
+
+namespace detail {
+
+namespace {
+
+size_t SizeClass(size_t size) {
+  return size == 0 ? 0 : (size - 1) / SlabAllocator::kAlignment;
+}
+
+}  // unnamed namespace
+
+const size_t SlabAllocator::kAlignment;
+const size_t SlabAllocator::kMaxSlabbedSize;
+const size_t SlabAllocator::kSlabSize;
+
+SlabAllocator::SlabAllocator()
+    : free_lists_(kMaxSlabbedSize / kAlignment, nullptr),
+      slabs_(),
+      slab_position_(nullptr),
+      slab_end_(nullptr),
+      reserved_bytes_(0) {
+  static_assert(sizeof(FreeBlock) <= kAlignment, "A free block must fit in the smallest class.");
+  static_assert(kSlabSize % kMaxSlabbedSize == 0, "Slabs must divide into the largest class.");
+}
+
+void* SlabAllocator::Allocate(size_t size) {
+  if (size > kMaxSlabbedSize) {
+    reserved_bytes_ += size;
+    return ::operator new(size);
+  }
+  FreeBlock*& free_list(free_lists_[SizeClass(size)]);
+  if (free_list) {
+    FreeBlock* block(free_list);
+    free_list = block->next;
+    return block;
+  }
+  const size_t kBlockSize(BlockSize(size));
+  if (static_cast<size_t>(slab_end_ - slab_position_) < kBlockSize) {
+    // The rest of the current slab is too small for this class, so is left unused.
+    slabs_.emplace_back(new char[kSlabSize]);
+    slab_position_ = slabs_.back().get();
+    slab_end_ = slab_position_ + kSlabSize;
+    reserved_bytes_ += kSlabSize;
+  }
+  void* block(slab_position_);
+  slab_position_ += kBlockSize;
+  return block;
+}
+
+void SlabAllocator::Deallocate(void* block, size_t size) {
+  if (!block)
+    return;
+  if (size > kMaxSlabbedSize) {
+    reserved_bytes_ -= size;
+    ::operator delete(block);
+    return;
+  }
+  FreeBlock*& free_list(free_lists_[SizeClass(size)]);
+  FreeBlock* freed(static_cast<FreeBlock*>(block));
+  freed->next = free_list;
+  free_list = freed;
+}
+
+size_t SlabAllocator::BlockSize(size_t size) {
+  if (size > kMaxSlabbedSize)
+    return size;
+  return (SizeClass(size) + 1) * kAlignment;
+}
+
+}  // namespace detail
+
+}  // namespace maidsafe
@@ -0,0 +1,91 @@
+/* Copyright 2012 MaidSafe.net limited
+
+This MaidSafe Software is licensed under the MaidSafe.net Commercial License, version 1.0 or later,
+and The General Public License (GPL), version 3. By contributing code to this project You agree to
+the terms laid out in the MaidSafe Contributor Agreement, version 1.0, found in the root directory
+of this project at LICENSE, COPYING and CONTRIBUTOR respectively and also available at:
+
+http://www.novinet.com/license
+
+Unless required by applicable law or agreed to in writing, software distributed under the License is
+distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or
+implied. See the License for the specific language governing permissions and limitations under the
+License.
+*/
+
+#include "maidsafe/common/counting_bloom_filter.h"
+
+#include <vector>
+
+#include "maidsafe/common/error.h"
+#include "maidsafe/common/test.h"
+#include "maidsafe/common/utils.h"
+
+
+namespace maidsafe {
+
+namespace test {
+
+namespace {
+
+std::vector<Identity> MakeKeys(size_t count) {
+  std::vector<Identity> keys;
+  while (keys.size() != count)
+    keys.push_back(Identity(RandomString(64)));
+  return keys;
+}
+
+}  // unnamed namespace
+
+TEST(CountingBloomFilterTest, BEH_AddAndRemove) {
+  EXPECT_THROW(detail::CountingBloomFilter(0), std::exception);
+  detail::CountingBloomFilter filter(100);
+  auto keys(MakeKeys(100));
+  for (auto& key : keys)
+    EXPECT_FALSE(filter.MayContain(key));
+  for (auto& key : keys)
+    filter.Add(key);
+  for (auto& key : keys)
+    EXPECT_TRUE(filter.MayContain(key));
+
+  // A key added twice stays until removed twice.
+  filter.Add(keys[0]);
+  for (auto& key : keys)
+    filter.Remove(key);
+  EXPECT_TRUE(filter.MayContain(keys[0]));
+  filter.Remove(keys[0]);
+  for (auto& key : keys)
+    EXPECT_FALSE(filter.MayContain(key));
+}
+
+TEST(CountingBloomFilterTest, BEH_FalsePositiveRate) {
+  const size_t kCapacity(10000);
+  detail::CountingBloomFilter filter(kCapacity);
+  for (auto& key : MakeKeys(kCapacity))
+    filter.Add(key);
+  size_t false_positives(0);
+  for (auto& key : MakeKeys(kCapacity)) {
+    if (filter.MayContain(key))
+      ++false_positives;
+  }
+  // About 1% is expected.
+  EXPECT_LT(false_positives, kCapacity / 40);
+}
+
+TEST(CountingBloomFilterTest, BEH_Saturation) {
+  detail::CountingBloomFilter filter(1);
+  auto keys(MakeKeys(2));
+  for (int i(0); i != 300; ++i)
+    filter.Add(keys[0]);
+  filter.Add(keys[1]);
+  // Removing keys[1] mustn't take keys[0]'s saturated counts down with it, even though keys[0] has
+  // been added more times than the counts can record.
+  filter.Remove(keys[1]);
+  for (int i(0); i != 299; ++i)
+    filter.Remove(keys[0]);
+  EXPECT_TRUE(filter.MayContain(keys[0]));
+}
+
+}  // namespace test
+
+}  // namespace maidsafe
@@ -0,0 +1,334 @@
+/* Copyright 2012 MaidSafe.net limited
+
+This MaidSafe Software is licensed under the MaidSafe.net Commercial License, version 1.0 or later,
+and The General Public License (GPL), version 3. By contributing code to this project You agree to
+the terms laid out in the MaidSafe Contributor Agreement, version 1.0, found in the root directory
+of this project at LICENSE, COPYING and CONTRIBUTOR respectively and also available at:
+
+http://www.novinet.com/license
+
+Unless required by applicable law or agreed to in writing, software distributed under the License is
+distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or
+implied. See the License for the specific language governing permissions and limitations under the
+License.
+*/
+
+#include "maidsafe/common/disk_backend.h"
+
+#include <future>
+#include <memory>
+#include <utility>
+#include <vector>
+
+#include "boost/filesystem/operations.hpp"
+#include "boost/filesystem/path.hpp"
+
+#include "maidsafe/common/error.h"
+#include "maidsafe/common/test.h"
+#include "maidsafe/common/utils.h"
+
+
+namespace fs = boost::filesystem;
+
+namespace maidsafe {
+
+namespace test {
+
+namespace {
+
+std::vector<std::pair<Identity, NonEmptyString>> MakeKeyValues(size_t count, size_t value_size) {
+  std::vector<std::pair<Identity, NonEmptyString>> key_values;
+  while (key_values.size() != count) {
+    NonEmptyString value(RandomAlphaNumericString(value_size));
+    key_values.push_back(std::make_pair(Identity(crypto::Hash<crypto::SHA512>(value)), value));
+  }
+  return key_values;
+}
+
+// Counts the files in directory and its subdirectories.
+size_t FileCount(const fs::path& directory) {
+  size_t count(0);
+  for (fs::recursive_directory_iterator itr(directory), end; itr != end; ++itr) {
+    if (fs::is_regular_file((*itr).status()))
+      ++count;
+  }
+  return count;
+}
+
+}  // unnamed namespace
+
+TEST(DiskBackendTest, BEH_FilePerKey) {
+  TestPath test_path(CreateTestPath("MaidSafe_Test_DiskBackend"));
+  detail::FilePerKeyDiskBackend backend(*test_path);
+  auto key_values(MakeKeyValues(10, 100));
+  for (auto& key_value : key_values)
+    EXPECT_NO_THROW(backend.Put(key_value.first, key_value.second));
+  EXPECT_EQ(key_values.size(), FileCount(*test_path));
+
+  NonEmptyString value;
+  for (auto& key_value : key_values) {
+    EXPECT_EQ(key_value.second, backend.Get(key_value.first));
+    EXPECT_NO_THROW(backend.Remove(key_value.first, &value));
+    EXPECT_EQ(key_value.second, value);
+    EXPECT_THROW(backend.Remove(key_value.first, nullptr), std::exception);
+  }
+  EXPECT_EQ(0U, FileCount(*test_path));
+}
+
+TEST(DiskBackendTest, BEH_FilePerKeySubdirectories) {
+  TestPath test_path(CreateTestPath("MaidSafe_Test_DiskBackend"));
+  auto key_values(MakeKeyValues(10, 100));
+  // Files written directly in the root by earlier versions are moved into subdirectories, while
+  // other files are left alone.
+  for (size_t i(0); i != 5; ++i)
+    ASSERT_TRUE(WriteFile(*test_path / EncodeToBase32(key_values[i].first),
+                          key_values[i].second.string()));
+  ASSERT_TRUE(WriteFile(*test_path / "manifest", "other"));
+  detail::FilePerKeyDiskBackend backend(*test_path);
+  for (size_t i(5); i != key_values.size(); ++i)
+    EXPECT_NO_THROW(backend.Put(key_values[i].first, key_values[i].second));
+
+  for (auto& key_value : key_values) {
+    const std::string kPrefix(EncodeToHex(key_value.first.string().substr(0, 1)));
+    fs::path expected(*test_path / kPrefix.substr(0, 1) / kPrefix.substr(1, 1) /
+                      EncodeToBase32(key_value.first));
+    EXPECT_EQ(expected, backend.GetFilename(key_value.first));
+    EXPECT_TRUE(fs::exists(expected));
+    EXPECT_EQ(key_value.second, backend.Get(key_value.first));
+  }
+  EXPECT_TRUE(fs::exists(*test_path / "manifest"));
+  EXPECT_EQ(key_values.size() + 1, FileCount(*test_path));
+}
+
+TEST(DiskBackendTest, BEH_FilePerKeyDirectIo) {
+  TestPath test_path(CreateTestPath("MaidSafe_Test_DiskBackend"));
+  detail::FilePerKeyDiskBackend backend(*test_path, true);
+  // Sizes either side of a block boundary, since direct I/O transfers whole blocks.
+  std::vector<std::pair<Identity, NonEmptyString>> key_values;
+  for (size_t size : { 1, 4095, 4096, 4097, 10000 }) {
+    auto key_value(MakeKeyValues(1, size));
+    key_values.push_back(key_value[0]);
+    ASSERT_NO_THROW(backend.Put(key_values.back().first, key_values.back().second));
+    EXPECT_EQ(size, fs::file_size(backend.GetFilename(key_values.back().first)));
+  }
+
+  NonEmptyString value;
+  for (auto& key_value : key_values) {
+    EXPECT_EQ(key_value.second, backend.Get(key_value.first));
+    auto mapped(backend.Map(key_value.first));
+    EXPECT_EQ(key_value.second.string(), std::string(mapped.first.get(), mapped.second));
+    EXPECT_NO_THROW(backend.Remove(key_value.first, &value));
+    EXPECT_EQ(key_value.second, value);
+    EXPECT_THROW(backend.Get(key_value.first), std::exception);
+  }
+  EXPECT_EQ(0U, FileCount(*test_path));
+}
+
+TEST(DiskBackendTest, BEH_SegmentFile) {
+  TestPath test_path(CreateTestPath("MaidSafe_Test_DiskBackend"));
+  // Leftovers from a previous instance are removed.
+  ASSERT_TRUE(WriteFile(*test_path / "segment_7", "stale"));
+  const uint64_t kSegmentSize(1024);
+  detail::SegmentFileDiskBackend backend(*test_path, kSegmentSize);
+  EXPECT_FALSE(fs::exists(*test_path / "segment_7"));
+
+  auto key_values(MakeKeyValues(50, 100));
+  for (auto& key_value : key_values)
+    EXPECT_NO_THROW(backend.Put(key_value.first, key_value.second));
+  // Each segment holds a few records, so values are spread over several files.
+  EXPECT_LT(1U, backend.segment_count());
+  EXPECT_GT(key_values.size(), backend.segment_count());
+  EXPECT_EQ(backend.segment_count(), FileCount(*test_path));
+
+  for (auto& key_value : key_values)
+    EXPECT_EQ(key_value.second, backend.Get(key_value.first));
+
+  // A value larger than the segment size still fits in a segment of its own.
+  auto large(MakeKeyValues(1, 2 * kSegmentSize));
+  EXPECT_NO_THROW(backend.Put(large[0].first, large[0].second));
+  EXPECT_EQ(large[0].second, backend.Get(large[0].first));
+
+  NonEmptyString value;
+  EXPECT_NO_THROW(backend.Remove(large[0].first, &value));
+  EXPECT_EQ(large[0].second, value);
+  EXPECT_THROW(backend.Get(large[0].first), std::exception);
+  EXPECT_THROW(backend.Remove(large[0].first, nullptr), std::exception);
+}
+
+TEST(DiskBackendTest, BEH_SegmentFileCompaction) {
+  TestPath test_path(CreateTestPath("MaidSafe_Test_DiskBackend"));
+  detail::SegmentFileDiskBackend backend(*test_path, 4096);
+  auto key_values(MakeKeyValues(200, 100));
+  for (auto& key_value : key_values)
+    ASSERT_NO_THROW(backend.Put(key_value.first, key_value.second));
+  size_t initial_segment_count(backend.segment_count());
+
+  // Remove all but every fourth value, leaving every segment mostly dead.
+  std::vector<std::pair<Identity, NonEmptyString>> remaining;
+  for (size_t i(0); i != key_values.size(); ++i) {
+    if (i % 4 == 0)
+      remaining.push_back(key_values[i]);
+    else
+      ASSERT_NO_THROW(backend.Remove(key_values[i].first, nullptr));
+  }
+  backend.WaitForCompaction();
+  EXPECT_GT(initial_segment_count, backend.segment_count());
+  EXPECT_EQ(backend.segment_count(), FileCount(*test_path));
+  for (auto& key_value : remaining)
+    EXPECT_EQ(key_value.second, backend.Get(key_value.first));
+
+  for (auto& key_value : remaining)
+    ASSERT_NO_THROW(backend.Remove(key_value.first, nullptr));
+  backend.WaitForCompaction();
+  EXPECT_EQ(1U, backend.segment_count());
+}
+
+TEST(DiskBackendTest, BEH_SegmentFileConcurrentAccess) {
+  TestPath test_path(CreateTestPath("MaidSafe_Test_DiskBackend"));
+  detail::SegmentFileDiskBackend backend(*test_path, 4096);
+  const size_t kThreadCount(4);
+  std::vector<std::vector<std::pair<Identity, NonEmptyString>>> key_values;
+  for (size_t i(0); i != kThreadCount; ++i)
+    key_values.push_back(MakeKeyValues(100, 100));
+
+  // Each thread stores, reads and removes its own values, so segments are written, read and
+  // compacted at the same time.
+  std::vector<std::future<void>> threads;
+  for (size_t i(0); i != kThreadCount; ++i) {
+    threads.push_back(std::async(std::launch::async, [&backend, &key_values, i] {
+      auto& own(key_values[i]);
+      for (auto& key_value : own)
+        backend.Put(key_value.first, key_value.second);
+      for (size_t j(0); j != own.size(); ++j) {
+        if (backend.Get(own[j].first) != own[j].second)
+          ThrowError(CommonErrors::invalid_parameter);
+        if (j % 4 != 0)
+          backend.Remove(own[j].first, nullptr);
+      }
+    }));
+  }
+  for (auto& thread : threads)
+    EXPECT_NO_THROW(thread.get());
+
+  backend.WaitForCompaction();
+  EXPECT_EQ(backend.segment_count(), FileCount(*test_path));
+  for (auto& own : key_values) {
+    for (size_t j(0); j != own.size(); ++j) {
+      if (j % 4 == 0)
+        EXPECT_EQ(own[j].second, backend.Get(own[j].first));
+      else
+        EXPECT_THROW(backend.Get(own[j].first), std::exception);
+    }
+  }
+}
+
+TEST(DiskBackendTest, BEH_SegmentFileRecovery) {
+  TestPath test_path(CreateTestPath("MaidSafe_Test_DiskBackend"));
+  auto key_values(MakeKeyValues(50, 100));
+  {
+    detail::SegmentFileDiskBackend backend(*test_path, 1024);
+    for (auto& key_value : key_values)
+      ASSERT_NO_THROW(backend.Put(key_value.first, key_value.second));
+    ASSERT_NO_THROW(backend.Remove(key_values.back().first, nullptr));
+    ASSERT_NO_THROW(backend.SaveIndex());
+  }
+  key_values.pop_back();
+
+  {
+    detail::SegmentFileDiskBackend backend(*test_path, 1024, true);
+    for (auto& key_value : key_values)
+      EXPECT_EQ(key_value.second, backend.Get(key_value.first));
+    // New values go to a new segment.
+    auto extra(MakeKeyValues(1, 100));
+    EXPECT_NO_THROW(backend.Put(extra[0].first, extra[0].second));
+    EXPECT_EQ(extra[0].second, backend.Get(extra[0].first));
+  }
+
+  // The saved index is only loaded once.
+  EXPECT_THROW(detail::SegmentFileDiskBackend(*test_path, 1024, true), std::exception);
+  detail::SegmentFileDiskBackend backend(*test_path, 1024);
+  EXPECT_EQ(1U, FileCount(*test_path));
+  EXPECT_THROW(backend.Get(key_values.front().first), std::exception);
+}
+
+TEST(DiskBackendTest, BEH_Map) {
+  TestPath test_path(CreateTestPath("MaidSafe_Test_DiskBackend"));
+  ASSERT_TRUE(fs::create_directories(*test_path / "file_per_key"));
+  ASSERT_TRUE(fs::create_directories(*test_path / "segment_file"));
+  detail::FilePerKeyDiskBackend file_per_key(*test_path / "file_per_key");
+  detail::SegmentFileDiskBackend segment_file(*test_path / "segment_file", 4096);
+  auto key_values(MakeKeyValues(10, 1000));
+  for (detail::DiskBackend* backend : std::vector<detail::DiskBackend*>{ &file_per_key,
+                                                                          &segment_file }) {
+    std::vector<std::pair<std::shared_ptr<const char>, size_t>> mapped;
+    for (auto& key_value : key_values) {
+      ASSERT_NO_THROW(backend->Put(key_value.first, key_value.second));
+      ASSERT_NO_THROW(mapped.push_back(backend->Map(key_value.first)));
+    }
+    // The mapped bytes outlive the values' removal.
+    for (auto& key_value : key_values)
+      ASSERT_NO_THROW(backend->Remove(key_value.first, nullptr));
+    for (size_t i(0); i != key_values.size(); ++i) {
+      EXPECT_EQ(key_values[i].second.string(), std::string(mapped[i].first.get(),
+                                                           mapped[i].second));
+    }
+    EXPECT_THROW(backend->Map(key_values[0].first), std::exception);
+  }
+}
+
+TEST(DiskBackendTest, BEH_ReadRange) {
+  TestPath test_path(CreateTestPath("MaidSafe_Test_DiskBackend"));
+  ASSERT_TRUE(fs::create_directories(*test_path / "file_per_key"));
+  ASSERT_TRUE(fs::create_directories(*test_path / "direct_io"));
+  ASSERT_TRUE(fs::create_directories(*test_path / "segment_file"));
+  detail::FilePerKeyDiskBackend file_per_key(*test_path / "file_per_key");
+  detail::FilePerKeyDiskBackend direct_io(*test_path / "direct_io", true);
+  detail::SegmentFileDiskBackend segment_file(*test_path / "segment_file", 64 * 1024);
+  auto key_values(MakeKeyValues(3, 10000));
+  // Ranges either side of block boundaries, since direct I/O transfers whole blocks.
+  const std::vector<std::pair<uint64_t, size_t>> kRanges{ { 0, 1 }, { 4095, 2 }, { 4096, 4096 },
+                                                          { 9990, 10 }, { 10000, 0 } };
+  for (detail::DiskBackend* backend : std::vector<detail::DiskBackend*>{ &file_per_key,
+                                                                          &direct_io,
+                                                                          &segment_file }) {
+    for (auto& key_value : key_values)
+      ASSERT_NO_THROW(backend->Put(key_value.first, key_value.second));
+    std::vector<std::pair<std::shared_ptr<const char>, size_t>> ranges;
+    for (auto& range : kRanges) {
+      ASSERT_NO_THROW(ranges.push_back(backend->ReadRange(key_values[1].first, range.first,
+                                                          range.second)));
+    }
+    // The bytes read outlive the value's removal.
+    for (auto& key_value : key_values)
+      ASSERT_NO_THROW(backend->Remove(key_value.first, nullptr));
+    for (size_t i(0); i != kRanges.size(); ++i) {
+      ASSERT_EQ(kRanges[i].second, ranges[i].second);
+      EXPECT_EQ(key_values[1].second.string().substr(kRanges[i].first, kRanges[i].second),
+                std::string(ranges[i].first.get(), ranges[i].second));
+    }
+    EXPECT_THROW(backend->ReadRange(key_values[1].first, 0, 1), std::exception);
+  }
+}
+
+TEST(DiskBackendTest, BEH_DiskManifest) {
+  TestPath test_path(CreateTestPath("MaidSafe_Test_DiskBackend"));
+  fs::path path(*test_path / "manifest");
+  detail::DiskManifest manifest, recovered;
+  EXPECT_FALSE(detail::ReadDiskManifest(path, 0, recovered));
+  for (auto& key_value : MakeKeyValues(10, 100))
+    manifest.push_back(std::make_pair(key_value.first, key_value.second.string().size()));
+  ASSERT_NO_THROW(detail::WriteDiskManifest(path, 1, manifest));
+  EXPECT_FALSE(detail::ReadDiskManifest(path, 0, recovered));
+  ASSERT_TRUE(detail::ReadDiskManifest(path, 1, recovered));
+  EXPECT_TRUE(manifest == recovered);
+
+  std::string truncated;
+  ASSERT_TRUE(ReadFile(path, &truncated));
+  truncated.resize(truncated.size() - 1);
+  ASSERT_TRUE(WriteFile(path, truncated));
+  EXPECT_FALSE(detail::ReadDiskManifest(path, 1, recovered));
+}
+
+}  // namespace test
+
+}  // namespace maidsafe
@@ -0,0 +1,151 @@
+/* Copyright 2012 MaidSafe.net limited
+
+This MaidSafe Software is licensed under the MaidSafe.net Commercial License, version 1.0 or later,
+and The General Public License (GPL), version 3. By contributing code to this project You agree to
+the terms laid out in the MaidSafe Contributor Agreement, version 1.0, found in the root directory
+of this project at LICENSE, COPYING and CONTRIBUTOR respectively and also available at:
+
+http://www.novinet.com/license
+
+Unless required by applicable law or agreed to in writing, software distributed under the License is
+distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or
+implied. See the License for the specific language governing permissions and limitations under the
+License.
+*/
+
+#include "maidsafe/common/eviction_queue.h"
+
+#include <vector>
+
+#include "maidsafe/common/error.h"
+#include "maidsafe/common/test.h"
+#include "maidsafe/common/utils.h"
+
+
+namespace maidsafe {
+
+namespace test {
+
+namespace {
+
+std::vector<Identity> MakeKeys(size_t count) {
+  std::vector<Identity> keys;
+  while (keys.size() != count)
+    keys.push_back(Identity(RandomString(64)));
+  return keys;
+}
+
+}  // unnamed namespace
+
+TEST(EvictionQueueTest, BEH_Lru) {
+  detail::LruEvictionQueue queue;
+  EXPECT_TRUE(queue.empty());
+  EXPECT_THROW(queue.Pop(), std::exception);
+  auto keys(MakeKeys(3));
+  for (auto& key : keys)
+    queue.Add(key, 1);
+  EXPECT_FALSE(queue.empty());
+
+  queue.Touch(keys[0]);
+  queue.Touch(Identity(RandomString(64)));
+  EXPECT_EQ(keys[1], queue.Pop());
+  queue.Remove(keys[2]);
+  queue.Remove(keys[2]);
+  EXPECT_EQ(keys[0], queue.Pop());
+  EXPECT_TRUE(queue.empty());
+}
+
+TEST(EvictionQueueTest, BEH_Lfu) {
+  detail::LfuEvictionQueue queue;
+  auto keys(MakeKeys(4));
+  for (auto& key : keys)
+    queue.Add(key, 1);
+  queue.Touch(keys[0]);
+  queue.Touch(keys[0]);
+  queue.Touch(keys[1]);
+  queue.Touch(keys[3]);
+  // Of the equally used keys[1] and keys[3], keys[1] was used less recently.
+  EXPECT_EQ(keys[2], queue.Pop());
+  EXPECT_EQ(keys[1], queue.Pop());
+  EXPECT_EQ(keys[3], queue.Pop());
+  EXPECT_EQ(keys[0], queue.Pop());
+  EXPECT_TRUE(queue.empty());
+}
+
+TEST(EvictionQueueTest, BEH_Arc) {
+  detail::ArcEvictionQueue queue;
+  auto keys(MakeKeys(3));
+  for (auto& key : keys)
+    queue.Add(key, 1);
+  // keys[0] has been used twice, so is kept over the other two.
+  queue.Touch(keys[0]);
+  EXPECT_EQ(keys[1], queue.Pop());
+
+  // keys[1] returning soon after eviction makes room for more of the keys used once, so
+  // frequently used keys are evicted next.
+  queue.Add(keys[1], 1);
+  EXPECT_EQ(keys[0], queue.Pop());
+  EXPECT_EQ(keys[1], queue.Pop());
+  EXPECT_EQ(keys[2], queue.Pop());
+  EXPECT_TRUE(queue.empty());
+  EXPECT_THROW(queue.Pop(), std::exception);
+
+  // Evicted keys aren't candidates, so can't be removed or touched.
+  queue.Remove(keys[0]);
+  queue.Touch(keys[0]);
+  EXPECT_TRUE(queue.empty());
+}
+
+TEST(EvictionQueueTest, BEH_Gdsf) {
+  detail::GdsfEvictionQueue queue;
+  auto keys(MakeKeys(4));
+  // Larger values are evicted first, unless used more often.  Sizes are powers of two so that the
+  // priorities are exact.
+  queue.Add(keys[0], 4);
+  queue.Add(keys[1], 1024);
+  EXPECT_EQ(keys[1], queue.Pop());
+  queue.Add(keys[1], 4);
+  queue.Add(keys[2], 4);
+  queue.Touch(keys[0]);
+  queue.Touch(keys[0]);
+  queue.Touch(keys[2]);
+  EXPECT_EQ(keys[1], queue.Pop());
+  EXPECT_EQ(keys[2], queue.Pop());
+
+  // Each eviction raises the priority of later additions, so that keys[0]'s three uses now count
+  // for no more than keys[3]'s one, and the older is evicted.
+  queue.Add(keys[3], 4);
+  EXPECT_EQ(keys[0], queue.Pop());
+  EXPECT_EQ(keys[3], queue.Pop());
+  EXPECT_TRUE(queue.empty());
+}
+
+TEST(EvictionQueueTest, BEH_PendingTouches) {
+  detail::LruEvictionQueue queue;
+  detail::PendingTouches touches;
+  auto keys(MakeKeys(3));
+  for (auto& key : keys)
+    queue.Add(key, 1);
+
+  // Recorded reads have no effect until applied.
+  EXPECT_FALSE(touches.Record(keys[0]));
+  EXPECT_FALSE(touches.Record(keys[1]));
+  touches.Apply(queue);
+  touches.Apply(queue);
+  EXPECT_EQ(keys[2], queue.Pop());
+  EXPECT_EQ(keys[0], queue.Pop());
+
+  // A full stripe asks to be applied, and drops further reads until it is.
+  queue.Add(keys[0], 1);
+  for (size_t i(1); i != detail::PendingTouches::kMaxPerStripe; ++i)
+    EXPECT_FALSE(touches.Record(keys[2]));
+  EXPECT_TRUE(touches.Record(keys[2]));
+  EXPECT_TRUE(touches.Record(keys[1]));
+  touches.Apply(queue);
+  EXPECT_EQ(keys[1], queue.Pop());
+  EXPECT_FALSE(touches.Record(keys[1]));
+}
+
+}  // namespace test
+
+}  // namespace maidsafe
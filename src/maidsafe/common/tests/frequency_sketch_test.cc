@@ -0,0 +1,81 @@
+/* Copyright 2012 MaidSafe.net limited
+
+This MaidSafe Software is licensed under the MaidSafe.net Commercial License, version 1.0 or later,
+and The General Public License (GPL), version 3. By contributing code to this project You agree to
+the terms laid out in the MaidSafe Contributor Agreement, version 1.0, found in the root directory
+of this project at LICENSE, COPYING and CONTRIBUTOR respectively and also available at:
+
+http://www.novinet.com/license
+
+Unless required by applicable law or agreed to in writing, software distributed under the License is
+distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or
+implied. See the License for the specific language governing permissions and limitations under the
+License.
+*/
+
+#include "maidsafe/common/frequency_sketch.h"
+
+#include <vector>
+
+#include "maidsafe/common/error.h"
+#include "maidsafe/common/test.h"
+#include "maidsafe/common/utils.h"
+
+
+namespace maidsafe {
+
+namespace test {
+
+namespace {
+
+std::vector<Identity> MakeKeys(size_t count) {
+  std::vector<Identity> keys;
+  while (keys.size() != count)
+    keys.push_back(Identity(RandomString(64)));
+  return keys;
+}
+
+}  // unnamed namespace
+
+TEST(FrequencySketchTest, BEH_Estimate) {
+  EXPECT_THROW(detail::FrequencySketch(0), std::exception);
+  detail::FrequencySketch sketch(1000);
+  auto keys(MakeKeys(100));
+  for (size_t i(0); i != keys.size(); ++i) {
+    for (size_t j(0); j != i % 5; ++j)
+      sketch.Record(keys[i]);
+  }
+  // Collisions can only inflate an estimate, and with so few keys rarely do.
+  size_t inflated(0);
+  for (size_t i(0); i != keys.size(); ++i) {
+    uint32_t estimate(sketch.Estimate(keys[i]));
+    EXPECT_LE(i % 5, estimate);
+    if (estimate != i % 5)
+      ++inflated;
+  }
+  EXPECT_LT(inflated, 5U);
+
+  // Estimates saturate rather than wrap.
+  for (uint32_t i(0); i != 2 * detail::FrequencySketch::kMaxFrequency; ++i)
+    sketch.Record(keys[0]);
+  EXPECT_EQ(detail::FrequencySketch::kMaxFrequency, sketch.Estimate(keys[0]));
+}
+
+TEST(FrequencySketchTest, BEH_Ageing) {
+  const uint64_t kCapacity(100);
+  detail::FrequencySketch sketch(kCapacity);
+  auto keys(MakeKeys(2));
+  for (int i(0); i != 12; ++i)
+    sketch.Record(keys[0]);
+  EXPECT_EQ(12U, sketch.Estimate(keys[0]));
+
+  // Once ten uses per key of capacity have been recorded, every count is halved.
+  for (uint64_t i(12); i != 10 * kCapacity; ++i)
+    sketch.Record(keys[1]);
+  EXPECT_EQ(6U, sketch.Estimate(keys[0]));
+  EXPECT_GE(detail::FrequencySketch::kMaxFrequency / 2, sketch.Estimate(keys[1]));
+}
+
+}  // namespace test
+
+}  // namespace maidsafe
@@ -0,0 +1,108 @@
+/* Copyright 2012 MaidSafe.net limited
+
+This MaidSafe Software is licensed under the MaidSafe.net Commercial License, version 1.0 or later,
+and The General Public License (GPL), version 3. By contributing code to this project You agree to
+the terms laid out in the MaidSafe Contributor Agreement, version 1.0, found in the root directory
+of this project at LICENSE, COPYING and CONTRIBUTOR respectively and also available at:
+
+http://www.novinet.com/license
+
+Unless required by applicable law or agreed to in writing, software distributed under the License is
+distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or
+implied. See the License for the specific language governing permissions and limitations under the
+License.
+*/
+
+#include "maidsafe/common/key_order.h"
+
+#include <algorithm>
+#include <list>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "maidsafe/common/test.h"
+#include "maidsafe/common/utils.h"
+
+
+namespace maidsafe {
+
+namespace test {
+
+namespace {
+
+std::vector<Identity> FindAll(const detail::KeyOrder& key_order, const std::string& prefix,
+                              size_t batch_size) {
+  std::vector<Identity> found;
+  std::vector<std::pair<Identity, uint64_t>> batch;
+  Identity after;
+  for (bool done(false); !done;) {
+    batch.clear();
+    done = key_order.Find(after, prefix, batch_size, batch);
+    EXPECT_GE(batch_size, batch.size());
+    if (!batch.empty())
+      after = batch.back().first;
+    for (const auto& entry : batch)
+      found.push_back(entry.first);
+  }
+  return found;
+}
+
+}  // unnamed namespace
+
+TEST(KeyOrderTest, BEH_Find) {
+  // The KeyOrder refers to the keys rather than copying them, so they're held in a list.
+  const std::string kPrefix(9, '\x7f');
+  std::list<Identity> keys;
+  std::vector<Identity> expected, expected_with_prefix;
+  detail::KeyOrder key_order;
+  for (int i(0); i != 60; ++i) {
+    // Some keys share more than their leading eight bytes.
+    keys.push_back(Identity(i < 10 ? kPrefix + RandomString(55) : RandomString(64)));
+    key_order.Insert(keys.back(), i);
+    expected.push_back(keys.back());
+    if (i < 10)
+      expected_with_prefix.push_back(keys.back());
+  }
+  key_order.Insert(keys.front(), 100);
+  EXPECT_EQ(60U, key_order.size());
+  std::sort(expected.begin(), expected.end());
+  std::sort(expected_with_prefix.begin(), expected_with_prefix.end());
+  EXPECT_EQ(expected, FindAll(key_order, "", 7));
+  EXPECT_EQ(expected, FindAll(key_order, "", 60));
+  EXPECT_EQ(expected_with_prefix, FindAll(key_order, kPrefix, 3));
+  EXPECT_TRUE(FindAll(key_order, std::string(64, '\x7f'), 3).empty());
+
+  // Sequences are returned with their keys, and a batch may resume after an erased key.
+  std::vector<std::pair<Identity, uint64_t>> batch;
+  EXPECT_FALSE(key_order.Find(Identity(), "", 1, batch));
+  ASSERT_EQ(1U, batch.size());
+  EXPECT_EQ(expected[0], batch[0].first);
+  uint64_t sequence(0);
+  for (const auto& key : keys) {
+    if (key == expected[0])
+      break;
+    ++sequence;
+  }
+  EXPECT_EQ(sequence, batch[0].second);
+  key_order.Erase(expected[0]);
+  EXPECT_EQ(59U, key_order.size());
+  batch.clear();
+  EXPECT_FALSE(key_order.Find(expected[0], "", 1, batch));
+  ASSERT_EQ(1U, batch.size());
+  EXPECT_EQ(expected[1], batch[0].first);
+  expected.erase(expected.begin());
+  EXPECT_EQ(expected, FindAll(key_order, "", 7));
+
+  // The table shrinks as keys are erased.
+  while (expected.size() != 3) {
+    key_order.Erase(expected.back());
+    expected.pop_back();
+  }
+  EXPECT_EQ(3U, key_order.size());
+  EXPECT_EQ(expected, FindAll(key_order, "", 2));
+}
+
+}  // namespace test
+
+}  // namespace maidsafe
@@ -15,11 +15,19 @@ License.
 
 #include "maidsafe/common/key_value_buffer.h"
 
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <future>
+#include <map>
 #include <memory>
+#include <set>
+#include <thread>
 
 #include "boost/filesystem/operations.hpp"
 #include "boost/filesystem/path.hpp"
 
+#include "maidsafe/common/asio_service.h"
 #include "maidsafe/common/error.h"
 #include "maidsafe/common/test.h"
 #include "maidsafe/common/utils.h"
@@ -119,6 +127,13 @@ class KeyValueBufferTest : public testing::Test {
     return kvb.kDiskBuffer_;
   }
 
+  // Returns true once every value held in memory has also been copied to disk.
+  bool AllSpilled(KeyValueBuffer& kvb) {
+    std::lock_guard<std::mutex> lock(kvb.memory_store_.mutex);
+    return kvb.memory_store_.index.not_on_disk.empty() &&
+           kvb.memory_store_.index.storing_to_disk.empty();
+  }
+
   MemoryUsage max_memory_usage_;
   DiskUsage max_disk_usage_;
   fs::path kv_buffer_path_;
@@ -134,6 +149,17 @@ TEST_F(KeyValueBufferTest, BEH_Constructor) {
   EXPECT_THROW(KeyValueBuffer(MemoryUsage(200001), DiskUsage(200000), pop_functor_),
                std::exception);
   EXPECT_NO_THROW(KeyValueBuffer(MemoryUsage(199999), DiskUsage(200000), pop_functor_));
+  KeyValueBuffer::Options options;
+  options.spill_writer_count = 0;
+  EXPECT_THROW(KeyValueBuffer(MemoryUsage(1), DiskUsage(1), pop_functor_, options), std::exception);
+  options.spill_writer_count = 1;
+  options.spill_batch_size = 0;
+  EXPECT_THROW(KeyValueBuffer(MemoryUsage(1), DiskUsage(1), pop_functor_, options), std::exception);
+  options.spill_batch_size = 1;
+  options.direct_disk_io = true;
+  EXPECT_NO_THROW(KeyValueBuffer(MemoryUsage(1), DiskUsage(1), pop_functor_, options));
+  options.disk_layout = KeyValueBuffer::DiskLayout::kSegmentFile;
+  EXPECT_THROW(KeyValueBuffer(MemoryUsage(1), DiskUsage(1), pop_functor_, options), std::exception);
   // Create a path to a file, and check that this can't be used as the disk buffer path.
   TestPath test_path(CreateTestPath("MaidSafe_Test_KeyValueBuffer"));
   ASSERT_FALSE(test_path->empty());
@@ -184,6 +210,32 @@ TEST_F(KeyValueBufferTest, BEH_SetMaxDiskMemoryUsage) {
   EXPECT_NO_THROW(key_value_buffer_->SetMaxDiskUsage(DiskUsage(kDefaultMaxDiskUsage)));
 }
 
+TEST_F(KeyValueBufferTest, BEH_LowerMaxDiskUsageWhileWaiting) {
+  key_value_buffer_.reset(new KeyValueBuffer(MemoryUsage(1), DiskUsage(2 * OneKB),
+                                             pop_functor_));
+  std::vector<std::pair<Identity, NonEmptyString>> key_value_pairs;
+  for (int i(0); i != 3; ++i) {
+    NonEmptyString value(RandomAlphaNumericString(OneKB));
+    key_value_pairs.push_back(std::make_pair(Identity(crypto::Hash<crypto::SHA512>(value)),
+                                             value));
+  }
+  // The values go straight to disk, and the third waits for space which never comes.
+  for (int i(0); i != 2; ++i)
+    ASSERT_NO_THROW(key_value_buffer_->Store(key_value_pairs[i].first, key_value_pairs[i].second));
+  auto store(std::async(std::launch::async, [&] {
+      key_value_buffer_->Store(key_value_pairs[2].first, key_value_pairs[2].second);
+  }));
+  for (int i(0); i != 100 && key_value_buffer_->LargestUnwrittenValue() == 0; ++i)
+    Sleep(boost::posix_time::milliseconds(10));
+  ASSERT_NE(0U, key_value_buffer_->LargestUnwrittenValue());
+
+  // Once the max is below the waiting value's size, it can never be stored.
+  EXPECT_NO_THROW(key_value_buffer_->SetMaxDiskUsage(DiskUsage(OneKB - 1)));
+  ASSERT_EQ(std::future_status::ready, store.wait_for(std::chrono::seconds(5)));
+  EXPECT_THROW(store.get(), std::exception);
+  EXPECT_THROW(key_value_buffer_->Get(key_value_pairs[0].first), std::exception);
+}
+
 TEST_F(KeyValueBufferTest, BEH_RemoveDiskBuffer) {
   boost::system::error_code error_code;
   TestPath test_path(CreateTestPath("MaidSafe_Test_KeyValueBuffer"));
@@ -194,8 +246,16 @@ TEST_F(KeyValueBufferTest, BEH_RemoveDiskBuffer) {
   Identity key(RandomAlphaNumericString(crypto::SHA512::DIGESTSIZE));
   NonEmptyString small_value(std::string(kMemorySize, 'a'));
   EXPECT_NO_THROW(key_value_buffer_->Store(key, small_value));
+  // Wait for the spill writer to finish with the value, so that it's deleted from disk here.
+  for (int i(0); i != 100 && (key_value_buffer_->stats().values_spilled == 0 ||
+                              key_value_buffer_->LargestUnwrittenValue() != 0); ++i) {
+    Sleep(boost::posix_time::milliseconds(10));
+  }
+  ASSERT_EQ(1U, key_value_buffer_->stats().values_spilled);
+  ASSERT_EQ(0U, key_value_buffer_->LargestUnwrittenValue());
   EXPECT_NO_THROW(key_value_buffer_->Delete(key));
-  ASSERT_EQ(1, fs::remove_all(kv_buffer_path, error_code));
+  // The buffer's directory, and the two levels of subdirectories for key.
+  ASSERT_EQ(3, fs::remove_all(kv_buffer_path, error_code));
   ASSERT_FALSE(fs::exists(kv_buffer_path, error_code));
   // Fits into memory buffer successfully.  Background thread in future should throw, causing other
   // API functions to throw on next execution.
@@ -210,7 +270,8 @@ TEST_F(KeyValueBufferTest, BEH_RemoveDiskBuffer) {
   NonEmptyString large_value(std::string(kDiskSize, 'a'));
   EXPECT_NO_THROW(key_value_buffer_->Store(key, large_value));
   EXPECT_NO_THROW(key_value_buffer_->Delete(key));
-  ASSERT_EQ(1, fs::remove_all(kv_buffer_path, error_code));
+  // The value was written straight to disk, so its subdirectories exist.
+  ASSERT_EQ(3, fs::remove_all(kv_buffer_path, error_code));
   ASSERT_FALSE(fs::exists(kv_buffer_path, error_code));
   // Skips memory buffer and goes straight to disk, causing exception.  Background thread in future
   // should finish, causing other API functions to throw on next execution.
@@ -251,10 +312,11 @@ TEST_F(KeyValueBufferTest, BEH_DeleteOnDiskBufferOverfill) {
   Identity first_key(key_value_pairs[0].first), second_key(key_value_pairs[1].first);
   value = NonEmptyString(std::string(RandomAlphaNumericString(static_cast<uint32_t>(2 * OneKB))));
   key = Identity(crypto::Hash<crypto::SHA512>(value));
+  // Get must run before the Store below starts, since Get blocks once the value is being stored.
+  EXPECT_THROW(recovered = key_value_buffer_->Get(key), std::exception);
   auto async = std::async(std::launch::async, [this, key, value] {
                                                   key_value_buffer_->Store(key, value);
                                               });
-  EXPECT_THROW(recovered = key_value_buffer_->Get(key), std::exception);
   EXPECT_NO_THROW(key_value_buffer_->Delete(first_key));
   EXPECT_NO_THROW(key_value_buffer_->Delete(second_key));
   EXPECT_NO_THROW(async.wait());
@@ -556,6 +618,1310 @@ TEST_F(KeyValueBufferTest, BEH_RandomAsync) {
   key_value_buffer_.reset();
 }
 
+TEST_F(KeyValueBufferTest, BEH_SegmentFileLayout) {
+  std::vector<std::pair<Identity, NonEmptyString>> popped;
+  std::mutex pop_mutex;
+  KeyValueBuffer::PopFunctor pop_functor([&](const Identity& key, const NonEmptyString& value) {
+      std::lock_guard<std::mutex> lock(pop_mutex);
+      popped.push_back(std::make_pair(key, value));
+  });
+  TestPath test_path(CreateTestPath("MaidSafe_Test_KeyValueBuffer"));
+  kv_buffer_path_ = fs::path(*test_path / "kv_buffer");
+  KeyValueBuffer::Options options;
+  options.disk_layout = KeyValueBuffer::DiskLayout::kSegmentFile;
+  const size_t kDiskEntries(8);
+  key_value_buffer_.reset(new KeyValueBuffer(MemoryUsage(2 * OneKB),
+                                             DiskUsage(kDiskEntries * OneKB),
+                                             pop_functor,
+                                             kv_buffer_path_,
+                                             options));
+  std::vector<std::pair<Identity, NonEmptyString>> key_value_pairs;
+  for (size_t i(0); i != 2 * kDiskEntries; ++i) {
+    NonEmptyString value(RandomAlphaNumericString(OneKB));
+    key_value_pairs.push_back(std::make_pair(Identity(crypto::Hash<crypto::SHA512>(value)),
+                                             value));
+    EXPECT_NO_THROW(key_value_buffer_->Store(key_value_pairs.back().first,
+                                             key_value_pairs.back().second));
+  }
+  // Only segment files are written, rather than one file per value.
+  for (fs::directory_iterator itr(kv_buffer_path_), end; itr != end; ++itr)
+    EXPECT_EQ(0U, (*itr).path().filename().string().find("segment_"));
+
+  NonEmptyString recovered;
+  for (auto& key_value : key_value_pairs) {
+    bool was_popped(false);
+    {
+      std::lock_guard<std::mutex> lock(pop_mutex);
+      for (auto& popped_key_value : popped) {
+        if (popped_key_value.first == key_value.first) {
+          EXPECT_EQ(key_value.second, popped_key_value.second);
+          was_popped = true;
+        }
+      }
+    }
+    if (!was_popped) {
+      EXPECT_NO_THROW(recovered = key_value_buffer_->Get(key_value.first));
+      EXPECT_EQ(key_value.second, recovered);
+      EXPECT_NO_THROW(key_value_buffer_->Delete(key_value.first));
+    }
+    EXPECT_THROW(key_value_buffer_->Get(key_value.first), std::exception);
+  }
+  EXPECT_FALSE(popped.empty());
+  key_value_buffer_.reset();
+}
+
+TEST_F(KeyValueBufferTest, BEH_PromoteDiskHits) {
+  TestPath test_path(CreateTestPath("MaidSafe_Test_KeyValueBuffer"));
+  kv_buffer_path_ = fs::path(*test_path / "kv_buffer");
+  KeyValueBuffer::Options options;
+  options.promote_disk_hits = true;
+  key_value_buffer_.reset(new KeyValueBuffer(MemoryUsage(2 * OneKB), DiskUsage(8 * OneKB),
+                                             pop_functor_, kv_buffer_path_, options));
+  std::vector<std::pair<Identity, NonEmptyString>> key_value_pairs;
+  for (int i(0); i != 6; ++i) {
+    NonEmptyString value(RandomAlphaNumericString(OneKB));
+    key_value_pairs.push_back(std::make_pair(Identity(crypto::Hash<crypto::SHA512>(value)),
+                                             value));
+    ASSERT_NO_THROW(key_value_buffer_->Store(key_value_pairs.back().first,
+                                             key_value_pairs.back().second));
+  }
+
+  // Promotion is best-effort and is skipped if no memory can be freed, so let the spills finish.
+  for (int i(0); i != 100 && key_value_buffer_->CurrentDiskUsage() < 6 * OneKB; ++i)
+    Sleep(boost::posix_time::milliseconds(10));
+
+  // The first value has been pushed out of memory, so is read from disk and then promoted.
+  NonEmptyString recovered;
+  EXPECT_NO_THROW(recovered = key_value_buffer_->Get(key_value_pairs[0].first));
+  EXPECT_EQ(key_value_pairs[0].second, recovered);
+  EXPECT_EQ(0U, key_value_buffer_->stats().memory_hits);
+  EXPECT_EQ(1U, key_value_buffer_->stats().disk_hits);
+  for (int i(0); i != 100 && key_value_buffer_->stats().promotions == 0; ++i)
+    Sleep(boost::posix_time::milliseconds(10));
+  ASSERT_EQ(1U, key_value_buffer_->stats().promotions);
+  EXPECT_GE(2 * OneKB, key_value_buffer_->CurrentMemoryUsage().data);
+
+  EXPECT_NO_THROW(recovered = key_value_buffer_->Get(key_value_pairs[0].first));
+  EXPECT_EQ(key_value_pairs[0].second, recovered);
+  EXPECT_EQ(1U, key_value_buffer_->stats().memory_hits);
+  EXPECT_EQ(1U, key_value_buffer_->stats().disk_hits);
+
+  // Deleting the value removes the promoted copy along with the disk copy.
+  EXPECT_NO_THROW(key_value_buffer_->Delete(key_value_pairs[0].first));
+  EXPECT_THROW(key_value_buffer_->Get(key_value_pairs[0].first), std::exception);
+  EXPECT_EQ(1U, key_value_buffer_->stats().misses);
+
+  // Without the option, disk hits are counted but never promoted.
+  key_value_buffer_.reset(new KeyValueBuffer(MemoryUsage(OneKB), DiskUsage(4 * OneKB),
+                                             pop_functor_, *test_path / "kv_buffer2"));
+  for (int i(1); i != 4; ++i) {
+    ASSERT_NO_THROW(key_value_buffer_->Store(key_value_pairs[i].first,
+                                             key_value_pairs[i].second));
+  }
+  EXPECT_NO_THROW(recovered = key_value_buffer_->Get(key_value_pairs[1].first));
+  EXPECT_EQ(key_value_pairs[1].second, recovered);
+  EXPECT_NO_THROW(recovered = key_value_buffer_->Get(key_value_pairs[1].first));
+  EXPECT_EQ(2U, key_value_buffer_->stats().disk_hits);
+  EXPECT_EQ(0U, key_value_buffer_->stats().promotions);
+  key_value_buffer_.reset();
+}
+
+TEST_F(KeyValueBufferTest, BEH_Batch) {
+  TestPath test_path(CreateTestPath("MaidSafe_Test_KeyValueBuffer"));
+  kv_buffer_path_ = fs::path(*test_path / "kv_buffer");
+  key_value_buffer_.reset(new KeyValueBuffer(MemoryUsage(4 * OneKB), DiskUsage(32 * OneKB),
+                                             pop_functor_, kv_buffer_path_));
+  std::vector<std::pair<Identity, NonEmptyString>> key_value_pairs;
+  std::vector<Identity> keys;
+  for (int i(0); i != 20; ++i) {
+    NonEmptyString value(RandomAlphaNumericString(OneKB));
+    key_value_pairs.push_back(std::make_pair(Identity(crypto::Hash<crypto::SHA512>(value)),
+                                             value));
+    keys.push_back(key_value_pairs.back().first);
+  }
+  // Too large for memory, so is written straight to disk.
+  NonEmptyString large_value(RandomAlphaNumericString(8 * OneKB));
+  key_value_pairs.push_back(std::make_pair(Identity(crypto::Hash<crypto::SHA512>(large_value)),
+                                           large_value));
+  keys.push_back(key_value_pairs.back().first);
+  // A repeated key keeps the last value given for it.
+  NonEmptyString replacement(RandomAlphaNumericString(OneKB));
+  key_value_pairs.push_back(std::make_pair(keys[0], replacement));
+  EXPECT_NO_THROW(key_value_buffer_->StoreBatch(key_value_pairs));
+
+  Identity missing(RandomAlphaNumericString(crypto::SHA512::DIGESTSIZE));
+  keys.push_back(missing);
+  std::vector<NonEmptyString> values;
+  EXPECT_NO_THROW(values = key_value_buffer_->GetBatch(keys));
+  ASSERT_EQ(keys.size(), values.size());
+  EXPECT_EQ(replacement, values[0]);
+  for (size_t i(1); i != keys.size() - 1; ++i)
+    EXPECT_EQ(key_value_pairs[i].second, values[i]);
+  EXPECT_FALSE(values.back().IsInitialised());
+  EXPECT_EQ(1U, key_value_buffer_->stats().misses);
+
+  // Keys which aren't held are ignored.
+  EXPECT_NO_THROW(key_value_buffer_->DeleteBatch(keys));
+  EXPECT_NO_THROW(values = key_value_buffer_->GetBatch(keys));
+  for (auto& value : values)
+    EXPECT_FALSE(value.IsInitialised());
+  EXPECT_EQ(0U, key_value_buffer_->CurrentMemoryUsage().data);
+  EXPECT_EQ(0U, key_value_buffer_->CurrentDiskUsage().data);
+
+  // A repeated key keeps its last value when the copies go to different buffers, either way round.
+  NonEmptyString small_value(RandomAlphaNumericString(OneKB));
+  std::vector<std::pair<Identity, NonEmptyString>> repeated;
+  repeated.push_back(std::make_pair(keys[0], small_value));
+  repeated.push_back(std::make_pair(keys[0], large_value));
+  repeated.push_back(std::make_pair(keys[1], large_value));
+  repeated.push_back(std::make_pair(keys[1], small_value));
+  key_value_buffer_.reset(new KeyValueBuffer(MemoryUsage(4 * OneKB), DiskUsage(32 * OneKB),
+                                             pop_functor_, *test_path / "repeated"));
+  EXPECT_NO_THROW(key_value_buffer_->StoreBatch(repeated));
+  EXPECT_EQ(large_value, key_value_buffer_->Get(keys[0]));
+  EXPECT_EQ(small_value, key_value_buffer_->Get(keys[1]));
+  // Only the values kept are written to disk.
+  for (int i(0); i != 100 && key_value_buffer_->LargestUnwrittenValue() != 0; ++i)
+    Sleep(boost::posix_time::milliseconds(10));
+  ASSERT_EQ(0U, key_value_buffer_->LargestUnwrittenValue());
+  EXPECT_EQ(2U, key_value_buffer_->stats().values_spilled);
+  EXPECT_EQ(large_value, key_value_buffer_->Get(keys[0]));
+  EXPECT_EQ(small_value, key_value_buffer_->Get(keys[1]));
+  key_value_buffer_.reset();
+}
+
+TEST_F(KeyValueBufferTest, BEH_Async) {
+  TestPath test_path(CreateTestPath("MaidSafe_Test_KeyValueBuffer"));
+  kv_buffer_path_ = fs::path(*test_path / "kv_buffer");
+  std::atomic<int> above_high_water(0), below_high_water(0);
+  KeyValueBuffer::Options options;
+  options.async_high_water_mark = OneKB;
+  options.backpressure_functor = [&](bool above) {
+      ++(above ? above_high_water : below_high_water);
+  };
+  key_value_buffer_.reset(new KeyValueBuffer(MemoryUsage(OneKB), DiskUsage(3 * OneKB),
+                                             pop_functor_, kv_buffer_path_, options));
+  std::vector<std::pair<Identity, NonEmptyString>> key_value_pairs;
+  for (int i(0); i != 6; ++i) {
+    NonEmptyString value(RandomAlphaNumericString(OneKB));
+    key_value_pairs.push_back(std::make_pair(Identity(crypto::Hash<crypto::SHA512>(value)),
+                                             value));
+  }
+  // Fill the disk buffer, and the memory buffer with a value which can't be moved to disk.
+  for (int i(0); i != 4; ++i)
+    ASSERT_NO_THROW(key_value_buffer_->Store(key_value_pairs[i].first, key_value_pairs[i].second));
+
+  // These would block, so are queued and the futures aren't ready.
+  auto store4(key_value_buffer_->StoreAsync(key_value_pairs[4].first, key_value_pairs[4].second));
+  auto store5(key_value_buffer_->StoreAsync(key_value_pairs[5].first, key_value_pairs[5].second));
+  auto get3(key_value_buffer_->GetAsync(key_value_pairs[3].first));
+  EXPECT_EQ(1, above_high_water);
+  EXPECT_EQ(0, below_high_water);
+  EXPECT_EQ(std::future_status::timeout, store4.wait_for(std::chrono::milliseconds(100)));
+  EXPECT_EQ(std::future_status::timeout, store5.wait_for(std::chrono::milliseconds(0)));
+  EXPECT_EQ(std::future_status::timeout, get3.wait_for(std::chrono::milliseconds(0)));
+
+  for (int i(0); i != 3; ++i)
+    EXPECT_NO_THROW(key_value_buffer_->Delete(key_value_pairs[i].first));
+  EXPECT_NO_THROW(store4.get());
+  EXPECT_NO_THROW(store5.get());
+  EXPECT_EQ(key_value_pairs[3].second, get3.get());
+  for (int i(0); i != 100 && below_high_water == 0; ++i)
+    Sleep(boost::posix_time::milliseconds(10));
+  EXPECT_EQ(1, below_high_water);
+
+  // Once nothing is queued, a memory hit completes straight away.
+  auto get5(key_value_buffer_->GetAsync(key_value_pairs[5].first));
+  EXPECT_EQ(std::future_status::ready, get5.wait_for(std::chrono::milliseconds(0)));
+  EXPECT_EQ(key_value_pairs[5].second, get5.get());
+  Identity missing(RandomAlphaNumericString(crypto::SHA512::DIGESTSIZE));
+  EXPECT_THROW(key_value_buffer_->GetAsync(missing).get(), std::exception);
+
+  // Handlers are posted to the given io_service.
+  AsioService asio_service(1);
+  asio_service.Start();
+  std::promise<NonEmptyString> got;
+  key_value_buffer_->StoreAsync(key_value_pairs[0].first, key_value_pairs[0].second,
+                                asio_service.service(), [&](std::exception_ptr error) {
+      EXPECT_FALSE(error);
+      key_value_buffer_->GetAsync(key_value_pairs[0].first, asio_service.service(),
+                                  [&](std::exception_ptr error, const NonEmptyString& value) {
+          EXPECT_FALSE(error);
+          got.set_value(value);
+      });
+  });
+  EXPECT_EQ(key_value_pairs[0].second, got.get_future().get());
+  asio_service.Stop();
+  key_value_buffer_.reset();
+}
+
+TEST_F(KeyValueBufferTest, BEH_SpillWriterPool) {
+  std::vector<Identity> popped;
+  std::mutex pop_mutex;
+  KeyValueBuffer::PopFunctor pop_functor([&](const Identity& key, const NonEmptyString&) {
+      std::lock_guard<std::mutex> lock(pop_mutex);
+      popped.push_back(key);
+  });
+  auto popped_count([&]()->size_t {
+    std::lock_guard<std::mutex> lock(pop_mutex);
+    return popped.size();
+  });
+  TestPath test_path(CreateTestPath("MaidSafe_Test_KeyValueBuffer"));
+  // The writers' results must be the same whether or not they bypass the page cache.
+  for (bool direct_disk_io : { false, true }) {
+    popped.clear();
+    kv_buffer_path_ = fs::path(*test_path / (direct_disk_io ? "direct" : "buffered"));
+    KeyValueBuffer::Options options;
+    options.spill_writer_count = 4;
+    options.spill_batch_size = 3;
+    options.direct_disk_io = direct_disk_io;
+    const size_t kDiskEntries(16), kEntryCount(64);
+    key_value_buffer_.reset(new KeyValueBuffer(MemoryUsage(8 * OneKB),
+                                               DiskUsage(kDiskEntries * OneKB),
+                                               pop_functor, kv_buffer_path_, options));
+    std::vector<std::pair<Identity, NonEmptyString>> key_value_pairs;
+    for (size_t i(0); i != kEntryCount; ++i) {
+      NonEmptyString value(RandomAlphaNumericString(OneKB));
+      key_value_pairs.push_back(std::make_pair(Identity(crypto::Hash<crypto::SHA512>(value)),
+                                               value));
+      ASSERT_NO_THROW(key_value_buffer_->Store(key_value_pairs.back().first,
+                                               key_value_pairs.back().second));
+    }
+    // Every value is eventually spilled, so all but the last kDiskEntries are popped.
+    for (int i(0); i != 500 && popped_count() < kEntryCount - kDiskEntries; ++i)
+      Sleep(boost::posix_time::milliseconds(10));
+    ASSERT_EQ(kEntryCount - kDiskEntries, popped_count());
+
+    // Although the writers complete in any order, values are popped in the order they were stored.
+    for (size_t i(0); i != popped.size(); ++i)
+      EXPECT_EQ(key_value_pairs[i].first, popped[i]);
+    NonEmptyString recovered;
+    for (size_t i(popped.size()); i != kEntryCount; ++i) {
+      EXPECT_NO_THROW(recovered = key_value_buffer_->Get(key_value_pairs[i].first));
+      EXPECT_EQ(key_value_pairs[i].second, recovered);
+    }
+    key_value_buffer_.reset();
+  }
+}
+
+TEST_F(KeyValueBufferTest, BEH_WarmRestart) {
+  TestPath test_path(CreateTestPath("MaidSafe_Test_KeyValueBuffer"));
+  std::vector<std::pair<Identity, NonEmptyString>> key_value_pairs;
+  for (int i(0); i != 10; ++i) {
+    NonEmptyString value(RandomAlphaNumericString(OneKB));
+    key_value_pairs.push_back(std::make_pair(Identity(crypto::Hash<crypto::SHA512>(value)),
+                                             value));
+  }
+  std::vector<Identity> popped;
+  std::mutex pop_mutex;
+  KeyValueBuffer::PopFunctor pop_functor([&](const Identity& key, const NonEmptyString&) {
+      std::lock_guard<std::mutex> lock(pop_mutex);
+      popped.push_back(key);
+  });
+  auto popped_count([&]()->size_t {
+    std::lock_guard<std::mutex> lock(pop_mutex);
+    return popped.size();
+  });
+
+  for (auto layout : { KeyValueBuffer::DiskLayout::kFilePerKey,
+                       KeyValueBuffer::DiskLayout::kSegmentFile }) {
+    popped.clear();
+    kv_buffer_path_ = fs::path(*test_path / (layout == KeyValueBuffer::DiskLayout::kFilePerKey ?
+                                             "file_per_key" : "segment_file"));
+    KeyValueBuffer::Options options;
+    options.disk_layout = layout;
+    options.recover_disk_buffer = true;
+    key_value_buffer_.reset(new KeyValueBuffer(MemoryUsage(2 * OneKB), DiskUsage(8 * OneKB),
+                                               pop_functor, kv_buffer_path_, options));
+    for (int i(0); i != 4; ++i) {
+      ASSERT_NO_THROW(key_value_buffer_->Store(key_value_pairs[i].first,
+                                               key_value_pairs[i].second));
+    }
+    for (int i(0); i != 100 && key_value_buffer_->CurrentDiskUsage() < 4 * OneKB; ++i)
+      Sleep(boost::posix_time::milliseconds(10));
+    ASSERT_EQ(4 * OneKB, key_value_buffer_->CurrentDiskUsage().data);
+    key_value_buffer_.reset();
+
+    // The spilled values are served straight away by the next instance.
+    key_value_buffer_.reset(new KeyValueBuffer(MemoryUsage(2 * OneKB), DiskUsage(8 * OneKB),
+                                               pop_functor, kv_buffer_path_, options));
+    EXPECT_EQ(4 * OneKB, key_value_buffer_->CurrentDiskUsage().data);
+    EXPECT_EQ(0U, key_value_buffer_->CurrentMemoryUsage().data);
+    NonEmptyString recovered;
+    for (int i(0); i != 4; ++i) {
+      EXPECT_NO_THROW(recovered = key_value_buffer_->Get(key_value_pairs[i].first));
+      EXPECT_EQ(key_value_pairs[i].second, recovered);
+    }
+    EXPECT_EQ(4U, key_value_buffer_->stats().disk_hits);
+
+    // Recovered values keep their place in the pop order, ahead of values stored since.
+    for (int i(4); i != 10; ++i) {
+      ASSERT_NO_THROW(key_value_buffer_->Store(key_value_pairs[i].first,
+                                               key_value_pairs[i].second));
+    }
+    for (int i(0); i != 100 && (popped_count() < 2 ||
+                                key_value_buffer_->CurrentDiskUsage() < 8 * OneKB); ++i) {
+      Sleep(boost::posix_time::milliseconds(10));
+    }
+    ASSERT_EQ(2U, popped_count());
+    EXPECT_EQ(key_value_pairs[0].first, popped[0]);
+    EXPECT_EQ(key_value_pairs[1].first, popped[1]);
+    key_value_buffer_.reset();
+
+    // If the disk buffer has shrunk, the oldest recovered values are popped.
+    key_value_buffer_.reset(new KeyValueBuffer(MemoryUsage(2 * OneKB), DiskUsage(6 * OneKB),
+                                               pop_functor, kv_buffer_path_, options));
+    EXPECT_EQ(6 * OneKB, key_value_buffer_->CurrentDiskUsage().data);
+    ASSERT_EQ(4U, popped_count());
+    EXPECT_EQ(key_value_pairs[2].first, popped[2]);
+    EXPECT_EQ(key_value_pairs[3].first, popped[3]);
+    for (int i(4); i != 10; ++i) {
+      EXPECT_NO_THROW(recovered = key_value_buffer_->Get(key_value_pairs[i].first));
+      EXPECT_EQ(key_value_pairs[i].second, recovered);
+    }
+    key_value_buffer_.reset();
+
+    // Without the option, nothing is recovered.
+    options.recover_disk_buffer = false;
+    key_value_buffer_.reset(new KeyValueBuffer(MemoryUsage(2 * OneKB), DiskUsage(8 * OneKB),
+                                               pop_functor, kv_buffer_path_, options));
+    EXPECT_EQ(0U, key_value_buffer_->CurrentDiskUsage().data);
+    EXPECT_THROW(key_value_buffer_->Get(key_value_pairs[9].first), std::exception);
+    key_value_buffer_.reset();
+  }
+}
+
+TEST_F(KeyValueBufferTest, BEH_SharedValues) {
+  TestPath test_path(CreateTestPath("MaidSafe_Test_KeyValueBuffer"));
+  kv_buffer_path_ = fs::path(*test_path / "kv_buffer");
+  std::vector<std::pair<Identity, const NonEmptyString*>> popped;
+  std::mutex pop_mutex;
+  KeyValueBuffer::PopFunctor pop_functor([&](const Identity& key, const NonEmptyString& value) {
+      std::lock_guard<std::mutex> lock(pop_mutex);
+      popped.push_back(std::make_pair(key, &value));
+  });
+  KeyValueBuffer::Options options;
+  options.promote_disk_hits = true;
+  key_value_buffer_.reset(new KeyValueBuffer(MemoryUsage(2 * OneKB), DiskUsage(3 * OneKB),
+                                             pop_functor, kv_buffer_path_, options));
+  std::vector<std::pair<Identity, KeyValueBuffer::SharedValue>> key_value_pairs;
+  for (int i(0); i != 4; ++i) {
+    KeyValueBuffer::SharedValue value(
+        std::make_shared<const NonEmptyString>(RandomAlphaNumericString(OneKB)));
+    key_value_pairs.push_back(std::make_pair(Identity(crypto::Hash<crypto::SHA512>(*value)),
+                                             value));
+  }
+  EXPECT_THROW(key_value_buffer_->Store(key_value_pairs[0].first, KeyValueBuffer::SharedValue()),
+               std::exception);
+
+  // A value in memory is handed out without being copied.
+  ASSERT_NO_THROW(key_value_buffer_->Store(key_value_pairs[0].first, key_value_pairs[0].second));
+  EXPECT_EQ(key_value_pairs[0].second.get(),
+            key_value_buffer_->GetShared(key_value_pairs[0].first).get());
+  EXPECT_EQ(*key_value_pairs[0].second, key_value_buffer_->Get(key_value_pairs[0].first));
+
+  for (int i(1); i != 3; ++i)
+    ASSERT_NO_THROW(key_value_buffer_->Store(key_value_pairs[i].first, key_value_pairs[i].second));
+  for (int i(0); i != 100 && key_value_buffer_->CurrentDiskUsage() < 3 * OneKB; ++i)
+    Sleep(boost::posix_time::milliseconds(10));
+  ASSERT_EQ(3 * OneKB, key_value_buffer_->CurrentDiskUsage().data);
+
+  // The first value has left memory, so is read from disk and then promoted back into memory.
+  KeyValueBuffer::SharedValue from_disk(key_value_buffer_->GetShared(key_value_pairs[0].first));
+  EXPECT_NE(key_value_pairs[0].second.get(), from_disk.get());
+  EXPECT_EQ(*key_value_pairs[0].second, *from_disk);
+  for (int i(0); i != 100 && key_value_buffer_->stats().promotions == 0; ++i)
+    Sleep(boost::posix_time::milliseconds(10));
+  ASSERT_EQ(1U, key_value_buffer_->stats().promotions);
+  KeyValueBuffer::SharedValue promoted(key_value_buffer_->GetShared(key_value_pairs[0].first));
+  EXPECT_EQ(3U, key_value_buffer_->stats().memory_hits);
+
+  // When it's popped from disk, the pop functor is given the memory copy rather than a new read.
+  ASSERT_NO_THROW(key_value_buffer_->Store(key_value_pairs[3].first, key_value_pairs[3].second));
+  auto popped_count([&]()->size_t {
+    std::lock_guard<std::mutex> lock(pop_mutex);
+    return popped.size();
+  });
+  for (int i(0); i != 100 && popped_count() == 0; ++i)
+    Sleep(boost::posix_time::milliseconds(10));
+  ASSERT_EQ(1U, popped_count());
+  EXPECT_EQ(key_value_pairs[0].first, popped[0].first);
+  EXPECT_EQ(promoted.get(), popped[0].second);
+  // Handles stay valid once the buffer has dropped its copy.
+  EXPECT_EQ(*key_value_pairs[0].second, *promoted);
+  key_value_buffer_.reset();
+}
+
+TEST_F(KeyValueBufferTest, BEH_DiskCompression) {
+  TestPath test_path(CreateTestPath("MaidSafe_Test_KeyValueBuffer"));
+  kv_buffer_path_ = fs::path(*test_path / "kv_buffer");
+  KeyValueBuffer::Options options;
+  options.disk_compression_level = crypto::kMaxCompressionLevel + 1;
+  EXPECT_THROW(KeyValueBuffer(MemoryUsage(2 * OneKB), DiskUsage(8 * OneKB),
+                              KeyValueBuffer::PopFunctor(), kv_buffer_path_, options),
+               std::exception);
+
+  options.disk_compression_level = 6;
+  options.recover_disk_buffer = true;
+  key_value_buffer_.reset(new KeyValueBuffer(MemoryUsage(2 * OneKB), DiskUsage(8 * OneKB),
+                                             KeyValueBuffer::PopFunctor(), kv_buffer_path_,
+                                             options));
+  // Compressible values, one of them too large for the memory buffer, then an incompressible one.
+  std::vector<std::pair<Identity, NonEmptyString>> key_value_pairs;
+  for (char c('a'); c != 'e'; ++c) {
+    key_value_pairs.push_back(std::make_pair(Identity(RandomString(64)),
+                                             NonEmptyString(std::string(OneKB, c))));
+  }
+  key_value_pairs.push_back(std::make_pair(Identity(RandomString(64)),
+                                           NonEmptyString(std::string(3 * OneKB, 'z'))));
+  key_value_pairs.push_back(std::make_pair(Identity(RandomString(64)),
+                                           NonEmptyString(RandomString(OneKB))));
+  for (auto& key_value : key_value_pairs)
+    ASSERT_NO_THROW(key_value_buffer_->Store(key_value.first, key_value.second));
+
+  // Only the compressed sizes count against the disk buffer; the incompressible value is written
+  // as it is, plus a byte recording that.
+  for (int i(0); i != 100 && key_value_buffer_->CurrentDiskUsage() <= OneKB; ++i)
+    Sleep(boost::posix_time::milliseconds(10));
+  EXPECT_LE(OneKB + 1, key_value_buffer_->CurrentDiskUsage().data);
+  EXPECT_GT(2 * OneKB, key_value_buffer_->CurrentDiskUsage().data);
+  DiskUsage disk_usage(key_value_buffer_->CurrentDiskUsage());
+  key_value_buffer_.reset();
+
+  // The recovered values are all read back from disk.
+  key_value_buffer_.reset(new KeyValueBuffer(MemoryUsage(2 * OneKB), DiskUsage(8 * OneKB),
+                                             KeyValueBuffer::PopFunctor(), kv_buffer_path_,
+                                             options));
+  EXPECT_EQ(disk_usage.data, key_value_buffer_->CurrentDiskUsage().data);
+  NonEmptyString recovered;
+  for (auto& key_value : key_value_pairs) {
+    EXPECT_NO_THROW(recovered = key_value_buffer_->Get(key_value.first));
+    EXPECT_EQ(key_value.second, recovered);
+  }
+  std::vector<Identity> keys;
+  for (auto& key_value : key_value_pairs)
+    keys.push_back(key_value.first);
+  auto values(key_value_buffer_->GetBatch(keys));
+  for (size_t i(0); i != keys.size(); ++i)
+    EXPECT_EQ(key_value_pairs[i].second, values[i]);
+  EXPECT_EQ(2 * key_value_pairs.size(), key_value_buffer_->stats().disk_hits);
+  key_value_buffer_.reset();
+
+  // Values written with compression aren't recovered by an instance which doesn't use it.
+  options.disk_compression_level = 0;
+  key_value_buffer_.reset(new KeyValueBuffer(MemoryUsage(2 * OneKB), DiskUsage(8 * OneKB),
+                                             KeyValueBuffer::PopFunctor(), kv_buffer_path_,
+                                             options));
+  EXPECT_EQ(0U, key_value_buffer_->CurrentDiskUsage().data);
+  key_value_buffer_.reset();
+}
+
+TEST_F(KeyValueBufferTest, BEH_EvictionPolicies) {
+  TestPath test_path(CreateTestPath("MaidSafe_Test_KeyValueBuffer"));
+  std::vector<std::pair<Identity, NonEmptyString>> key_value_pairs;
+  for (int i(0); i != 4; ++i) {
+    NonEmptyString value(RandomAlphaNumericString(OneKB));
+    key_value_pairs.push_back(std::make_pair(Identity(crypto::Hash<crypto::SHA512>(value)),
+                                             value));
+  }
+  std::vector<Identity> popped;
+  std::mutex pop_mutex;
+  KeyValueBuffer::PopFunctor pop_functor([&](const Identity& key, const NonEmptyString&) {
+      std::lock_guard<std::mutex> lock(pop_mutex);
+      popped.push_back(key);
+  });
+  auto popped_count([&]()->size_t {
+    std::lock_guard<std::mutex> lock(pop_mutex);
+    return popped.size();
+  });
+
+  // With LRU in memory, the value read since being stored outlives the value stored after it.
+  kv_buffer_path_ = fs::path(*test_path / "memory_lru");
+  KeyValueBuffer::Options options;
+  options.memory_eviction_policy = KeyValueBuffer::EvictionPolicy::kLru;
+  key_value_buffer_.reset(new KeyValueBuffer(MemoryUsage(3 * OneKB), DiskUsage(8 * OneKB),
+                                             pop_functor, kv_buffer_path_, options));
+  for (int i(0); i != 3; ++i) {
+    ASSERT_NO_THROW(key_value_buffer_->Store(key_value_pairs[i].first,
+                                             key_value_pairs[i].second));
+  }
+  for (int i(0); i != 100 && !AllSpilled(*key_value_buffer_); ++i)
+    Sleep(boost::posix_time::milliseconds(10));
+  ASSERT_EQ(3 * OneKB, key_value_buffer_->CurrentDiskUsage().data);
+  EXPECT_EQ(key_value_pairs[0].second, key_value_buffer_->Get(key_value_pairs[0].first));
+  ASSERT_NO_THROW(key_value_buffer_->Store(key_value_pairs[3].first, key_value_pairs[3].second));
+  EXPECT_EQ(key_value_pairs[0].second, key_value_buffer_->Get(key_value_pairs[0].first));
+  EXPECT_EQ(2U, key_value_buffer_->stats().memory_hits);
+  EXPECT_EQ(key_value_pairs[1].second, key_value_buffer_->Get(key_value_pairs[1].first));
+  EXPECT_EQ(1U, key_value_buffer_->stats().disk_hits);
+  key_value_buffer_.reset();
+
+  // With LRU on disk, the value read since being stored isn't the first popped.
+  kv_buffer_path_ = fs::path(*test_path / "disk_lru");
+  options = KeyValueBuffer::Options();
+  options.disk_eviction_policy = KeyValueBuffer::EvictionPolicy::kLru;
+  key_value_buffer_.reset(new KeyValueBuffer(MemoryUsage(OneKB), DiskUsage(3 * OneKB),
+                                             pop_functor, kv_buffer_path_, options));
+  for (int i(0); i != 3; ++i) {
+    ASSERT_NO_THROW(key_value_buffer_->Store(key_value_pairs[i].first,
+                                             key_value_pairs[i].second));
+  }
+  for (int i(0); i != 100 && !AllSpilled(*key_value_buffer_); ++i)
+    Sleep(boost::posix_time::milliseconds(10));
+  ASSERT_EQ(3 * OneKB, key_value_buffer_->CurrentDiskUsage().data);
+  EXPECT_EQ(key_value_pairs[0].second, key_value_buffer_->Get(key_value_pairs[0].first));
+  ASSERT_NO_THROW(key_value_buffer_->Store(key_value_pairs[3].first, key_value_pairs[3].second));
+  for (int i(0); i != 100 && popped_count() == 0; ++i)
+    Sleep(boost::posix_time::milliseconds(10));
+  ASSERT_EQ(1U, popped_count());
+  EXPECT_EQ(key_value_pairs[1].first, popped[0]);
+  EXPECT_EQ(key_value_pairs[0].second, key_value_buffer_->Get(key_value_pairs[0].first));
+  key_value_buffer_.reset();
+
+  // Every policy serves what it holds.
+  for (auto policy : { KeyValueBuffer::EvictionPolicy::kLfu,
+                       KeyValueBuffer::EvictionPolicy::kArc,
+                       KeyValueBuffer::EvictionPolicy::kGdsf }) {
+    popped.clear();
+    kv_buffer_path_ = fs::path(*test_path / ("policy_" + std::to_string(static_cast<int>(policy))));
+    options.memory_eviction_policy = options.disk_eviction_policy = policy;
+    key_value_buffer_.reset(new KeyValueBuffer(MemoryUsage(OneKB), DiskUsage(2 * OneKB),
+                                               pop_functor, kv_buffer_path_, options));
+    for (auto& key_value : key_value_pairs)
+      ASSERT_NO_THROW(key_value_buffer_->Store(key_value.first, key_value.second));
+    for (int i(0); i != 100 && popped_count() < 2; ++i)
+      Sleep(boost::posix_time::milliseconds(10));
+    ASSERT_EQ(2U, popped_count());
+    for (auto& key_value : key_value_pairs) {
+      if (std::find(popped.begin(), popped.end(), key_value.first) == popped.end())
+        EXPECT_EQ(key_value.second, key_value_buffer_->Get(key_value.first));
+      else
+        EXPECT_THROW(key_value_buffer_->Get(key_value.first), std::exception);
+    }
+    key_value_buffer_.reset();
+  }
+}
+
+TEST_F(KeyValueBufferTest, BEH_QueuedPops) {
+  TestPath test_path(CreateTestPath("MaidSafe_Test_KeyValueBuffer"));
+  kv_buffer_path_ = fs::path(*test_path / "kv_buffer");
+  std::vector<std::pair<Identity, NonEmptyString>> key_value_pairs;
+  for (int i(0); i != 5; ++i) {
+    NonEmptyString value(RandomAlphaNumericString(OneKB));
+    key_value_pairs.push_back(std::make_pair(Identity(crypto::Hash<crypto::SHA512>(value)),
+                                             value));
+  }
+  // The pop functor is held up until 'release' is set, as a slow consumer would be.
+  std::promise<void> release;
+  std::shared_future<void> released(release.get_future());
+  std::vector<std::pair<Identity, NonEmptyString>> popped;
+  std::mutex pop_mutex;
+  KeyValueBuffer::PopFunctor pop_functor([&](const Identity& key, const NonEmptyString& value) {
+      released.wait();
+      std::lock_guard<std::mutex> lock(pop_mutex);
+      popped.push_back(std::make_pair(key, value));
+  });
+  auto popped_count([&]()->size_t {
+    std::lock_guard<std::mutex> lock(pop_mutex);
+    return popped.size();
+  });
+  KeyValueBuffer::Options options;
+  options.pop_queue_size = 2;
+  key_value_buffer_.reset(new KeyValueBuffer(MemoryUsage(OneKB), DiskUsage(2 * OneKB),
+                                             pop_functor, kv_buffer_path_, options));
+
+  // Two values are popped for the next two to be spilled without waiting for the functor, and the
+  // buffer stays usable meanwhile.  The fifth value can't be spilled until the functor catches up.
+  for (auto& key_value : key_value_pairs)
+    ASSERT_NO_THROW(key_value_buffer_->Store(key_value.first, key_value.second));
+  EXPECT_EQ(key_value_pairs[3].second, key_value_buffer_->Get(key_value_pairs[3].first));
+  EXPECT_EQ(key_value_pairs[4].second, key_value_buffer_->Get(key_value_pairs[4].first));
+  EXPECT_THROW(key_value_buffer_->Get(key_value_pairs[0].first), std::exception);
+  Sleep(boost::posix_time::milliseconds(100));
+  EXPECT_EQ(0U, popped_count());
+  EXPECT_EQ(2 * OneKB, key_value_buffer_->CurrentDiskUsage().data);
+  EXPECT_EQ(OneKB, key_value_buffer_->CurrentMemoryUsage().data);
+
+  release.set_value();
+  for (int i(0); i != 100 && popped_count() < 3; ++i)
+    Sleep(boost::posix_time::milliseconds(10));
+  ASSERT_EQ(3U, popped_count());
+  for (size_t i(0); i != popped.size(); ++i) {
+    EXPECT_EQ(key_value_pairs[i].first, popped[i].first);
+    EXPECT_EQ(key_value_pairs[i].second, popped[i].second);
+  }
+  EXPECT_EQ(key_value_pairs[4].second, key_value_buffer_->Get(key_value_pairs[4].first));
+  key_value_buffer_.reset();
+}
+
+TEST_F(KeyValueBufferTest, BEH_GetView) {
+  TestPath test_path(CreateTestPath("MaidSafe_Test_KeyValueBuffer"));
+  std::vector<std::pair<Identity, NonEmptyString>> key_value_pairs;
+  for (int i(0); i != 3; ++i) {
+    NonEmptyString value(RandomAlphaNumericString(OneKB));
+    key_value_pairs.push_back(std::make_pair(Identity(crypto::Hash<crypto::SHA512>(value)),
+                                             value));
+  }
+  for (auto layout : { KeyValueBuffer::DiskLayout::kFilePerKey,
+                       KeyValueBuffer::DiskLayout::kSegmentFile }) {
+    kv_buffer_path_ = fs::path(*test_path / (layout == KeyValueBuffer::DiskLayout::kFilePerKey ?
+                                             "file_per_key" : "segment_file"));
+    KeyValueBuffer::Options options;
+    options.disk_layout = layout;
+    key_value_buffer_.reset(new KeyValueBuffer(MemoryUsage(OneKB), DiskUsage(4 * OneKB),
+                                               KeyValueBuffer::PopFunctor(), kv_buffer_path_,
+                                               options));
+    KeyValueBuffer::SharedValue shared(
+        std::make_shared<const NonEmptyString>(key_value_pairs[0].second));
+    ASSERT_NO_THROW(key_value_buffer_->Store(key_value_pairs[0].first, shared));
+    // A view of a value in memory refers to the memory buffer's copy.
+    KeyValueBuffer::ValueView view(key_value_buffer_->GetView(key_value_pairs[0].first));
+    EXPECT_EQ(shared->string().data(), view.data());
+    EXPECT_EQ(OneKB, view.size());
+
+    for (int i(1); i != 3; ++i) {
+      ASSERT_NO_THROW(key_value_buffer_->Store(key_value_pairs[i].first,
+                                               key_value_pairs[i].second));
+    }
+    std::vector<KeyValueBuffer::ValueView> views;
+    for (auto& key_value : key_value_pairs)
+      ASSERT_NO_THROW(views.push_back(key_value_buffer_->GetView(key_value.first)));
+    EXPECT_EQ(2U, key_value_buffer_->stats().disk_hits);
+    // Views stay valid once their values have been deleted.
+    for (auto& key_value : key_value_pairs)
+      ASSERT_NO_THROW(key_value_buffer_->Delete(key_value.first));
+    for (size_t i(0); i != views.size(); ++i) {
+      EXPECT_EQ(key_value_pairs[i].second.string(), std::string(views[i].data(),
+                                                                views[i].size()));
+    }
+    EXPECT_THROW(key_value_buffer_->GetView(key_value_pairs[0].first), std::exception);
+    key_value_buffer_.reset();
+  }
+}
+
+TEST_F(KeyValueBufferTest, BEH_GetRange) {
+  TestPath test_path(CreateTestPath("MaidSafe_Test_KeyValueBuffer"));
+  std::vector<std::pair<Identity, NonEmptyString>> key_value_pairs;
+  for (int i(0); i != 3; ++i) {
+    NonEmptyString value(RandomAlphaNumericString(OneKB));
+    key_value_pairs.push_back(std::make_pair(Identity(crypto::Hash<crypto::SHA512>(value)),
+                                             value));
+  }
+  auto expect_range([](const NonEmptyString& value, uint64_t offset, size_t length,
+                       const KeyValueBuffer::ValueView& view) {
+      EXPECT_EQ(value.string().substr(static_cast<size_t>(offset), length),
+                std::string(view.data(), view.size()));
+  });
+  for (uint16_t compression_level : { 0, 6 }) {
+    for (auto layout : { KeyValueBuffer::DiskLayout::kFilePerKey,
+                         KeyValueBuffer::DiskLayout::kSegmentFile }) {
+      kv_buffer_path_ = fs::path(*test_path / RandomAlphaNumericString(8));
+      KeyValueBuffer::Options options;
+      options.disk_layout = layout;
+      options.disk_compression_level = compression_level;
+      key_value_buffer_.reset(new KeyValueBuffer(MemoryUsage(OneKB), DiskUsage(4 * OneKB),
+                                                 KeyValueBuffer::PopFunctor(), kv_buffer_path_,
+                                                 options));
+      KeyValueBuffer::SharedValue shared(
+          std::make_shared<const NonEmptyString>(key_value_pairs[0].second));
+      ASSERT_NO_THROW(key_value_buffer_->Store(key_value_pairs[0].first, shared));
+      // A range of a value in memory refers to the memory buffer's copy.
+      KeyValueBuffer::ValueView view(key_value_buffer_->GetRange(key_value_pairs[0].first, 100,
+                                                                 200));
+      EXPECT_EQ(shared->string().data() + 100, view.data());
+      EXPECT_EQ(200U, view.size());
+
+      for (int i(1); i != 3; ++i) {
+        ASSERT_NO_THROW(key_value_buffer_->Store(key_value_pairs[i].first,
+                                                 key_value_pairs[i].second));
+      }
+      // Ranges are cut short by the end of the value.
+      std::vector<KeyValueBuffer::ValueView> views;
+      for (auto& key_value : key_value_pairs) {
+        ASSERT_NO_THROW(views.push_back(key_value_buffer_->GetRange(key_value.first, 1000,
+                                                                    100)));
+        EXPECT_EQ(OneKB - 1000, views.back().size());
+      }
+      ASSERT_NO_THROW(view = key_value_buffer_->GetRange(key_value_pairs[2].first, OneKB, 1));
+      EXPECT_EQ(0U, view.size());
+      EXPECT_THROW(key_value_buffer_->GetRange(key_value_pairs[2].first, OneKB + 1, 1),
+                   std::exception);
+      ASSERT_NO_THROW(view = key_value_buffer_->GetRange(key_value_pairs[2].first, 5, OneKB));
+      expect_range(key_value_pairs[2].second, 5, OneKB, view);
+      EXPECT_EQ(0U, key_value_buffer_->stats().promotions);
+      // Ranges stay valid once their values have been deleted.
+      for (auto& key_value : key_value_pairs)
+        ASSERT_NO_THROW(key_value_buffer_->Delete(key_value.first));
+      for (size_t i(0); i != views.size(); ++i)
+        expect_range(key_value_pairs[i].second, 1000, 100, views[i]);
+      EXPECT_THROW(key_value_buffer_->GetRange(key_value_pairs[0].first, 0, 1), std::exception);
+      key_value_buffer_.reset();
+    }
+  }
+}
+
+TEST_F(KeyValueBufferTest, BEH_ContainsAndTryGet) {
+  TestPath test_path(CreateTestPath("MaidSafe_Test_KeyValueBuffer"));
+  std::vector<std::pair<Identity, NonEmptyString>> key_value_pairs;
+  for (int i(0); i != 6; ++i) {
+    NonEmptyString value(RandomAlphaNumericString(OneKB));
+    key_value_pairs.push_back(std::make_pair(Identity(crypto::Hash<crypto::SHA512>(value)),
+                                             value));
+  }
+  const Identity kAbsentKey(RandomString(64));
+  // The results must be the same with and without the key filter.
+  for (uint64_t capacity : { 0, 64 }) {
+    kv_buffer_path_ = fs::path(*test_path / std::to_string(capacity));
+    KeyValueBuffer::Options options;
+    options.key_filter_capacity = capacity;
+    std::mutex pop_mutex;
+    std::vector<Identity> popped;
+    key_value_buffer_.reset(new KeyValueBuffer(MemoryUsage(OneKB), DiskUsage(4 * OneKB),
+        [&](const Identity& key, const NonEmptyString&) {
+          std::lock_guard<std::mutex> lock(pop_mutex);
+          popped.push_back(key);
+        },
+        kv_buffer_path_, options));
+    for (auto& key_value : key_value_pairs)
+      ASSERT_NO_THROW(key_value_buffer_->Store(key_value.first, key_value.second));
+    for (int i(0); i != 100 && !AllSpilled(*key_value_buffer_); ++i)
+      Sleep(boost::posix_time::milliseconds(10));
+    ASSERT_TRUE(AllSpilled(*key_value_buffer_));
+    {
+      std::lock_guard<std::mutex> lock(pop_mutex);
+      ASSERT_EQ(2U, popped.size());
+    }
+    EXPECT_EQ(6 * OneKB, key_value_buffer_->stats().bytes_spilled);
+
+    NonEmptyString value;
+    for (size_t i(0); i != key_value_pairs.size(); ++i) {
+      const bool kHeld(i >= 2);
+      EXPECT_EQ(kHeld, key_value_buffer_->Contains(key_value_pairs[i].first));
+      EXPECT_EQ(kHeld, key_value_buffer_->TryGet(key_value_pairs[i].first, value));
+      if (kHeld) {
+        EXPECT_EQ(key_value_pairs[i].second, value);
+      }
+    }
+    EXPECT_FALSE(key_value_buffer_->Contains(kAbsentKey));
+    EXPECT_FALSE(key_value_buffer_->TryGet(kAbsentKey, value));
+    EXPECT_THROW(key_value_buffer_->Get(kAbsentKey), std::exception);
+    EXPECT_THROW(key_value_buffer_->GetView(kAbsentKey), std::exception);
+
+    ASSERT_NO_THROW(key_value_buffer_->Delete(key_value_pairs[5].first));
+    EXPECT_FALSE(key_value_buffer_->Contains(key_value_pairs[5].first));
+    EXPECT_FALSE(key_value_buffer_->TryGet(key_value_pairs[5].first, value));
+    ASSERT_NO_THROW(key_value_buffer_->Store(key_value_pairs[5].first, key_value_pairs[5].second));
+    EXPECT_TRUE(key_value_buffer_->Contains(key_value_pairs[5].first));
+
+    // Contains doesn't count towards the stats.
+    KeyValueBuffer::Stats stats(key_value_buffer_->stats());
+    EXPECT_EQ(4U, stats.memory_hits + stats.disk_hits);
+    EXPECT_EQ(6U, stats.misses);
+    key_value_buffer_.reset();
+  }
+}
+
+TEST_F(KeyValueBufferTest, BEH_WriteCoalescing) {
+  TestPath test_path(CreateTestPath("MaidSafe_Test_KeyValueBuffer"));
+  kv_buffer_path_ = fs::path(*test_path / "kv_buffer");
+  key_value_buffer_.reset(new KeyValueBuffer(MemoryUsage(8 * OneKB), DiskUsage(16 * OneKB),
+                                             KeyValueBuffer::PopFunctor(), kv_buffer_path_));
+  const std::vector<Identity> kKeys = { Identity(RandomString(64)), Identity(RandomString(64)) };
+  auto spills_done([&](uint64_t expected)->bool {
+    KeyValueBuffer::Stats stats(key_value_buffer_->stats());
+    return AllSpilled(*key_value_buffer_) &&
+           stats.values_spilled + stats.spills_skipped == expected &&
+           key_value_buffer_->CurrentDiskUsage() == 2 * OneKB;
+  });
+
+  // Within a batch, only the last value for each key is held, so only those are written to disk.
+  std::vector<std::pair<Identity, NonEmptyString>> batch;
+  for (int i(0); i != 8; ++i)
+    batch.push_back(std::make_pair(kKeys[i % 2], NonEmptyString(RandomAlphaNumericString(OneKB))));
+  ASSERT_NO_THROW(key_value_buffer_->StoreBatch(batch));
+  for (int i(0); i != 100 && !spills_done(2); ++i)
+    Sleep(boost::posix_time::milliseconds(10));
+  ASSERT_TRUE(spills_done(2));
+  KeyValueBuffer::Stats stats(key_value_buffer_->stats());
+  EXPECT_EQ(2U, stats.values_spilled);
+  EXPECT_EQ(0U, stats.spills_skipped);
+  EXPECT_EQ(2 * OneKB, stats.bytes_spilled);
+  EXPECT_EQ(batch[6].second, key_value_buffer_->Get(kKeys[0]));
+  EXPECT_EQ(batch[7].second, key_value_buffer_->Get(kKeys[1]));
+
+  // Each value replaced or deleted in quick succession is either written or skipped, and only the
+  // last is left on disk.
+  const int kStores(100);
+  NonEmptyString value;
+  for (int i(0); i != kStores; ++i) {
+    value = NonEmptyString(RandomAlphaNumericString(OneKB));
+    ASSERT_NO_THROW(key_value_buffer_->Store(kKeys[0], value));
+    if (i % 10 == 0) {
+      ASSERT_NO_THROW(key_value_buffer_->Delete(kKeys[0]));
+    }
+  }
+  for (int i(0); i != 100 && !spills_done(2 + kStores); ++i)
+    Sleep(boost::posix_time::milliseconds(10));
+  ASSERT_TRUE(spills_done(2 + kStores));
+  EXPECT_EQ(value, key_value_buffer_->Get(kKeys[0]));
+  key_value_buffer_.reset();
+}
+
+TEST_F(KeyValueBufferTest, BEH_TimeToLive) {
+  TestPath test_path(CreateTestPath("MaidSafe_Test_KeyValueBuffer"));
+  std::vector<std::pair<Identity, NonEmptyString>> key_value_pairs;
+  for (int i(0); i != 4; ++i) {
+    NonEmptyString value(RandomAlphaNumericString(OneKB));
+    key_value_pairs.push_back(std::make_pair(Identity(crypto::Hash<crypto::SHA512>(value)),
+                                             value));
+  }
+  const std::chrono::milliseconds kTimeToLive(50);
+  auto wait_for_expirations([&](uint64_t expected) {
+    for (int i(0); i != 200 && key_value_buffer_->stats().expirations < expected; ++i)
+      Sleep(boost::posix_time::milliseconds(10));
+  });
+  std::mutex pop_mutex;
+  std::vector<Identity> popped;
+  KeyValueBuffer::PopFunctor pop_functor([&](const Identity& key, const NonEmptyString&) {
+    std::lock_guard<std::mutex> lock(pop_mutex);
+    popped.push_back(key);
+  });
+
+  // Values given their own time to live expire from both buffers; others stay.
+  kv_buffer_path_ = fs::path(*test_path / "own");
+  key_value_buffer_.reset(new KeyValueBuffer(MemoryUsage(2 * OneKB), DiskUsage(4 * OneKB),
+                                             pop_functor, kv_buffer_path_));
+  ASSERT_NO_THROW(key_value_buffer_->Store(key_value_pairs[0].first, key_value_pairs[0].second,
+                                           kTimeToLive));
+  ASSERT_NO_THROW(key_value_buffer_->Store(key_value_pairs[1].first, key_value_pairs[1].second));
+  // Re-storing without a time to live cancels the earlier one.
+  ASSERT_NO_THROW(key_value_buffer_->Store(key_value_pairs[2].first, key_value_pairs[2].second,
+                                           kTimeToLive));
+  ASSERT_NO_THROW(key_value_buffer_->Store(key_value_pairs[2].first, key_value_pairs[2].second));
+  ASSERT_NO_THROW(key_value_buffer_->Store(key_value_pairs[3].first, key_value_pairs[3].second,
+                                           std::chrono::milliseconds(0)));
+  wait_for_expirations(1);
+  Sleep(boost::posix_time::milliseconds(2 * kTimeToLive.count()));
+  EXPECT_EQ(1U, key_value_buffer_->stats().expirations);
+  EXPECT_FALSE(key_value_buffer_->Contains(key_value_pairs[0].first));
+  for (int i(1); i != 4; ++i)
+    EXPECT_EQ(key_value_pairs[i].second, key_value_buffer_->Get(key_value_pairs[i].first));
+  for (int i(0); i != 100 && !AllSpilled(*key_value_buffer_); ++i)
+    Sleep(boost::posix_time::milliseconds(10));
+  EXPECT_EQ(3 * OneKB, key_value_buffer_->CurrentDiskUsage().data);
+  key_value_buffer_.reset();
+
+  // With a default time to live, every value expires and none is popped.
+  kv_buffer_path_ = fs::path(*test_path / "default");
+  KeyValueBuffer::Options options;
+  options.default_time_to_live = kTimeToLive;
+  key_value_buffer_.reset(new KeyValueBuffer(MemoryUsage(2 * OneKB), DiskUsage(4 * OneKB),
+                                             pop_functor, kv_buffer_path_, options));
+  ASSERT_NO_THROW(key_value_buffer_->StoreBatch(key_value_pairs));
+  wait_for_expirations(4);
+  EXPECT_EQ(4U, key_value_buffer_->stats().expirations);
+  for (auto& key_value : key_value_pairs)
+    EXPECT_FALSE(key_value_buffer_->Contains(key_value.first));
+  EXPECT_EQ(0U, key_value_buffer_->CurrentMemoryUsage().data);
+  EXPECT_EQ(0U, key_value_buffer_->CurrentDiskUsage().data);
+  {
+    std::lock_guard<std::mutex> lock(pop_mutex);
+    EXPECT_TRUE(popped.empty());
+  }
+  key_value_buffer_.reset();
+
+  options.default_time_to_live = std::chrono::milliseconds(-1);
+  EXPECT_THROW(KeyValueBuffer(MemoryUsage(OneKB), DiskUsage(2 * OneKB),
+                              KeyValueBuffer::PopFunctor(), options), std::exception);
+}
+
+TEST_F(KeyValueBufferTest, BEH_MemoryOverheadAccounting) {
+  TestPath test_path(CreateTestPath("MaidSafe_Test_KeyValueBuffer"));
+  kv_buffer_path_ = fs::path(*test_path / "kv_buffer");
+  KeyValueBuffer::Options options;
+  options.account_memory_overhead = true;
+  key_value_buffer_.reset(new KeyValueBuffer(MemoryUsage(OneKB), DiskUsage(2 * OneKB),
+                                             KeyValueBuffer::PopFunctor(), kv_buffer_path_,
+                                             options));
+
+  // A value of exactly the memory buffer's size no longer fits there once its overhead is counted.
+  NonEmptyString large_value(RandomAlphaNumericString(OneKB));
+  Identity large_key(RandomString(64));
+  ASSERT_NO_THROW(key_value_buffer_->Store(large_key, large_value));
+  EXPECT_EQ(0U, key_value_buffer_->CurrentMemoryUsage().data);
+  EXPECT_EQ(OneKB, key_value_buffer_->CurrentDiskUsage().data);
+  EXPECT_EQ(large_value, key_value_buffer_->Get(large_key));
+  key_value_buffer_.reset();
+
+  // Small values each count for many times their size.
+  kv_buffer_path_ = fs::path(*test_path / "small");
+  key_value_buffer_.reset(new KeyValueBuffer(MemoryUsage(1024 * OneKB), DiskUsage(2048 * OneKB),
+                                             KeyValueBuffer::PopFunctor(), kv_buffer_path_,
+                                             options));
+  const size_t kValueSize(16);
+  std::vector<Identity> keys;
+  keys.push_back(Identity(RandomString(64)));
+  ASSERT_NO_THROW(key_value_buffer_->Store(
+      keys.back(), NonEmptyString(RandomAlphaNumericString(kValueSize))));
+  const uint64_t kFootprint(key_value_buffer_->CurrentMemoryUsage().data);
+  EXPECT_LT(8 * kValueSize, kFootprint);
+  while (keys.size() != 100) {
+    keys.push_back(Identity(RandomString(64)));
+    ASSERT_NO_THROW(key_value_buffer_->Store(
+        keys.back(), NonEmptyString(RandomAlphaNumericString(kValueSize))));
+  }
+  EXPECT_EQ(keys.size() * kFootprint, key_value_buffer_->CurrentMemoryUsage().data);
+  for (auto& key : keys)
+    ASSERT_NO_THROW(key_value_buffer_->Delete(key));
+  EXPECT_EQ(0U, key_value_buffer_->CurrentMemoryUsage().data);
+  key_value_buffer_.reset();
+}
+
+TEST_F(KeyValueBufferTest, BEH_GetsDuringStores) {
+  TestPath test_path(CreateTestPath("MaidSafe_Test_KeyValueBuffer"));
+  kv_buffer_path_ = fs::path(*test_path / "kv_buffer");
+  KeyValueBuffer::Options options;
+  options.memory_eviction_policy = options.disk_eviction_policy =
+      KeyValueBuffer::EvictionPolicy::kLru;
+  key_value_buffer_.reset(new KeyValueBuffer(MemoryUsage(64 * OneKB), DiskUsage(1024 * OneKB),
+                                             KeyValueBuffer::PopFunctor(), kv_buffer_path_,
+                                             options));
+  std::vector<std::pair<Identity, NonEmptyString>> stable;
+  for (int i(0); i != 8; ++i) {
+    stable.push_back(std::make_pair(Identity(RandomString(64)),
+                                    NonEmptyString(RandomAlphaNumericString(OneKB))));
+    ASSERT_NO_THROW(key_value_buffer_->Store(stable.back().first, stable.back().second));
+  }
+
+  // Readers keep finding the stable values, by then mostly in memory, while a writer replaces and
+  // deletes others, spilling and evicting values as it goes.
+  std::atomic<bool> stop(false);
+  std::atomic<int> failures(0);
+  std::vector<std::thread> readers;
+  for (int i(0); i != 4; ++i) {
+    readers.emplace_back([&] {
+      NonEmptyString value;
+      while (!stop) {
+        for (auto& key_value : stable) {
+          if (!key_value_buffer_->TryGet(key_value.first, value) || value != key_value.second)
+            ++failures;
+        }
+      }
+    });
+  }
+  std::vector<Identity> churned;
+  for (int i(0); i != 32; ++i)
+    churned.push_back(Identity(RandomString(64)));
+  for (int i(0); i != 500; ++i) {
+    ASSERT_NO_THROW(key_value_buffer_->Store(
+        churned[i % churned.size()], NonEmptyString(RandomAlphaNumericString(OneKB))));
+    if (i % 7 == 0) {
+      ASSERT_NO_THROW(key_value_buffer_->Delete(churned[i % churned.size()]));
+    }
+  }
+  stop = true;
+  for (auto& reader : readers)
+    reader.join();
+  EXPECT_EQ(0, failures);
+  EXPECT_LT(0U, key_value_buffer_->stats().memory_hits);
+  key_value_buffer_.reset();
+}
+
+TEST_F(KeyValueBufferTest, BEH_AdmissionControl) {
+  TestPath test_path(CreateTestPath("MaidSafe_Test_KeyValueBuffer"));
+  kv_buffer_path_ = fs::path(*test_path / "kv_buffer");
+  KeyValueBuffer::Options options;
+  options.memory_admission_max_size = 256;
+  key_value_buffer_.reset(new KeyValueBuffer(MemoryUsage(4 * OneKB), DiskUsage(64 * OneKB),
+                                             KeyValueBuffer::PopFunctor(), kv_buffer_path_,
+                                             options));
+
+  // Values over the size limit go straight to disk, leaving memory to the small ones.
+  Identity small_key(RandomString(64)), large_key(RandomString(64));
+  NonEmptyString small_value(RandomAlphaNumericString(100)),
+                 large_value(RandomAlphaNumericString(OneKB));
+  ASSERT_NO_THROW(key_value_buffer_->Store(small_key, small_value));
+  ASSERT_NO_THROW(key_value_buffer_->Store(large_key, large_value));
+  EXPECT_EQ(100U, key_value_buffer_->CurrentMemoryUsage().data);
+  EXPECT_LE(OneKB, key_value_buffer_->CurrentDiskUsage().data);
+  EXPECT_EQ(large_value, key_value_buffer_->Get(large_key));
+  std::vector<std::pair<Identity, NonEmptyString>> batch(
+      1, std::make_pair(Identity(RandomString(64)), large_value));
+  ASSERT_NO_THROW(key_value_buffer_->StoreBatch(batch));
+  EXPECT_EQ(100U, key_value_buffer_->CurrentMemoryUsage().data);
+  KeyValueBuffer::Stats stats(key_value_buffer_->stats());
+  EXPECT_EQ(2U, stats.admissions_bypassed);
+  EXPECT_EQ(0U, stats.admissions_refused);
+  EXPECT_EQ(1U, stats.disk_hits);
+  key_value_buffer_.reset();
+
+  // Once memory is full, a key seen for the first time is refused, while one used before is let in.
+  kv_buffer_path_ = fs::path(*test_path / "sketch");
+  options = KeyValueBuffer::Options();
+  options.admission_sketch_capacity = 1000;
+  options.memory_admission_min_frequency = 2;
+  key_value_buffer_.reset(new KeyValueBuffer(MemoryUsage(OneKB), DiskUsage(64 * OneKB),
+                                             KeyValueBuffer::PopFunctor(), kv_buffer_path_,
+                                             options));
+  const size_t kValueSize(128);
+  for (size_t i(0); i != OneKB / kValueSize; ++i) {
+    ASSERT_NO_THROW(key_value_buffer_->Store(
+        Identity(RandomString(64)), NonEmptyString(RandomAlphaNumericString(kValueSize))));
+  }
+  EXPECT_EQ(0U, key_value_buffer_->stats().admissions_refused);
+
+  Identity cold_key(RandomString(64)), warm_key(RandomString(64));
+  NonEmptyString cold_value(RandomAlphaNumericString(kValueSize)),
+                 warm_value(RandomAlphaNumericString(kValueSize));
+  ASSERT_NO_THROW(key_value_buffer_->Store(cold_key, cold_value));
+  EXPECT_EQ(1U, key_value_buffer_->stats().admissions_refused);
+  EXPECT_EQ(cold_value, key_value_buffer_->Get(cold_key));
+  EXPECT_EQ(0U, key_value_buffer_->stats().memory_hits);
+
+  NonEmptyString value;
+  EXPECT_FALSE(key_value_buffer_->TryGet(warm_key, value));
+  ASSERT_NO_THROW(key_value_buffer_->Store(warm_key, warm_value));
+  EXPECT_EQ(1U, key_value_buffer_->stats().admissions_refused);
+  EXPECT_EQ(warm_value, key_value_buffer_->Get(warm_key));
+  EXPECT_EQ(1U, key_value_buffer_->stats().memory_hits);
+
+  // Asynchronous stores are judged in the same way.
+  ASSERT_NO_THROW(key_value_buffer_->StoreAsync(
+      Identity(RandomString(64)), NonEmptyString(RandomAlphaNumericString(kValueSize))).get());
+  EXPECT_EQ(2U, key_value_buffer_->stats().admissions_refused);
+  EXPECT_EQ(OneKB, key_value_buffer_->CurrentMemoryUsage().data);
+  key_value_buffer_.reset();
+}
+
+TEST_F(KeyValueBufferTest, BEH_Scan) {
+  TestPath test_path(CreateTestPath("MaidSafe_Test_KeyValueBuffer"));
+  kv_buffer_path_ = fs::path(*test_path / "kv_buffer");
+  key_value_buffer_.reset(new KeyValueBuffer(MemoryUsage(4 * OneKB), DiskUsage(256 * OneKB),
+                                             KeyValueBuffer::PopFunctor(), kv_buffer_path_));
+  const std::string kPrefix("\x01\x02", 2);
+  std::set<Identity> keys, prefixed;
+  for (int i(0); i != 110; ++i) {
+    Identity key(i < 10 ? kPrefix + RandomString(62) : RandomString(64));
+    keys.insert(key);
+    if (i < 10)
+      prefixed.insert(key);
+    ASSERT_NO_THROW(key_value_buffer_->Store(key, NonEmptyString(RandomAlphaNumericString(100))));
+  }
+  auto scan_all([this](KeyValueBuffer::ScanCursor& cursor)->std::vector<Identity> {
+      std::vector<Identity> scanned;
+      while (!cursor.done()) {
+        auto batch(key_value_buffer_->Scan(cursor, 7));
+        EXPECT_GE(7U, batch.size());
+        scanned.insert(scanned.end(), batch.begin(), batch.end());
+      }
+      EXPECT_TRUE(key_value_buffer_->Scan(cursor, 7).empty());
+      return scanned;
+  });
+
+  // Every key is returned once and in order, wherever it's held.
+  EXPECT_THROW(key_value_buffer_->BeginScan(std::string(65, 'a')), std::exception);
+  KeyValueBuffer::ScanCursor cursor(key_value_buffer_->BeginScan());
+  EXPECT_THROW(key_value_buffer_->Scan(cursor, 0), std::exception);
+  std::vector<Identity> scanned(scan_all(cursor));
+  EXPECT_TRUE(std::is_sorted(scanned.begin(), scanned.end()));
+  EXPECT_EQ(keys.size(), scanned.size());
+  EXPECT_TRUE(keys == std::set<Identity>(scanned.begin(), scanned.end()));
+
+  cursor = key_value_buffer_->BeginScan(kPrefix);
+  scanned = scan_all(cursor);
+  EXPECT_EQ(prefixed.size(), scanned.size());
+  EXPECT_TRUE(prefixed == std::set<Identity>(scanned.begin(), scanned.end()));
+
+  // Keys deleted or replaced before the scan reaches them, and keys stored since it began, are left
+  // out.
+  cursor = key_value_buffer_->BeginScan();
+  scanned = key_value_buffer_->Scan(cursor, 10);
+  ASSERT_EQ(10U, scanned.size());
+  auto unscanned(keys.upper_bound(scanned.back()));
+  Identity deleted(*unscanned++), replaced(*unscanned);
+  ASSERT_NO_THROW(key_value_buffer_->Delete(deleted));
+  ASSERT_NO_THROW(key_value_buffer_->Store(replaced,
+                                           NonEmptyString(RandomAlphaNumericString(100))));
+  for (int i(0); i != 20; ++i) {
+    ASSERT_NO_THROW(key_value_buffer_->Store(Identity(RandomString(64)),
+                                             NonEmptyString(RandomAlphaNumericString(100))));
+  }
+  std::vector<Identity> rest(scan_all(cursor));
+  scanned.insert(scanned.end(), rest.begin(), rest.end());
+  keys.erase(deleted);
+  keys.erase(replaced);
+  EXPECT_EQ(keys.size(), scanned.size());
+  EXPECT_TRUE(keys == std::set<Identity>(scanned.begin(), scanned.end()));
+  key_value_buffer_.reset();
+}
+
+TEST_F(KeyValueBufferTest, BEH_DiskDeduplication) {
+  TestPath test_path(CreateTestPath("MaidSafe_Test_KeyValueBuffer"));
+  kv_buffer_path_ = fs::path(*test_path / "kv_buffer");
+  KeyValueBuffer::Options options;
+  options.deduplicate_disk_values = true;
+  options.recover_disk_buffer = true;
+  key_value_buffer_.reset(new KeyValueBuffer(MemoryUsage(2 * OneKB), DiskUsage(8 * OneKB),
+                                             KeyValueBuffer::PopFunctor(), kv_buffer_path_,
+                                             options));
+  auto wait_for_disk([this](uint64_t values) {
+      for (int i(0); i != 200; ++i) {
+        KeyValueBuffer::Stats stats(key_value_buffer_->stats());
+        if (stats.values_spilled + stats.values_deduplicated >= values)
+          return;
+        Sleep(boost::posix_time::milliseconds(10));
+      }
+  });
+
+  // Four keys holding the same value, and one holding another.
+  const NonEmptyString kRepeated(RandomString(OneKB)), kOther(RandomString(OneKB));
+  std::vector<Identity> repeated_keys;
+  for (int i(0); i != 4; ++i) {
+    repeated_keys.push_back(Identity(RandomString(64)));
+    ASSERT_NO_THROW(key_value_buffer_->Store(repeated_keys.back(), kRepeated));
+  }
+  const Identity kOtherKey(RandomString(64));
+  ASSERT_NO_THROW(key_value_buffer_->Store(kOtherKey, kOther));
+  wait_for_disk(5);
+
+  // Each distinct value is written once and counts once against the disk buffer.
+  KeyValueBuffer::Stats stats(key_value_buffer_->stats());
+  EXPECT_EQ(2U, stats.values_spilled);
+  EXPECT_EQ(2 * OneKB, stats.bytes_spilled);
+  EXPECT_EQ(3U, stats.values_deduplicated);
+  EXPECT_EQ(3 * OneKB, stats.bytes_deduplicated);
+  EXPECT_EQ(2 * OneKB, key_value_buffer_->CurrentDiskUsage().data);
+  NonEmptyString recovered;
+  for (auto& key : repeated_keys) {
+    EXPECT_NO_THROW(recovered = key_value_buffer_->Get(key));
+    EXPECT_EQ(kRepeated, recovered);
+  }
+
+  // The repeated value stays on disk until the last key holding it is deleted.
+  for (int i(0); i != 3; ++i)
+    ASSERT_NO_THROW(key_value_buffer_->Delete(repeated_keys[i]));
+  EXPECT_EQ(2 * OneKB, key_value_buffer_->CurrentDiskUsage().data);
+  EXPECT_NO_THROW(recovered = key_value_buffer_->Get(repeated_keys[3]));
+  EXPECT_EQ(kRepeated, recovered);
+  ASSERT_NO_THROW(key_value_buffer_->Delete(repeated_keys[3]));
+  EXPECT_EQ(OneKB, key_value_buffer_->CurrentDiskUsage().data);
+
+  // A value already held for another key isn't written again.
+  const Identity kCopyKey(RandomString(64));
+  ASSERT_NO_THROW(key_value_buffer_->Store(kCopyKey, kOther));
+  wait_for_disk(6);
+  EXPECT_EQ(2U, key_value_buffer_->stats().values_spilled);
+  EXPECT_EQ(OneKB, key_value_buffer_->CurrentDiskUsage().data);
+  key_value_buffer_.reset();
+
+  // The references are recovered along with the values.
+  key_value_buffer_.reset(new KeyValueBuffer(MemoryUsage(2 * OneKB), DiskUsage(8 * OneKB),
+                                             KeyValueBuffer::PopFunctor(), kv_buffer_path_,
+                                             options));
+  EXPECT_EQ(OneKB, key_value_buffer_->CurrentDiskUsage().data);
+  EXPECT_NO_THROW(recovered = key_value_buffer_->Get(kCopyKey));
+  EXPECT_EQ(kOther, recovered);
+  ASSERT_NO_THROW(key_value_buffer_->Delete(kOtherKey));
+  EXPECT_EQ(OneKB, key_value_buffer_->CurrentDiskUsage().data);
+  EXPECT_NO_THROW(recovered = key_value_buffer_->Get(kCopyKey));
+  EXPECT_EQ(kOther, recovered);
+  key_value_buffer_.reset();
+
+  // Values written with deduplication aren't recovered by an instance which doesn't use it.
+  options.deduplicate_disk_values = false;
+  key_value_buffer_.reset(new KeyValueBuffer(MemoryUsage(2 * OneKB), DiskUsage(8 * OneKB),
+                                             KeyValueBuffer::PopFunctor(), kv_buffer_path_,
+                                             options));
+  EXPECT_EQ(0U, key_value_buffer_->CurrentDiskUsage().data);
+  EXPECT_THROW(key_value_buffer_->Get(kCopyKey), std::exception);
+  key_value_buffer_.reset();
+}
+
+TEST_F(KeyValueBufferTest, FUNC_LargeNumberOfEntries) {
+  const size_t kEntryCount(20000), kValueSize(16);
+  const uint64_t kMemoryEntries(kEntryCount / 4);
+  TestPath test_path(CreateTestPath("MaidSafe_Test_KeyValueBuffer"));
+  kv_buffer_path_ = fs::path(*test_path / "kv_buffer");
+  key_value_buffer_.reset(new KeyValueBuffer(MemoryUsage(kMemoryEntries * kValueSize),
+                                             DiskUsage(kEntryCount * kValueSize),
+                                             pop_functor_,
+                                             kv_buffer_path_));
+  std::vector<std::pair<Identity, NonEmptyString>> key_value_pairs;
+  for (size_t i(0); i != kEntryCount; ++i) {
+    NonEmptyString value(RandomAlphaNumericString(kValueSize));
+    key_value_pairs.push_back(std::make_pair(Identity(crypto::Hash<crypto::SHA512>(value)),
+                                             value));
+  }
+  for (auto& key_value : key_value_pairs)
+    ASSERT_NO_THROW(key_value_buffer_->Store(key_value.first, key_value.second));
+
+  NonEmptyString recovered;
+  for (auto& key_value : key_value_pairs) {
+    ASSERT_NO_THROW(recovered = key_value_buffer_->Get(key_value.first));
+    EXPECT_EQ(key_value.second, recovered);
+  }
+  for (size_t i(0); i < kEntryCount; i += 2)
+    ASSERT_NO_THROW(key_value_buffer_->Delete(key_value_pairs[i].first));
+  for (size_t i(0); i != kEntryCount; ++i) {
+    if (i % 2 == 0) {
+      EXPECT_THROW(key_value_buffer_->Get(key_value_pairs[i].first), std::exception);
+    } else {
+      ASSERT_NO_THROW(recovered = key_value_buffer_->Get(key_value_pairs[i].first));
+      EXPECT_EQ(key_value_pairs[i].second, recovered);
+    }
+  }
+  key_value_buffer_.reset();
+}
+
+TEST_F(KeyValueBufferTest, FUNC_WarmRestartStartupTime) {
+  const size_t kEntryCount(1000000), kValueSize(16), kBatchSize(10000);
+  TestPath test_path(CreateTestPath("MaidSafe_Test_KeyValueBuffer"));
+  kv_buffer_path_ = fs::path(*test_path / "kv_buffer");
+  KeyValueBuffer::Options options;
+  options.disk_layout = KeyValueBuffer::DiskLayout::kSegmentFile;
+  options.recover_disk_buffer = true;
+  options.spill_writer_count = 4;
+  options.spill_batch_size = 256;
+  key_value_buffer_.reset(new KeyValueBuffer(MemoryUsage(kBatchSize * kValueSize),
+                                             DiskUsage(kEntryCount * kValueSize),
+                                             pop_functor_, kv_buffer_path_, options));
+  std::vector<std::pair<Identity, NonEmptyString>> sample;
+  std::vector<std::pair<Identity, NonEmptyString>> batch;
+  for (size_t i(0); i != kEntryCount; ++i) {
+    NonEmptyString value(RandomAlphaNumericString(kValueSize));
+    batch.push_back(std::make_pair(Identity(crypto::Hash<crypto::SHA512>(value)), value));
+    if (i % 1000 == 0)
+      sample.push_back(batch.back());
+    if (batch.size() == kBatchSize) {
+      ASSERT_NO_THROW(key_value_buffer_->StoreBatch(batch));
+      batch.clear();
+    }
+  }
+  for (int i(0); i != 6000 && key_value_buffer_->CurrentDiskUsage() < kEntryCount * kValueSize;
+       ++i) {
+    Sleep(boost::posix_time::milliseconds(10));
+  }
+  ASSERT_EQ(kEntryCount * kValueSize, key_value_buffer_->CurrentDiskUsage().data);
+  key_value_buffer_.reset();
+
+  auto start(std::chrono::steady_clock::now());
+  key_value_buffer_.reset(new KeyValueBuffer(MemoryUsage(kBatchSize * kValueSize),
+                                             DiskUsage(kEntryCount * kValueSize),
+                                             pop_functor_, kv_buffer_path_, options));
+  auto startup_time(std::chrono::duration_cast<std::chrono::milliseconds>(
+      std::chrono::steady_clock::now() - start));
+  LOG(kInfo) << "Recovered " << kEntryCount << " entries in " << startup_time.count() << " ms.";
+  EXPECT_GT(std::chrono::milliseconds(10000), startup_time);
+  EXPECT_EQ(kEntryCount * kValueSize, key_value_buffer_->CurrentDiskUsage().data);
+
+  NonEmptyString recovered;
+  for (auto& key_value : sample) {
+    ASSERT_NO_THROW(recovered = key_value_buffer_->Get(key_value.first));
+    EXPECT_EQ(key_value.second, recovered);
+  }
+  key_value_buffer_.reset();
+}
+
 class KeyValueBufferTestDiskMemoryUsage : public testing::TestWithParam<MaxMemoryDiskUsage> {
  protected:
   KeyValueBufferTestDiskMemoryUsage()
@@ -0,0 +1,129 @@
+/* Copyright 2012 MaidSafe.net limited
+
+This MaidSafe Software is licensed under the MaidSafe.net Commercial License, version 1.0 or later,
+and The General Public License (GPL), version 3. By contributing code to this project You agree to
+the terms laid out in the MaidSafe Contributor Agreement, version 1.0, found in the root directory
+of this project at LICENSE, COPYING and CONTRIBUTOR respectively and also available at:
+
+http://www.novinet.com/license
+
+Unless required by applicable law or agreed to in writing, software distributed under the License is
+distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or
+implied. See the License for the specific language governing permissions and limitations under the
+License.
+*/
+
+#include "maidsafe/common/read_index.h"
+
+#include <atomic>
+#include <memory>
+#include <thread>
+#include <vector>
+
+#include "maidsafe/common/test.h"
+#include "maidsafe/common/utils.h"
+
+
+namespace maidsafe {
+
+namespace test {
+
+namespace {
+
+std::vector<Identity> MakeKeys(size_t count) {
+  std::vector<Identity> keys;
+  while (keys.size() != count)
+    keys.push_back(Identity(RandomString(64)));
+  return keys;
+}
+
+detail::ReadIndex::Value MakeValue() {
+  return std::make_shared<const NonEmptyString>(RandomString(10));
+}
+
+}  // unnamed namespace
+
+TEST(ReadIndexTest, BEH_InsertFindErase) {
+  detail::ReadIndex index;
+  auto keys(MakeKeys(1000));
+  detail::ReadIndex::Value found;
+  EXPECT_FALSE(index.Find(keys[0], found));
+  index.Erase(keys[0], 0);
+
+  // Enough keys to grow the table several times.
+  std::vector<detail::ReadIndex::Value> values;
+  for (size_t i(0); i != keys.size(); ++i) {
+    values.push_back(MakeValue());
+    index.Insert(keys[i], i, values.back());
+  }
+  EXPECT_EQ(keys.size(), index.size());
+  for (size_t i(0); i != keys.size(); ++i) {
+    ASSERT_TRUE(index.Find(keys[i], found));
+    EXPECT_EQ(values[i], found);
+  }
+
+  // Replacing an entry means erasing with the old sequence does nothing.
+  auto replacement(MakeValue());
+  index.Insert(keys[0], keys.size(), replacement);
+  EXPECT_EQ(keys.size(), index.size());
+  index.Erase(keys[0], 0);
+  ASSERT_TRUE(index.Find(keys[0], found));
+  EXPECT_EQ(replacement, found);
+  index.Erase(keys[0], keys.size());
+  EXPECT_FALSE(index.Contains(keys[0]));
+
+  for (size_t i(1); i != keys.size(); ++i)
+    index.Erase(keys[i], i);
+  EXPECT_EQ(0U, index.size());
+  for (auto& key : keys)
+    EXPECT_FALSE(index.Contains(key));
+}
+
+TEST(ReadIndexTest, BEH_ConcurrentReaders) {
+  detail::ReadIndex index;
+  // The stable keys are held throughout, while the writer churns the others and grows the table.
+  auto stable_keys(MakeKeys(10)), churned_keys(MakeKeys(2000));
+  std::vector<detail::ReadIndex::Value> stable_values;
+  uint64_t sequence(0);
+  for (auto& key : stable_keys) {
+    stable_values.push_back(MakeValue());
+    index.Insert(key, sequence++, stable_values.back());
+  }
+
+  std::atomic<bool> stop(false);
+  std::atomic<int> missed(0);
+  std::vector<std::thread> readers;
+  for (int i(0); i != 4; ++i) {
+    readers.emplace_back([&] {
+      detail::ReadIndex::Value found;
+      while (!stop) {
+        for (size_t j(0); j != stable_keys.size(); ++j) {
+          if (!index.Find(stable_keys[j], found) || found != stable_values[j])
+            ++missed;
+        }
+        for (auto& key : churned_keys)
+          index.Find(key, found);
+      }
+    });
+  }
+  for (int round(0); round != 5; ++round) {
+    std::vector<uint64_t> sequences;
+    for (auto& key : churned_keys) {
+      sequences.push_back(sequence);
+      index.Insert(key, sequence++, MakeValue());
+    }
+    for (size_t j(0); j != stable_keys.size(); ++j)
+      index.Insert(stable_keys[j], sequence++, stable_values[j]);
+    for (size_t j(0); j != churned_keys.size(); ++j)
+      index.Erase(churned_keys[j], sequences[j]);
+  }
+  stop = true;
+  for (auto& reader : readers)
+    reader.join();
+  EXPECT_EQ(0, missed);
+  EXPECT_EQ(stable_keys.size(), index.size());
+}
+
+}  // namespace test
+
+}  // namespace maidsafe
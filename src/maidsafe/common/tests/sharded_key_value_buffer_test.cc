@@ -0,0 +1,213 @@
+/* Copyright 2012 MaidSafe.net limited
+
+This MaidSafe Software is licensed under the MaidSafe.net Commercial License, version 1.0 or later,
+and The General Public License (GPL), version 3. By contributing code to this project You agree to
+the terms laid out in the MaidSafe Contributor Agreement, version 1.0, found in the root directory
+of this project at LICENSE, COPYING and CONTRIBUTOR respectively and also available at:
+
+http://www.novinet.com/license
+
+Unless required by applicable law or agreed to in writing, software distributed under the License is
+distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or
+implied. See the License for the specific language governing permissions and limitations under the
+License.
+*/
+
+#include "maidsafe/common/sharded_key_value_buffer.h"
+
+#include <future>
+#include <memory>
+#include <set>
+#include <vector>
+
+#include "boost/filesystem/operations.hpp"
+#include "boost/filesystem/path.hpp"
+
+#include "maidsafe/common/error.h"
+#include "maidsafe/common/test.h"
+#include "maidsafe/common/utils.h"
+
+
+namespace fs = boost::filesystem;
+
+namespace maidsafe {
+
+namespace test {
+
+namespace {
+
+std::pair<Identity, NonEmptyString> MakeKeyValue(size_t value_size) {
+  NonEmptyString value(RandomAlphaNumericString(value_size));
+  return std::make_pair(Identity(crypto::Hash<crypto::SHA512>(value)), value);
+}
+
+}  // unnamed namespace
+
+TEST(ShardedKeyValueBufferTest, BEH_Constructor) {
+  ShardedKeyValueBuffer::PopFunctor pop_functor;
+  EXPECT_THROW(ShardedKeyValueBuffer(MemoryUsage(1), DiskUsage(2), pop_functor, 0),
+               std::exception);
+  EXPECT_THROW(ShardedKeyValueBuffer(MemoryUsage(2), DiskUsage(1), pop_functor, 4),
+               std::exception);
+  EXPECT_NO_THROW(ShardedKeyValueBuffer(MemoryUsage(0), DiskUsage(0), pop_functor, 4));
+  EXPECT_NO_THROW(ShardedKeyValueBuffer(MemoryUsage(7), DiskUsage(9), pop_functor, 4));
+
+  TestPath test_path(CreateTestPath("MaidSafe_Test_ShardedKeyValueBuffer"));
+  {
+    ShardedKeyValueBuffer buffer(MemoryUsage(1000), DiskUsage(2000), pop_functor,
+                                 *test_path / "kv_buffer", 3);
+    EXPECT_EQ(3U, buffer.shard_count());
+    for (int i(0); i != 3; ++i)
+      EXPECT_TRUE(fs::exists(*test_path / "kv_buffer" / std::to_string(i)));
+  }
+}
+
+TEST(ShardedKeyValueBufferTest, BEH_StoreGetDelete) {
+  const uint32_t kShardCount(4);
+  ShardedKeyValueBuffer buffer(MemoryUsage(4 * 1024), DiskUsage(64 * 1024),
+                               ShardedKeyValueBuffer::PopFunctor(), kShardCount);
+  std::vector<std::pair<Identity, NonEmptyString>> key_value_pairs;
+  std::set<KeyValueBuffer*> used_shards;
+  for (int i(0); i != 40; ++i) {
+    key_value_pairs.push_back(MakeKeyValue(256));
+    used_shards.insert(&buffer.shard(key_value_pairs.back().first));
+    EXPECT_NO_THROW(buffer.Store(key_value_pairs.back().first, key_value_pairs.back().second));
+  }
+  EXPECT_EQ(kShardCount, used_shards.size());
+
+  NonEmptyString recovered;
+  for (auto& key_value : key_value_pairs) {
+    EXPECT_NO_THROW(recovered = buffer.Get(key_value.first));
+    EXPECT_EQ(key_value.second, recovered);
+    EXPECT_NO_THROW(buffer.Delete(key_value.first));
+    EXPECT_THROW(buffer.Get(key_value.first), std::exception);
+  }
+  KeyValueBuffer::Stats stats(buffer.stats());
+  EXPECT_EQ(key_value_pairs.size(), stats.memory_hits + stats.disk_hits);
+  EXPECT_EQ(key_value_pairs.size(), stats.misses);
+}
+
+TEST(ShardedKeyValueBufferTest, BEH_Batch) {
+  ShardedKeyValueBuffer buffer(MemoryUsage(4 * 1024), DiskUsage(64 * 1024),
+                               ShardedKeyValueBuffer::PopFunctor(), 4);
+  std::vector<std::pair<Identity, NonEmptyString>> key_value_pairs;
+  std::vector<Identity> keys;
+  for (int i(0); i != 40; ++i) {
+    key_value_pairs.push_back(MakeKeyValue(256));
+    keys.push_back(key_value_pairs.back().first);
+  }
+  EXPECT_NO_THROW(buffer.StoreBatch(key_value_pairs));
+  std::vector<NonEmptyString> values;
+  EXPECT_NO_THROW(values = buffer.GetBatch(keys));
+  ASSERT_EQ(keys.size(), values.size());
+  for (size_t i(0); i != keys.size(); ++i)
+    EXPECT_EQ(key_value_pairs[i].second, values[i]);
+
+  EXPECT_NO_THROW(buffer.DeleteBatch(keys));
+  EXPECT_NO_THROW(values = buffer.GetBatch(keys));
+  for (auto& value : values)
+    EXPECT_FALSE(value.IsInitialised());
+}
+
+TEST(ShardedKeyValueBufferTest, BEH_Scan) {
+  ShardedKeyValueBuffer buffer(MemoryUsage(4 * 1024), DiskUsage(64 * 1024),
+                               ShardedKeyValueBuffer::PopFunctor(), 4);
+  std::vector<std::pair<Identity, NonEmptyString>> key_value_pairs;
+  std::set<Identity> keys;
+  for (int i(0); i != 40; ++i) {
+    key_value_pairs.push_back(MakeKeyValue(256));
+    keys.insert(key_value_pairs.back().first);
+  }
+  EXPECT_NO_THROW(buffer.StoreBatch(key_value_pairs));
+  ShardedKeyValueBuffer::ScanCursor cursor(buffer.BeginScan());
+  std::vector<Identity> scanned;
+  while (!cursor.done()) {
+    auto batch(buffer.Scan(cursor, 5));
+    EXPECT_GE(5U, batch.size());
+    scanned.insert(scanned.end(), batch.begin(), batch.end());
+  }
+  EXPECT_EQ(keys.size(), scanned.size());
+  EXPECT_TRUE(keys == std::set<Identity>(scanned.begin(), scanned.end()));
+}
+
+TEST(ShardedKeyValueBufferTest, BEH_Rebalance) {
+  const uint32_t kShardCount(4);
+  const uint64_t kMaxMemoryUsage(4000), kMaxDiskUsage(8000);
+  ShardedKeyValueBuffer buffer(MemoryUsage(kMaxMemoryUsage), DiskUsage(kMaxDiskUsage),
+                               ShardedKeyValueBuffer::PopFunctor(), kShardCount);
+  // Keep storing values belonging to a single shard until it holds more than its initial share.
+  auto first(MakeKeyValue(100));
+  KeyValueBuffer& busy_shard(buffer.shard(first.first));
+  EXPECT_EQ(kMaxDiskUsage / kShardCount, busy_shard.max_disk_usage().data);
+  uint64_t stored(0);
+  while (stored < 2 * kMaxDiskUsage / kShardCount) {
+    auto key_value(MakeKeyValue(100));
+    if (&buffer.shard(key_value.first) != &busy_shard)
+      continue;
+    ASSERT_NO_THROW(buffer.Store(key_value.first, key_value.second));
+    stored += 100;
+  }
+  buffer.Rebalance();
+  EXPECT_LT(kMaxDiskUsage / kShardCount, busy_shard.max_disk_usage().data);
+
+  // The limits given to the shards add up to the overall limits.  The background rebalancer may
+  // be adjusting the limits while they're being summed, so allow a few attempts.
+  uint64_t total_memory(0), total_disk(0);
+  for (int attempt(0); attempt != 10; ++attempt) {
+    std::set<KeyValueBuffer*> counted;
+    total_memory = total_disk = 0;
+    while (counted.size() != kShardCount) {
+      KeyValueBuffer& shard(buffer.shard(MakeKeyValue(1).first));
+      if (counted.insert(&shard).second) {
+        total_memory += shard.max_memory_usage().data;
+        total_disk += shard.max_disk_usage().data;
+      }
+    }
+    if (total_memory == kMaxMemoryUsage && total_disk == kMaxDiskUsage)
+      break;
+  }
+  EXPECT_EQ(kMaxMemoryUsage, total_memory);
+  EXPECT_EQ(kMaxDiskUsage, total_disk);
+
+  EXPECT_THROW(buffer.SetMaxMemoryUsage(MemoryUsage(kMaxDiskUsage + 1)), std::exception);
+  EXPECT_NO_THROW(buffer.SetMaxDiskUsage(DiskUsage(4 * kMaxDiskUsage)));
+}
+
+TEST(ShardedKeyValueBufferTest, BEH_LargeValueGrowsShard) {
+  const uint32_t kShardCount(8);
+  ShardedKeyValueBuffer buffer(MemoryUsage(800), DiskUsage(8000),
+                               ShardedKeyValueBuffer::PopFunctor(), kShardCount);
+  // Larger than any single shard's initial share of the disk limit.
+  auto key_value(MakeKeyValue(4000));
+  EXPECT_NO_THROW(buffer.Store(key_value.first, key_value.second));
+  // Later rebalances don't take the room back while the shard holds the value.
+  buffer.Rebalance();
+  EXPECT_LE(4000U, buffer.shard(key_value.first).max_disk_usage().data);
+  NonEmptyString recovered;
+  EXPECT_NO_THROW(recovered = buffer.Get(key_value.first));
+  EXPECT_EQ(key_value.second, recovered);
+}
+
+TEST(ShardedKeyValueBufferTest, FUNC_ParallelStoreGet) {
+  const uint32_t kShardCount(8);
+  const int kThreadCount(8), kPerThread(200);
+  ShardedKeyValueBuffer buffer(MemoryUsage(256 * 1024), DiskUsage(4 * 1024 * 1024),
+                               ShardedKeyValueBuffer::PopFunctor(), kShardCount);
+  std::vector<std::future<void>> workers;
+  for (int t(0); t != kThreadCount; ++t) {
+    workers.push_back(std::async(std::launch::async, [&buffer, kPerThread] {
+        for (int i(0); i != kPerThread; ++i) {
+          auto key_value(MakeKeyValue(512));
+          buffer.Store(key_value.first, key_value.second);
+          if (buffer.Get(key_value.first) != key_value.second)
+            ThrowError(CommonErrors::invalid_conversion);
+        }
+    }));
+  }
+  for (auto& worker : workers)
+    EXPECT_NO_THROW(worker.get());
+}
+
+}  // namespace test
+
+}  // namespace maidsafe
@@ -0,0 +1,101 @@
+/* Copyright 2012 MaidSafe.net limited
+
+This MaidSafe Software is licensed under the MaidSafe.net Commercial License, version 1.0 or later,
+and The General Public License (GPL), version 3. By contributing code to this project You agree to
+the terms laid out in the MaidSafe Contributor Agreement, version 1.0, found in the root directory
+of this project at LICENSE, COPYING and CONTRIBUTOR respectively and also available at:
+
+http://www.novinet.com/license
+
+Unless required by applicable law or agreed to in writing, software distributed under the License is
+distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or
+implied. See the License for the specific language governing permissions and limitations under the
+License.
+*/
+
+#include "maidsafe/common/slab_allocator.h"
+
+#include <list>
+#include <set>
+#include <vector>
+
+#include "maidsafe/common/test.h"
+
+
+namespace maidsafe {
+
+namespace test {
+
+TEST(SlabAllocatorTest, BEH_SizeClasses) {
+  EXPECT_EQ(16U, detail::SlabAllocator::BlockSize(1));
+  EXPECT_EQ(16U, detail::SlabAllocator::BlockSize(16));
+  EXPECT_EQ(32U, detail::SlabAllocator::BlockSize(17));
+  EXPECT_EQ(512U, detail::SlabAllocator::BlockSize(512));
+  EXPECT_EQ(513U, detail::SlabAllocator::BlockSize(513));
+
+  detail::SlabAllocator slabs;
+  EXPECT_EQ(0U, slabs.reserved_bytes());
+  std::vector<void*> blocks;
+  for (int i(0); i != 100; ++i)
+    blocks.push_back(slabs.Allocate(40));
+  EXPECT_EQ(uint64_t(detail::SlabAllocator::kSlabSize), slabs.reserved_bytes());
+  EXPECT_EQ(100U, std::set<void*>(blocks.begin(), blocks.end()).size());
+  for (auto block : blocks)
+    EXPECT_EQ(0U, reinterpret_cast<uintptr_t>(block) % detail::SlabAllocator::kAlignment);
+
+  // Freed blocks are handed out again to requests of the same class, and not to other classes.
+  void* freed(blocks.back());
+  slabs.Deallocate(freed, 40);
+  blocks.back() = slabs.Allocate(33);
+  EXPECT_EQ(freed, blocks.back());
+  slabs.Deallocate(blocks.back(), 33);
+  void* other_class(slabs.Allocate(100));
+  EXPECT_NE(freed, other_class);
+  slabs.Deallocate(other_class, 100);
+  blocks.pop_back();
+
+  // Large requests are taken from the heap and counted until freed.
+  void* large(slabs.Allocate(1000));
+  EXPECT_EQ(uint64_t(detail::SlabAllocator::kSlabSize) + 1000, slabs.reserved_bytes());
+  slabs.Deallocate(large, 1000);
+  EXPECT_EQ(uint64_t(detail::SlabAllocator::kSlabSize), slabs.reserved_bytes());
+
+  // Enough blocks to fill more than one slab.
+  const size_t kBlocksPerSlab(detail::SlabAllocator::kSlabSize / 48);
+  for (size_t i(0); i != kBlocksPerSlab; ++i)
+    blocks.push_back(slabs.Allocate(48));
+  EXPECT_EQ(2 * uint64_t(detail::SlabAllocator::kSlabSize), slabs.reserved_bytes());
+  for (auto block : blocks)
+    slabs.Deallocate(block, 48);
+  slabs.Deallocate(nullptr, 48);
+}
+
+TEST(SlabAllocatorTest, BEH_StdAllocator) {
+  detail::SlabAllocator slabs;
+  typedef std::list<int, detail::SlabStdAllocator<int>> List;
+  List first((List::allocator_type(&slabs))), second((List::allocator_type(&slabs)));
+  for (int i(0); i != 1000; ++i)
+    (i % 2 ? first : second).push_back(i);
+  const uint64_t kReserved(slabs.reserved_bytes());
+  EXPECT_LT(0U, kReserved);
+  EXPECT_TRUE(first.get_allocator() == second.get_allocator());
+
+  // Nodes spliced between lists sharing the slabs are freed by their new list.
+  second.splice(second.end(), first, first.begin(), first.end());
+  EXPECT_TRUE(first.empty());
+  EXPECT_EQ(1000U, second.size());
+  second.clear();
+  // The freed nodes are reused.
+  for (int i(0); i != 1000; ++i)
+    first.push_front(i);
+  EXPECT_EQ(kReserved, slabs.reserved_bytes());
+  EXPECT_EQ(0, first.back());
+
+  detail::SlabAllocator other_slabs;
+  List other((List::allocator_type(&other_slabs)));
+  EXPECT_TRUE(first.get_allocator() != other.get_allocator());
+}
+
+}  // namespace test
+
+}  // namespace maidsafe
@@ -0,0 +1,107 @@
+/* Copyright 2012 MaidSafe.net limited
+
+This MaidSafe Software is licensed under the MaidSafe.net Commercial License, version 1.0 or later,
+and The General Public License (GPL), version 3. By contributing code to this project You agree to
+the terms laid out in the MaidSafe Contributor Agreement, version 1.0, found in the root directory
+of this project at LICENSE, COPYING and CONTRIBUTOR respectively and also available at:
+
+http://www.novinet.com/license
+
+Unless required by applicable law or agreed to in writing, software distributed under the License is
+distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or
+implied. See the License for the specific language governing permissions and limitations under the
+License.
+*/
+
+
+#include "maidsafe/common/timing_wheel.h"
+
+#include <chrono>
+#include <vector>
+
+#include "maidsafe/common/error.h"
+#include "maidsafe/common/test.h"
+#include "maidsafe/common/utils.h"
+
+
+namespace maidsafe {
+
+namespace test {
+
+namespace {
+
+typedef detail::TimingWheel::Clock Clock;
+
+std::vector<Identity> MakeKeys(size_t count) {
+  std::vector<Identity> keys;
+  while (keys.size() != count)
+    keys.push_back(Identity(RandomString(64)));
+  return keys;
+}
+
+}  // unnamed namespace
+
+TEST(TimingWheelTest, BEH_AddAndAdvance) {
+  const Clock::duration kTick(std::chrono::milliseconds(10));
+  const Clock::time_point kStart(Clock::now());
+  EXPECT_THROW(detail::TimingWheel(Clock::duration::zero(), kStart), std::exception);
+  detail::TimingWheel wheel(kTick, kStart);
+  EXPECT_TRUE(wheel.empty());
+  EXPECT_EQ(Clock::time_point::max(), wheel.NextExpiry());
+
+  auto keys(MakeKeys(3));
+  wheel.Add(keys[0], 0, kStart + 5 * kTick);
+  // Deadlines between ticks are rounded up.
+  wheel.Add(keys[1], 1, kStart + 5 * kTick + Clock::duration(1));
+  wheel.Add(keys[2], 2, kStart - kTick);
+  EXPECT_EQ(3U, wheel.size());
+
+  // A deadline which has already passed expires without the wheel moving on.
+  auto expired(wheel.Advance(kStart));
+  ASSERT_EQ(1U, expired.size());
+  EXPECT_EQ(keys[2], expired[0].first);
+  EXPECT_EQ(2U, expired[0].second);
+  EXPECT_GE(kStart + 5 * kTick, wheel.NextExpiry());
+  EXPECT_TRUE(wheel.Advance(kStart + 5 * kTick - Clock::duration(1)).empty());
+  expired = wheel.Advance(kStart + 5 * kTick);
+  ASSERT_EQ(1U, expired.size());
+  EXPECT_EQ(keys[0], expired[0].first);
+
+  // Adding a key again replaces its entry.
+  wheel.Add(keys[1], 3, kStart + 7 * kTick);
+  EXPECT_EQ(1U, wheel.size());
+  EXPECT_TRUE(wheel.Advance(kStart + 6 * kTick).empty());
+  expired = wheel.Advance(kStart + 7 * kTick);
+  ASSERT_EQ(1U, expired.size());
+  EXPECT_EQ(keys[1], expired[0].first);
+  EXPECT_EQ(3U, expired[0].second);
+  EXPECT_TRUE(wheel.empty());
+}
+
+TEST(TimingWheelTest, BEH_DistantDeadlines) {
+  // Deadlines either side of each level's span, and beyond the whole wheel's, all expire on time.
+  const Clock::duration kTick(std::chrono::milliseconds(1));
+  const Clock::time_point kStart(Clock::now());
+  detail::TimingWheel wheel(kTick, kStart);
+  const std::vector<uint64_t> kTicks = { 1, 63, 64, 65, 4095, 4096, 4097, 262143, 262144, 300000,
+                                         16777215, 16777216, 20000000 };
+  auto keys(MakeKeys(kTicks.size()));
+  // Added in reverse so that the order of expiry isn't just the order of adding.
+  for (size_t i(kTicks.size()); i != 0; --i)
+    wheel.Add(keys[i - 1], i - 1, kStart + kTick * static_cast<Clock::rep>(kTicks[i - 1]));
+
+  for (size_t i(0); i != kTicks.size(); ++i) {
+    const Clock::time_point kDeadline(kStart + kTick * static_cast<Clock::rep>(kTicks[i]));
+    EXPECT_GE(kDeadline, wheel.NextExpiry());
+    EXPECT_TRUE(wheel.Advance(kDeadline - kTick).empty());
+    auto expired(wheel.Advance(kDeadline));
+    ASSERT_EQ(1U, expired.size());
+    EXPECT_EQ(keys[i], expired[0].first);
+    EXPECT_EQ(i, expired[0].second);
+  }
+  EXPECT_TRUE(wheel.empty());
+}
+
+}  // namespace test
+
+}  // namespace maidsafe
@@ -0,0 +1,154 @@
+/* Copyright 2012 MaidSafe.net limited
+
+This MaidSafe Software is licensed under the MaidSafe.net Commercial License, version 1.0 or later,
+and The General Public License (GPL), version 3. By contributing code to this project You agree to
+the terms laid out in the MaidSafe Contributor Agreement, version 1.0, found in the root directory
+of this project at LICENSE, COPYING and CONTRIBUTOR respectively and also available at:
+
+http://www.novinet.com/license
+
+Unless required by applicable law or agreed to in writing, software distributed under the License is
+distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or
+implied. See the License for the specific language governing permissions and limitations under the
+License.
+*/
+
+
+#include "maidsafe/common/timing_wheel.h"
+
+#include <algorithm>
+#include <limits>
+
+#include "maidsafe/common/error.h"
+#include "maidsafe/common/log.h"
+
+
+namespace maidsafe {
+
+namespace detail {
+
+namespace {
+
+// The number of ticks ahead which the wheel's slots reach.
+const uint64_t kSpan(static_cast<uint64_t>(1) << 24);
+
+}  // unnamed namespace
+
+TimingWheel::TimingWheel(Clock::duration tick, Clock::time_point start)
+    : kTick_(tick),
+      kStart_(start),
+      current_tick_(0),
+      slots_(static_cast<size_t>(kLevels * kSlots + 1)),
+      lookup_() {
+  static_assert(kLevels * kSlotBits == 24, "kSpan must match the wheel's size.");
+  if (tick <= Clock::duration::zero()) {
+    LOG(kError) << "Timing wheel tick must be positive.";
+    ThrowError(CommonErrors::invalid_parameter);
+  }
+}
+
+void TimingWheel::Add(const Identity& key, uint64_t sequence, Clock::time_point deadline) {
+  uint64_t tick(0);
+  if (deadline > kStart_) {
+    // Rounded up, so that no entry expires before its deadline.
+    Clock::duration elapsed(deadline - kStart_);
+    tick = static_cast<uint64_t>(elapsed / kTick_) + (elapsed % kTick_ != Clock::duration::zero());
+  }
+  auto existing(lookup_.find(key));
+  if (existing != lookup_.end()) {
+    Slot::iterator itr(existing->second);
+    (*itr).sequence = sequence;
+    (*itr).tick = tick;
+    Place(slots_[(*itr).slot], itr);
+    return;
+  }
+  Slot added;
+  added.emplace_back(key, sequence, tick);
+  Slot::iterator itr(added.begin());
+  Place(added, itr);
+  lookup_[key] = itr;
+}
+
+std::vector<std::pair<Identity, uint64_t>> TimingWheel::Advance(Clock::time_point now) {
+  const uint64_t kTarget(now > kStart_ ? static_cast<uint64_t>((now - kStart_) / kTick_) : 0);
+  Slot& due(slots_.back());
+  // Once every entry is due there is nothing to move, so the remaining ticks are skipped.
+  while (current_tick_ < kTarget && due.size() != lookup_.size()) {
+    ++current_tick_;
+    // Higher levels first, so that an entry moved down can be moved again in the same tick.
+    for (int level(kLevels - 1); level != 0; --level) {
+      if ((current_tick_ & ((static_cast<uint64_t>(1) << (kSlotBits * level)) - 1)) == 0)
+        Cascade(level);
+    }
+    Slot& expiring(slots_[static_cast<size_t>(current_tick_ & (kSlots - 1))]);
+    for (auto& entry : expiring)
+      entry.slot = slots_.size() - 1;
+    due.splice(due.end(), expiring);
+  }
+  current_tick_ = std::max(current_tick_, kTarget);
+
+  std::vector<std::pair<Identity, uint64_t>> expired;
+  expired.reserve(due.size());
+  for (auto& entry : due) {
+    expired.emplace_back(entry.key, entry.sequence);
+    lookup_.erase(entry.key);
+  }
+  due.clear();
+  return expired;
+}
+
+TimingWheel::Clock::time_point TimingWheel::NextExpiry() const {
+  if (lookup_.empty())
+    return Clock::time_point::max();
+  if (!slots_.back().empty())
+    return kStart_ + kTick_ * static_cast<Clock::rep>(current_tick_);
+  // The nearest occupied slot of the lowest level holds the earliest of its entries, and entries in
+  // higher levels can't expire before the next time the lowest level wraps.
+  uint64_t earliest(std::numeric_limits<uint64_t>::max());
+  size_t in_lowest_level(0);
+  for (uint64_t tick(current_tick_ + 1); tick <= current_tick_ + kSlots; ++tick) {
+    const Slot& slot(slots_[static_cast<size_t>(tick & (kSlots - 1))]);
+    if (!slot.empty() && earliest == std::numeric_limits<uint64_t>::max())
+      earliest = tick;
+    in_lowest_level += slot.size();
+  }
+  if (in_lowest_level != lookup_.size())
+    earliest = std::min(earliest, (current_tick_ / kSlots + 1) * kSlots);
+  return kStart_ + kTick_ * static_cast<Clock::rep>(earliest);
+}
+
+bool TimingWheel::empty() const {
+  return lookup_.empty();
+}
+
+size_t TimingWheel::size() const {
+  return lookup_.size();
+}
+
+void TimingWheel::Place(Slot& from, Slot::iterator itr) {
+  size_t slot(slots_.size() - 1);
+  if ((*itr).tick > current_tick_) {
+    // Entries beyond the wheel's span are placed at its far end, and placed again from there.
+    const uint64_t kTick(std::min((*itr).tick, current_tick_ + kSpan - 1));
+    const uint64_t kDelta(kTick - current_tick_);
+    int level(0);
+    while (kDelta >= (static_cast<uint64_t>(1) << (kSlotBits * (level + 1))))
+      ++level;
+    slot = static_cast<size_t>(level * kSlots + ((kTick >> (kSlotBits * level)) & (kSlots - 1)));
+  }
+  (*itr).slot = slot;
+  slots_[slot].splice(slots_[slot].end(), from, itr);
+}
+
+void TimingWheel::Cascade(int level) {
+  // Called when current_tick_ reaches the start of the span covered by one of this level's slots.
+  Slot cascading;
+  cascading.swap(slots_[static_cast<size_t>(
+      level * kSlots + ((current_tick_ >> (kSlotBits * level)) & (kSlots - 1)))]);
+  while (!cascading.empty())
+    Place(cascading, cascading.begin());
+}
+
+}  // namespace detail
+
+}  // namespace maidsafe
@@ -0,0 +1,96 @@
+/* Copyright 2012 MaidSafe.net limited
+
+This MaidSafe Software is licensed under the MaidSafe.net Commercial License, version 1.0 or later,
+and The General Public License (GPL), version 3. By contributing code to this project You agree to
+the terms laid out in the MaidSafe Contributor Agreement, version 1.0, found in the root directory
+of this project at LICENSE, COPYING and CONTRIBUTOR respectively and also available at:
+
+http://www.novinet.com/license
+
+Unless required by applicable law or agreed to in writing, software distributed under the License is
+distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or
+implied. See the License for the specific language governing permissions and limitations under the
+License.
+*/
+
+#ifndef MAIDSAFE_COMMON_TIMING_WHEEL_H_
+#define MAIDSAFE_COMMON_TIMING_WHEEL_H_
+
+#include <chrono>
+#include <cstdint>
+#include <functional>
+#include <list>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include "maidsafe/common/types.h"
+
+
+namespace maidsafe {
+
+namespace detail {
+
+// Holds a deadline for each of a set of keys in a hierarchical timing wheel, so that those which
+// have passed can be found without ordering them all.  Each level has kSlots slots, each a
+// kSlots-fold longer span of ticks than those of the level below.  An entry is placed in the lowest
+// level whose slots reach its deadline, and is moved down a level each time the wheel reaches its
+// slot, so adding or replacing an entry costs O(1) and an entry is moved at most kLevels - 1 times
+// before it expires.  Not thread-safe.
+class TimingWheel {
+ public:
+  typedef std::chrono::steady_clock Clock;
+  // Deadlines are rounded up to a whole number of ticks after 'start'.  Throws if tick isn't
+  // positive.
+  TimingWheel(Clock::duration tick, Clock::time_point start);
+  // Replaces any entry already held for 'key'.  'sequence' is returned with the key on expiry, so
+  // that the caller can tell which of its values the entry was for.  A deadline which has already
+  // passed expires on the next call to Advance.
+  void Add(const Identity& key, uint64_t sequence, Clock::time_point deadline);
+  // Moves the wheel on to 'now', removing and returning the entries whose deadlines have passed.
+  std::vector<std::pair<Identity, uint64_t>> Advance(Clock::time_point now);
+  // Returns a time no later than the earliest deadline held, or Clock::time_point::max() if there
+  // are none, for the caller to know when next to call Advance.
+  Clock::time_point NextExpiry() const;
+  bool empty() const;
+  size_t size() const;
+
+ private:
+  TimingWheel(const TimingWheel&);
+  TimingWheel& operator=(const TimingWheel&);
+
+  static const int kLevels = 4;
+  static const int kSlotBits = 6;
+  static const uint64_t kSlots = static_cast<uint64_t>(1) << kSlotBits;
+
+  struct Entry {
+    Entry(const Identity& key_in, uint64_t sequence_in, uint64_t tick_in)
+        : key(key_in), sequence(sequence_in), tick(tick_in), slot(0) {}
+    Identity key;
+    uint64_t sequence, tick;
+    size_t slot;  // Index into slots_ of the list holding the entry.
+  };
+  typedef std::list<Entry> Slot;
+
+  struct IdentityHash {
+    size_t operator()(const Identity& key) const { return std::hash<std::string>()(key.string()); }
+  };
+
+  void Place(Slot& from, Slot::iterator itr);
+  void Cascade(int level);
+
+  const Clock::duration kTick_;
+  const Clock::time_point kStart_;
+  uint64_t current_tick_;
+  // Each level's slots in turn, then the entries which are due but not yet returned by Advance.
+  std::vector<Slot> slots_;
+  std::unordered_map<Identity, Slot::iterator, IdentityHash> lookup_;
+};
+
+}  // namespace detail
+
+}  // namespace maidsafe
+
+
+#endif  // MAIDSAFE_COMMON_TIMING_WHEEL_H_
@@ -23,6 +23,7 @@ License.
 #include <limits>
 #include <set>
 #include <thread>
+#include <utility>
 #include <vector>
 
 
@@ -420,10 +421,11 @@ NonEmptyString ReadFile(const fs::path &file_path) {
 
   std::ifstream file_in(file_path.c_str(), std::ios::in | std::ios::binary);
 
-  std::vector<char> file_content(static_cast<size_t>(file_size));
+  // Read straight into the string which the result takes over, rather than copying via a buffer.
+  std::string file_content(static_cast<size_t>(file_size), 0);
   file_in.read(&file_content[0], file_size);
   file_in.close();
-  return NonEmptyString(std::string(&file_content[0], static_cast<size_t>(file_size)));
+  return NonEmptyString(std::move(file_content));
 }
 
 bool WriteFile(const fs::path &file_path, const std::string &content) {